@@ -0,0 +1,109 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   eventBlocking -- latency of a blocking em_postEvent
+
+   Times each of a series of blocking posts to one listener, from the
+   call until it returns, and prints the mean and percentiles. The mode
+   is chosen when the event manager starts, so run once per mode to
+   compare them.
+
+   usage: eventBlocking [thread | pool [workers]] [posts]
+*/
+
+#include <voxi/util/config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/event.h>
+#include <voxi/util/time.h>
+
+#define WARMUP_POSTS 200
+
+static int source;
+
+static void ignoreEvent( void *source, EventType eventType, void *eventData,
+                         void *handlerData )
+{
+  (void) source; (void) eventType; (void) eventData; (void) handlerData;
+}
+
+static int compareLatency( const void *latency1, const void *latency2 )
+{
+  uint64_t first = *(const uint64_t *) latency1;
+  uint64_t second = *(const uint64_t *) latency2;
+
+  return first < second ? -1 : first > second;
+}
+
+int main( int argc, char **argv )
+{
+  const char *mode = "thread";
+  uint64_t *latencies, start, total = 0;
+  int workers = 0, posts = 20000, i;
+
+  if( argc > 1 )
+    mode = argv[ 1 ];
+  if( strcmp( mode, "pool" ) == 0 )
+  {
+    if( argc > 2 )
+      workers = atoi( argv[ 2 ] );
+    if( argc > 3 )
+      posts = atoi( argv[ 3 ] );
+    em_setDispatchMode( EM_DISPATCH_POOL, workers );
+  }
+  else if( strcmp( mode, "thread" ) == 0 )
+  {
+    if( argc > 2 )
+      posts = atoi( argv[ 2 ] );
+  }
+  else
+    posts = 0;
+
+  if( posts < 1 )
+  {
+    fprintf( stderr, "usage: eventBlocking [thread | pool [workers]] "
+             "[posts]\n" );
+    return 1;
+  }
+
+  latencies = (uint64_t *) malloc( posts * sizeof( uint64_t ) );
+  if( latencies == NULL )
+    return 1;
+
+  em_startup();
+  em_addListener( &source, 1, ignoreEvent, NULL, FALSE );
+
+  for( i = 0; i < WARMUP_POSTS; i++ )
+    em_postEvent( &source, 1, NULL, NULL, TRUE );
+
+  for( i = 0; i < posts; i++ )
+  {
+    start = nanosec();
+    em_postEvent( &source, 1, NULL, NULL, TRUE );
+    latencies[ i ] = nanosec() - start;
+    total += latencies[ i ];
+  }
+
+  em_shutdown();
+
+  qsort( latencies, posts, sizeof( uint64_t ), compareLatency );
+  printf( "%s, blocking post: mean %.2f us, p50 %.2f us, p99 %.2f us, "
+          "max %.2f us\n", mode, (double) total / posts / 1000.0,
+          latencies[ posts / 2 ] / 1000.0,
+          latencies[ (int) (posts * 0.99) ] / 1000.0,
+          latencies[ posts - 1 ] / 1000.0 );
+
+  free( latencies );
+
+  return 0;
+}
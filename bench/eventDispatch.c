@@ -0,0 +1,93 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   eventDispatch -- event throughput of a dispatch mode
+
+   Posts non-blocking events as fast as possible and waits until all of
+   them have been handled, first to a plain listener and then to one that
+   asked for a thread of its own. The mode is chosen when the event
+   manager starts, so run once per mode to compare them.
+
+   usage: eventDispatch [thread | pool [workers]]
+*/
+
+#include <voxi/util/config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/event.h>
+#include <voxi/util/time.h>
+
+#define EVENTS 100000
+
+#define PLAIN_EVENT 1
+#define THREADED_EVENT 2
+
+static int source;
+static volatile int handled;
+
+static void countEvent( void *source, EventType eventType, void *eventData,
+                        void *handlerData )
+{
+  (void) source; (void) eventType; (void) eventData; (void) handlerData;
+
+  atomic_addInt( &handled, 1 );
+}
+
+static void run( const char *mode, const char *listener, EventType eventType,
+                 int count )
+{
+  uint64_t start;
+  int i;
+
+  handled = 0;
+  start = nanosec();
+  for( i = 0; i < count; i++ )
+    em_postEvent( &source, eventType, NULL, NULL, FALSE );
+  while( atomic_loadInt( &handled ) < count )
+    usleep( 100 );
+
+  printf( "%s, %s listener: %.0f ns per event\n", mode, listener,
+          (double) (nanosec() - start) / count );
+}
+
+int main( int argc, char **argv )
+{
+  const char *mode = "thread";
+  int workers = 0;
+
+  if( argc > 1 )
+    mode = argv[ 1 ];
+  if( argc > 2 )
+    workers = atoi( argv[ 2 ] );
+
+  if( strcmp( mode, "pool" ) == 0 )
+    em_setDispatchMode( EM_DISPATCH_POOL, workers );
+  else if( strcmp( mode, "thread" ) != 0 )
+  {
+    fprintf( stderr, "usage: eventDispatch [thread | pool [workers]]\n" );
+    return 1;
+  }
+
+  em_startup();
+  em_addListener( &source, PLAIN_EVENT, countEvent, NULL, FALSE );
+  em_addListener( &source, THREADED_EVENT, countEvent, NULL, TRUE );
+
+  run( mode, "plain", PLAIN_EVENT, EVENTS );
+  run( mode, "threaded", THREADED_EVENT, EVENTS / 10 );
+
+  em_shutdown();
+
+  return 0;
+}
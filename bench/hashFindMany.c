@@ -0,0 +1,159 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   hashFindMany -- HashFindMany against a loop of HashFind
+
+   Looks up random keys in a table too large for the cache, one at a time
+   with HashFind and in batches with HashFindMany, and does the same for
+   names in a word map with wordMap_findByName and wordMap_findManyByName.
+
+   usage: hashFindMany [elements [batch]]
+*/
+
+#include <voxi/util/config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/hash.h>
+#include <voxi/util/time.h>
+#include <voxi/util/wordMap.h>
+
+#define LOOKUPS 4000000
+#define NAME_LENGTH 16
+
+static int hashInt( void *data )
+{
+  return *(int *) data * 2654435761U;
+}
+
+static int compInt( void *data1, void *data2 )
+{
+  return *(int *) data1 != *(int *) data2;
+}
+
+static void benchHash( int size, int batch )
+{
+  HashTable ht;
+  int *keys;
+  void **lookup, **results;
+  uint64_t start, scalarTime, batchTime;
+  int i, j, found = 0;
+
+  keys = (int *) malloc( size * sizeof( int ) );
+  lookup = (void **) malloc( LOOKUPS * sizeof( void * ) );
+  results = (void **) malloc( batch * sizeof( void * ) );
+  ht = HashCreateTable( size, hashInt, compInt, NULL );
+  if( (keys == NULL) || (lookup == NULL) || (results == NULL) ||
+      (ht == NULL) )
+    exit( 1 );
+
+  for( i = 0; i < size; i++ )
+  {
+    keys[ i ] = i;
+    HashAdd( ht, &keys[ i ] );
+  }
+  for( i = 0; i < LOOKUPS; i++ )
+    lookup[ i ] = &keys[ rand() % size ];
+
+  start = nanosec();
+  for( i = 0; i < LOOKUPS; i++ )
+    found += HashFind( ht, lookup[ i ] ) != NULL;
+  scalarTime = nanosec() - start;
+
+  start = nanosec();
+  for( i = 0; i + batch <= LOOKUPS; i += batch )
+  {
+    HashFindMany( ht, &lookup[ i ], batch, results );
+    for( j = 0; j < batch; j++ )
+      found += results[ j ] != NULL;
+  }
+  batchTime = nanosec() - start;
+
+  printf( "hash, %d elements: HashFind %.1f ns, "
+          "HashFindMany(%d) %.1f ns per key (%d found)\n", size,
+          (double) scalarTime / LOOKUPS, batch, (double) batchTime / LOOKUPS,
+          found );
+
+  HashDestroyTable( ht );
+  free( results );
+  free( lookup );
+  free( keys );
+}
+
+static void benchWordMap( int size, int batch )
+{
+  WordMap map;
+  char *names;
+  const char **lookup;
+  int *numbers;
+  uint64_t start, scalarTime, batchTime;
+  int i, j, found = 0;
+
+  names = (char *) malloc( size * NAME_LENGTH );
+  lookup = (const char **) malloc( LOOKUPS * sizeof( char * ) );
+  numbers = (int *) malloc( batch * sizeof( int ) );
+  if( (names == NULL) || (lookup == NULL) || (numbers == NULL) ||
+      (wordMap_create2( "bench", WORDMAP_BYNAME, &map, size ) != NULL) )
+    exit( 1 );
+
+  for( i = 0; i < size; i++ )
+  {
+    sprintf( names + i * NAME_LENGTH, "word%d", i );
+    if( wordMap_add( map, names + i * NAME_LENGTH, i ) != NULL )
+      exit( 1 );
+  }
+  for( i = 0; i < LOOKUPS; i++ )
+    lookup[ i ] = names + (rand() % size) * NAME_LENGTH;
+
+  start = nanosec();
+  for( i = 0; i < LOOKUPS; i++ )
+    found += wordMap_findByName( map, lookup[ i ] ) != -1;
+  scalarTime = nanosec() - start;
+
+  start = nanosec();
+  for( i = 0; i + batch <= LOOKUPS; i += batch )
+  {
+    wordMap_findManyByName( map, &lookup[ i ], batch, numbers );
+    for( j = 0; j < batch; j++ )
+      found += numbers[ j ] != -1;
+  }
+  batchTime = nanosec() - start;
+
+  printf( "wordMap, %d names: wordMap_findByName %.1f ns, "
+          "wordMap_findManyByName(%d) %.1f ns per name (%d found)\n", size,
+          (double) scalarTime / LOOKUPS, batch, (double) batchTime / LOOKUPS,
+          found );
+
+  /* There is no wordMap_destroy; the map lives until exit */
+  free( numbers );
+  free( lookup );
+  free( names );
+}
+
+int main( int argc, char **argv )
+{
+  int size = 1000000, batch = 64;
+
+  if( argc > 1 )
+    size = atoi( argv[ 1 ] );
+  if( argc > 2 )
+    batch = atoi( argv[ 2 ] );
+  if( (size < 1) || (batch < 1) )
+  {
+    fprintf( stderr, "usage: hashFindMany [elements [batch]]\n" );
+    return 1;
+  }
+
+  benchHash( size, batch );
+  benchWordMap( size, batch );
+
+  return 0;
+}
@@ -0,0 +1,103 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   hashUpdate -- cost of HashAdd and HashDelete
+
+   Keeps a chained table (HashCreateTable) at a steady size and times
+   adding and deleting elements in it, the pattern of a table of
+   outstanding calls. Then does the same with a cursor open on the table.
+   Each pass adds size elements and then deletes them again, and only the
+   passes are timed, so the clock is not read around every call. It only 
+   uses the original hash.h API, so it builds against older trees too.
+
+   usage: hashUpdate [elements]
+*/
+
+#include <voxi/util/config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/hash.h>
+#include <voxi/util/time.h>
+
+#define ROUNDS 2000000
+
+static int hashInt( void *data )
+{
+  return *(int *) data * 2654435761U;
+}
+
+static int compInt( void *data1, void *data2 )
+{
+  return *(int *) data1 != *(int *) data2;
+}
+
+/* Adds and deletes the elements beyond the first size, a pass at a time */
+static void run( const char *what, HashTable ht, int *keys, int size )
+{
+  unsigned long addTime = 0, deleteTime = 0, start;
+  int passes = (ROUNDS + size - 1) / size;
+  int pass, i;
+
+  for( pass = 0; pass < passes; pass++ )
+  {
+    start = microsec();
+    for( i = size; i < 2 * size; i++ )
+      HashAdd( ht, &keys[ i ] );
+    addTime += microsec() - start;
+
+    start = microsec();
+    for( i = size; i < 2 * size; i++ )
+      HashDelete( ht, &keys[ i ] );
+    deleteTime += microsec() - start;
+  }
+
+  printf( "%-12s HashAdd %.1f ns, HashDelete %.1f ns\n", what,
+          addTime * 1000.0 / ((double) passes * size), 
+          deleteTime * 1000.0 / ((double) passes * size) );
+}
+
+int main( int argc, char **argv )
+{
+  HashTable ht;
+  HashTableCursor cursor;
+  int *keys;
+  int size = 10000, i;
+
+  if( argc > 1 )
+    size = atoi( argv[ 1 ] );
+  if( size < 1 )
+    size = 1;
+
+  keys = (int *) malloc( 2 * size * sizeof( int ) );
+  if( keys == NULL )
+    return 1;
+  for( i = 0; i < 2 * size; i++ )
+    keys[ i ] = i;
+
+  ht = HashCreateTable( 2 * size, hashInt, compInt, NULL );
+  if( ht == NULL )
+    return 1;
+
+  for( i = 0; i < size; i++ )
+    HashAdd( ht, &keys[ i ] );
+
+  run( "no cursor", ht, keys, size );
+
+  cursor = HashCursorCreate( ht );
+  run( "cursor open", ht, keys, size );
+  HashCursorDestroy( cursor );
+
+  HashDestroyTable( ht );
+  free( keys );
+
+  return 0;
+}
@@ -0,0 +1,129 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   mutex -- VoxiMutex microbenchmark
+
+   Times an uncontended lock/unlock pair, a counter incremented by several
+   threads under one lock, and a round trip between two threads that hand
+   a turn back and forth with threading_cond_wait and pthread_cond_signal.
+   Only whole loops are timed, with microsec(), and only the original 
+   threading.h API is used, so the same file builds against the tree 
+   before this series to compare the implementations.
+
+   usage: mutex [threads]
+*/
+
+#include <voxi/util/config.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/threading.h>
+#include <voxi/util/time.h>
+
+#define UNCONTENDED_ROUNDS 10000000
+#define CONTENDED_ROUNDS 1000000
+#define PINGPONG_ROUNDS 100000
+
+static sVoxiMutex lock;
+static pthread_cond_t turnCondition;
+static volatile int turn = 0;
+static long counter = 0;
+static int threadCount = 2;
+
+static void *contendedThread( void *arg )
+{
+  int i;
+
+  for( i = 0; i < CONTENDED_ROUNDS / threadCount; i++ )
+  {
+    threading_mutex_lock( &lock );
+    counter++;
+    threading_mutex_unlock( &lock );
+  }
+
+  return arg;
+}
+
+/* Thread me waits for its turn, then gives the turn to the other */
+static void *pingPongThread( void *arg )
+{
+  int me = (int) (long) arg;
+  int i;
+
+  for( i = 0; i < PINGPONG_ROUNDS; i++ )
+  {
+    threading_mutex_lock( &lock );
+    while( turn != me )
+      threading_cond_wait( &turnCondition, &lock );
+    turn = 1 - me;
+    pthread_cond_signal( &turnCondition );
+    threading_mutex_unlock( &lock );
+  }
+
+  return NULL;
+}
+
+int main( int argc, char **argv )
+{
+  pthread_t *threads;
+  unsigned long start;
+  double elapsed;
+  int i;
+
+  if( argc > 1 )
+    threadCount = atoi( argv[ 1 ] );
+  if( threadCount < 1 )
+    threadCount = 1;
+
+  threading_init();
+  threading_mutex_init( &lock );
+  pthread_cond_init( &turnCondition, NULL );
+
+  /* At least two, for the ping-pong */
+  threads = (pthread_t *) malloc( (threadCount < 2 ? 2 : threadCount) *
+                                  sizeof( pthread_t ) );
+  if( threads == NULL )
+    return 1;
+
+  start = microsec();
+  for( i = 0; i < UNCONTENDED_ROUNDS; i++ )
+  {
+    threading_mutex_lock( &lock );
+    threading_mutex_unlock( &lock );
+  }
+  elapsed = (microsec() - start) * 1000.0;
+  printf( "uncontended lock/unlock: %.1f ns\n", elapsed / UNCONTENDED_ROUNDS );
+
+  start = microsec();
+  for( i = 0; i < threadCount; i++ )
+    pthread_create( &threads[ i ], NULL, contendedThread, NULL );
+  for( i = 0; i < threadCount; i++ )
+    pthread_join( threads[ i ], NULL );
+  elapsed = (microsec() - start) * 1000.0;
+  printf( "contended, %d threads: %.1f ns per lock/unlock\n", threadCount,
+          elapsed / counter );
+
+  start = microsec();
+  for( i = 0; i < 2; i++ )
+    pthread_create( &threads[ i ], NULL, pingPongThread, (void *) (long) i );
+  for( i = 0; i < 2; i++ )
+    pthread_join( threads[ i ], NULL );
+  elapsed = (microsec() - start) * 1000.0;
+  printf( "cond_wait ping-pong: %.2f us per round trip\n",
+          elapsed / PINGPONG_ROUNDS / 1000.0 );
+
+  free( threads );
+  pthread_cond_destroy( &turnCondition );
+  threading_mutex_destroy( &lock );
+
+  return 0;
+}
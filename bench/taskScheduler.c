@@ -0,0 +1,194 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   taskScheduler -- scaling of the work-stealing scheduler
+
+   Runs a recursive fib and a divide-and-conquer array sum on schedulers
+   of 1, 2, 4, ... up to the given number of workers, and times spawning
+   many tiny tasks from outside the workers.
+
+   usage: taskScheduler [workers]
+*/
+
+#include <voxi/util/config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/taskScheduler.h>
+#include <voxi/util/time.h>
+
+#define FIB_N 32
+#define FIB_CUTOFF 12
+#define SUM_LENGTH (1 << 24)
+#define SUM_CUTOFF 4096
+#define EXTERNAL_TASKS 100000
+
+typedef struct
+{
+  int n;
+  long result;
+} sFibArgs;
+
+typedef struct
+{
+  int low, high;
+  long result;
+} sSumArgs;
+
+static TaskScheduler scheduler;
+static int *array;
+static volatile int externalCount;
+
+static long fibSerial( int n )
+{
+  return n < 2 ? n : fibSerial( n - 1 ) + fibSerial( n - 2 );
+}
+
+static void *fibTask( void *args )
+{
+  sFibArgs *fib = (sFibArgs *) args;
+  sFibArgs first, second;
+  sTaskGroup group;
+
+  if( fib->n < FIB_CUTOFF )
+  {
+    fib->result = fibSerial( fib->n );
+    return NULL;
+  }
+
+  first.n = fib->n - 1;
+  second.n = fib->n - 2;
+
+  taskGroup_init( &group );
+  if( taskScheduler_spawn( scheduler, &group, fibTask, &first ) != NULL )
+    fibTask( &first );
+  fibTask( &second );
+  taskScheduler_wait( scheduler, &group );
+
+  fib->result = first.result + second.result;
+
+  return NULL;
+}
+
+static void *sumTask( void *args )
+{
+  sSumArgs *sum = (sSumArgs *) args;
+  sSumArgs low, high;
+  sTaskGroup group;
+  long result;
+  int i;
+
+  if( sum->high - sum->low <= SUM_CUTOFF )
+  {
+    result = 0;
+    for( i = sum->low; i < sum->high; i++ )
+      result += array[ i ];
+    sum->result = result;
+    return NULL;
+  }
+
+  low.low = sum->low;
+  low.high = high.low = sum->low + (sum->high - sum->low) / 2;
+  high.high = sum->high;
+
+  taskGroup_init( &group );
+  if( taskScheduler_spawn( scheduler, &group, sumTask, &low ) != NULL )
+    sumTask( &low );
+  sumTask( &high );
+  taskScheduler_wait( scheduler, &group );
+
+  sum->result = low.result + high.result;
+
+  return NULL;
+}
+
+static void *countTask( void *args )
+{
+  atomic_addInt( &externalCount, 1 );
+
+  return args;
+}
+
+/* Runs task( args ) on a worker and returns the time it took, in ms */
+static double timeTask( ThreadFunc task, void *args )
+{
+  sTaskGroup group;
+  uint64_t start;
+
+  start = nanosec();
+  taskGroup_init( &group );
+  if( taskScheduler_spawn( scheduler, &group, task, args ) != NULL )
+    exit( 1 );
+  taskScheduler_wait( scheduler, &group );
+
+  return (nanosec() - start) / 1e6;
+}
+
+int main( int argc, char **argv )
+{
+  sFibArgs fib;
+  sSumArgs sum;
+  sTaskGroup group;
+  uint64_t start;
+  double fibTime, sumTime, externalTime;
+  int maxWorkers = 4, workers, i;
+
+  if( argc > 1 )
+    maxWorkers = atoi( argv[ 1 ] );
+  if( maxWorkers < 1 )
+    maxWorkers = 1;
+
+  threading_init();
+
+  array = (int *) malloc( SUM_LENGTH * sizeof( int ) );
+  if( array == NULL )
+    return 1;
+  for( i = 0; i < SUM_LENGTH; i++ )
+    array[ i ] = i & 7;
+
+  start = nanosec();
+  fib.result = fibSerial( FIB_N );
+  printf( "serial: fib(%d) = %ld in %.1f ms\n", FIB_N, fib.result,
+          (nanosec() - start) / 1e6 );
+
+  for( workers = 1; workers <= maxWorkers; workers *= 2 )
+  {
+    if( taskScheduler_create( workers, NULL, &scheduler ) != NULL )
+      return 1;
+
+    fib.n = FIB_N;
+    fibTime = timeTask( fibTask, &fib );
+
+    sum.low = 0;
+    sum.high = SUM_LENGTH;
+    sumTime = timeTask( sumTask, &sum );
+
+    externalCount = 0;
+    start = nanosec();
+    taskGroup_init( &group );
+    for( i = 0; i < EXTERNAL_TASKS; i++ )
+      if( taskScheduler_spawn( scheduler, &group, countTask, NULL ) != NULL )
+        return 1;
+    taskScheduler_wait( scheduler, &group );
+    externalTime = (double) (nanosec() - start) / EXTERNAL_TASKS;
+
+    printf( "%d workers: fib(%d) = %ld in %.1f ms, sum = %ld in %.1f ms, "
+            "%d external spawns at %.0f ns\n", workers, FIB_N, fib.result,
+            fibTime, sum.result, sumTime, externalCount, externalTime );
+
+    taskScheduler_destroy( scheduler );
+  }
+
+  free( array );
+
+  return 0;
+}
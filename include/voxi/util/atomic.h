@@ -0,0 +1,169 @@
+/*
+ * <voxi/util/atomic.h>
+ *
+ * Minimal atomic operations on ints and pointers, used by the lock-free
+ * parts of the library.
+ *
+ * Loads have acquire semantics, stores have release semantics, and the
+ * read-modify-write operations (add, cas, exchange) are full barriers.
+ *
+ * Implemented with the __atomic builtins on gcc and with the Interlocked
+ * functions on Microsoft Visual C++.
+ */
+
+#ifndef VOXIUTIL_ATOMIC_H
+#define VOXIUTIL_ATOMIC_H
+
+#if defined( _MSC_VER )
+#include <windows.h>
+#include <intrin.h>
+#endif
+
+#include <voxi/types.h>
+
+#if defined( __GNUC__ )
+
+static __inline int atomic_loadInt( volatile int *p )
+{
+  return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+}
+
+static __inline void atomic_storeInt( volatile int *p, int value )
+{
+  __atomic_store_n( p, value, __ATOMIC_RELEASE );
+}
+
+/* Returns the new value */
+static __inline int atomic_addInt( volatile int *p, int delta )
+{
+  return __atomic_add_fetch( p, delta, __ATOMIC_SEQ_CST );
+}
+
+static __inline int atomic_exchangeInt( volatile int *p, int value )
+{
+  return __atomic_exchange_n( p, value, __ATOMIC_SEQ_CST );
+}
+
+static __inline Boolean atomic_casInt( volatile int *p, int oldValue,
+                                       int newValue )
+{
+  return __atomic_compare_exchange_n( p, &oldValue, newValue, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+}
+
+static __inline void *atomic_loadPtr( void * volatile *p )
+{
+  return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+}
+
+static __inline void atomic_storePtr( void * volatile *p, void *value )
+{
+  __atomic_store_n( p, value, __ATOMIC_RELEASE );
+}
+
+static __inline void *atomic_exchangePtr( void * volatile *p, void *value )
+{
+  return __atomic_exchange_n( p, value, __ATOMIC_SEQ_CST );
+}
+
+static __inline Boolean atomic_casPtr( void * volatile *p, void *oldValue,
+                                       void *newValue )
+{
+  return __atomic_compare_exchange_n( p, &oldValue, newValue, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+}
+
+static __inline void atomic_fence( void )
+{
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+}
+
+/* CPU hint for use in spin-wait loops */
+static __inline void atomic_pause( void )
+{
+#if defined( __i386__ ) || defined( __x86_64__ )
+  __builtin_ia32_pause();
+#elif defined( __aarch64__ ) || defined( __arm__ )
+  __asm__ __volatile__( "yield" );
+#else
+  __atomic_signal_fence( __ATOMIC_SEQ_CST );
+#endif
+}
+
+#elif defined( _MSC_VER )
+
+/*
+   On x86 and x64, MSVC volatile accesses are acquire loads and release
+   stores. The compiler barrier stops the compiler from moving other memory
+   accesses across them.
+*/
+static __inline int atomic_loadInt( volatile int *p )
+{
+  int value = *p;
+  _ReadWriteBarrier();
+  return value;
+}
+
+static __inline void atomic_storeInt( volatile int *p, int value )
+{
+  _ReadWriteBarrier();
+  *p = value;
+}
+
+static __inline int atomic_addInt( volatile int *p, int delta )
+{
+  return InterlockedExchangeAdd( (volatile LONG *) p, delta ) + delta;
+}
+
+static __inline int atomic_exchangeInt( volatile int *p, int value )
+{
+  return InterlockedExchange( (volatile LONG *) p, value );
+}
+
+static __inline Boolean atomic_casInt( volatile int *p, int oldValue,
+                                       int newValue )
+{
+  return InterlockedCompareExchange( (volatile LONG *) p, newValue,
+                                     oldValue ) == oldValue;
+}
+
+static __inline void *atomic_loadPtr( void * volatile *p )
+{
+  void *value = *p;
+  _ReadWriteBarrier();
+  return value;
+}
+
+static __inline void atomic_storePtr( void * volatile *p, void *value )
+{
+  _ReadWriteBarrier();
+  *p = value;
+}
+
+static __inline void *atomic_exchangePtr( void * volatile *p, void *value )
+{
+  return InterlockedExchangePointer( p, value );
+}
+
+static __inline Boolean atomic_casPtr( void * volatile *p, void *oldValue,
+                                       void *newValue )
+{
+  return InterlockedCompareExchangePointer( p, newValue,
+                                            oldValue ) == oldValue;
+}
+
+static __inline void atomic_fence( void )
+{
+  MemoryBarrier();
+}
+
+static __inline void atomic_pause( void )
+{
+  YieldProcessor();
+}
+
+#else
+#error Please provide atomic operations for this compiler in atomic.h
+#endif
+
+#endif
@@ -39,6 +39,7 @@
 #include <voxi/types.h>
 #include "collection.h"
 #include "err.h"
+#include "threadpool.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -269,6 +270,18 @@ EXTERN_UTIL void bagForEach( Bag bag, ForEachFunc forEachFunc, void *args );
  */
 EXTERN_UTIL void bagForEach2( Bag bag, ForEachFunc2 forEachFunc, void *args );
 
+#ifdef _POSIX_THREADS
+/**
+ * Same as bagForEach, but the calls are spread over the workers of an
+ * executor (see threadPool_createExecutor) and the calling thread, in no
+ * particular order. The bag is locked until all calls have returned.
+ *
+ * @return NULL if no error occured, else a pointer to an error.
+ */
+EXTERN_UTIL Error bagForEachParallel( Bag bag, ThreadPool pool, 
+                                      ForEachFunc forEachFunc, void *args );
+#endif
+
 /**
  * Calls the for each function with the elements for
  * which the filter function returns true.
@@ -0,0 +1,100 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   A thread-safe variant of the chained HashTable in hash.h.
+
+   The table is split into shards, each with its own lock, so that threads
+   adding and deleting elements in different shards do not wait for each
+   other. ConcurrentHashFind takes no lock and writes no shared memory; it
+   reads inside a section of the epoch domain returned by
+   epoch_getDefaultDomain (see epoch.h). Deletes never wait for readers.
+
+   Nothing keeps an element alive after ConcurrentHashFind has returned
+   it: another thread may delete or destroy it at any time. A reader that
+   keeps using the element while other threads may delete it must bracket
+   the find and the use with epoch_enter and epoch_exit on the default
+   domain, or keep the element alive itself, e.g. with a reference count.
+
+   The functions take the same arguments and return the same values as
+   their counterparts in hash.h, but see ConcurrentHashDelete for how 
+   deleted elements must be freed.
+*/
+
+#ifndef CONCURRENTHASH_H
+#define CONCURRENTHASH_H
+
+#include <voxi/util/hash.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sConcurrentHashTable *ConcurrentHashTable;
+typedef struct sConcurrentHashTableCursor *ConcurrentHashTableCursor;
+
+/*
+   Returns a table with room for size elements before the chains start to
+   grow. Pass 0 as shardCount to get four shards per processor, rounded up
+   to a power of two. Returns NULL if the table could not be created.
+*/
+EXTERN_UTIL ConcurrentHashTable ConcurrentHashCreateTable( unsigned int size,
+                                                           unsigned int shardCount,
+                                                           HashFuncPtr calc,
+                                                           CompFuncPtr comp,
+                                                           DestroyFuncPtr destr );
+
+/* No other thread may use the table while it is being destroyed */
+EXTERN_UTIL void ConcurrentHashDestroyTable( ConcurrentHashTable ht );
+
+/*
+   Returns the number of elements. The count is exact only if no other
+   thread is adding or deleting at the same time.
+*/
+EXTERN_UTIL int ConcurrentHashGetElementCount( ConcurrentHashTable ht );
+
+EXTERN_UTIL void *ConcurrentHashFind( ConcurrentHashTable ht, void *data );
+EXTERN_UTIL int ConcurrentHashAdd( ConcurrentHashTable ht, void *data );
+/*
+   Unlike after HashDelete, the caller must NOT free the element when 
+   ConcurrentHashDelete returns: a concurrent find may still be comparing
+   against it. Use ConcurrentHashDeleteRetire instead, or hand the element
+   to epoch_retire on the default domain, or call epoch_synchronize on 
+   that domain before freeing it.
+*/
+EXTERN_UTIL int ConcurrentHashDelete( ConcurrentHashTable ht, void *data );
+/*
+   Deletes the element matching data, and calls freeFunc on it once no 
+   reader can still see it. Returns the same as ConcurrentHashDelete.
+*/
+EXTERN_UTIL int ConcurrentHashDeleteRetire( ConcurrentHashTable ht, 
+                                            void *data, 
+                                            DestroyFuncPtr freeFunc );
+/* Like ConcurrentHashDeleteRetire with the table's destroy function */
+EXTERN_UTIL int ConcurrentHashDestroy( ConcurrentHashTable ht, void *data );
+
+/*
+   Cursors copy the elements of one bucket at a time under the shard lock,
+   so other threads may add and delete elements while a cursor is open.
+   Elements added or removed during the traversal may or may not be seen.
+
+   The element returned by ConcurrentHashCursorGetElement may have been
+   deleted from the table by another thread since the cursor reached it.
+*/
+EXTERN_UTIL ConcurrentHashTableCursor ConcurrentHashCursorCreate( ConcurrentHashTable ht );
+EXTERN_UTIL void ConcurrentHashCursorDestroy( ConcurrentHashTableCursor cursor );
+EXTERN_UTIL void *ConcurrentHashCursorGetElement( ConcurrentHashTableCursor cursor );
+EXTERN_UTIL void ConcurrentHashCursorGoFirst( ConcurrentHashTableCursor cursor );
+EXTERN_UTIL void ConcurrentHashCursorGoNext( ConcurrentHashTableCursor cursor );
+EXTERN_UTIL Boolean ConcurrentHashCursorPastLastElement( ConcurrentHashTableCursor cursor );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,76 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   Epoch based memory reclamation.
+
+   Lets readers traverse a shared data structure without taking locks, by
+   deferring the freeing of anything a writer removes until no reader can
+   still be looking at it.
+
+   Readers bracket each traversal with epoch_enter and epoch_exit. Writers
+   unlink an object so that new readers cannot reach it, then hand it to
+   epoch_retire, which calls freeFunc on it once every reader that was
+   inside a read section at the time has left. The objects a thread 
+   retires are kept and freed by that thread, in later calls to 
+   epoch_retire or epoch_synchronize, so writers do not share a lock.
+
+   Read sections may nest, are cheap (no locks, no system calls), and must
+   not block for long since they hold back reclamation for all writers of
+   the domain. A thread must not call epoch_synchronize from inside a read
+   section of the same domain.
+*/
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <voxi/util/libcCompat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sEpochDomain *EpochDomain;
+
+typedef void (*EpochFreeFunc)( void *data );
+
+/* Returns NULL if the domain could not be created */
+EXTERN_UTIL EpochDomain epoch_createDomain( void );
+
+/*
+   Frees everything still waiting to be reclaimed. No thread may be in a
+   read section of the domain.
+*/
+EXTERN_UTIL void epoch_destroyDomain( EpochDomain domain );
+
+/* A domain shared by the containers of the library */
+EXTERN_UTIL EpochDomain epoch_getDefaultDomain( void );
+
+EXTERN_UTIL void epoch_enter( EpochDomain domain );
+EXTERN_UTIL void epoch_exit( EpochDomain domain );
+
+/* 
+   Calls freeFunc( data ) when no reader can still reach data. The call is
+   made by a later epoch_retire or epoch_synchronize of the same thread, 
+   or of the next thread to use its record if it exits. If memory runs 
+   out, epoch_retire waits as epoch_synchronize does and frees data itself.
+*/
+EXTERN_UTIL void epoch_retire( EpochDomain domain, void *data,
+                               EpochFreeFunc freeFunc );
+
+/*
+   Waits until every read section that was open when the call was made has
+   ended, and frees everything the calling thread retired before the call.
+*/
+EXTERN_UTIL void epoch_synchronize( EpochDomain domain );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -84,10 +84,61 @@ typedef void (*EventHandlerFunc)( void *source, EventType eventType,
 typedef void (*EventFreeFunc)( void *source, EventType eventType, 
 															 void *eventData );
 
+/**
+ * Prototype for the callback-function of a batch listener, see
+ * em_addBatchListener. eventData holds the data of count events, oldest
+ * first, and is only valid during the call.
+ */
+typedef void (*EventBatchHandlerFunc)( void *source, EventType eventType,
+                                       void **eventData, int count,
+                                       void *handlerData );
+
+/**
+ * How a coalescing listener is handed the events that were posted while
+ * it waited to be called.
+ */
+typedef enum
+{
+  /** Only the latest event. The others are dropped as they are
+      replaced, and their freeFunc called then. */
+  EM_COALESCE_LATEST,
+  /** All of them, in the order they reached the listener. Events that
+      one thread posts to keys with only coalescing listeners reach them
+      in the order they were posted. */
+  EM_COALESCE_BATCH
+} EmCoalesceMode;
+
+/**
+ * How posted events are handed to their listeners.
+ */
+typedef enum
+{
+  /** A new thread for every event, and for every listener that asked for
+      one. The default. */
+  EM_DISPATCH_THREAD_PER_EVENT,
+  /** A bounded pool of worker threads handles the events, and calls the
+      listeners that asked for a thread of their own. */
+  EM_DISPATCH_POOL
+} EmDispatchMode;
+
 /*
  * Global variables
  */
 
+/**
+ * Selects the dispatch mode. Must be called before em_startup.
+ *
+ * maxWorkers bounds the pool in EM_DISPATCH_POOL mode, 0 means one
+ * worker per processor. Listeners are called as in the default mode:
+ * a blocking post returns once every listener has returned, and the
+ * listeners that asked for a thread run alongside the others. If no
+ * worker is free, such a listener is called by the thread handling the
+ * event instead. A blocking post made from a listener is handled by the
+ * posting thread, so that listeners waiting for their own events cannot
+ * use up the pool.
+ */
+void em_setDispatchMode( EmDispatchMode mode, int maxWorkers );
+
 /*
  * Start the event handler.
  */
@@ -97,6 +148,7 @@ void em_startup();
  * Ends the event handling and frees the resources that it used.
  * There might be spawned  eventhandling threads running after
  * this function returns...
+ * Coalescing listeners are called at once with the events they hold.
  */
 void em_shutdown();
 
@@ -115,6 +167,38 @@ void em_shutdown();
 void em_postEvent( void *source, EventType eventType, void *eventData, 
                    EventFreeFunc freeFunc, Boolean blocking );
 
+/**
+ * Called by the poster whose event makes the queue longer than the high
+ * water mark, see em_setQueueHighWaterMark. Must not post events.
+ */
+typedef void (*EmHighWaterFunc)( int queueLength, void *userData );
+
+/**
+ * The accounting of the queue of posted events that em_mainLoop has not
+ * taken yet, filled in by em_getQueueStats.
+ */
+typedef struct
+{
+  /** Events queued now */
+  int length;
+  /** The most events queued at once since em_startup */
+  int maxLength;
+  /** The high water mark, 0 if none is set */
+  int highWaterMark;
+  /** Times the queue has grown past the high water mark */
+  int overHighWater;
+} sEmQueueStats, *EmQueueStats;
+
+/**
+ * Sets the queue length above which func, if not NULL, is called. It is
+ * called every time the length goes from mark to mark + 1. 0 turns it
+ * off. Meant to be called before events are posted.
+ */
+void em_setQueueHighWaterMark( int mark, EmHighWaterFunc func,
+                               void *userData );
+
+void em_getQueueStats( EmQueueStats stats );
+
 /**
  * Add an event listener.
  * The listener will be called when an event with a matching
@@ -126,9 +210,47 @@ void em_addListener( void *source, EventType eventType,
 
 /**
  * Remove an event listener from the specified source.
+ * Returns once no other thread can call the listener any more, unless
+ * it was added with makeNewThread, so handlerData may then be freed.
  */
 void em_removeListener( void *source, EventType eventType, 
 			EventHandlerFunc handlerFunc, void *handlerData );
 
+/**
+ * Add a listener that is called at most maxDelayMillis after an event is
+ * posted, with the events that were posted until then, as mode says.
+ * Meant for sources that post the same eventType many times a second.
+ *
+ * The calls to one coalescing listener are made one at a time, each in
+ * a thread of its own, or by a worker in EM_DISPATCH_POOL mode. Posts to
+ * keys that only have coalescing listeners are not queued at all.
+ * Blocking posts are not coalesced: they are passed on at once, in the
+ * thread that handles the event, after the events the listener holds.
+ * Outside EM_DISPATCH_POOL mode the listener must therefore not make
+ * blocking posts to its own keys, as that call would wait for itself.
+ *
+ * Remove it with em_removeListener. Events that it has not been called
+ * with yet are then dropped.
+ */
+void em_addCoalescingListener( void *source, EventType eventType,
+                               EventHandlerFunc handlerFunc,
+                               void *handlerData, EmCoalesceMode mode,
+                               int maxDelayMillis );
+
+/**
+ * Like em_addCoalescingListener, but the events are passed in one call.
+ * With EM_COALESCE_LATEST, count is always 1.
+ */
+void em_addBatchListener( void *source, EventType eventType,
+                          EventBatchHandlerFunc batchFunc, void *handlerData,
+                          EmCoalesceMode mode, int maxDelayMillis );
+
+/**
+ * Removes a listener added with em_addBatchListener, as em_removeListener.
+ */
+void em_removeBatchListener( void *source, EventType eventType,
+                             EventBatchHandlerFunc batchFunc,
+                             void *handlerData );
+
 #endif
 
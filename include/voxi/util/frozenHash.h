@@ -0,0 +1,77 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   Frozen hash tables: immutable snapshots of a HashTable, for tables that
+   are built once and then only read.
+
+   The snapshot maps keys to values, both byte arrays copied out of the
+   elements of the HashTable. It is a minimal perfect hash: each key has
+   a slot of its own, found with a single probe, so a lookup touches a
+   small fixed number of cache lines and takes no lock.
+
+   The snapshot is a single block of memory without pointers, which
+   HashFrozenSave writes to a file as it is. HashFrozenMap maps such a file
+   back into memory without reading or parsing it, so loading a large
+   table takes no longer than the system calls. The file can only be
+   mapped on machines with the same byte order as the one that saved it.
+*/
+
+#ifndef FROZENHASH_H
+#define FROZENHASH_H
+
+#include <voxi/util/hash.h>
+#include <voxi/util/err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sHashFrozen *HashFrozen;
+
+/*
+   Called by HashFreeze for each element of the table, to get the key and
+   the value to store for it. The key and value are copied, and only need
+   to stay valid until HashFreeze returns. The keys must be unique.
+*/
+typedef void (*HashFreezeFuncPtr)( void *data,
+                                   const void **key, size_t *keyLength,
+                                   const void **value, size_t *valueLength );
+
+/* Builds a frozen snapshot of the elements currently in ht */
+EXTERN_UTIL Error HashFreeze( HashTable ht, HashFreezeFuncPtr describe,
+                              HashFrozen *frozen );
+
+/* Writes the snapshot to fileName, which is overwritten if it exists */
+EXTERN_UTIL Error HashFrozenSave( HashFrozen frozen, const char *fileName );
+
+/*
+   Maps a file written by HashFrozenSave into memory. The file must not be
+   changed while it is mapped.
+*/
+EXTERN_UTIL Error HashFrozenMap( const char *fileName, HashFrozen *frozen );
+
+/* Frees or unmaps the snapshot */
+EXTERN_UTIL void HashFrozenDestroy( HashFrozen frozen );
+
+EXTERN_UTIL int HashFrozenGetElementCount( HashFrozen frozen );
+
+/*
+   Returns the value stored for key and sets valueLength to its length, or
+   returns NULL if key is not in the snapshot. The value is aligned to
+   eight bytes and stays valid until the snapshot is destroyed.
+*/
+EXTERN_UTIL const void *HashFrozenFind( HashFrozen frozen, const void *key,
+                                        size_t keyLength,
+                                        size_t *valueLength );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,102 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   Futures: the result of a piece of work that may not have finished yet.
+
+   A future is completed exactly once, with a void * result, by whoever
+   does the work (the promise side). Any number of threads may poll it,
+   wait for it, or attach callbacks that run when it completes. A thread
+   waiting for a future sleeps on its state word (a futex on Linux), so
+   completing a future nobody waits for costs no system call.
+
+   A future has two references when it is created: one is dropped by
+   future_complete, the other by future_release when the consumer is done
+   with it. Control blocks are recycled through a small cache per thread,
+   so creating a future does not usually call malloc.
+
+   Futures for tasks are returned by threadPool_submitFuture and
+   taskScheduler_spawnFuture.
+*/
+
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include <voxi/util/libcCompat.h>
+#include <voxi/util/err.h>
+#include <voxi/util/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sFuture *Future;
+
+/* Called with the result of the future when it completes */
+typedef void (*FutureCallback)( Future future, void *result,
+                                void *userData );
+
+/* Returns a future that is not complete, or NULL if memory ran out */
+EXTERN_UTIL Future future_create( void );
+
+/*
+   Returns a future that is completed with func( args ) by
+   future_runTask, which is a ThreadFunc that takes the future as its
+   argument. Returns NULL if memory ran out.
+*/
+EXTERN_UTIL Future future_createTask( ThreadFunc func, void *args );
+EXTERN_UTIL void *future_runTask( void *future );
+
+/*
+   Sets the result, wakes the waiting threads, and runs the callbacks in
+   the order they were added, in the calling thread. Drops the promise
+   side's reference.
+*/
+EXTERN_UTIL void future_complete( Future future, void *result );
+
+/* Drops the consumer's reference. The future need not be complete. */
+EXTERN_UTIL void future_release( Future future );
+
+/* Adds a reference, to be dropped with future_release */
+EXTERN_UTIL void future_retain( Future future );
+
+/*
+   Returns TRUE and sets *result (if result is not NULL) if the future is
+   complete, without waiting.
+*/
+EXTERN_UTIL Boolean future_poll( Future future, void **result );
+
+/* Waits until the future is complete and returns its result */
+EXTERN_UTIL void *future_wait( Future future );
+
+/*
+   Waits at most usec microseconds. Returns TRUE and sets *result (if
+   result is not NULL) if the future completed.
+*/
+EXTERN_UTIL Boolean future_waitTimeout( Future future, unsigned long usec,
+                                        void **result );
+
+/*
+   Has callback called when the future completes: by the thread that
+   completes it, or at once by the calling thread if it already has.
+*/
+EXTERN_UTIL Error future_then( Future future, FutureCallback callback,
+                               void *userData );
+
+/*
+   Returns a future that completes, with the result NULL, when all count
+   futures have completed. The futures keep their own results. Returns
+   NULL if memory ran out.
+*/
+EXTERN_UTIL Future future_whenAll( Future *futures, int count );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
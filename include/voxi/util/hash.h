@@ -22,7 +22,10 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #include <voxi/util/libcCompat.h>
+#include <voxi/util/stdint.h>
 
 typedef int (*HashFuncPtr)(void *data);
 #ifndef _COMPFUNCPTR
@@ -43,6 +46,47 @@ typedef struct sHashTableCursor *HashTableCursor;
 EXTERN_UTIL HashTable HashCreateTable( unsigned int size, HashFuncPtr calc,
                                        CompFuncPtr comp, DestroyFuncPtr destr);
 
+/* Returns a hash table that grows as elements are added, so that the
+   number of elements never exceeds maxLoadFactor times the number of slots.
+   Pass 0 to get the default load factor (0.75). initialSize is the number of
+   elements the table can hold before it has to grow.
+
+   The elements are stored in a flat array (open addressing) rather than in
+   linked lists, and the table is rehashed a few slots at a time by HashAdd
+   and HashDelete, so that no single call pays for the whole rehash.
+   Rehashing is postponed while cursors are open on the table, as long as
+   the new array has room. If the table has to grow again before the
+   rehash is done, the rehash is finished at once, and the cursors open 
+   then may return elements they have already returned.
+
+   All other functions work the same as for tables created by
+   HashCreateTable. If the creation of the table fails, NULL is returned. */
+
+EXTERN_UTIL HashTable HashCreateTableDynamic( unsigned int initialSize, 
+                                              float maxLoadFactor,
+                                              HashFuncPtr calc, 
+                                              CompFuncPtr comp, 
+                                              DestroyFuncPtr destr );
+
+/* Returns a hash table that keeps its elements in an array, in the order 
+   they were added, and finds them through a separate open addressing 
+   index into the array (the layout of Python's dict). It grows as elements
+   are added; initialSize is the number of elements it can hold before it 
+   has to.
+
+   Cursors traverse the elements in the order they were added, by scanning
+   the array. A cursor is a position in the array, which does not change 
+   when other elements are added or removed. The room left by removed 
+   elements is reclaimed when the table grows with no cursors open.
+
+   All other functions work the same as for tables created by
+   HashCreateTable. If the creation of the table fails, NULL is returned. */
+
+EXTERN_UTIL HashTable HashCreateTableCompact( unsigned int initialSize, 
+                                              HashFuncPtr calc, 
+                                              CompFuncPtr comp, 
+                                              DestroyFuncPtr destr );
+
 /*
   Set the debugging level for the hash table. 0 = no debugging.
   Returns the previous debugging level.
@@ -62,10 +106,57 @@ EXTERN_UTIL void HashDestroyTable(HashTable ht);
 /* return the number of elements in the hash table */
 EXTERN_UTIL int HashGetElementCount( HashTable ht );
 
+/* the last entry of sHashStats.chainLengths counts all longer chains too */
+#define HASH_STATS_CHAIN_LENGTHS 16
+
+typedef struct sHashStats
+{
+  int elementCount;
+  /* buckets, or slots for a table created by HashCreateTableDynamic */
+  unsigned int bucketCount;
+  float loadFactor;
+
+  /* 
+     For chained tables, chainLengths[i] is the number of buckets holding
+     i elements, and meanChainLength is the mean over the non-empty ones.
+
+     For dynamic tables the chain length of an element is the number of
+     slots HashFind probes to reach it, and chainLengths[i] is the number
+     of elements with chain length i.
+  */
+  int maxChainLength;
+  float meanChainLength;
+  unsigned int chainLengths[ HASH_STATS_CHAIN_LENGTHS ];
+
+  /*
+     Cumulative counts of the searches made by finds, adds and deletes, of
+     the elements or slots they looked at, and of the calls to the
+     CompFuncPtr. Only counted if the library is built with HASH_STATS 
+     defined (configure --enable-hash-stats); zero otherwise.
+  */
+  unsigned long lookups;
+  unsigned long probes;
+  unsigned long compares;
+} sHashStats, *HashStats;
+
+/* 
+   Fills in stats for ht. Walks the whole table, so it is meant for 
+   occasional diagnostics rather than frequent calls.
+*/
+EXTERN_UTIL void HashGetStats( HashTable ht, HashStats stats );
+
 /* If a data record matching 'data' is found in ht, HashFind returns a pointer
    to it -- if no match can be found, it returns NULL. */
 EXTERN_UTIL /*@observer@*/void *HashFind(HashTable ht, void *data);
 
+/* 
+   Looks up count elements at once, setting results[i] to what HashFind
+   would return for keys[i]. Faster than calling HashFind for each key on 
+   large tables, since the memory accesses of several lookups overlap.
+*/
+EXTERN_UTIL void HashFindMany( HashTable ht, void *keys[], int count, 
+                               void *results[] );
+
 /* Removes the record containing 'data' from ht. If no such record exists,
    it returns 0. On success 1 is returned. */
 EXTERN_UTIL int HashDelete(HashTable ht, void *data);
@@ -82,11 +173,29 @@ EXTERN_UTIL int HashDestroy(HashTable ht, void *data);
 EXTERN_UTIL int HashAdd(HashTable ht, /*@only@*/void *data);
 /*perhaps @keep@ would be sufficient*/
 
+/*
+   The same as HashFind, HashAdd and HashDelete, for callers that already 
+   have the hash value of data. hashValue must be what the table's 
+   HashFuncPtr returns for data.
+*/
+EXTERN_UTIL /*@observer@*/void *HashFindWithHash( HashTable ht, void *data, 
+                                                  int hashValue );
+EXTERN_UTIL int HashAddWithHash( HashTable ht, /*@only@*/void *data, 
+                                 int hashValue );
+EXTERN_UTIL int HashDeleteWithHash( HashTable ht, void *data, int hashValue );
+
 /*
    functions for traversing (enumerating) the entries in the hashtable added
    by erl 981015.
 
    cursors are not expected to be used by more than one thread at a time.
+
+   Elements may be added and removed while a cursor is open. If the element 
+   under the cursor is removed, HashCursorGoNext continues with the element
+   that followed it, provided that one is still in the table. A cursor on a
+   table created by HashCreateTableDynamic may return an element twice if
+   the table has to finish a rehash while the cursor is open, see 
+   HashCreateTableDynamic.
 */
 /*
    create a cursor for traversing the hash table 
@@ -95,7 +204,8 @@ EXTERN_UTIL HashTableCursor HashCursorCreate( HashTable ht );
 
 EXTERN_UTIL void HashCursorDestroy( /*@special@*/HashTableCursor cursor )/*@releases cursor@*/;
 
-/* return the element that the cursor is pointing to */
+/* return the element that the cursor is pointing to, NULL if it has been
+   removed */
 EXTERN_UTIL /*@observer@*/void *HashCursorGetElement( HashTableCursor cursor );
 
 /* Move the cursor to the first element in the hashtable (according to some
@@ -117,6 +227,35 @@ EXTERN_UTIL Boolean HashCursorPastLastElement( HashTableCursor );
 EXTERN_UTIL int HashString( const char *string );
 EXTERN_UTIL int HashLowercaseString( const char *string );
 
+/* 
+   64 bit hash values for strings and byte arrays, reading eight bytes at a
+   time. Different seeds give unrelated hash values for the same string.
+   
+   HashLowercaseString64 hashes the string as if all ASCII capitals in it 
+   were lower case.
+*/
+EXTERN_UTIL uint64_t HashString64( const char *string, uint64_t seed );
+EXTERN_UTIL uint64_t HashLowercaseString64( const char *string, 
+                                            uint64_t seed );
+EXTERN_UTIL uint64_t HashBytes64( const void *data, size_t length, 
+                                  uint64_t seed );
+
+/* 
+   Scrambles value so that all bits of the result depend on all bits of 
+   value and seed. The tables use this on the values from the HashFuncPtr
+   before selecting a bucket from the high bits.
+*/
+EXTERN_UTIL uint64_t HashMix64( uint64_t value, uint64_t seed );
+
+/* 
+   Returns the random seed picked for the table when it was created. 
+   A HashFuncPtr that has access to its table may pass it to HashString64.
+*/
+EXTERN_UTIL uint64_t HashGetSeed( HashTable ht );
+
+/* Returns a new random seed, of the kind picked for each new table */
+EXTERN_UTIL uint64_t HashNewSeed( void );
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,62 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   A hash table for data that is looked up much more often than it changes.
+
+   RcuHashFind takes no lock and never waits. Writers are serialized by a
+   lock in the table, and replace whole buckets with modified copies
+   instead of changing them in place. The replaced buckets, and elements
+   passed to RcuHashDestroy, are freed through the epoch domain returned by
+   epoch_getDefaultDomain once no reader can still see them.
+
+   An element returned by RcuHashFind stays valid until it is deleted by
+   another thread. A reader that keeps using the element while other
+   threads may delete it must bracket the find and the use with
+   epoch_enter and epoch_exit on the default domain; the destroy function
+   is then not called on the element until epoch_exit.
+
+   The functions take the same arguments and return the same values as
+   their counterparts in hash.h.
+*/
+
+#ifndef RCUHASH_H
+#define RCUHASH_H
+
+#include <voxi/util/hash.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sRcuHashTable *RcuHashTable;
+
+/*
+   The table grows as elements are added, size is the number of elements
+   it can hold before it first has to. Returns NULL on failure.
+*/
+EXTERN_UTIL RcuHashTable RcuHashCreateTable( unsigned int size,
+                                             HashFuncPtr calc,
+                                             CompFuncPtr comp,
+                                             DestroyFuncPtr destr );
+
+/* No other thread may use the table while it is being destroyed */
+EXTERN_UTIL void RcuHashDestroyTable( RcuHashTable ht );
+
+EXTERN_UTIL int RcuHashGetElementCount( RcuHashTable ht );
+
+EXTERN_UTIL void *RcuHashFind( RcuHashTable ht, void *data );
+EXTERN_UTIL int RcuHashAdd( RcuHashTable ht, void *data );
+EXTERN_UTIL int RcuHashDelete( RcuHashTable ht, void *data );
+EXTERN_UTIL int RcuHashDestroy( RcuHashTable ht, void *data );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,7 +10,7 @@
 #ifndef VOXIUTIL_STDINT_H
 #  define VOXIUTIL_STDINT_H
 
-#  ifdef HAVE_STDINT_H
+#  if defined( HAVE_STDINT_H ) || defined( __GNUC__ )
 #    include <stdint.h>
 #  else
 #    include <limits.h>
@@ -21,6 +21,23 @@
 #    else
 #      error Please configure a 16 bit type here.
 #    endif
+
+#    if (INT_MAX == 2147483647)
+       typedef int int32_t;
+       typedef unsigned int uint32_t;
+#    else
+#      error Please configure a 32 bit type here.
+#    endif
+
+#    if HAVE___INT64
+       typedef __int64 int64_t;
+       typedef unsigned __int64 uint64_t;
+#    elif HAVE_LONG_LONG
+       typedef long long int64_t;
+       typedef unsigned long long uint64_t;
+#    else
+#      error Please configure a 64 bit type here.
+#    endif
 #  endif
 #endif
 
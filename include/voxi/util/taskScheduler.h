@@ -0,0 +1,119 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   A work-stealing scheduler for many small tasks.
+
+   Each worker thread has a deque of its own. Tasks spawned by a worker go
+   on its deque, and the worker runs them newest first, so that a task
+   that splits its work keeps the data it just touched in its cache.
+   Workers that run out of tasks steal the oldest task from the deque of a
+   randomly chosen worker, and sleep when there is nothing to steal.
+   Tasks spawned by other threads go on a shared queue.
+
+   Tasks are grouped in TaskGroups. taskScheduler_wait returns when every
+   task spawned into a group has finished; on a worker it runs other tasks
+   while it waits. A task may spawn into and wait for groups of its own,
+   which is how divide-and-conquer work is written:
+
+     static void *fib( void *arg )
+     {
+       FibArgs args = arg;
+       sFibArgs a, b;
+       sTaskGroup group;
+
+       if( args->n < CUTOFF )
+       {
+         args->result = serialFib( args->n );
+         return NULL;
+       }
+
+       taskGroup_init( &group );
+       a.n = args->n - 1;
+       b.n = args->n - 2;
+       taskScheduler_spawn( args->scheduler, &group, fib, &a );
+       fib( &b );
+       taskScheduler_wait( args->scheduler, &group );
+       args->result = a.result + b.result;
+
+       return NULL;
+     }
+*/
+
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <voxi/util/libcCompat.h>
+#include <voxi/util/err.h>
+#include <voxi/util/future.h>
+#include <voxi/util/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sTaskScheduler *TaskScheduler;
+
+/*
+   The unfinished tasks of a group. Usually kept on the stack of the thread
+   that spawns the tasks and waits for them. The count is kept times two;
+   the lowest bit is set while a thread that is not a worker sleeps on it.
+*/
+typedef struct
+{
+  volatile int pending;
+} sTaskGroup, *TaskGroup;
+
+EXTERN_UTIL void taskGroup_init( TaskGroup group );
+
+/*
+   Starts workerCount workers, or one per processor if workerCount is 0.
+   spec describes the worker threads, see threading_pthread_createSpec;
+   NULL means default threads. The detached field is ignored.
+*/
+EXTERN_UTIL Error taskScheduler_create( int workerCount, ThreadSpec spec,
+                                        TaskScheduler *res );
+
+/*
+   Runs the tasks that are left, stops the workers and frees the
+   scheduler. Must not be called from a worker.
+*/
+EXTERN_UTIL void taskScheduler_destroy( TaskScheduler scheduler );
+
+/*
+   Has func( args ) called by one of the workers. group may be NULL if no
+   one will wait for the task. Fails only if the scheduler is being
+   destroyed, or if memory runs out.
+*/
+EXTERN_UTIL Error taskScheduler_spawn( TaskScheduler scheduler,
+                                       TaskGroup group,
+                                       ThreadFunc func, void *args );
+
+/*
+   Like taskScheduler_spawn without a group, but sets *res to a future
+   that is completed with the return value of func. Release it with
+   future_release.
+*/
+EXTERN_UTIL Error taskScheduler_spawnFuture( TaskScheduler scheduler,
+                                             ThreadFunc func, void *args,
+                                             Future *res );
+
+/* Returns when all tasks spawned into group have finished */
+EXTERN_UTIL void taskScheduler_wait( TaskScheduler scheduler,
+                                     TaskGroup group );
+
+EXTERN_UTIL int taskScheduler_getWorkerCount( TaskScheduler scheduler );
+
+/* Returns the index of the calling worker, or -1 if it is not a worker */
+EXTERN_UTIL int taskScheduler_getCurrentWorker( TaskScheduler scheduler );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
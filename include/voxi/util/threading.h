@@ -37,6 +37,9 @@
 #endif /* WIN32 */
 
 #include <voxi/types.h>
+#include <voxi/util/stdint.h>
+
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {  /* only need to export C interface if */
@@ -48,27 +51,118 @@ extern "C" {  /* only need to export C interface if */
    pthread_crete. */
 typedef void * (*ThreadFunc)(void *);
 
+/*
+  A recursive mutex. 
+
+  The lock is a single word, taken with one compare-and-swap when it is 
+  free; threads that find it taken sleep on the word (a futex on Linux).
+  The thread holding the lock and its recursion count are kept next to it.
+
+  The debugging information (thread, pid, lastLockFrom and the traces 
+  enabled by threading_mutex_setDebug) is only kept in builds without 
+  NDEBUG. The fields are there in all builds, so that the layout is the 
+  same.
+*/
 typedef struct
 {
-  pthread_mutex_t mutex;
-  pthread_t thread; /* The thread which has the mutex locked */
-  pid_t pid;  /* the number used by gdb to identify threads */
+  /* 0 = unlocked, 1 = locked, 2 = locked and threads may be sleeping */
+  volatile int state;
+  /* an id of the thread holding the lock, 0 if none */
+  volatile int owner;
+  int count;
   /* 
-     this semaphore has value 1 when no-one is accessing the mutex data,
-     0 otherwise.
-     
-     rules:
-     
-     one may only try to lock the lock while holding the semaphore if the 
-     count is non zero.
-     
+     Set when a thread in threading_cond_wait has released the lock but may
+     not yet be waiting on the condition. Only changed with the lock held.
   */
-  sem_t semaphore;
-  int count;
+  Boolean condWindow;
+  pthread_mutex_t condMutex;
+  /* where the lock word cannot be slept on directly, threads sleep here */
+  pthread_mutex_t parkMutex;
+  pthread_cond_t parkCondition;
+
+  /* how many times a contended lock is polled before sleeping, 0 = never */
+  int spinBudget;
+  /* updated by the thread holding the lock, see threading_mutex_getStats */
+  unsigned long acquisitions, contendedAcquisitions, spinAcquisitions, parks;
+  /* the contention profiler's record of the current hold, NULL if none */
+  void *profileRecord;
+  uint64_t profileHoldStart;
+
+  pthread_t thread; /* The thread which has the mutex locked */
+  pid_t pid;  /* the number used by gdb to identify threads */
   const char *lastLockFrom;
   Boolean debug;
 } sVoxiMutex, *VoxiMutex;
 
+/*
+  How a thread that finds a VoxiMutex locked waits for it. A blocking mutex
+  sleeps at once. An adaptive mutex first polls the lock for a while, which
+  is cheaper when the lock is only held for short moments; it does not poll
+  on machines with a single processor, or when other threads are already 
+  sleeping on the lock.
+*/
+typedef enum
+{
+  THREADING_MUTEX_BLOCKING,
+  THREADING_MUTEX_ADAPTIVE
+} VoxiMutexMode;
+
+/* The spin budget given to adaptive mutexes by threading_mutex_initMode */
+#define THREADING_MUTEX_SPIN_BUDGET 100
+
+/* Lock counters of a VoxiMutex, filled in by threading_mutex_getStats */
+typedef struct
+{
+  /* non-recursive lockings, including reacquisitions in cond waits */
+  unsigned long acquisitions;
+  /* of those, the ones that found the mutex locked */
+  unsigned long contendedAcquisitions;
+  /* of those, the ones that got the mutex by polling, without sleeping */
+  unsigned long spinAcquisitions;
+  /* the number of times a thread went to sleep waiting for the mutex */
+  unsigned long parks;
+} sVoxiMutexStats, *VoxiMutexStats;
+
+/*
+  A reader-writer lock. Any number of threads may hold it for reading, or 
+  one thread for writing. 
+
+  Readers count themselves in one of several counters, picked by thread,
+  each in a cache line of its own, so readers on different processors do
+  not write to the same memory. A writer waits for all the counters to
+  drop to zero.
+
+  Writers are preferred: once a writer is waiting, new readers wait until 
+  there are no writers left. The lock is not recursive; in particular a 
+  thread holding it for reading must not lock it again, since a waiting 
+  writer would block it.
+*/
+#define THREADING_RWLOCK_SLOTS 16
+
+typedef struct
+{
+  volatile int readers;
+  char padding[ 64 - sizeof( int ) ];
+} sVoxiRWLockSlot;
+
+typedef struct
+{
+  sVoxiRWLockSlot slots[ THREADING_RWLOCK_SLOTS ];
+  /* writers holding or waiting for the lock */
+  volatile int writers;
+  /* an id of the thread holding the lock for writing, 0 if none */
+  volatile int writerOwner;
+  /* serializes writers */
+  sVoxiMutex writerMutex;
+  /* readers and writers sleep here */
+  pthread_mutex_t waitMutex;
+  pthread_cond_t readerCondition, writerCondition;
+
+  /* the where of the last writer, only kept in builds without NDEBUG */
+  const char *lastLockFrom;
+  Boolean debug;
+} sVoxiRWLock, *VoxiRWLock;
+
 /* 
    The detachedThreadAttr variable must not be accessed until the 
    threading_init call has been made.
@@ -85,7 +179,22 @@ EXTERN_UTIL pthread_attr_t detachedThreadAttr, realtimeDetachedThreadAttr,
 EXTERN_UTIL Error threading_init();
 EXTERN_UTIL Error threading_shutdown();
 
+/* Initializes a blocking mutex */
 EXTERN_UTIL Error threading_mutex_init( VoxiMutex mutex );
+EXTERN_UTIL Error threading_mutex_initMode( VoxiMutex mutex, 
+                                            VoxiMutexMode mode );
+/*
+  Sets how many times the lock is polled before a waiting thread sleeps.
+  0 makes the mutex blocking.
+*/
+EXTERN_UTIL void threading_mutex_setSpinBudget( VoxiMutex mutex, 
+                                                int spinBudget );
+/*
+  Copies the counters of the mutex. They are only exact while no other
+  thread uses the mutex.
+*/
+EXTERN_UTIL void threading_mutex_getStats( VoxiMutex mutex, 
+                                           VoxiMutexStats stats );
 EXTERN_UTIL void threading_mutex_lock( VoxiMutex mutex );
 EXTERN_UTIL void threading_mutex_setDebug( VoxiMutex mutex, Boolean debug );
 /*
@@ -93,7 +202,8 @@ EXTERN_UTIL void threading_mutex_setDebug( VoxiMutex mutex, Boolean debug );
   
   Pass a string describing why/where the lock is being locked. 
   
-  The function will return the description of the previous locker of the lock.
+  The function will return the description of the previous locker of the lock
+  (always NULL in builds with NDEBUG).
 */
 EXTERN_UTIL const char *threading_mutex_lock_debug( VoxiMutex mutex, const char *where );
 /*
@@ -108,6 +218,57 @@ EXTERN_UTIL void threading_mutex_destroy( VoxiMutex mutex );
 
 EXTERN_UTIL Error threading_cond_wait( pthread_cond_t *condition, VoxiMutex mutex );
 
+/*
+  Lock contention profiling.
+
+  While profiling is on, every locking of a VoxiMutex is recorded under the
+  mutex and the where passed to threading_mutex_lock_debug (NULL for 
+  threading_mutex_lock): how many times it was locked, how many of those 
+  found it locked, how long the thread waited for it in total and at most,
+  and a histogram of how long it was held. Each thread records into a 
+  buffer of its own, so profiling adds no shared writes. While profiling 
+  is off, locking only tests a flag.
+
+  If the environment variable VOXI_LOCK_PROFILE is set when the first 
+  mutex is initialized, profiling is turned on, and the report is written
+  at exit to the file it names, or to stderr if it is empty or "-".
+*/
+EXTERN_UTIL void threading_profile_setEnabled( Boolean enabled );
+/*
+  Writes a report of the records so far, sorted by total wait time, with
+  the records of all threads for the same mutex and where merged.
+*/
+EXTERN_UTIL void threading_profile_dump( FILE *file );
+
+EXTERN_UTIL Error threading_rwlock_init( VoxiRWLock rwlock );
+EXTERN_UTIL void threading_rwlock_destroy( VoxiRWLock rwlock );
+/*
+  Unlike VoxiMutex, the read lock is not recursive. A thread must not take
+  a read lock it already holds: a writer waiting for the lock holds off new
+  readers, so the thread would wait for the writer, and the writer for the
+  thread's first read lock. For the same reason a thread holding a read 
+  lock must not take the write lock. Debug builds assert on both.
+*/
+EXTERN_UTIL void threading_rwlock_rdlock( VoxiRWLock rwlock );
+EXTERN_UTIL void threading_rwlock_wrlock( VoxiRWLock rwlock );
+/* Releases a read or a write lock held by the calling thread */
+EXTERN_UTIL void threading_rwlock_unlock( VoxiRWLock rwlock );
+EXTERN_UTIL void threading_rwlock_setDebug( VoxiRWLock rwlock, 
+                                            Boolean debug );
+/*
+  Debugging versions of the functions above. where describes why/where the
+  lock is being locked; it is printed when debugging is turned on with 
+  threading_rwlock_setDebug, and the where of the last writer is kept in 
+  lastLockFrom. Readers do not store it, so that they do not all write to 
+  the same field.
+*/
+EXTERN_UTIL void threading_rwlock_rdlock_debug( VoxiRWLock rwlock, 
+                                                const char *where );
+EXTERN_UTIL void threading_rwlock_wrlock_debug( VoxiRWLock rwlock, 
+                                                const char *where );
+EXTERN_UTIL void threading_rwlock_unlock_debug( VoxiRWLock rwlock, 
+                                                const char *where );
+
 /*
   Returns false when condition is signalled, and a true value if timed out 
 */
@@ -120,6 +281,55 @@ EXTERN_UTIL Boolean threading_cond_absolute_timedwait( pthread_cond_t *condition
                                               struct timespec *wakeuptime );
 
 
+/*
+  A description of a thread to create, for threading_pthread_createSpec and
+  threadPool_createSpec. Initialize it with threading_spec_init, which 
+  gives a joinable thread with the default settings, and change the fields
+  that matter.
+*/
+#define THREADING_SPEC_MAX_CPUS 256
+#define THREADING_SPEC_CPU_BITS ((int) (8 * sizeof( unsigned long )))
+/* the longest name Linux keeps, without the terminating null */
+#define THREADING_SPEC_NAME_LENGTH 15
+/* policy value for keeping the scheduling of the creating thread */
+#define THREADING_SPEC_INHERIT_POLICY -1
+
+typedef struct
+{
+  /* 
+     Shown by top, perf and gdb. Cut to THREADING_SPEC_NAME_LENGTH 
+     characters; NULL keeps the name of the creating process.
+  */
+  const char *name;
+  /* 
+     The processors the thread may run on, set with threading_spec_addCpu.
+     No processors means any.
+  */
+  unsigned long cpus[ THREADING_SPEC_MAX_CPUS / THREADING_SPEC_CPU_BITS ];
+  /* SCHED_OTHER, SCHED_FIFO, SCHED_RR or THREADING_SPEC_INHERIT_POLICY */
+  int policy;
+  int priority;
+  /* in bytes, 0 for the defaults */
+  size_t stackSize;
+  size_t guardSize;
+  Boolean detached;
+} sThreadSpec, *ThreadSpec;
+
+EXTERN_UTIL void threading_spec_init( ThreadSpec spec );
+/* Allows the thread to run on processor cpu, counting from 0 */
+EXTERN_UTIL void threading_spec_addCpu( ThreadSpec spec, int cpu );
+
+/*
+  Creates a thread as described by spec. Returns 0 or an error number, like
+  pthread_create. The name and processors are set by the new thread before
+  it calls start_routine; where the system cannot set them, they are 
+  ignored.
+*/
+EXTERN_UTIL int threading_pthread_createSpec( pthread_t *thread, 
+                                              ThreadSpec spec,
+                                              ThreadFunc start_routine, 
+                                              void *arg );
+
 /* use this instead of pthread_create! */
 EXTERN_UTIL int threading_pthread_create( pthread_t * thread, 
                                           pthread_attr_t * attr,
@@ -131,6 +341,31 @@ EXTERN_UTIL int threading_pthread_create( pthread_t * thread,
      successfully
   */
 EXTERN_UTIL int threading_sem_wait( sem_t *semaphore );
+
+/*
+  Returns the number of processors currently online, or 1 if it cannot be
+  determined.
+*/
+EXTERN_UTIL int threading_getCpuCount( void );
+
+/* Gives up the processor to another runnable thread, if there is one */
+EXTERN_UTIL void threading_yield( void );
+
+/*
+  Sleeping on a word of memory (a futex on Linux). threading_word_wait
+  sleeps if *word still equals value, until threading_word_wake is called
+  on the same word. Both may return early, so waiters check the word again
+  in a loop. A thread that changes the word and then calls 
+  threading_word_wake cannot miss a waiter.
+*/
+#define THREADING_WORD_WAKE_ALL 0x7fffffff
+
+EXTERN_UTIL void threading_word_wait( volatile int *word, int value );
+/* Returns TRUE if usec microseconds passed without a wake */
+EXTERN_UTIL Boolean threading_word_timedwait( volatile int *word, int value, 
+                                              unsigned long usec );
+/* Wakes up to count of the threads sleeping on word */
+EXTERN_UTIL void threading_word_wake( volatile int *word, int count );
   
 #ifdef __cplusplus
 }
@@ -34,9 +34,23 @@ extern "C" {  // only need to export C interface if
 typedef struct sThreadPool *ThreadPool;
 typedef struct sThreadPoolThread *ThreadPoolThread;
 
+/**
+ * What threadPool_submit does when the task queue of an executor is full.
+ */
+typedef enum {
+  /** Wait until a worker has taken a task from the queue */
+  THREADPOOL_REJECT_BLOCK,
+  /** Return an error */
+  THREADPOOL_REJECT_FAIL,
+  /** Run the task in the submitting thread, which slows the submitter */
+  THREADPOOL_REJECT_CALLER_RUNS
+} ThreadPoolRejectPolicy;
+
 /* the stuff below is a hack to solve recursive include problems */
 
 #include <voxi/util/err.h>
+#include <voxi/util/future.h>
+#include <voxi/util/stdint.h>
 #include <voxi/util/threading.h>
 
 /**
@@ -58,6 +72,119 @@ typedef struct sThreadPoolThread *ThreadPoolThread;
  */
 Error threadPool_create(int initialSize, pthread_attr_t attr, ThreadPool *res);
 
+/**
+ * Create a new ThreadPool whose threads are created as described by spec,
+ * see threading_pthread_createSpec. All threads get the same name,
+ * processors, scheduling and stack, so that for example latency critical
+ * work can be kept on processors of its own.
+ *
+ * @pre initialSize >= 0
+ *
+ * @param initialSize The initial number of available threads
+ *    in the pool. Must be zero or greater.
+ * @param spec The description of the threads. It is copied, and the
+ *    detached field decides whether threads must be joined upon.
+ * @param res If error is NULL this will point to a valid ThreadPool object.
+ *
+ * @return NULL if no error occured, else a pointer to an error.
+ */
+Error threadPool_createSpec(int initialSize, ThreadSpec spec, ThreadPool *res);
+
+/**
+ * Create an executor: a ThreadPool with a set of worker threads that run
+ * tasks given to threadPool_submit, in the order they were submitted.
+ * Tasks wait in a bounded queue until a worker is free, so a burst of
+ * tasks does not create a burst of threads.
+ *
+ * The pool starts minWorkers workers, and starts more, up to maxWorkers,
+ * when a task is submitted while all workers are busy.
+ *
+ * @pre 1 <= minWorkers <= maxWorkers, queueCapacity >= 1
+ *
+ * @param queueCapacity The number of tasks the queue can hold. It is
+ *    rounded up to a power of two.
+ * @param rejectPolicy What threadPool_submit does when the queue is full.
+ * @param spec Describes the worker threads, see threading_pthread_createSpec.
+ *    NULL means default threads. The detached field is ignored.
+ * @param res If error is NULL this will point to a valid ThreadPool object.
+ *
+ * @return NULL if no error occured, else a pointer to an error.
+ */
+Error threadPool_createExecutor(int minWorkers, int maxWorkers,
+                                int queueCapacity,
+                                ThreadPoolRejectPolicy rejectPolicy,
+                                ThreadSpec spec, ThreadPool *res);
+
+/**
+ * Queues func to be called with args by one of the workers of an executor.
+ * The queue takes no lock unless a worker is idle or the queue is full.
+ *
+ * @remarks Calling this function after threadPool_destroy has
+ * been called will result in an error. Tasks queued before
+ * threadPool_destroy is called are run before it returns. Submitters
+ * blocked on a full queue get an error, and threadPool_destroy waits
+ * for them to return before it frees the pool.
+ *
+ * @return NULL if the task was queued (or, with
+ *    THREADPOOL_REJECT_CALLER_RUNS, run), else a pointer to an error.
+ */
+Error threadPool_submit(ThreadPool pool, ThreadFunc func, void *args);
+
+/**
+ * Like threadPool_submit, but hands back a future that is completed with
+ * the return value of func. Waiting for the future does not tie up a
+ * worker, unlike threadPoolThread_join.
+ *
+ * @param res If error is NULL this will point to the future. Release it
+ *    with future_release.
+ *
+ * @return NULL if the task was queued, else a pointer to an error.
+ */
+Error threadPool_submitFuture(ThreadPool pool, ThreadFunc func, void *args,
+                              Future *res);
+
+/**
+ * Called by threadPool_parallelFor for one chunk of the range, with
+ * begin <= i < end.
+ */
+typedef void (*ThreadPoolRangeFunc)(int begin, int end, void *context);
+
+/** Returns the partial result of one chunk for threadPool_parallelReduce */
+typedef void *(*ThreadPoolReduceFunc)(int begin, int end, void *context);
+
+/**
+ * Combines two partial results into one. It may free or reuse a and b.
+ * Partial results are combined in no particular order, so the function
+ * must be associative and commutative.
+ */
+typedef void *(*ThreadPoolCombineFunc)(void *a, void *b, void *context);
+
+/**
+ * Calls func for chunks of the range begin <= i < end, on the workers of
+ * an executor and on the calling thread, and returns when all chunks are
+ * done. Participants take the next chunk from a shared counter, so a
+ * thread that gets cheap chunks simply takes more of them.
+ *
+ * The calling thread works on the range too, so this may be called from
+ * a task running on the same pool.
+ *
+ * @param grain The number of indexes in a chunk. 0 picks a size that
+ *    gives about four chunks per worker.
+ *
+ * @return NULL if no error occured, else a pointer to an error.
+ */
+Error threadPool_parallelFor(ThreadPool pool, int begin, int end, int grain,
+                             ThreadPoolRangeFunc func, void *context);
+
+/**
+ * Like threadPool_parallelFor, but combines the partial results of the
+ * chunks into *res. *res is NULL if the range is empty.
+ */
+Error threadPool_parallelReduce(ThreadPool pool, int begin, int end,
+                                int grain, ThreadPoolReduceFunc reduce,
+                                ThreadPoolCombineFunc combine, void *context,
+                                void **res);
+
 /**
  * Destroys and frees a thread pool object.
  * Any attempt to call destroy, join or runThread on
@@ -104,6 +231,55 @@ Error threadPool_runThread(ThreadPool threadPool, ThreadFunc func, void *args,
  */
 Error threadPoolThread_join(ThreadPoolThread threadToJoin, void **threadFuncResult);
 
+/**
+ * Times of at least 2^i ns, but less than 2^(i + 1) ns, are counted in
+ * bucket i of the histograms in sThreadPoolStats. The last bucket also
+ * counts all longer times.
+ */
+#define THREADPOOL_STATS_BUCKETS 32
+
+/**
+ * The counters of a pool, filled in by threadPool_getStats. For a pool
+ * made by threadPool_create or threadPool_createSpec a task is a call
+ * given to threadPool_runThread; for an executor it is a task given to
+ * threadPool_submit.
+ */
+typedef struct {
+  /** Threads started and ended since the pool was created */
+  unsigned long threadsCreated;
+  unsigned long threadsDestroyed;
+  /** Threads now running a task, and threads waiting for one */
+  int busyThreads;
+  int idleThreads;
+  /** Tasks waiting in the queue of an executor */
+  int queuedTasks;
+
+  /** Tasks that have finished */
+  unsigned long tasksRun;
+  /** Time, in ns, that finished tasks ran and waited for a thread */
+  uint64_t runTimeTotal;
+  uint64_t waitTimeTotal;
+  unsigned long runTimes[THREADPOOL_STATS_BUCKETS];
+  unsigned long waitTimes[THREADPOOL_STATS_BUCKETS];
+} sThreadPoolStats, *ThreadPoolStats;
+
+/**
+ * Fills in stats. The counters of threads that are running tasks are
+ * read without stopping them, so the sums may be off by a task or two,
+ * but the counters of each thread are read as a consistent whole.
+ */
+void threadPool_getStats(ThreadPool pool, ThreadPoolStats stats);
+
+/**
+ * Lets idle threads exit once they have waited usec microseconds for a
+ * task, as long as more than minThreads threads are left. usec 0, the
+ * default, keeps threads until the pool is destroyed.
+ *
+ * @pre For an executor, minThreads >= 1. It replaces minWorkers.
+ */
+void threadPool_setIdleTimeout(ThreadPool pool, unsigned long usec,
+                               int minThreads);
+
 #ifdef __cplusplus
 }  // only need to export C interface if
               // used by C++ source code
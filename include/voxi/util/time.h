@@ -15,10 +15,16 @@ extern "C" {
 #endif 
 
 #include <voxi/util/libcCompat.h>
+#include <voxi/util/stdint.h>
 
 /* get the number of ms since some unspecified time */
 EXTERN_UTIL unsigned long millisec();
 EXTERN_UTIL unsigned long microsec();
+/* 
+   get the number of ns since some unspecified time, from a clock that is 
+   not affected by changes to the time of day 
+*/
+EXTERN_UTIL uint64_t nanosec( void );
 
 #ifdef __cplusplus
 }
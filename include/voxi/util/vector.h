@@ -36,6 +36,7 @@ typedef const struct sVector *ConstVector;
 #include <voxi/util/collection.h>
 #include <voxi/types.h>
 #include <voxi/util/libcCompat.h>
+#include <voxi/util/threadpool.h>
 
 #ifndef NDEBUG
 /* helperfunction for assert */
@@ -176,6 +177,19 @@ EXTERN_UTIL void vectorSetElementAt( Vector vector, int index,
  */
 EXTERN_UTIL Vector vectorClone( const char *name, Vector a );
 
+#ifdef _POSIX_THREADS
+/**
+ * Calls forEachFunc with a pointer to each element of the vector, spread
+ * over the workers of an executor (see threadPool_createExecutor) and the
+ * calling thread, in no particular order. The vector is locked until all
+ * calls have returned.
+ *
+ * @return NULL if no error occured, else a pointer to an error.
+ */
+EXTERN_UTIL Error vectorForEachParallel( Vector vector, ThreadPool pool,
+                                         ForEachFunc forEachFunc, void *args );
+#endif
+
 #ifdef __cplusplus
 }
 #endif 
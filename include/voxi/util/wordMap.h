@@ -66,6 +66,13 @@ EXTERN_UTIL Error wordMap_deleteByName( WordMap map, const char *name );
 
 /* returns -1 if entry not found */
 EXTERN_UTIL int wordMap_findByName( WordMap pm, const char *name );
+/* 
+   Looks up count names at once, which is faster than calling 
+   wordMap_findByName for each. numbers[i] is set to the number of names[i],
+   or -1 if it is not in the map.
+*/
+EXTERN_UTIL void wordMap_findManyByName( WordMap map, const char *names[], 
+                                         int count, int numbers[] );
 EXTERN_UTIL /*@observer@*/const char *wordMap_findByNumber( WordMap pm, 
                                                             int number );
 
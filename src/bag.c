@@ -140,7 +140,8 @@ Bag bagCreate2( int initialCapacity,
   result->destroyFunc = destroyFunc;
  
 #ifdef _POSIX_THREADS
-  error = threading_mutex_init( &(result->lock) );
+  error = threading_mutex_initMode( &(result->lock),
+                                    THREADING_MUTEX_ADAPTIVE );
   if (error != NULL) {
     ErrDispose(error, TRUE);
     goto ERR_RETURN3;
@@ -570,6 +571,50 @@ void bagForEach2( Bag bag, ForEachFunc2 forEachFunc, void *args )
   bagUnlock( bag );
 }
 
+#ifdef _POSIX_THREADS
+typedef struct
+{
+  Bag bag;
+  ForEachFunc forEachFunc;
+  void *args;
+} sForEachParallel;
+
+static void forEachParallelRange( int begin, int end, void *context )
+{
+  sForEachParallel *forEach = context;
+  void **elements = forEach->bag->array;
+  int i;
+
+  for( i = begin; i < end; i++ )
+    forEach->forEachFunc( forEach->args, elements[ i ] );
+}
+
+Error bagForEachParallel( Bag bag, ThreadPool pool, ForEachFunc forEachFunc,
+                          void *args )
+{
+  sForEachParallel forEach;
+  Error error;
+
+  PreCond( bag == NULL || bag_isValid( bag ) );
+
+  if( bag == NULL )
+    return NULL;
+
+  assert( bag->elementSize == sizeof( void * ) );
+
+  forEach.bag = bag;
+  forEach.forEachFunc = forEachFunc;
+  forEach.args = args;
+
+  bagLock( bag );
+  error = threadPool_parallelFor( pool, 0, bag->noElements, 0, 
+                                  forEachParallelRange, &forEach );
+  bagUnlock( bag );
+
+  return error;
+}
+#endif
+
 
 void bagFilterForEach( Bag bag, FilterFunc filterFunc, void *filterArgs, 
                        ForEachFunc forEachFunc, void *args )
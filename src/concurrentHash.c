@@ -0,0 +1,460 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   concurrentHash.c -- thread-safe sharded hash table
+
+   Each shard is a small chained hash table with its own lock. Writers
+   (add and delete) take the lock of the shard the element hashes to.
+   Readers take no lock: the chains are linked so that a reader always
+   sees either the old or the new chain, and an unlinked node is only
+   freed once every reader that might still be on it has left.
+
+   Readers bracket their walk with a read section of the default epoch
+   domain, which only writes to the reader's own record. A writer that
+   has unlinked a node retires it to the domain after dropping the shard
+   lock, so writers never wait for readers.
+*/
+
+#include <voxi/util/config.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <voxi/util/win32_glue.h>
+#endif /* WIN32 */
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/epoch.h>
+#include <voxi/util/err.h>
+#include <voxi/util/threading.h>
+
+#include <voxi/util/concurrentHash.h>
+
+CVSID("$Id$");
+
+/* --------- Definitions */
+
+#define SHARDS_PER_CPU 4
+#define MAX_SHARD_BITS 10
+
+typedef struct sCHashNode
+{
+  struct sCHashNode * volatile next;
+  void *data;
+  unsigned int hashValue;
+} sCHashNode, *CHashNode;
+
+typedef struct
+{
+  sVoxiMutex lock;
+  unsigned int bucketCount;
+  CHashNode volatile *buckets;
+  int elementCount;
+} sShard, *Shard;
+
+struct sConcurrentHashTable
+{
+  unsigned int shardBits;
+  uint64_t seed;
+  HashFuncPtr calcIndx;
+  CompFuncPtr compData;
+  DestroyFuncPtr destrData;
+  EpochDomain domain;
+  sShard shards[ 1 ];
+};
+
+struct sConcurrentHashTableCursor
+{
+  ConcurrentHashTable hashTable;
+  unsigned int shardIndex;
+  unsigned int bucketIndex;
+  /* copy of the elements in the current bucket */
+  void **elements;
+  int elementCount;
+  int elementsSize;
+  int position;
+};
+
+/* --------- Static function declarations */
+
+static void locate( ConcurrentHashTable ht, void *data,
+                    unsigned int *hashValue, Shard *shard,
+                    unsigned int *bucket );
+static int removeElement( ConcurrentHashTable ht, void *data, 
+                          DestroyFuncPtr freeFunc );
+static void loadBucket( ConcurrentHashTableCursor cursor );
+
+/* --------- Help functions */
+
+/* Picks the shard from the top bits of the mixed hash, the bucket from
+   the low 32 */
+static void locate( ConcurrentHashTable ht, void *data,
+                    unsigned int *hashValue, Shard *shard,
+                    unsigned int *bucket )
+{
+  uint64_t mixed;
+
+  *hashValue = (unsigned int) ht->calcIndx( data );
+  mixed = HashMix64( *hashValue, ht->seed );
+
+  if( ht->shardBits == 0 )
+    *shard = &(ht->shards[ 0 ]);
+  else
+    *shard = &(ht->shards[ mixed >> (64 - ht->shardBits) ]);
+
+  *bucket = (unsigned int) (((mixed & 0xffffffff) * (*shard)->bucketCount)
+                            >> 32);
+}
+
+/* ----------------------- */
+
+ConcurrentHashTable ConcurrentHashCreateTable( unsigned int size,
+                                               unsigned int shardCount,
+                                               HashFuncPtr calc,
+                                               CompFuncPtr comp,
+                                               DestroyFuncPtr destr )
+{
+  ConcurrentHashTable ht;
+  unsigned int i, shardBits, bucketCount;
+
+  ErrPushFunc( "ConcurrentHashCreateTable" );
+
+  assert( size != 0 );
+
+  if( shardCount == 0 )
+    shardCount = threading_getCpuCount() * SHARDS_PER_CPU;
+
+  for( shardBits = 0;
+       ((1U << shardBits) < shardCount) && (shardBits < MAX_SHARD_BITS);
+       shardBits++ )
+    ;
+  shardCount = 1U << shardBits;
+
+  bucketCount = (size + shardCount - 1) / shardCount;
+
+  ht = (ConcurrentHashTable) malloc( sizeof( struct sConcurrentHashTable ) +
+                                     (shardCount - 1) * sizeof( sShard ) );
+  if( ht == NULL )
+    goto ERR_RETURN;
+
+  ht->shardBits = shardBits;
+  ht->seed = HashNewSeed();
+  ht->calcIndx = calc;
+  ht->compData = comp;
+  ht->destrData = destr;
+  ht->domain = epoch_getDefaultDomain();
+
+  for( i = 0; i < shardCount; i++ )
+  {
+    Shard shard = &(ht->shards[ i ]);
+
+    shard->bucketCount = bucketCount;
+    shard->elementCount = 0;
+    shard->buckets = (CHashNode volatile *) calloc( bucketCount,
+                                                    sizeof( CHashNode ) );
+    if( (shard->buckets == NULL) ||
+        (threading_mutex_init( &(shard->lock) ) != NULL) )
+    {
+      free( (void *) shard->buckets );
+      while( i > 0 )
+      {
+        i--;
+        threading_mutex_destroy( &(ht->shards[ i ].lock) );
+        free( (void *) ht->shards[ i ].buckets );
+      }
+      free( ht );
+      ht = NULL;
+      goto ERR_RETURN;
+    }
+  }
+
+ ERR_RETURN:
+  ErrPopFunc();
+  return ht;
+}
+
+void ConcurrentHashDestroyTable( ConcurrentHashTable ht )
+{
+  unsigned int i, j;
+
+  for( i = 0; i < (1U << ht->shardBits); i++ )
+  {
+    Shard shard = &(ht->shards[ i ]);
+    CHashNode node, next;
+
+    for( j = 0; j < shard->bucketCount; j++ )
+      for( node = shard->buckets[ j ]; node != NULL; node = next )
+      {
+        next = node->next;
+        if( ht->destrData != NULL )
+          ht->destrData( node->data );
+        free( node );
+      }
+
+    free( (void *) shard->buckets );
+    threading_mutex_destroy( &(shard->lock) );
+  }
+
+  free( ht );
+}
+
+int ConcurrentHashGetElementCount( ConcurrentHashTable ht )
+{
+  unsigned int i;
+  int count = 0;
+
+  for( i = 0; i < (1U << ht->shardBits); i++ )
+    count += atomic_loadInt( &(ht->shards[ i ].elementCount) );
+
+  return count;
+}
+
+void *ConcurrentHashFind( ConcurrentHashTable ht, void *data )
+{
+  unsigned int hashValue, bucket;
+  Shard shard;
+  CHashNode node;
+  void *result = NULL;
+
+  locate( ht, data, &hashValue, &shard, &bucket );
+
+  epoch_enter( ht->domain );
+
+  for( node = atomic_loadPtr( (void * volatile *) &(shard->buckets[ bucket ]) );
+       node != NULL;
+       node = atomic_loadPtr( (void * volatile *) &(node->next) ) )
+    if( (node->hashValue == hashValue) &&
+        (ht->compData( data, node->data ) == 0) )
+    {
+      result = node->data;
+      break;
+    }
+
+  epoch_exit( ht->domain );
+
+  return result;
+}
+
+int ConcurrentHashAdd( ConcurrentHashTable ht, void *data )
+{
+  unsigned int hashValue, bucket;
+  Shard shard;
+  CHashNode node;
+  int retval = 0;
+
+  locate( ht, data, &hashValue, &shard, &bucket );
+
+  threading_mutex_lock( &(shard->lock) );
+
+  for( node = shard->buckets[ bucket ]; node != NULL; node = node->next )
+    if( (node->hashValue == hashValue) &&
+        (ht->compData( data, node->data ) == 0) )
+      goto ERR_RETURN;
+
+  node = (CHashNode) malloc( sizeof( sCHashNode ) );
+  if( node == NULL )
+    goto ERR_RETURN;
+
+  node->data = data;
+  node->hashValue = hashValue;
+  node->next = shard->buckets[ bucket ];
+
+  /* The node must be filled in before readers can reach it */
+  atomic_storePtr( (void * volatile *) &(shard->buckets[ bucket ]), node );
+  atomic_storeInt( &(shard->elementCount), shard->elementCount + 1 );
+  retval = 1;
+
+ ERR_RETURN:
+  threading_mutex_unlock( &(shard->lock) );
+  return retval;
+}
+
+/* 
+   Unlinks the element matching data, and retires it with freeFunc unless
+   that is NULL. Returns 1 if it was found.
+*/
+static int removeElement( ConcurrentHashTable ht, void *data, 
+                          DestroyFuncPtr freeFunc )
+{
+  unsigned int hashValue, bucket;
+  Shard shard;
+  CHashNode node;
+  CHashNode volatile *link;
+  void *removed;
+
+  locate( ht, data, &hashValue, &shard, &bucket );
+
+  threading_mutex_lock( &(shard->lock) );
+
+  for( link = &(shard->buckets[ bucket ]); *link != NULL;
+       link = &((*link)->next) )
+    if( ((*link)->hashValue == hashValue) &&
+        (ht->compData( data, (*link)->data ) == 0) )
+      break;
+
+  node = *link;
+  if( node == NULL )
+  {
+    threading_mutex_unlock( &(shard->lock) );
+    return 0;
+  }
+
+  atomic_storePtr( (void * volatile *) link, node->next );
+  atomic_storeInt( &(shard->elementCount), shard->elementCount - 1 );
+  removed = node->data;
+
+  threading_mutex_unlock( &(shard->lock) );
+
+  /* Readers may still be on the node, and comparing against removed */
+  epoch_retire( ht->domain, node, free );
+  if( freeFunc != NULL )
+    epoch_retire( ht->domain, removed, freeFunc );
+
+  return 1;
+}
+
+int ConcurrentHashDelete( ConcurrentHashTable ht, void *data )
+{
+  return removeElement( ht, data, NULL );
+}
+
+int ConcurrentHashDeleteRetire( ConcurrentHashTable ht, void *data,
+                                DestroyFuncPtr freeFunc )
+{
+  assert( freeFunc != NULL );
+
+  return removeElement( ht, data, freeFunc );
+}
+
+int ConcurrentHashDestroy( ConcurrentHashTable ht, void *data )
+{
+  return removeElement( ht, data, ht->destrData );
+}
+
+/* --------- Cursors */
+
+/*
+   Copies the elements of the cursor's bucket, moving on to the following
+   buckets until one with elements is found or the table is exhausted.
+*/
+static void loadBucket( ConcurrentHashTableCursor cursor )
+{
+  ConcurrentHashTable ht = cursor->hashTable;
+  unsigned int shardCount = 1U << ht->shardBits;
+
+  cursor->elementCount = 0;
+  cursor->position = 0;
+
+  while( cursor->shardIndex < shardCount )
+  {
+    Shard shard = &(ht->shards[ cursor->shardIndex ]);
+    CHashNode node;
+
+    threading_mutex_lock( &(shard->lock) );
+
+    for( node = shard->buckets[ cursor->bucketIndex ]; node != NULL;
+         node = node->next )
+    {
+      if( cursor->elementCount == cursor->elementsSize )
+      {
+        int newSize = (cursor->elementsSize == 0) ? 8 :
+          cursor->elementsSize * 2;
+        void **newElements;
+
+        newElements = (void **) realloc( cursor->elements,
+                                         newSize * sizeof( void * ) );
+        if( newElements == NULL )
+          break;
+
+        cursor->elements = newElements;
+        cursor->elementsSize = newSize;
+      }
+      cursor->elements[ cursor->elementCount++ ] = node->data;
+    }
+
+    threading_mutex_unlock( &(shard->lock) );
+
+    if( cursor->elementCount > 0 )
+      return;
+
+    cursor->bucketIndex++;
+    if( cursor->bucketIndex >= shard->bucketCount )
+    {
+      cursor->bucketIndex = 0;
+      cursor->shardIndex++;
+    }
+  }
+}
+
+ConcurrentHashTableCursor ConcurrentHashCursorCreate( ConcurrentHashTable ht )
+{
+  ConcurrentHashTableCursor cursor;
+
+  cursor = (ConcurrentHashTableCursor)
+    malloc( sizeof( struct sConcurrentHashTableCursor ) );
+  if( cursor == NULL )
+    return NULL;
+
+  cursor->hashTable = ht;
+  cursor->elements = NULL;
+  cursor->elementsSize = 0;
+
+  ConcurrentHashCursorGoFirst( cursor );
+
+  return cursor;
+}
+
+void ConcurrentHashCursorDestroy( ConcurrentHashTableCursor cursor )
+{
+  free( cursor->elements );
+  free( cursor );
+}
+
+void *ConcurrentHashCursorGetElement( ConcurrentHashTableCursor cursor )
+{
+  if( cursor->position >= cursor->elementCount )
+    return NULL;
+
+  return cursor->elements[ cursor->position ];
+}
+
+void ConcurrentHashCursorGoFirst( ConcurrentHashTableCursor cursor )
+{
+  cursor->shardIndex = 0;
+  cursor->bucketIndex = 0;
+
+  loadBucket( cursor );
+}
+
+void ConcurrentHashCursorGoNext( ConcurrentHashTableCursor cursor )
+{
+  if( ConcurrentHashCursorPastLastElement( cursor ) )
+    return;
+
+  cursor->position++;
+  if( cursor->position < cursor->elementCount )
+    return;
+
+  cursor->bucketIndex++;
+  if( cursor->bucketIndex >=
+      cursor->hashTable->shards[ cursor->shardIndex ].bucketCount )
+  {
+    cursor->bucketIndex = 0;
+    cursor->shardIndex++;
+  }
+
+  loadBucket( cursor );
+}
+
+Boolean ConcurrentHashCursorPastLastElement( ConcurrentHashTableCursor cursor )
+{
+  return cursor->position >= cursor->elementCount;
+}
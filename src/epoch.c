@@ -0,0 +1,372 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   epoch.c -- epoch based memory reclamation
+
+   The domain has a global epoch counter. Each thread that enters a read
+   section records the current epoch in its own record and marks itself
+   active. Retired objects are put on a list in the retiring thread's 
+   record, one list for each of the last three epochs.
+
+   The epoch may only be advanced from e to e + 1 when every active reader
+   has recorded e. At that point no reader can be inside a section that
+   started before epoch e - 1, so everything retired in epoch e - 2 is
+   unreachable. Each thread frees its own lists once they are that old,
+   without holding any lock. Advancing is a compare-and-swap of the epoch,
+   which a thread tries every EPOCH_ADVANCE_INTERVAL retires.
+
+   The thread records are never freed while the domain exists; when a
+   thread exits its record is released for reuse by the next new thread,
+   which also takes over the objects the old thread retired.
+*/
+
+#include <voxi/util/config.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <voxi/util/win32_glue.h>
+#endif /* WIN32 */
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/err.h>
+#include <voxi/util/threading.h>
+
+#include <voxi/util/epoch.h>
+
+CVSID("$Id$");
+
+/* --------- Definitions */
+
+#define EPOCH_LISTS 3
+/* The epoch wraps at a multiple of EPOCH_LISTS, so that the lists line up */
+#define EPOCH_WRAP (EPOCH_LISTS * 0x10000000)
+/* number of retires between a thread's attempts to advance the epoch */
+#define EPOCH_ADVANCE_INTERVAL 32
+
+typedef struct sRetired
+{
+  void *data;
+  EpochFreeFunc freeFunc;
+  struct sRetired *next;
+} sRetired, *Retired;
+
+typedef struct sEpochRecord
+{
+  volatile int active;
+  volatile int epoch;
+  volatile int inUse;
+  int nesting;
+
+  /* 
+     Objects retired by the thread using the record. retiredEpoch[ i ] is
+     the epoch in which the objects on retired[ i ] were retired.
+  */
+  Retired retired[ EPOCH_LISTS ];
+  int retiredEpoch[ EPOCH_LISTS ];
+  /* retires since the thread last tried to advance the epoch */
+  int retiredCount;
+
+  struct sEpochRecord *next;
+} sEpochRecord, *EpochRecord;
+
+struct sEpochDomain
+{
+  volatile int epoch;
+  /* records are only ever pushed on this list */
+  EpochRecord volatile records;
+  pthread_key_t recordKey;
+};
+
+/* --------- Static data */
+
+static pthread_once_t defaultDomainOnce = PTHREAD_ONCE_INIT;
+static EpochDomain defaultDomain = NULL;
+
+/* --------- Static function declarations */
+
+static EpochRecord getRecord( EpochDomain domain );
+static void releaseRecord( void *record );
+static Boolean tryAdvance( EpochDomain domain );
+static int epochAge( int epoch, int then );
+static void reclaim( EpochRecord record, int epoch );
+static void freeRetiredList( Retired list );
+static void createDefaultDomain( void );
+
+/* --------- Help functions */
+
+/* Returns the calling thread's record, claiming one on first use */
+static EpochRecord getRecord( EpochDomain domain )
+{
+  EpochRecord record;
+
+  record = (EpochRecord) pthread_getspecific( domain->recordKey );
+  if( record != NULL )
+    return record;
+
+  for( record = atomic_loadPtr( (void * volatile *) &(domain->records) );
+       record != NULL; record = record->next )
+    if( (atomic_loadInt( &(record->inUse) ) == 0) &&
+        atomic_casInt( &(record->inUse), 0, 1 ) )
+      break;
+
+  if( record == NULL )
+  {
+    int i;
+
+    record = (EpochRecord) malloc( sizeof( sEpochRecord ) );
+    if( record == NULL )
+      ERR ERR_ABORT, "epoch: out of memory for a thread record" ENDERR;
+
+    record->active = 0;
+    record->epoch = 0;
+    record->inUse = 1;
+    for( i = 0; i < EPOCH_LISTS; i++ )
+    {
+      record->retired[ i ] = NULL;
+      record->retiredEpoch[ i ] = 0;
+    }
+    record->retiredCount = 0;
+
+    do
+      record->next = atomic_loadPtr( (void * volatile *) &(domain->records) );
+    while( !atomic_casPtr( (void * volatile *) &(domain->records),
+                           record->next, record ) );
+  }
+
+  record->nesting = 0;
+  pthread_setspecific( domain->recordKey, record );
+
+  return record;
+}
+
+/* Called by pthreads when a thread that has a record exits */
+static void releaseRecord( void *record )
+{
+  EpochRecord rec = (EpochRecord) record;
+
+  rec->nesting = 0;
+  atomic_storeInt( &(rec->active), 0 );
+  atomic_storeInt( &(rec->inUse), 0 );
+}
+
+/*
+   Advances the epoch if all active readers have seen the current one.
+   Returns FALSE if some reader has not, or if another thread advanced it
+   first.
+*/
+static Boolean tryAdvance( EpochDomain domain )
+{
+  EpochRecord record;
+  int epoch;
+
+  epoch = atomic_loadInt( &(domain->epoch) );
+
+  atomic_fence();
+
+  for( record = atomic_loadPtr( (void * volatile *) &(domain->records) );
+       record != NULL; record = record->next )
+    if( atomic_loadInt( &(record->active) ) &&
+        (atomic_loadInt( &(record->epoch) ) != epoch) )
+      return FALSE;
+
+  return atomic_casInt( &(domain->epoch), epoch, (epoch + 1) % EPOCH_WRAP );
+}
+
+/* The number of times the epoch has been advanced from then to epoch */
+static int epochAge( int epoch, int then )
+{
+  return (epoch - then + EPOCH_WRAP) % EPOCH_WRAP;
+}
+
+/* 
+   Frees the objects on record's lists that were retired at least 
+   EPOCH_LISTS epochs before epoch. The lists are all taken off the record
+   before any is freed, since the freeFuncs may retire more objects, in 
+   epochs later than epoch.
+*/
+static void reclaim( EpochRecord record, int epoch )
+{
+  Retired lists[ EPOCH_LISTS ];
+  int i;
+
+  for( i = 0; i < EPOCH_LISTS; i++ )
+  {
+    lists[ i ] = NULL;
+    if( (record->retired[ i ] != NULL) &&
+        (epochAge( epoch, record->retiredEpoch[ i ] ) >= EPOCH_LISTS) )
+    {
+      lists[ i ] = record->retired[ i ];
+      record->retired[ i ] = NULL;
+    }
+  }
+
+  for( i = 0; i < EPOCH_LISTS; i++ )
+    freeRetiredList( lists[ i ] );
+}
+
+static void freeRetiredList( Retired list )
+{
+  Retired next;
+
+  for( ; list != NULL; list = next )
+  {
+    next = list->next;
+    list->freeFunc( list->data );
+    free( list );
+  }
+}
+
+static void createDefaultDomain( void )
+{
+  defaultDomain = epoch_createDomain();
+  assert( defaultDomain != NULL );
+}
+
+/* ----------------------- */
+
+EpochDomain epoch_createDomain( void )
+{
+  EpochDomain domain;
+
+  domain = (EpochDomain) malloc( sizeof( struct sEpochDomain ) );
+  if( domain == NULL )
+    return NULL;
+
+  if( pthread_key_create( &(domain->recordKey), releaseRecord ) != 0 )
+  {
+    free( domain );
+    return NULL;
+  }
+
+  domain->epoch = 0;
+  domain->records = NULL;
+
+  return domain;
+}
+
+void epoch_destroyDomain( EpochDomain domain )
+{
+  EpochRecord record, next;
+  int i;
+
+  pthread_key_delete( domain->recordKey );
+
+  for( record = domain->records; record != NULL; record = next )
+  {
+    next = record->next;
+    for( i = 0; i < EPOCH_LISTS; i++ )
+      freeRetiredList( record->retired[ i ] );
+    free( record );
+  }
+
+  free( domain );
+}
+
+EpochDomain epoch_getDefaultDomain( void )
+{
+  pthread_once( &defaultDomainOnce, createDefaultDomain );
+
+  return defaultDomain;
+}
+
+void epoch_enter( EpochDomain domain )
+{
+  EpochRecord record = getRecord( domain );
+
+  if( record->nesting++ > 0 )
+    return;
+
+  atomic_storeInt( &(record->epoch), atomic_loadInt( &(domain->epoch) ) );
+  atomic_storeInt( &(record->active), 1 );
+
+  /* The reader's loads must not be done before it is seen as active */
+  atomic_fence();
+}
+
+void epoch_exit( EpochDomain domain )
+{
+  EpochRecord record = getRecord( domain );
+
+  assert( record->nesting > 0 );
+
+  if( --record->nesting > 0 )
+    return;
+
+  atomic_storeInt( &(record->active), 0 );
+}
+
+void epoch_retire( EpochDomain domain, void *data, EpochFreeFunc freeFunc )
+{
+  EpochRecord record = getRecord( domain );
+  Retired retired;
+  int epoch, i;
+
+  retired = (Retired) malloc( sizeof( sRetired ) );
+  if( retired == NULL )
+  {
+    /* 
+       Wait for the readers instead. Inside a read section that would 
+       never end, and data has to be leaked.
+    */
+    if( record->nesting == 0 )
+    {
+      epoch_synchronize( domain );
+      freeFunc( data );
+    }
+    return;
+  }
+
+  retired->data = data;
+  retired->freeFunc = freeFunc;
+
+  epoch = atomic_loadInt( &(domain->epoch) );
+
+  /* empties the list for this epoch if it holds an older one */
+  reclaim( record, epoch );
+
+  /* 
+     If a freeFunc called by reclaim retired something in a later epoch 
+     with the same list, this object is freed later than it could be, 
+     which is harmless.
+  */
+  i = epoch % EPOCH_LISTS;
+  if( record->retired[ i ] == NULL )
+    record->retiredEpoch[ i ] = epoch;
+  retired->next = record->retired[ i ];
+  record->retired[ i ] = retired;
+
+  if( ++record->retiredCount >= EPOCH_ADVANCE_INTERVAL )
+  {
+    record->retiredCount = 0;
+    if( tryAdvance( domain ) )
+      reclaim( record, atomic_loadInt( &(domain->epoch) ) );
+  }
+}
+
+void epoch_synchronize( EpochDomain domain )
+{
+  EpochRecord record = getRecord( domain );
+  int start, epoch;
+
+  assert( record->nesting == 0 );
+
+  start = atomic_loadInt( &(domain->epoch) );
+
+  /* advances by other threads count too */
+  for( epoch = start; epochAge( epoch, start ) < EPOCH_LISTS; 
+       epoch = atomic_loadInt( &(domain->epoch) ) )
+    if( !tryAdvance( domain ) )
+      threading_yield();
+
+  reclaim( record, epoch );
+}
@@ -29,12 +29,10 @@
 
 #include <stddef.h>
 #include <pthread.h>
-#ifdef HAS_SEMAPHORE_H
-#include <semaphore.h>
-#endif
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <unistd.h>
@@ -43,23 +41,17 @@
 #include <voxi/util/win32_glue.h>
 #endif /* WIN32 */
 
-#include <voxi/util/hash.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/epoch.h>
+#include <voxi/util/rcuHash.h>
 #include <voxi/util/vector.h>
 
 #include <voxi/util/threading.h>
+#include <voxi/util/threadpool.h>
+#include <voxi/util/time.h>
 
 #include <voxi/util/event.h>
 
-/* 
-   Hacked by erl 2007-08-30
-   Couldn't we use the queue class in util, and not need this limitation?
- */
-#define EVENT_MAX_EVENTS 256 
-   
-#ifndef EVENT_MAX_EVENTS
-#error You must define EVENT_MAX_EVENTS to be the maximum number of events in the event queue at any time
-#endif
-
 #ifdef _WIN32_WCE
 /* A hack to not be dependent on oow.lib */
 /* this will break event-stuff if oow-objects are used, 
@@ -80,22 +72,45 @@ CVSID("$Id: event.c 6184 2003-03-26 15:51:31Z mst $");
  * and with the event data eventData. freeFunc is the function
  * to be called upon completion of handling of this event.
  */
-typedef struct
+typedef struct sEvent
 {
+  /* The next event in the queue, see enqueueEvent */
+  struct sEvent * volatile next;
+
   void *source;
   EventType eventType;
   void *eventData;
   EventFreeFunc freeFunc;
   /*
-    If the post of the event is blocking, then the poster will wait for the
-    semaphore before returning. The semaphore will be triggered after the
-    freeFunc is called.
+    If the post of the event is blocking, then the poster will sleep on
+    done before returning. It is set to EVENT_DONE after the freeFunc is
+    called, see finishedWithEvent.
   */
   Boolean isBlocking;
-  sem_t semaphore;
+  volatile int done;
+
+  /* Held by the dispatch, and by each coalescer holding the event. The
+     event is finished with when the last one is released. */
+  volatile int refCount;
+  /* Clear for blocking posts, which coalescing listeners get at once */
+  Boolean canCoalesce;
 } sEvent, *Event;
 
 
+/* The states of Event.done */
+#define EVENT_PENDING 0
+#define EVENT_WAITERS 1
+#define EVENT_DONE    2
+
+/*
+ * The free events of a thread, in a list through Event.next.
+ */
+typedef struct
+{
+  Event first;
+  int count;
+} sEventCache, *EventCache;
+
 /*
  * Struct to hold a listener entry in the listener list.
  * handlerFunc and handlerData  make up the keys in the list.
@@ -105,25 +120,63 @@ typedef struct
   EventHandlerFunc handlerFunc;
   void *handlerData;
   Boolean makeNewThread;
+  /* Set for coalescing listeners, handlerFunc is NULL for batch ones */
+  struct sCoalescer *coalescer;
 } sListenerEntry, *ListenerEntry;
 
 
+/*
+ * The listeners of a ListenerList at one point in time. It is never
+ * changed once published: em_addListener and em_removeListener publish
+ * a changed copy instead. The ListenerList holds a reference while the
+ * snapshot is current, and so does each dispatch that is using it.
+ */
+typedef struct
+{
+  volatile int refCount;
+  int count;
+  /* Entries with a coalescer */
+  int coalescers;
+  sListenerEntry entries[1];
+} sListenerSnapshot, *ListenerSnapshot;
+
 /*
  * Struct to hold the data for every event listener list
  * in the hashtable. It has to store the two keys as
  * well to make it possible to compare the keys exactly
- * if the hash code should be the same. The listenerList
- * contains entrys of the type ListenerEntry.
+ * if the hash code should be the same. The snapshot
+ * holds the listeners, NULL if there are none.
+ *
+ * Dispatches count themselves in calling[ phase & 1 ] while they call
+ * the listeners, so that em_removeListener can wait for those that may
+ * still call the listener it removed; see waitForCalling.
  */
-#define LLIST_NO_ELEMS 50
 typedef struct
 {
   void *source;
   EventType eventType;
+  /* Serializes the writers of snapshot */
 	sVoxiMutex listenerListLock;
-  ListenerEntry listenerEntryList[LLIST_NO_ELEMS];
+  ListenerSnapshot volatile snapshot;
+
+  volatile int phase;
+  volatile int calling[ 2 ];
+  /* em_removeListener calls waiting for calling to drop */
+  volatile int removers;
 } sListenerList, *ListenerList;
 
+/*
+ * A dispatch calling the listeners of a list. The dispatches of a thread
+ * are kept in a stack through dispatchFrameKey, so that a listener that
+ * removes a listener does not wait for its own dispatch.
+ */
+typedef struct sDispatchFrame
+{
+  ListenerList list;
+  int phase;
+  struct sDispatchFrame *prev;
+} sDispatchFrame, *DispatchFrame;
+
 
 /*
  * Defining the thread start-routine prototype
@@ -145,6 +198,82 @@ typedef struct
 	void *handlerData;
 } sHandleOneListenerData, *HandleOneListenerData;
 
+/*
+ * In EM_DISPATCH_POOL mode, the listeners of one event that asked for a
+ * thread of their own. Each is submitted to the dispatch pool, and called
+ * by whichever of a worker and the thread handling the event claims it
+ * first, so that a busy pool cannot keep the event from finishing. A
+ * worker may only get to its task after the event is done, so the block
+ * is freed by the last of them to let go of it.
+ */
+typedef struct sPooledListeners *PooledListeners;
+
+typedef struct
+{
+  PooledListeners block;
+  EventHandlerFunc handlerFunc;
+  void *handlerData;
+  volatile int claimed;
+} sPooledListener, *PooledListener;
+
+typedef struct sPooledListeners
+{
+  Event event;
+  volatile int refCount;
+  /* Listeners claimed by workers that have not returned yet. The thread
+     handling the event sleeps on this. */
+  volatile int running;
+  int count;
+  sPooledListener listeners[1];
+} sPooledListeners;
+
+/*
+ * Events held for a coalescing listener.
+ */
+typedef struct
+{
+  Event *events;
+  void **eventData;
+  int count;
+  int size;
+} sPendingEvents;
+
+/*
+ * A coalescing listener. The first event it is given puts it on the due
+ * list, and em_mainLoop hands it to em_flushCoalescer once maxDelay has
+ * passed. It stays scheduled until that call has returned, so that
+ * later events wait for the next call. It is freed when the listener is
+ * removed and no call is scheduled.
+ */
+typedef struct sCoalescer
+{
+  ListenerList list;
+  EmCoalesceMode mode;
+  EventHandlerFunc handlerFunc;
+  EventBatchHandlerFunc batchFunc;
+  void *handlerData;
+  /* nanoseconds */
+  uint64_t maxDelay;
+  volatile int refCount;
+
+  /* Held while the listener is called, so that it is called by one
+   * thread at a time. Taken before lock */
+  sVoxiMutex callLock;
+
+  /* Guards the fields below it */
+  sVoxiMutex lock;
+  sPendingEvents pending;
+  /* The buffers of the last call, for the next one to swap in */
+  sPendingEvents spare;
+  uint64_t pendingSince;
+  Boolean scheduled;
+  Boolean removed;
+
+  /* The due list, guarded by coalesceLock */
+  uint64_t deadline;
+  struct sCoalescer *nextDue;
+} sCoalescer, *Coalescer;
+
 
 
 /*********************************************************
@@ -156,11 +285,65 @@ static void *em_mainLoop( void *args );
 static void *em_handleOneEvent( Event event );
 static void *em_handleOneListenerHandlerFunc(HandleOneListenerData data);
 
+/* EM_DISPATCH_POOL mode */
+static void *em_handlePooledEvent( void *event );
+static void *em_runPooledListener( void *listener );
+static void em_finishPooledListeners( PooledListeners block );
+static void releasePooledListeners( PooledListeners block );
+static void createDispatchingKey( void );
+
+/* Listener snapshots */
+static ListenerSnapshot createSnapshot( int count );
+static void releaseSnapshot( void *snapshot );
+static ListenerSnapshot beginCalling( ListenerList list, DispatchFrame frame );
+static void endCalling( ListenerList list, DispatchFrame frame );
+static void waitForCalling( ListenerList list );
+
+/* Listener registration */
+static void addListener( void *source, EventType eventType,
+                         ListenerEntry listener );
+static void removeListener( void *source, EventType eventType,
+                            EventHandlerFunc handlerFunc,
+                            EventBatchHandlerFunc batchFunc,
+                            void *handlerData );
+static void addCoalescingListener( void *source, EventType eventType,
+                                   EventHandlerFunc handlerFunc,
+                                   EventBatchHandlerFunc batchFunc,
+                                   void *handlerData, EmCoalesceMode mode,
+                                   int maxDelayMillis );
+
+/* Coalescing listeners */
+static Boolean em_coalescePost( Event event );
+static void em_coalesceEvent( Coalescer coalescer, Event event );
+static void em_callPending( Coalescer coalescer, void **eventData );
+static void em_callCoalescer( Coalescer coalescer, void **eventData,
+                              int count );
+static void *em_flushCoalescer( void *coalescer );
+static uint64_t em_flushDueCoalescers( Boolean all );
+static void scheduleCoalescer( Coalescer coalescer, uint64_t deadline );
+static void dropCoalescer( Coalescer coalescer );
+static void releaseCoalescer( Coalescer coalescer );
+
 /* internal Event functions */
+static Event allocEvent( void );
 static void finishedWithEvent( Event event );
+static void releaseEvent( Event event );
 static void freeEvent( Event event );
+static void freeEventToDepot( Event event );
+static Event depositEvents( Event full );
+static void freeEventList( Event first );
+static void freeEventCache( void *cache );
+static void createEventCacheKey( void );
+static EventCache getEventCache( void );
+
+/* The event queue */
+static void enqueueEvent( Event event );
+static void linkEvent( Event event );
+static Event dequeueEvent( void );
+static void wakeMainLoop( void );
 
 /* Hashtable handling routines */
+static ListenerList findListenerList( void *source, EventType eventType );
 static int calcHashCode(ListenerList aList);
 static int compHashEntrys(ListenerList list1, ListenerList list2);
 static void freeListenerList(ListenerList aList);
@@ -176,22 +359,35 @@ static void writeListenerList(ListenerList aList);
  ***********************************************************/
 
 /*
- * Semaphores for the event queue counter and modification lock.
- */
-static sem_t eventsInQueue;
-static sVoxiMutex eventQueueModificationLock;
+  The pending events, in a linked list through Event.next that any thread
+  may add to but only em_mainLoop takes from. Posters swap themselves in
+  as queueHead and then link the event they replaced to theirs, so
+  queueTail, the next event to take, may briefly be cut off from the rest.
+  queueStub keeps the list from ever being empty, so posters never touch
+  queueTail.
+*/
+static Event volatile queueHead;
+static Event queueTail;
+static sEvent queueStub;
 
+/*
+  queueLength counts posts that em_mainLoop has not taken yet. It is
+  raised before the event is queued, so it may say there is an event that
+  cannot be taken for a moment.
+*/
+static volatile int queueLength = 0;
+static volatile int queueMaxLength = 0;
+static volatile int queueOverHighWater = 0;
+static volatile int queueHighWaterMark = 0;
+static EmHighWaterFunc queueHighWaterFunc = NULL;
+static void *queueHighWaterData = NULL;
 
 /*
-  Store the pending events
-  frontEvent points to the earliest event in the queue. This is the next
-  event to be handled.	 
-  The event after frontEvent is at (frontEvent + 1) % EVENT_MAX_EVENTS
-  backEvent points to where to add the next event
-  if frontEvent == backEvent then the queue is empty
+  Set by em_mainLoop before it sleeps on it, and cleared by the poster that
+  wakes it. A coalescer that becomes the first one due wakes it too.
 */
-static int frontEvent = 0, backEvent = 0;
-static Event eventQueue[ EVENT_MAX_EVENTS ];
+static volatile int mainLoopSleeping = 0;
+static volatile int mainLoopStopping = 0;
 
 
 /*
@@ -204,18 +400,76 @@ static pthread_t eventManagerThread = (pthread_t)NULL;
  * The hashtable that containts the added listeners.
  * Actually it contains a ListenerList for every
  * entry with the same keys (i.e. source and eventType) 
+ *
+ * Lookups take no lock. The lock is only held by em_addListener, so that
+ * two threads adding the first listener for the same keys do not both
+ * create a ListenerList. ListenerLists are never removed from the table.
  */
-static HashTable listenersHashTable = NULL;
+static RcuHashTable listenersHashTable = NULL;
 static sVoxiMutex listenersHashTableLock;
 
+/*
+ * Set by em_setDispatchMode. In EM_DISPATCH_POOL mode dispatchPool is the
+ * executor that handles the events, and dispatchingKey is set in the
+ * threads that handle events.
+ */
+static EmDispatchMode dispatchMode = EM_DISPATCH_THREAD_PER_EVENT;
+static int dispatchMaxWorkers = 0;
+static ThreadPool dispatchPool = NULL;
+static pthread_once_t dispatchingKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t dispatchingKey;
+
+/* The innermost DispatchFrame of each thread */
+static pthread_key_t dispatchFrameKey;
+
+/* Queued events beyond this are handled by em_mainLoop itself */
+#define DISPATCH_QUEUE_CAPACITY 256
+
+/*
+ * Free events are kept per thread. A thread's cache holds at most
+ * EVENT_CACHE_SIZE of them; when it is full, they are moved to the depot
+ * as a whole, and an empty cache takes a full list from there. That way
+ * the events that the dispatch threads finish get back to the posters.
+ *
+ * The threads of EM_DISPATCH_THREAD_PER_EVENT mode only live for one
+ * event, so they get no cache. They gather the events they free in
+ * depotLoose instead, under eventDepotLock, until there is a full list.
+ */
+#define EVENT_CACHE_SIZE 32
+#define EVENT_DEPOT_SIZE 64
+
+static pthread_once_t eventCacheKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t eventCacheKey;
+static Event eventDepot[ EVENT_DEPOT_SIZE ];
+static volatile int eventDepotCount = 0;
+static Event depotLoose = NULL;
+static int depotLooseCount = 0;
+static sVoxiMutex eventDepotLock;
+
+/*
+ * The coalescers with events to pass on, soonest deadline first.
+ * Only em_mainLoop takes them off.
+ */
+static Coalescer dueCoalescers = NULL;
+static sVoxiMutex coalesceLock;
+
 
 /*********************************************************
  *	start/stop functions
  ***********************************************************/
 
+void em_setDispatchMode( EmDispatchMode mode, int maxWorkers )
+{
+  assert( eventManagerThread == (pthread_t) NULL );
+  assert( maxWorkers >= 0 );
+
+  dispatchMode = mode;
+  dispatchMaxWorkers = maxWorkers;
+}
+
 /*
  * Start the event handler.
- * Initializes the Hashtable, event queue, semaphores and starts
+ * Initializes the Hashtable, event queue and starts
  * the main event manager thread.
  */
 void em_startup()
@@ -225,27 +479,51 @@ void em_startup()
     
   /* Init the the listnersHashTable */
   listenersHashTable =
-    HashCreateTable(1024,
+    RcuHashCreateTable(1024,
 		    (HashFuncPtr)calcHashCode, 
 		    (CompFuncPtr)compHashEntrys, 
 		    (DestroyFuncPtr) freeListenerList);
   
   threading_mutex_init( &(listenersHashTableLock) );
+  threading_mutex_init( &coalesceLock );
+  dueCoalescers = NULL;
   
   /* Init the event handler thread */
 	assert( eventManagerThread == (pthread_t) NULL );
   
-  frontEvent = 0;
-  backEvent = 0;
-  
-  err = sem_init( &eventsInQueue, 0, 0 );
-  assert( err == 0 );
-  
-  threading_mutex_init( &eventQueueModificationLock );
-  assert( err == 0 );
+  queueStub.next = NULL;
+  queueHead = &queueStub;
+  queueTail = &queueStub;
+  queueLength = 0;
+  queueMaxLength = 0;
+  queueOverHighWater = 0;
+  mainLoopSleeping = 0;
+  mainLoopStopping = 0;
   
 	/* So that we can access teh detachedThreadAttr variable */
 	threading_init();
+
+  pthread_once( &dispatchingKeyOnce, createDispatchingKey );
+
+  if( dispatchMode == EM_DISPATCH_POOL )
+  {
+    sThreadSpec spec;
+    int workers = dispatchMaxWorkers;
+
+    if( workers == 0 )
+      workers = threading_getCpuCount();
+
+    /* The handlers check that they do not run with realtime scheduling */
+    threading_spec_init( &spec );
+    spec.name = "em-dispatch";
+    spec.policy = SCHED_OTHER;
+    spec.priority = 0;
+
+    error = threadPool_createExecutor( 1, workers, DISPATCH_QUEUE_CAPACITY,
+                                       THREADPOOL_REJECT_CALLER_RUNS, &spec,
+                                       &dispatchPool );
+    assert( error == NULL );
+  }
 	
 	/* The Event Manager Thread will be joined upon shutdown, and is therefore
 		 not created in a detached state */
@@ -264,12 +542,25 @@ void em_shutdown()
 {
 	int error;
 	
-  /* Stop the event handler */
-	error = pthread_cancel(eventManagerThread);
-	assert(error == 0);
+  /* Stop the event handler, once it has taken the events already posted */
+  atomic_storeInt( &mainLoopStopping, 1 );
+  atomic_storeInt( &mainLoopSleeping, 0 );
+  threading_word_wake( &mainLoopSleeping, 1 );
+
 	error = pthread_join(eventManagerThread, NULL);
 	assert(error == 0);
+  eventManagerThread = (pthread_t) NULL;
   
+  /* Handles the events that are already queued */
+  if( dispatchPool != NULL )
+  {
+    Error err = threadPool_destroy( dispatchPool );
+
+    if( err != NULL )
+      ErrDispose( err, TRUE );
+    dispatchPool = NULL;
+  }
+
 	threading_shutdown();
 	
   /* skip destroying the hash table for now.
@@ -280,13 +571,8 @@ void em_shutdown()
   */
 #if 0 
   /* Destroy the hash table */
-  HashDestroyTable(listenersHashTable); 	
+  RcuHashDestroyTable(listenersHashTable); 	
 #endif
-  /* Destroy semaphores */
-	error = sem_destroy(&eventsInQueue);
-	assert(error == 0);
-  
-	threading_mutex_destroy( &eventQueueModificationLock );
 }
 
 
@@ -302,7 +588,6 @@ void em_shutdown()
 void em_postEvent( void *source, EventType eventType, void *eventData, 
                    EventFreeFunc freeFunc, Boolean blocking )
 {
-	int error = 0;
 	Event aEvent = NULL;
 
 	DEBUG(" enter ( source %p, type %d, eventData %p, freeFunc %p, blocking %d )\n",
@@ -310,48 +595,60 @@ void em_postEvent( void *source, EventType eventType, void *eventData,
 	
 	assert (source != NULL);
 	
-	/* Check if there are free space in the event queue */
-	assert( ((backEvent + 1) % EVENT_MAX_EVENTS) != frontEvent);
-	
-  DEBUG("before aquiring queue-lock\n" );
-	
-	/* Acquire the lock to the event list */
-	threading_mutex_lock( &eventQueueModificationLock );
-	assert( error == 0 );
- 
-  DEBUG("after  aquiring queue-lock\n" );
-	
-	/* Create new event and insert the event at the point of backEvent */
-	aEvent = malloc(sizeof(sEvent));
+  /* A listener waiting for its own event must not wait for a worker */
+  if( blocking && (dispatchPool != NULL) &&
+      (pthread_getspecific( dispatchingKey ) != NULL) )
+  {
+    aEvent = allocEvent();
+    aEvent->source = source;
+    aEvent->eventType = eventType;
+    aEvent->eventData = eventData;
+    aEvent->freeFunc = freeFunc;
+    aEvent->isBlocking = FALSE;
+    aEvent->refCount = 1;
+    aEvent->canCoalesce = FALSE;
+
+    em_handleOneEvent( aEvent );
+
+    DEBUG("leave (handled in place)\n");
+    return;
+  }
+
+	/* Create new event and insert it in the queue */
+	aEvent = allocEvent();
 	aEvent->source = source;
 	aEvent->eventType = eventType;
 	aEvent->eventData = eventData;
 	aEvent->freeFunc = freeFunc;
   aEvent->isBlocking = blocking;
-  if( blocking )
-    sem_init( &(aEvent->semaphore), 0, 0 );
-  
-	eventQueue[backEvent] = aEvent;
+  aEvent->refCount = 1;
+  aEvent->canCoalesce = !blocking;
 
-	/* Modify the backEvent pointer */
-	backEvent = (backEvent + 1) % EVENT_MAX_EVENTS;
+  /* Keys with only coalescing listeners need no dispatch */
+  if( !blocking && em_coalescePost( aEvent ) )
+  {
+    DEBUG("leave (coalesced)\n");
+    return;
+  }
 
-	/* Release the event list */
-	threading_mutex_unlock( &eventQueueModificationLock );
-	
-	/* Increase the QueueCounter by 1 to indicate a new event */
-  DEBUG(" sem_post(&eventsInQueue)\n" );
-	error = sem_post(&eventsInQueue);
-	assert( error == 0 );
+  aEvent->done = EVENT_PENDING;
+  
+  enqueueEvent( aEvent );
 	
   if( blocking )
   {
-    int err;
+    int done;
     
-		DEBUG("befor sem_wait(aEvent=%p)\n", aEvent );
-    err = threading_sem_wait( &(aEvent->semaphore) );
-    assert( err == 0 ); 
-		DEBUG("after sem_wait(aEvent=%p)\n", aEvent );
+		DEBUG("befor waiting for aEvent=%p\n", aEvent );
+    while( (done = atomic_loadInt( &(aEvent->done) )) != EVENT_DONE )
+    {
+      if( (done == EVENT_PENDING) &&
+          !atomic_casInt( &(aEvent->done), EVENT_PENDING, EVENT_WAITERS ) )
+        continue;
+
+      threading_word_wait( &(aEvent->done), EVENT_WAITERS );
+    }
+		DEBUG("after waiting for aEvent=%p\n", aEvent );
 
     freeEvent( aEvent );
   }
@@ -361,36 +658,106 @@ void em_postEvent( void *source, EventType eventType, void *eventData,
 
 
 
+void em_setQueueHighWaterMark( int mark, EmHighWaterFunc func,
+                               void *userData )
+{
+  assert( mark >= 0 );
+
+  queueHighWaterFunc = func;
+  queueHighWaterData = userData;
+  atomic_storeInt( &queueHighWaterMark, mark );
+}
+
+void em_getQueueStats( EmQueueStats stats )
+{
+  stats->length = atomic_loadInt( &queueLength );
+  if( stats->length < 0 )
+    stats->length = 0;
+  stats->maxLength = atomic_loadInt( &queueMaxLength );
+  stats->highWaterMark = atomic_loadInt( &queueHighWaterMark );
+  stats->overHighWater = atomic_loadInt( &queueOverHighWater );
+}
+
+
+
 /*********************************************************
  *	Add and remove listener functions
  ***********************************************************/
 
 
+void em_addListener( void *source, EventType eventType, 
+		     EventHandlerFunc handlerFunc, 
+		     void *handlerData, Boolean makeNewThread )
+{
+  sListenerEntry listener;
+
+  listener.handlerFunc = handlerFunc;
+  listener.handlerData = handlerData;
+  listener.makeNewThread = makeNewThread;
+  listener.coalescer = NULL;
+
+  addListener( source, eventType, &listener );
+}
+
+void em_addCoalescingListener( void *source, EventType eventType,
+                               EventHandlerFunc handlerFunc,
+                               void *handlerData, EmCoalesceMode mode,
+                               int maxDelayMillis )
+{
+  assert( handlerFunc != NULL );
+
+  addCoalescingListener( source, eventType, handlerFunc, NULL, handlerData,
+                         mode, maxDelayMillis );
+}
+
+void em_addBatchListener( void *source, EventType eventType,
+                          EventBatchHandlerFunc batchFunc, void *handlerData,
+                          EmCoalesceMode mode, int maxDelayMillis )
+{
+  assert( batchFunc != NULL );
+
+  addCoalescingListener( source, eventType, NULL, batchFunc, handlerData,
+                         mode, maxDelayMillis );
+}
+
+void em_removeListener( void *source, EventType eventType, 
+			EventHandlerFunc handlerFunc, void *handlerData )
+{
+  removeListener( source, eventType, handlerFunc, NULL, handlerData );
+}
+
+void em_removeBatchListener( void *source, EventType eventType,
+                             EventBatchHandlerFunc batchFunc,
+                             void *handlerData )
+{
+  removeListener( source, eventType, NULL, batchFunc, handlerData );
+}
+
 /*
  * Adds a listener.
  * First it finds the listenerList from the hash table (or creates
  * a new if not found) with source and eventType as keys.
- * Then a entry is insterted into the list with handlerFunc and
- * handlerData as keys
+ * Then a copy of its listeners, with the new one last, is put in
+ * place of the old ones. Dispatches that are using the old ones
+ * go on doing so.
  */
-void em_addListener( void *source, EventType eventType, 
-		     EventHandlerFunc handlerFunc, 
-		     void *handlerData, Boolean makeNewThread )
+static void addListener( void *source, EventType eventType,
+                         ListenerEntry listener )
 {
-  int i;
-  int res;
+  int res, count;
   /* The soon enough found listenerlist */
   ListenerList listenerList = NULL;
-  /* The template of how to find the listenerList */
-  sListenerList findTemplate = {source, eventType, {{0}}, {NULL} };
+  ListenerSnapshot oldSnapshot, newSnapshot;
+  ListenerEntry entry;
 
 	DEBUG(" enter ( source %p, type %d, handlerData %p, handlerFunc %p, makeNewThread %d )\n",
-        source, eventType, handlerData, handlerFunc, makeNewThread );
+        source, eventType, listener->handlerData, listener->handlerFunc,
+        listener->makeNewThread );
   
   threading_mutex_lock( &(listenersHashTableLock) );
   
   /* Get listener list from hash table with keys (source, eventType) */
-  listenerList = HashFind(listenersHashTable, &findTemplate);
+  listenerList = findListenerList( source, eventType );
 
   /* Check if we got a listenerList or if we got null */
   if (listenerList == NULL)
@@ -404,46 +771,43 @@ void em_addListener( void *source, EventType eventType,
     
     threading_mutex_init( &(listenerList->listenerListLock) );
     
-		/* error = sem_init( &(listenerList->listenerListLock), 0, 1 );
-       assert( error == 0 ); */
-    
-    for (i = 0; i < LLIST_NO_ELEMS; i++)
-      listenerList->listenerEntryList[i] = NULL;
-    res = HashAdd(listenersHashTable, listenerList);
+    listenerList->snapshot = NULL;
+    listenerList->phase = 0;
+    listenerList->calling[ 0 ] = 0;
+    listenerList->calling[ 1 ] = 0;
+    listenerList->removers = 0;
+    res = RcuHashAdd(listenersHashTable, listenerList);
     /* Check if success */
     assert(res != 0);
   }
   
   threading_mutex_unlock( &(listenersHashTableLock) );
   
-  /* Now we got a listenerList. First lock it.
-   * Then loop through the list to check for an empty entry */
-  
   DEBUG(" get      lock %p->listenerListLock \n", listenerList );
   threading_mutex_lock( &(listenerList->listenerListLock) );
   DEBUG(" got      lock %p->listenerListLock \n", listenerList );
   
-	for (i=0; i < LLIST_NO_ELEMS; i++)
+  oldSnapshot = listenerList->snapshot;
+  count = (oldSnapshot == NULL) ? 0 : oldSnapshot->count;
+
+  newSnapshot = createSnapshot( count + 1 );
+  if( count > 0 )
   {
-    if (listenerList->listenerEntryList[i] == NULL)
-    {
-      /* Add it here */
-      listenerList->listenerEntryList[i] = 
-				(ListenerEntry) malloc(sizeof(sListenerEntry));
-      listenerList->listenerEntryList[i]->handlerFunc = handlerFunc;
-      listenerList->listenerEntryList[i]->handlerData = handlerData;
-      listenerList->listenerEntryList[i]->makeNewThread = makeNewThread;
-			
-      break;
-    }
+    memcpy( newSnapshot->entries, oldSnapshot->entries,
+            count * sizeof( sListenerEntry ) );
+    newSnapshot->coalescers = oldSnapshot->coalescers;
   }
-	/* Unlock list */
-  threading_mutex_unlock( &(listenerList->listenerListLock) );
-  DEBUG(" released lock %p->listenerListLock \n", listenerList );
-	/* sem_post(&(listenerList->listenerListLock)); */
 
-  /* Error if no free entrys in list */
-	assert (i < LLIST_NO_ELEMS);
+  entry = &(newSnapshot->entries[ count ]);
+  *entry = *listener;
+  if( entry->coalescer != NULL )
+  {
+    entry->coalescer->list = listenerList;
+    newSnapshot->coalescers++;
+  }
+
+  atomic_storePtr( (void * volatile *) &(listenerList->snapshot),
+                   newSnapshot );
 
 #ifndef NDEBUG
 	if( debug )
@@ -453,6 +817,14 @@ void em_addListener( void *source, EventType eventType,
 	}
 #endif /* NDEBUG */
 
+	/* Unlock list */
+  threading_mutex_unlock( &(listenerList->listenerListLock) );
+  DEBUG(" released lock %p->listenerListLock \n", listenerList );
+
+  /* Dispatches may have found the old snapshot, but not yet taken it */
+  if( oldSnapshot != NULL )
+    epoch_retire( epoch_getDefaultDomain(), oldSnapshot, releaseSnapshot );
+
   DEBUG("leave\n");
 }
 
@@ -460,28 +832,31 @@ void em_addListener( void *source, EventType eventType,
 
 /*
  * Removes the first occurrance of listener with the keys
- * handlerFunc and handlerData from a list retrieved from the
+ * handlerFunc, batchFunc and handlerData from a list retrieved from the
  * hash table with the keys source and eventType.
+ *
+ * Returns once the listener is not called any more, except by
+ * dispatches in the calling thread, and in threads of its own
+ * if it asked for them.
  */
-void em_removeListener( void *source, EventType eventType, 
-			EventHandlerFunc handlerFunc, void *handlerData )
+static void removeListener( void *source, EventType eventType,
+                            EventHandlerFunc handlerFunc,
+                            EventBatchHandlerFunc batchFunc,
+                            void *handlerData )
 {
-  int i;
+  int i, count;
   /* The soon enough found listenerlist */
   ListenerList listenerList = NULL;
-  /* The template of how to find the listenerList */
-  sListenerList findTemplate = {source, eventType, {{0}}, {NULL} };
+  ListenerSnapshot oldSnapshot, newSnapshot = NULL;
+  ListenerEntry entry;
+  Coalescer coalescer = NULL;
 
 	DEBUG(" enter ( source %p, type %d, handlerData %p, handlerFunc %p )\n",
         source, eventType, handlerData, handlerFunc );
 
-  threading_mutex_lock( &(listenersHashTableLock) );
-  
   /* Get listener list from hash table with keys (source, eventType) */
-  listenerList = HashFind(listenersHashTable, &findTemplate);
+  listenerList = findListenerList( source, eventType );
 
-  threading_mutex_unlock( &(listenersHashTableLock) );
-  
   assert( listenerList != NULL );
   
 	/* Lock the list */
@@ -489,27 +864,53 @@ void em_removeListener( void *source, EventType eventType,
 	threading_mutex_lock(&(listenerList->listenerListLock));
   DEBUG(" got      lock %p->listenerListLock \n", listenerList );
 
+  oldSnapshot = listenerList->snapshot;
+  count = (oldSnapshot == NULL) ? 0 : oldSnapshot->count;
+
   /* Loop through the list to check for the entry with
-   * the keys handlerFund and handlerData */
-  for (i=0; i < LLIST_NO_ELEMS; i++)
+   * the keys handlerFund, batchFunc and handlerData */
+  for (i = 0; i < count; i++)
   {
-    if ((listenerList->listenerEntryList[i] != NULL) &&
-	(listenerList->listenerEntryList[i]->handlerFunc == handlerFunc) &&
-	(listenerList->listenerEntryList[i]->handlerData == handlerData))
-    {
-      /* Found a match, remove it */
-      free(listenerList->listenerEntryList[i]);
-      listenerList->listenerEntryList[i] = NULL;
-			DEBUG("removed listenerEntry\n");
-
+    entry = &(oldSnapshot->entries[i]);
+    if ((entry->handlerFunc == handlerFunc) &&
+        (entry->handlerData == handlerData) &&
+        (((entry->coalescer == NULL) ? NULL : entry->coalescer->batchFunc) ==
+         batchFunc))
       break;
-    }
   }
 
-	/* Unlock list */
-	threading_mutex_unlock(&(listenerList->listenerListLock));
-  DEBUG(" released lock %p->listenerListLock \n", listenerList );
-	
+  if (i == count)
+  {
+    threading_mutex_unlock(&(listenerList->listenerListLock));
+    DEBUG("leave (no such listener)\n");
+    return;
+  }
+
+  /* Found a match, publish the others */
+  coalescer = oldSnapshot->entries[i].coalescer;
+  if (count > 1)
+  {
+    newSnapshot = createSnapshot( count - 1 );
+    memcpy( newSnapshot->entries, oldSnapshot->entries,
+            i * sizeof( sListenerEntry ) );
+    memcpy( newSnapshot->entries + i, oldSnapshot->entries + i + 1,
+            (count - i - 1) * sizeof( sListenerEntry ) );
+    newSnapshot->coalescers =
+      oldSnapshot->coalescers - ((coalescer != NULL) ? 1 : 0);
+  }
+
+  /* A call that is scheduled but not yet made is not made at all */
+  if (coalescer != NULL)
+  {
+    threading_mutex_lock( &(coalescer->lock) );
+    coalescer->removed = TRUE;
+    threading_mutex_unlock( &(coalescer->lock) );
+  }
+
+  atomic_storePtr( (void * volatile *) &(listenerList->snapshot),
+                   newSnapshot );
+  DEBUG("removed listenerEntry\n");
+
 #ifndef NDEBUG
 	if( debug )
 	{
@@ -517,6 +918,17 @@ void em_removeListener( void *source, EventType eventType,
 		writeListenerList(listenerList);
 	}
 #endif
+
+	/* Unlock list */
+	threading_mutex_unlock(&(listenerList->listenerListLock));
+  DEBUG(" released lock %p->listenerListLock \n", listenerList );
+
+  waitForCalling( listenerList );
+  epoch_retire( epoch_getDefaultDomain(), oldSnapshot, releaseSnapshot );
+
+  if (coalescer != NULL)
+    dropCoalescer( coalescer );
+
   DEBUG("leave\n");
 }
 
@@ -529,41 +941,69 @@ void em_removeListener( void *source, EventType eventType,
 
 /*
  * The main event manager loop.
- * Waits for the queue to contain at least one event and starts
- * to take it off the queue. It then starts a new thread to
- * handle that current event.
+ * Takes the events off the queue as long as there are any, and starts
+ * a new thread to handle each of them. Sleeps when the queue is empty,
+ * until the next post.
  */
 static void *em_mainLoop( void *args )
 {
   int error;
+  uint64_t untilDue;
   
+  /* Events that the queue has no room for are handled here */
+  if( dispatchPool != NULL )
+    pthread_setspecific( dispatchingKey, (void *) 1 );
+
   while( TRUE )
   {
     Event event;
     pthread_t oneEventHandlerThread;
 
-    /* Wait for some events to be added 
-		 * This is also the cancelation point for this thread */
+    /* Coalescers are passed on in time even if the queue is never empty */
+    if( atomic_loadPtr( (void * volatile *) &dueCoalescers ) != NULL )
+      em_flushDueCoalescers( FALSE );
 
-    DEBUG("waits for events\n");
-    error = threading_sem_wait( &eventsInQueue );
-    assert( error == 0 );
-    /*
-    if( error != 0 )
-      fprintf( stderr, "event.c: catastrophic: sem_wait returned %d, not 0. errno=%d\n",
-      error, errno );
-    */
-    assert( frontEvent != backEvent );
-
-    /* get and remove the element from the queue */
-    event = eventQueue[ frontEvent ];
-    
-    threading_mutex_lock( &eventQueueModificationLock );
+    event = dequeueEvent();
+    if( event == NULL )
+    {
+      /* Say that we sleep, then look again, so that a poster either
+         sees that or has its event counted */
+      DEBUG("waits for events\n");
+      atomic_storeInt( &mainLoopSleeping, 1 );
+      atomic_fence();
+      if( atomic_loadInt( &queueLength ) > 0 )
+        atomic_storeInt( &mainLoopSleeping, 0 );
+      else if( atomic_loadInt( &mainLoopStopping ) )
+      {
+        /* Coalesced events are not held back any longer */
+        em_flushDueCoalescers( TRUE );
+        break;
+      }
+      else if( (untilDue = em_flushDueCoalescers( FALSE )) != 0 )
+      {
+        threading_word_timedwait( &mainLoopSleeping, 1,
+                                  (unsigned long) (untilDue / 1000) + 1 );
+        atomic_storeInt( &mainLoopSleeping, 0 );
+      }
+      else
+        threading_word_wait( &mainLoopSleeping, 1 );
+      continue;
+    }
 
-		/* modify the queue */
-    frontEvent = (frontEvent + 1) % EVENT_MAX_EVENTS;
-    
-    threading_mutex_unlock( &eventQueueModificationLock );
+    atomic_addInt( &queueLength, -1 );
+
+    if( dispatchPool != NULL )
+    {
+      Error err;
+
+      /* A full queue has us handle the event, which holds back the
+         posters until the workers catch up */
+      err = threadPool_submit( dispatchPool, em_handlePooledEvent, event );
+      assert( err == NULL );
+
+      DEBUG(" queued event %p\n", event);
+      continue;
+    }
 
     /* Create a thread that dispatches the callbacks to the
      * registred listeners */
@@ -595,97 +1035,334 @@ static void *em_mainLoop( void *args )
   return NULL;
 }
 
-static void freeEvent( Event event )
+static void enqueueEvent( Event event )
 {
-  if( event->isBlocking )
+  int length, maxLength, mark;
+
+  /* Counted first, so that em_mainLoop does not sleep on it */
+  length = atomic_addInt( &queueLength, 1 );
+
+  while( length > (maxLength = atomic_loadInt( &queueMaxLength )) )
+    if( atomic_casInt( &queueMaxLength, maxLength, length ) )
+      break;
+
+  mark = atomic_loadInt( &queueHighWaterMark );
+  if( (mark > 0) && (length == mark + 1) )
   {
-    int err;
-    
-    /* free the semaphore */
-    err = sem_destroy( &(event->semaphore) );
-    assert( err == 0 );
-    DEBUG(" destroyed %p->semaphore\n",event);
+    atomic_addInt( &queueOverHighWater, 1 );
+    if( queueHighWaterFunc != NULL )
+      queueHighWaterFunc( length, queueHighWaterData );
   }
-  
-  free( event );
+
+  linkEvent( event );
+
+  wakeMainLoop();
+}
+
+static void wakeMainLoop( void )
+{
+  if( atomic_loadInt( &mainLoopSleeping ) &&
+      atomic_exchangeInt( &mainLoopSleeping, 0 ) )
+    threading_word_wake( &mainLoopSleeping, 1 );
 }
 
 /*
-  posts to the event's semaphore if the event is blocking, otherwise frees it.
-  
-  If it is a blocking event, then the thread that does sem_wait must also
-  do the freeing by calling freeEvent.
-*/
-static void finishedWithEvent( Event event )
+ * Puts event last in the queue, with no lock and no waiting.
+ */
+static void linkEvent( Event event )
 {
-  /* free the event */
-  if (event->freeFunc)
-    event->freeFunc(event->source, event->eventType, event->eventData);
-  
-  if( event->isBlocking )
-  {
-    int err;
-  
-    DEBUG(" sem_post %p->semaphore\n",event);
-    err = sem_post( &(event->semaphore ) );
-    assert( err == 0 );
-    /* freeEvent will be called from em_postEvent */
-  }
-  else
-    freeEvent( event );
+  Event previous;
+
+  event->next = NULL;
+  previous = atomic_exchangePtr( (void * volatile *) &queueHead, event );
+  atomic_storePtr( (void * volatile *) &(previous->next), event );
 }
 
 /*
- * Handles the execution of a single event.
- * It first fetches the list of all listeners for
- * the event's source and eventType.
- * For every listener, the handlerFunction is called
- * either within a new thread or within the current thread
- * depending on what the variable makeNewThread is
+ * Takes the first event off the queue, or returns NULL if it is empty.
+ * Only called by em_mainLoop.
  */
-static void *em_handleOneEvent(Event event)
+static Event dequeueEvent( void )
 {
-	int listnCntr = 0;
-  
-	/* List with threads to be checked for completion */
-	pthread_t threadWaitList[LLIST_NO_ELEMS];
-	int threadWaitCntr = 0;
-		
-  /* The soon enough found listenerlist */
-  ListenerList listenerList = NULL;
-  /* The template of how to find the listenerList initiated
-	 * with the event's source and eventType */
-  sListenerList findTemplate = {event->source, event->eventType, {{0}}, {NULL} };
-  
-  DEBUG(" enter %p\n", event);
-  
-  /* Check if we have erraneously gotten realtime scheduling */
-#ifndef NDEBUG
+  Event tail = queueTail;
+  Event next = atomic_loadPtr( (void * volatile *) &(tail->next) );
+
+  if( tail == &queueStub )
   {
-  int err, scheduler;
-  struct sched_param schedParam;
-  err = pthread_getschedparam( pthread_self(), &scheduler, &schedParam );
-  assert( err == 0 );
-    
-  assert( scheduler == SCHED_OTHER );
+    if( next == NULL )
+      return NULL;
+
+    queueTail = next;
+    tail = next;
+    next = atomic_loadPtr( (void * volatile *) &(tail->next) );
   }
-#endif
 
+  if( next == NULL )
+  {
+    /* tail is the last event, so put the stub after it to have a new
+       last one, unless a poster is about to link an event to it */
+    if( tail == atomic_loadPtr( (void * volatile *) &queueHead ) )
+      linkEvent( &queueStub );
+
+    while( (next = atomic_loadPtr( (void * volatile *) &(tail->next) )) ==
+           NULL )
+      threading_yield();
+  }
+
+  queueTail = next;
+  return tail;
+}
+
+/*
+ * Takes an event from the cache of the calling thread, refilling it from
+ * the depot if it is empty.
+ */
+static Event allocEvent( void )
+{
+  EventCache cache = getEventCache();
+  Event event;
+
+  if( cache == NULL )
+    return malloc( sizeof( sEvent ) );
+
+  /* The count is read without the lock first, so that posters do not
+     take it for every event while the depot is empty */
+  if( (cache->first == NULL) && (atomic_loadInt( &eventDepotCount ) > 0) )
+  {
+    threading_mutex_lock( &eventDepotLock );
+    if( eventDepotCount > 0 )
+    {
+      cache->first = eventDepot[ --eventDepotCount ];
+      cache->count = EVENT_CACHE_SIZE;
+    }
+    threading_mutex_unlock( &eventDepotLock );
+  }
+
+  if( cache->first == NULL )
+    return malloc( sizeof( sEvent ) );
+
+  event = cache->first;
+  cache->first = event->next;
+  cache->count--;
+
+  return event;
+}
+
+/*
+ * Puts event in the cache of the calling thread, moving the cache to the
+ * depot first if it is full.
+ */
+static void freeEvent( Event event )
+{
+  EventCache cache = getEventCache();
+  Event full = NULL;
+
+  if( cache == NULL )
+  {
+    free( event );
+    return;
+  }
+
+  if( cache->count == EVENT_CACHE_SIZE )
+  {
+    threading_mutex_lock( &eventDepotLock );
+    full = depositEvents( cache->first );
+    threading_mutex_unlock( &eventDepotLock );
+
+    cache->first = NULL;
+    cache->count = 0;
+
+    freeEventList( full );
+  }
+
+  event->next = cache->first;
+  cache->first = event;
+  cache->count++;
+}
+
+/*
+ * Frees event from a thread that has no cache, see depotLoose.
+ */
+static void freeEventToDepot( Event event )
+{
+  Event full = NULL;
+
+  pthread_once( &eventCacheKeyOnce, createEventCacheKey );
+
+  threading_mutex_lock( &eventDepotLock );
+  event->next = depotLoose;
+  depotLoose = event;
+  if( ++depotLooseCount == EVENT_CACHE_SIZE )
+  {
+    full = depositEvents( depotLoose );
+    depotLoose = NULL;
+    depotLooseCount = 0;
+  }
+  threading_mutex_unlock( &eventDepotLock );
+
+  freeEventList( full );
+}
+
+/*
+ * Puts a list of EVENT_CACHE_SIZE events in the depot. Returns the list
+ * if the depot is full, for the caller to free once it has let go of
+ * eventDepotLock, which must be held.
+ */
+static Event depositEvents( Event full )
+{
+  if( eventDepotCount == EVENT_DEPOT_SIZE )
+    return full;
+
+  eventDepot[ eventDepotCount++ ] = full;
+
+  return NULL;
+}
+
+static void freeEventList( Event first )
+{
+  Event next;
+
+  for( ; first != NULL; first = next )
+  {
+    next = first->next;
+    free( first );
+  }
+}
+
+/*
+ * The destructor of eventCacheKey, frees the events of an exiting thread.
+ */
+static void freeEventCache( void *data )
+{
+  EventCache cache = data;
+
+  freeEventList( cache->first );
+  free( cache );
+}
+
+static void createEventCacheKey( void )
+{
+  int err;
+
+  err = pthread_key_create( &eventCacheKey, freeEventCache );
+  assert( err == 0 );
+  threading_mutex_init( &eventDepotLock );
+}
+
+static EventCache getEventCache( void )
+{
+  EventCache cache;
+
+  pthread_once( &eventCacheKeyOnce, createEventCacheKey );
+
+  cache = pthread_getspecific( eventCacheKey );
+  if( cache == NULL )
+  {
+    cache = malloc( sizeof( sEventCache ) );
+    if( cache == NULL )
+      return NULL;
+
+    cache->first = NULL;
+    cache->count = 0;
+    pthread_setspecific( eventCacheKey, cache );
+  }
+
+  return cache;
+}
+
+/*
+  Wakes the poster if the event is blocking, otherwise frees it.
   
-  threading_mutex_lock( &(listenersHashTableLock) );
+  Outside EM_DISPATCH_POOL mode this mostly runs in threads that only
+  live for one event, and would never reuse a cache, so the event goes
+  towards the depot directly.
+
+  If it is a blocking event, then the poster must also do the freeing by
+  calling freeEvent once it sees done set to EVENT_DONE. The event may be
+  gone by the time threading_word_wake is called, which then at most
+  wakes a thread that sleeps on whatever the event became.
+*/
+static void finishedWithEvent( Event event )
+{
+  /* free the event */
+  if (event->freeFunc)
+    event->freeFunc(event->source, event->eventType, event->eventData);
   
-  /* Get listener list from hash table with keys (source, eventType) */
-  listenerList = HashFind(listenersHashTable, &findTemplate);
+  if( event->isBlocking )
+  {
+    DEBUG(" waking the poster of %p\n",event);
+    if( atomic_exchangeInt( &(event->done), EVENT_DONE ) == EVENT_WAITERS )
+      threading_word_wake( &(event->done), 1 );
+    /* freeEvent will be called from em_postEvent */
+  }
+  else if( dispatchPool == NULL )
+    freeEventToDepot( event );
+  else
+    freeEvent( event );
+}
 
-  threading_mutex_unlock( &(listenersHashTableLock) );
+/*
+ * Drops a reference to event, and finishes with it if it was the last.
+ */
+static void releaseEvent( Event event )
+{
+  if( atomic_addInt( &(event->refCount), -1 ) == 0 )
+    finishedWithEvent( event );
+}
+
+/*
+ * Handles the execution of a single event.
+ * It first fetches the list of all listeners for
+ * the event's source and eventType.
+ * For every listener, the handlerFunction is called
+ * either within a new thread or within the current thread
+ * depending on what the variable makeNewThread is
+ */
+static void *em_handleOneEvent(Event event)
+{
+	int listnCntr = 0;
   
-  /* Check if we got a listenerList or if we got null */
-  if (listenerList == NULL)
+	/* List with threads to be checked for completion */
+	pthread_t *threadWaitList = NULL;
+	int threadWaitCntr = 0;
+
+  /* The listeners handed to the dispatch pool instead */
+  PooledListeners pooled = NULL;
+		
+  /* The soon enough found listenerlist, and its listeners */
+  ListenerList listenerList = NULL;
+  ListenerSnapshot snapshot = NULL;
+  sDispatchFrame frame;
+  
+  DEBUG(" enter %p\n", event);
+  
+  /* Check if we have erraneously gotten realtime scheduling */
+#ifndef NDEBUG
+  {
+  int err, scheduler;
+  struct sched_param schedParam;
+  err = pthread_getschedparam( pthread_self(), &scheduler, &schedParam );
+  assert( err == 0 );
+    
+  assert( scheduler == SCHED_OTHER );
+  }
+#endif
+
+  
+  /* Get listener list from hash table with keys (source, eventType) */
+  listenerList = findListenerList( event->source, event->eventType );
+  if (listenerList != NULL)
+    snapshot = beginCalling( listenerList, &frame );
+
+  /* Check if we got any listeners */
+  if (snapshot == NULL)
   {
 		/* No listeners... */
     DEBUG("No listeners\n");
+    if (listenerList != NULL)
+      endCalling( listenerList, &frame );
 
-    finishedWithEvent( event );
+    releaseEvent( event );
 #if 0
     /* free the event */
     if (event->freeFunc)
@@ -697,23 +1374,52 @@ static void *em_handleOneEvent(Event event)
 		return NULL;
 	}
 
-	/* Lock the list */
-  DEBUG(" get      lock %p->listenerListLock \n", listenerList );
-	threading_mutex_lock(&(listenerList->listenerListLock));
-  DEBUG(" got      lock %p->listenerListLock \n", listenerList );
-
-	/* Loop through the list and for each non-null position
-	 * call the handlerFunc in the desired way */
-  for (listnCntr=0; listnCntr < LLIST_NO_ELEMS; listnCntr++)
+	/* Loop through the listeners and call the handlerFunc of each in
+	 * the desired way. No lock is held, listeners may be added and
+	 * removed meanwhile. */
+  for (listnCntr=0; listnCntr < snapshot->count; listnCntr++)
   {
-		/* Check if there is a listener */
-    if (listenerList->listenerEntryList[listnCntr] != NULL)
-    {
-			ListenerEntry aListener = NULL;
-			aListener = listenerList->listenerEntryList[listnCntr];
+			ListenerEntry aListener = &(snapshot->entries[listnCntr]);
 
-			/* Check if a new thread or within in this thread */
-			if (aListener->makeNewThread)
+			/* Check if coalesced, in a new thread or within in this thread */
+			if (aListener->coalescer != NULL)
+			{
+        if (event->canCoalesce)
+          em_coalesceEvent( aListener->coalescer, event );
+        else
+          em_callPending( aListener->coalescer, &(event->eventData) );
+			}
+			else if (aListener->makeNewThread && (dispatchPool != NULL))
+			{
+        PooledListener listener;
+        Error err;
+
+        if( pooled == NULL )
+        {
+          pooled = malloc( offsetof( sPooledListeners, listeners ) +
+                           snapshot->count * sizeof( sPooledListener ) );
+          pooled->event = event;
+          pooled->refCount = 1;
+          pooled->running = 0;
+          pooled->count = 0;
+        }
+
+        listener = &(pooled->listeners[ pooled->count++ ]);
+        listener->block = pooled;
+        listener->handlerFunc = aListener->handlerFunc;
+        listener->handlerData = aListener->handlerData;
+        listener->claimed = 0;
+
+        /* If it cannot be queued, it is called by em_finishPooledListeners */
+        atomic_addInt( &(pooled->refCount), 1 );
+        err = threadPool_submit( dispatchPool, em_runPooledListener, listener );
+        if( err != NULL )
+        {
+          atomic_addInt( &(pooled->refCount), -1 );
+          ErrDispose( err, TRUE );
+        }
+			}
+			else if (aListener->makeNewThread)
 			{
 				int error = 0;
 				HandleOneListenerData aHandleOneListenerData = NULL;
@@ -744,7 +1450,8 @@ static void *em_handleOneEvent(Event event)
         if( error == 0 )
         {
           /* Add thread to wait list */
-          assert( threadWaitCntr < LLIST_NO_ELEMS );
+          if( threadWaitList == NULL )
+            threadWaitList = malloc( snapshot->count * sizeof( pthread_t ) );
           threadWaitList[threadWaitCntr] = oneEventListenerThread;
           threadWaitCntr++;
         }
@@ -754,9 +1461,8 @@ static void *em_handleOneEvent(Event event)
 			}
 			else
 			{
-        /* This is a dangerous point. If the handlerFunc blocks for a long
-           time, we still have the listenerList locked, and will prevent other
-           events like this to be handled. 
+        /* If the handlerFunc blocks for a long time, this event is held
+           up, and so is em_removeListener for these keys. 
              Any handlers which can block should start new threads! 
         */
         DEBUG("forks NO thread for event %p  handlerData %p\n",
@@ -768,12 +1474,13 @@ static void *em_handleOneEvent(Event event)
         DEBUG("handlerFunc returned-1. event %p  handlerData %p\n",
               event, aListener->handlerData);
 			}
-		}
 	}
 
-	/* Unlock the list */
-	threading_mutex_unlock(&(listenerList->listenerListLock));
-  DEBUG(" released lock %p->listenerListLock \n", listenerList );
+  endCalling( listenerList, &frame );
+  releaseSnapshot( snapshot );
+
+  if( pooled != NULL )
+    em_finishPooledListeners( pooled );
 
 	/* Wait for all threads in wait list */
   DEBUG(" waits for joining threads for event %p\n", event );
@@ -782,9 +1489,10 @@ static void *em_handleOneEvent(Event event)
 		/* For every pthread created, do a join */
 		pthread_join(threadWaitList[listnCntr], NULL);
 	}
+  free( threadWaitList );
   DEBUG(" done joining threads for event %p\n", event );
 	
-  finishedWithEvent( event );
+  releaseEvent( event );
 #if 0
 	/* Check if freeFunc should be called. */
 	if (event->freeFunc)
@@ -839,6 +1547,86 @@ static void *em_handleOneListenerHandlerFunc(HandleOneListenerData data)
 	return NULL;
 }
 
+/*
+ * The task that handles an event in EM_DISPATCH_POOL mode.
+ */
+static void *em_handlePooledEvent( void *event )
+{
+  pthread_setspecific( dispatchingKey, (void *) 1 );
+
+  return em_handleOneEvent( (Event) event );
+}
+
+/*
+ * The task that calls a listener that asked for a thread of its own, in
+ * EM_DISPATCH_POOL mode, unless the thread handling the event has
+ * already called it.
+ */
+static void *em_runPooledListener( void *data )
+{
+  PooledListener listener = data;
+  PooledListeners block = listener->block;
+  Event event = block->event;
+
+  pthread_setspecific( dispatchingKey, (void *) 1 );
+
+  /* Counted as running before the claim, so that the thread handling the
+     event waits for us if it sees the listener claimed */
+  atomic_addInt( &(block->running), 1 );
+
+  if( atomic_casInt( &(listener->claimed), 0, 1 ) )
+    listener->handlerFunc( event->source, event->eventType, event->eventData,
+                           listener->handlerData );
+
+  if( atomic_addInt( &(block->running), -1 ) == 0 )
+    threading_word_wake( &(block->running), THREADING_WORD_WAKE_ALL );
+
+  releasePooledListeners( block );
+
+  return NULL;
+}
+
+/*
+ * Calls the listeners in block that no worker has started on, then waits
+ * for those that workers are calling.
+ */
+static void em_finishPooledListeners( PooledListeners block )
+{
+  Event event = block->event;
+  PooledListener listener;
+  int i, running;
+
+  for( i = 0; i < block->count; i++ )
+  {
+    listener = &(block->listeners[ i ]);
+
+    if( atomic_casInt( &(listener->claimed), 0, 1 ) )
+      listener->handlerFunc( event->source, event->eventType,
+                             event->eventData, listener->handlerData );
+  }
+
+  while( (running = atomic_loadInt( &(block->running) )) != 0 )
+    threading_word_wait( &(block->running), running );
+
+  releasePooledListeners( block );
+}
+
+static void releasePooledListeners( PooledListeners block )
+{
+  if( atomic_addInt( &(block->refCount), -1 ) == 0 )
+    free( block );
+}
+
+static void createDispatchingKey( void )
+{
+  int err;
+
+  err = pthread_key_create( &dispatchingKey, NULL );
+  assert( err == 0 );
+  err = pthread_key_create( &dispatchFrameKey, NULL );
+  assert( err == 0 );
+}
+
 
 
 
@@ -847,6 +1635,20 @@ static void *em_handleOneListenerHandlerFunc(HandleOneListenerData data)
  *  Hashtable handling functions
  ***********************************************************/
 
+/*
+ * Looks up the listener list for (source, eventType). Only the key
+ * fields of the template are set, the rest is left zeroed.
+ */
+static ListenerList findListenerList( void *source, EventType eventType )
+{
+  sListenerList findTemplate;
+
+  memset( &findTemplate, 0, sizeof( findTemplate ) );
+  findTemplate.source = source;
+  findTemplate.eventType = eventType;
+
+  return RcuHashFind( listenersHashTable, &findTemplate );
+}
 
 static int calcHashCode(ListenerList aList)
 {
@@ -869,19 +1671,14 @@ static int compHashEntrys(ListenerList list1, ListenerList list2)
 }
 
 /*
- * Free all the ListenerEntrys in the list
+ * Free the listeners of the list
  */
 static void freeListenerList(ListenerList aList)
 {
-  int i;
-
-  for (i = 0; i < LLIST_NO_ELEMS; i++)
+  if (aList->snapshot != NULL)
   {
-    if (aList->listenerEntryList[i] != NULL)
-    {
-      free(aList->listenerEntryList[i]);
-      aList->listenerEntryList[i] = NULL;
-    }
+    releaseSnapshot(aList->snapshot);
+    aList->snapshot = NULL;
   }
   
 }
@@ -893,20 +1690,466 @@ static void freeListenerList(ListenerList aList)
 static void writeListenerList(ListenerList aList)
 {
   int i;
+  ListenerSnapshot snapshot = aList->snapshot;
   
   printf("ListenerList: source: %x, evtype: %d\n",(int)aList->source,
 	 aList->eventType);
-  for (i=0; i < LLIST_NO_ELEMS; i++)
+  for (i=0; (snapshot != NULL) && (i < snapshot->count); i++)
   {
-    if (aList->listenerEntryList[i] != NULL)
-    {
       printf("  Entry: hfunc: %x, hdata: %x, newthr: %d\n",
-	     (int)aList->listenerEntryList[i]->handlerFunc,
-	     (int)aList->listenerEntryList[i]->handlerData,
-	     aList->listenerEntryList[i]->makeNewThread);
-    }
+	     (int)snapshot->entries[i].handlerFunc,
+	     (int)snapshot->entries[i].handlerData,
+	     snapshot->entries[i].makeNewThread);
   }
   printf("--------------------------------\n\n");
 }
 
 
+
+/*********************************************************
+ *  Listener snapshot functions
+ ***********************************************************/
+
+/*
+ * Returns a snapshot with room for count listeners, and the reference
+ * of the ListenerList it will be published in.
+ */
+static ListenerSnapshot createSnapshot( int count )
+{
+  ListenerSnapshot snapshot;
+
+  snapshot = malloc( offsetof( sListenerSnapshot, entries ) +
+                     count * sizeof( sListenerEntry ) );
+  snapshot->refCount = 1;
+  snapshot->count = count;
+  snapshot->coalescers = 0;
+
+  return snapshot;
+}
+
+static void releaseSnapshot( void *data )
+{
+  ListenerSnapshot snapshot = data;
+
+  if( atomic_addInt( &(snapshot->refCount), -1 ) == 0 )
+    free( snapshot );
+}
+
+/*
+ * Counts a dispatch as calling the listeners of list, and returns a
+ * reference to them, or NULL if there are none. The snapshot is taken
+ * after the dispatch is counted, so a dispatch that em_removeListener
+ * does not wait for sees the listener gone.
+ */
+static ListenerSnapshot beginCalling( ListenerList list, DispatchFrame frame )
+{
+  EpochDomain domain = epoch_getDefaultDomain();
+  ListenerSnapshot snapshot;
+
+  frame->list = list;
+  frame->phase = atomic_loadInt( &(list->phase) ) & 1;
+  atomic_addInt( &(list->calling[ frame->phase ]), 1 );
+
+  frame->prev = pthread_getspecific( dispatchFrameKey );
+  pthread_setspecific( dispatchFrameKey, frame );
+
+  /* A writer retires the old snapshot through the epoch domain, so it
+     cannot be freed before we have our reference */
+  epoch_enter( domain );
+  snapshot = atomic_loadPtr( (void * volatile *) &(list->snapshot) );
+  if( snapshot != NULL )
+    atomic_addInt( &(snapshot->refCount), 1 );
+  epoch_exit( domain );
+
+  return snapshot;
+}
+
+static void endCalling( ListenerList list, DispatchFrame frame )
+{
+  volatile int *calling = &(list->calling[ frame->phase ]);
+
+  pthread_setspecific( dispatchFrameKey, frame->prev );
+
+  atomic_addInt( calling, -1 );
+  if( atomic_loadInt( &(list->removers) ) > 0 )
+    threading_word_wake( calling, THREADING_WORD_WAKE_ALL );
+}
+
+/*
+ * Waits until the dispatches that were calling the listeners of list
+ * when the call was made are done with them, not counting those of the
+ * calling thread.
+ *
+ * New dispatches are counted in calling[ phase & 1 ]. Before waiting
+ * for a counter to drop, the phase is moved on, so that new dispatches
+ * count themselves in the other one and cannot keep us waiting. Other
+ * removers may move it back meanwhile, which is why the wait is timed.
+ */
+static void waitForCalling( ListenerList list )
+{
+  DispatchFrame frame;
+  int own[ 2 ] = { 0, 0 };
+  int i, phase, calling;
+
+  for( frame = pthread_getspecific( dispatchFrameKey ); frame != NULL;
+       frame = frame->prev )
+    if( frame->list == list )
+      own[ frame->phase ]++;
+
+  atomic_addInt( &(list->removers), 1 );
+
+  for( i = 0; i < 2; i++ )
+  {
+    for( ;; )
+    {
+      phase = atomic_loadInt( &(list->phase) );
+      if( (phase & 1) == i )
+      {
+        atomic_casInt( &(list->phase), phase, phase + 1 );
+        continue;
+      }
+
+      calling = atomic_loadInt( &(list->calling[ i ]) );
+      if( calling <= own[ i ] )
+        break;
+
+      threading_word_timedwait( &(list->calling[ i ]), calling, 10000 );
+    }
+  }
+
+  atomic_addInt( &(list->removers), -1 );
+}
+
+
+
+/*********************************************************
+ *  Coalescing listener functions
+ ***********************************************************/
+
+static void addCoalescingListener( void *source, EventType eventType,
+                                   EventHandlerFunc handlerFunc,
+                                   EventBatchHandlerFunc batchFunc,
+                                   void *handlerData, EmCoalesceMode mode,
+                                   int maxDelayMillis )
+{
+  sListenerEntry listener;
+  Coalescer coalescer;
+
+  assert( maxDelayMillis >= 0 );
+
+  coalescer = malloc( sizeof( sCoalescer ) );
+  memset( coalescer, 0, sizeof( sCoalescer ) );
+  coalescer->mode = mode;
+  coalescer->handlerFunc = handlerFunc;
+  coalescer->batchFunc = batchFunc;
+  coalescer->handlerData = handlerData;
+  coalescer->maxDelay = (uint64_t) maxDelayMillis * 1000000;
+  coalescer->refCount = 1;
+  threading_mutex_init( &(coalescer->callLock) );
+  threading_mutex_init( &(coalescer->lock) );
+  coalescer->scheduled = FALSE;
+  coalescer->removed = FALSE;
+
+  listener.handlerFunc = handlerFunc;
+  listener.handlerData = handlerData;
+  listener.makeNewThread = FALSE;
+  listener.coalescer = coalescer;
+
+  addListener( source, eventType, &listener );
+}
+
+/*
+ * Hands a posted event straight to the listeners of its keys if they are
+ * all coalescing, and drops the poster's reference. Returns FALSE,
+ * leaving the event alone, if it has to be queued.
+ */
+static Boolean em_coalescePost( Event event )
+{
+  ListenerList listenerList;
+  ListenerSnapshot snapshot;
+  sDispatchFrame frame;
+  int i;
+
+  listenerList = findListenerList( event->source, event->eventType );
+  if( listenerList == NULL )
+    return FALSE;
+
+  /* Counted as a dispatch, so that em_removeListener waits for us */
+  snapshot = beginCalling( listenerList, &frame );
+  if( (snapshot == NULL) || (snapshot->coalescers < snapshot->count) )
+  {
+    endCalling( listenerList, &frame );
+    if( snapshot != NULL )
+      releaseSnapshot( snapshot );
+    return FALSE;
+  }
+
+  for( i = 0; i < snapshot->count; i++ )
+    em_coalesceEvent( snapshot->entries[ i ].coalescer, event );
+
+  endCalling( listenerList, &frame );
+  releaseSnapshot( snapshot );
+  releaseEvent( event );
+
+  return TRUE;
+}
+
+/*
+ * Gives event to coalescer, replacing the one it holds if it only wants
+ * the latest, and schedules a call unless one is already scheduled.
+ * Called during a dispatch of the coalescer's list.
+ */
+static void em_coalesceEvent( Coalescer coalescer, Event event )
+{
+  sPendingEvents *pending = &(coalescer->pending);
+  Event dropped = NULL;
+  Boolean schedule = FALSE;
+
+  atomic_addInt( &(event->refCount), 1 );
+
+  threading_mutex_lock( &(coalescer->lock) );
+
+  if( pending->count == 0 )
+    coalescer->pendingSince = nanosec();
+  else if( coalescer->mode == EM_COALESCE_LATEST )
+  {
+    dropped = pending->events[ 0 ];
+    pending->count = 0;
+  }
+
+  if( pending->count == pending->size )
+  {
+    pending->size = (pending->size == 0) ? 8 : pending->size * 2;
+    pending->events = realloc( pending->events,
+                               pending->size * sizeof( Event ) );
+    pending->eventData = realloc( pending->eventData,
+                                  pending->size * sizeof( void * ) );
+  }
+
+  pending->events[ pending->count ] = event;
+  pending->eventData[ pending->count ] = event->eventData;
+  pending->count++;
+
+  if( !coalescer->scheduled )
+  {
+    coalescer->scheduled = TRUE;
+    atomic_addInt( &(coalescer->refCount), 1 );
+    schedule = TRUE;
+  }
+
+  threading_mutex_unlock( &(coalescer->lock) );
+
+  if( dropped != NULL )
+    releaseEvent( dropped );
+
+  if( schedule )
+    scheduleCoalescer( coalescer,
+                       coalescer->pendingSince + coalescer->maxDelay );
+}
+
+/*
+ * Calls a coalescing listener with the events it holds, and then with
+ * eventData unless that is NULL. Called during a dispatch of the
+ * coalescer's list, so that em_removeListener waits for the call.
+ */
+static void em_callPending( Coalescer coalescer, void **eventData )
+{
+  sPendingEvents batch = { NULL, NULL, 0, 0 };
+  int i;
+
+  threading_mutex_lock( &(coalescer->callLock) );
+
+  threading_mutex_lock( &(coalescer->lock) );
+  if( !coalescer->removed )
+  {
+    batch = coalescer->pending;
+    coalescer->pending = coalescer->spare;
+    coalescer->spare.events = NULL;
+    coalescer->spare.eventData = NULL;
+    coalescer->spare.size = 0;
+  }
+  threading_mutex_unlock( &(coalescer->lock) );
+
+  if( batch.count > 0 )
+    em_callCoalescer( coalescer, batch.eventData, batch.count );
+  if( eventData != NULL )
+    em_callCoalescer( coalescer, eventData, 1 );
+
+  threading_mutex_unlock( &(coalescer->callLock) );
+
+  for( i = 0; i < batch.count; i++ )
+    releaseEvent( batch.events[ i ] );
+  batch.count = 0;
+
+  threading_mutex_lock( &(coalescer->lock) );
+  if( coalescer->spare.events == NULL )
+    coalescer->spare = batch;
+  else
+  {
+    free( batch.events );
+    free( batch.eventData );
+  }
+  threading_mutex_unlock( &(coalescer->lock) );
+}
+
+static void em_callCoalescer( Coalescer coalescer, void **eventData,
+                              int count )
+{
+  ListenerList list = coalescer->list;
+  int i;
+
+  if( coalescer->batchFunc != NULL )
+    coalescer->batchFunc( list->source, list->eventType, eventData, count,
+                          coalescer->handlerData );
+  else
+    for( i = 0; i < count; i++ )
+      coalescer->handlerFunc( list->source, list->eventType, eventData[ i ],
+                              coalescer->handlerData );
+}
+
+/*
+ * Calls a coalescing listener with the events it holds, once its delay
+ * is up. Runs in a thread of its own, or as a task of the dispatch pool.
+ */
+static void *em_flushCoalescer( void *data )
+{
+  Coalescer coalescer = data;
+  ListenerList list = coalescer->list;
+  ListenerSnapshot snapshot;
+  sDispatchFrame frame;
+  Boolean again;
+
+  if( dispatchPool != NULL )
+    pthread_setspecific( dispatchingKey, (void *) 1 );
+
+  /* Counted as a dispatch, so that em_removeListener waits for the call */
+  snapshot = beginCalling( list, &frame );
+  if( snapshot != NULL )
+    releaseSnapshot( snapshot );
+
+  em_callPending( coalescer, NULL );
+
+  endCalling( list, &frame );
+
+  threading_mutex_lock( &(coalescer->lock) );
+  again = !coalescer->removed && (coalescer->pending.count > 0);
+  if( !again )
+    coalescer->scheduled = FALSE;
+  threading_mutex_unlock( &(coalescer->lock) );
+
+  /* Events given to it during the call were held for the next one */
+  if( again )
+    scheduleCoalescer( coalescer,
+                       coalescer->pendingSince + coalescer->maxDelay );
+  else
+    releaseCoalescer( coalescer );
+
+  return NULL;
+}
+
+/*
+ * Takes the coalescers whose deadline has passed, or all of them if all
+ * is set, off the due list and has them called. Returns the nanoseconds
+ * until the next one is due, 0 if none is left. Only called by
+ * em_mainLoop.
+ */
+static uint64_t em_flushDueCoalescers( Boolean all )
+{
+  Coalescer due = NULL, coalescer;
+  uint64_t now = nanosec(), untilDue = 0;
+
+  threading_mutex_lock( &coalesceLock );
+  while( (dueCoalescers != NULL) &&
+         (all || (dueCoalescers->deadline <= now)) )
+  {
+    coalescer = dueCoalescers;
+    dueCoalescers = coalescer->nextDue;
+    coalescer->nextDue = due;
+    due = coalescer;
+  }
+
+  if( dueCoalescers != NULL )
+    untilDue = dueCoalescers->deadline - now;
+  threading_mutex_unlock( &coalesceLock );
+
+  for( ; due != NULL; due = coalescer )
+  {
+    coalescer = due->nextDue;
+
+    if( dispatchPool != NULL )
+    {
+      Error err;
+
+      err = threadPool_submit( dispatchPool, em_flushCoalescer, due );
+      assert( err == NULL );
+    }
+    else
+    {
+      pthread_t flushThread;
+      int error;
+
+      error = threading_pthread_create( &flushThread, &detachedThreadAttr,
+                                        em_flushCoalescer, due );
+      assert( error == 0 );
+    }
+  }
+
+  return untilDue;
+}
+
+/*
+ * Puts coalescer on the due list, and wakes em_mainLoop if it is the
+ * first one due.
+ */
+static void scheduleCoalescer( Coalescer coalescer, uint64_t deadline )
+{
+  Coalescer *link;
+
+  coalescer->deadline = deadline;
+
+  threading_mutex_lock( &coalesceLock );
+  for( link = &dueCoalescers; *link != NULL; link = &((*link)->nextDue) )
+    if( (*link)->deadline > deadline )
+      break;
+
+  coalescer->nextDue = *link;
+  *link = coalescer;
+  threading_mutex_unlock( &coalesceLock );
+
+  if( link == &dueCoalescers )
+    wakeMainLoop();
+}
+
+/*
+ * Drops the events that a removed coalescer still holds, and the
+ * reference of its listener entry. Called once no dispatch can give it
+ * more.
+ */
+static void dropCoalescer( Coalescer coalescer )
+{
+  int i, count;
+
+  threading_mutex_lock( &(coalescer->lock) );
+  count = coalescer->pending.count;
+  coalescer->pending.count = 0;
+  threading_mutex_unlock( &(coalescer->lock) );
+
+  for( i = 0; i < count; i++ )
+    releaseEvent( coalescer->pending.events[ i ] );
+
+  releaseCoalescer( coalescer );
+}
+
+static void releaseCoalescer( Coalescer coalescer )
+{
+  if( atomic_addInt( &(coalescer->refCount), -1 ) != 0 )
+    return;
+
+  threading_mutex_destroy( &(coalescer->callLock) );
+  threading_mutex_destroy( &(coalescer->lock) );
+  free( coalescer->pending.events );
+  free( coalescer->pending.eventData );
+  free( coalescer->spare.events );
+  free( coalescer->spare.eventData );
+  free( coalescer );
+}
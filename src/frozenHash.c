@@ -0,0 +1,581 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   frozenHash.c -- minimal perfect hash snapshots of hash tables
+
+   The keys are hashed to 64 bits with HashBytes64 and split into buckets
+   of about FROZEN_BUCKET_LOAD keys each. Every bucket has a pilot value,
+   and a key's slot is found by mixing its hash with the pilot of its
+   bucket. The pilots are found when the snapshot is built, by trying
+   0, 1, 2, ... for each bucket, largest buckets first, until all its keys
+   land in slots that are still free ("hash and displace"). Lookups then
+   compute one slot and compare one key.
+
+   The image is laid out as follows, with every part aligned to eight
+   bytes so that it can be used directly from a mapped file:
+
+     sFrozenHeader
+     uint32_t pilots[ bucketCount ]
+     sFrozenSlot slots[ elementCount ]
+     the records: for each element its sFrozenRecord, key and value
+*/
+
+#include <voxi/util/config.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <voxi/util/win32_glue.h>
+#else
+#include <sys/mman.h>
+#endif /* WIN32 */
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/err.h>
+#include <voxi/util/mem.h>
+
+#include <voxi/util/frozenHash.h>
+
+CVSID("$Id$");
+
+/* --------- Definitions */
+
+/* "VXFH", which reads differently on a machine with another byte order */
+#define FROZEN_MAGIC 0x56584648UL
+#define FROZEN_VERSION 1
+
+/* mean number of keys per bucket */
+#define FROZEN_BUCKET_LOAD 3
+
+/* number of seeds tried before HashFreeze gives up */
+#define FROZEN_MAX_ATTEMPTS 8
+
+#define FROZEN_ALIGN( size ) (((size) + 7) & ~((size_t) 7))
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t elementCount;
+  uint32_t bucketCount;
+  uint64_t seed;
+  uint64_t slotsOffset;
+  uint64_t size;        /* of the whole image */
+} sFrozenHeader;
+
+typedef struct
+{
+  uint64_t hashValue;
+  uint64_t recordOffset;
+} sFrozenSlot;
+
+/* followed by the key, padded to eight bytes, and the value */
+typedef struct
+{
+  uint32_t keyLength;
+  uint32_t valueLength;
+} sFrozenRecord;
+
+struct sHashFrozen
+{
+  unsigned char *image;
+  size_t size;
+  Boolean isMapped;
+
+  const sFrozenHeader *header;
+  const uint32_t *pilots;
+  const sFrozenSlot *slots;
+};
+
+/* what HashFreeze needs to know about each element while it builds */
+typedef struct
+{
+  const void *key;
+  size_t keyLength;
+  const void *value;
+  size_t valueLength;
+  uint64_t hashValue;
+  uint32_t bucket;
+} sFrozenItem, *FrozenItem;
+
+/* --------- Static function declarations */
+
+static uint32_t reduce( uint64_t value, uint32_t range );
+static uint32_t slotIndex( uint64_t hashValue, uint32_t pilot,
+                           uint32_t slotCount );
+static Boolean findPilots( FrozenItem items, uint32_t count,
+                           uint32_t bucketCount, uint32_t *pilots,
+                           uint32_t *itemSlots );
+static void setPointers( HashFrozen frozen );
+
+/* --------- Help functions */
+
+/* maps the top 32 bits of value evenly on 0..range-1 */
+static uint32_t reduce( uint64_t value, uint32_t range )
+{
+  return (uint32_t) (((value >> 32) * range) >> 32);
+}
+
+static uint32_t slotIndex( uint64_t hashValue, uint32_t pilot,
+                           uint32_t slotCount )
+{
+  return reduce( HashMix64( hashValue, pilot ), slotCount );
+}
+
+/*
+   Finds a pilot for each bucket so that every item gets a slot of its
+   own, and stores the slots in itemSlots. Returns FALSE if some bucket
+   has no working pilot, such as when two items have the same hash value.
+*/
+static Boolean findPilots( FrozenItem items, uint32_t count,
+                           uint32_t bucketCount, uint32_t *pilots,
+                           uint32_t *itemSlots )
+{
+  uint32_t *bucketStarts = NULL, *bucketItems = NULL, *order = NULL;
+  uint32_t *sizeCounts = NULL, *sortedSlots = NULL;
+  uint64_t *sortedHashes = NULL;
+  unsigned char *taken = NULL;
+  uint32_t i, j, b, size, maxSize, pilot, maxPilot;
+  Boolean success = FALSE;
+
+  if( count == 0 )
+    return TRUE;
+
+  bucketStarts = (uint32_t *) calloc( bucketCount + 1, sizeof( uint32_t ) );
+  bucketItems = (uint32_t *) malloc( count * sizeof( uint32_t ) );
+  order = (uint32_t *) malloc( bucketCount * sizeof( uint32_t ) );
+  sortedHashes = (uint64_t *) malloc( count * sizeof( uint64_t ) );
+  sortedSlots = (uint32_t *) malloc( count * sizeof( uint32_t ) );
+  /* a bit per slot */
+  taken = (unsigned char *) calloc( count / 8 + 1, 1 );
+  if( (bucketStarts == NULL) || (bucketItems == NULL) || (order == NULL) ||
+      (sortedHashes == NULL) || (sortedSlots == NULL) || (taken == NULL) )
+    goto ERR_RETURN;
+
+  /* group the items by bucket */
+  for( i = 0; i < count; i++ )
+    bucketStarts[ items[ i ].bucket + 1 ]++;
+  for( b = 0; b < bucketCount; b++ )
+    bucketStarts[ b + 1 ] += bucketStarts[ b ];
+  for( i = 0; i < count; i++ )
+    bucketItems[ bucketStarts[ items[ i ].bucket ]++ ] = i;
+  for( b = bucketCount; b > 0; b-- )
+    bucketStarts[ b ] = bucketStarts[ b - 1 ];
+  bucketStarts[ 0 ] = 0;
+
+  /* the pilot search below then reads the hash values in sequence */
+  for( i = 0; i < count; i++ )
+    sortedHashes[ i ] = items[ bucketItems[ i ] ].hashValue;
+
+  /* order the buckets by decreasing size */
+  for( b = 0, maxSize = 0; b < bucketCount; b++ )
+    maxSize = MAX( maxSize, bucketStarts[ b + 1 ] - bucketStarts[ b ] );
+
+  sizeCounts = (uint32_t *) calloc( maxSize + 2, sizeof( uint32_t ) );
+  if( sizeCounts == NULL )
+    goto ERR_RETURN;
+
+  for( b = 0; b < bucketCount; b++ )
+    sizeCounts[ maxSize - (bucketStarts[ b + 1 ] - bucketStarts[ b ]) + 1 ]++;
+  for( size = 0; size <= maxSize; size++ )
+    sizeCounts[ size + 1 ] += sizeCounts[ size ];
+  for( b = 0; b < bucketCount; b++ )
+    order[ sizeCounts[ maxSize - (bucketStarts[ b + 1 ] -
+                                  bucketStarts[ b ]) ]++ ] = b;
+
+  /*
+     The last buckets placed have few free slots to choose from, the very
+     last one about 1 in count. Give up well beyond that.
+  */
+  maxPilot = (count < 0x1000000) ? count * 64 + 1024 : 0xffffffffUL;
+
+  for( j = 0; j < bucketCount; j++ )
+  {
+    uint32_t first, end;
+
+    b = order[ j ];
+    first = bucketStarts[ b ];
+    end = bucketStarts[ b + 1 ];
+
+    pilots[ b ] = 0;
+    if( first == end )
+      continue;
+
+    for( pilot = 0; pilot < maxPilot; pilot++ )
+    {
+      for( i = first; i < end; i++ )
+      {
+        uint32_t slot = slotIndex( sortedHashes[ i ], pilot, count );
+
+        if( taken[ slot >> 3 ] & (1 << (slot & 7)) )
+          break;
+        taken[ slot >> 3 ] |= (unsigned char) (1 << (slot & 7));
+        sortedSlots[ i ] = slot;
+      }
+
+      if( i == end )
+        break;
+
+      /* release the slots this pilot took before the collision */
+      while( i > first )
+      {
+        i--;
+        taken[ sortedSlots[ i ] >> 3 ] &= 
+          (unsigned char) ~(1 << (sortedSlots[ i ] & 7));
+      }
+    }
+
+    if( pilot == maxPilot )
+      goto ERR_RETURN;
+
+    pilots[ b ] = pilot;
+  }
+
+  for( i = 0; i < count; i++ )
+    itemSlots[ bucketItems[ i ] ] = sortedSlots[ i ];
+
+  success = TRUE;
+
+ ERR_RETURN:
+  free( bucketStarts );
+  free( bucketItems );
+  free( order );
+  free( sizeCounts );
+  free( sortedHashes );
+  free( sortedSlots );
+  free( taken );
+
+  return success;
+}
+
+static void setPointers( HashFrozen frozen )
+{
+  frozen->header = (const sFrozenHeader *) frozen->image;
+  frozen->pilots = (const uint32_t *) (frozen->image +
+                                       sizeof( sFrozenHeader ));
+  frozen->slots = (const sFrozenSlot *) (frozen->image +
+                                         frozen->header->slotsOffset);
+}
+
+/* ----------------------- */
+
+Error HashFreeze( HashTable ht, HashFreezeFuncPtr describe,
+                  HashFrozen *frozen )
+{
+  Error error = NULL;
+  HashTableCursor cursor;
+  FrozenItem items = NULL;
+  uint32_t *itemSlots = NULL;
+  uint32_t count, bucketCount, i;
+  uint64_t seed = 0;
+  size_t size, slotsOffset, offset;
+  sFrozenHeader *header;
+  uint32_t *pilots;
+  sFrozenSlot *slots;
+  int attempt;
+
+  ErrPushFunc( "HashFreeze" );
+
+  *frozen = NULL;
+
+  count = (uint32_t) HashGetElementCount( ht );
+  bucketCount = count / FROZEN_BUCKET_LOAD + 1;
+
+  items = (FrozenItem) malloc( (count + 1) * sizeof( sFrozenItem ) );
+  itemSlots = (uint32_t *) malloc( (count + 1) * sizeof( uint32_t ) );
+  if( (items == NULL) || (itemSlots == NULL) )
+    goto OUT_OF_MEMORY;
+
+  cursor = HashCursorCreate( ht );
+  if( cursor == NULL )
+    goto OUT_OF_MEMORY;
+
+  /* the records follow the slots */
+  slotsOffset = FROZEN_ALIGN( sizeof( sFrozenHeader ) +
+                              bucketCount * sizeof( uint32_t ) );
+  size = slotsOffset + count * sizeof( sFrozenSlot );
+
+  for( i = 0; !HashCursorPastLastElement( cursor );
+       HashCursorGoNext( cursor ) )
+  {
+    assert( i < count );
+
+    describe( HashCursorGetElement( cursor ),
+              &(items[ i ].key), &(items[ i ].keyLength),
+              &(items[ i ].value), &(items[ i ].valueLength) );
+
+    size += sizeof( sFrozenRecord ) + FROZEN_ALIGN( items[ i ].keyLength ) +
+      FROZEN_ALIGN( items[ i ].valueLength );
+    i++;
+  }
+  HashCursorDestroy( cursor );
+
+  assert( i == count );
+
+  *frozen = (HashFrozen) malloc( sizeof( struct sHashFrozen ) );
+  if( *frozen == NULL )
+    goto OUT_OF_MEMORY;
+
+  (*frozen)->image = (unsigned char *) calloc( size, 1 );
+  if( (*frozen)->image == NULL )
+    goto OUT_OF_MEMORY;
+  (*frozen)->size = size;
+  (*frozen)->isMapped = FALSE;
+
+  header = (sFrozenHeader *) (*frozen)->image;
+  pilots = (uint32_t *) ((*frozen)->image + sizeof( sFrozenHeader ));
+  slots = (sFrozenSlot *) ((*frozen)->image + slotsOffset);
+
+  for( attempt = 0; attempt < FROZEN_MAX_ATTEMPTS; attempt++ )
+  {
+    seed = HashNewSeed();
+
+    for( i = 0; i < count; i++ )
+    {
+      items[ i ].hashValue = HashBytes64( items[ i ].key,
+                                          items[ i ].keyLength, seed );
+      items[ i ].bucket = reduce( items[ i ].hashValue << 32, bucketCount );
+    }
+
+    if( findPilots( items, count, bucketCount, pilots, itemSlots ) )
+      break;
+  }
+
+  if( attempt == FROZEN_MAX_ATTEMPTS )
+  {
+    error = ErrNew( ERR_APP, 0, NULL, "No perfect hash function found for "
+                    "%lu keys; are they unique?", (unsigned long) count );
+    goto ERR_RETURN;
+  }
+
+  header->magic = FROZEN_MAGIC;
+  header->version = FROZEN_VERSION;
+  header->elementCount = count;
+  header->bucketCount = bucketCount;
+  header->seed = seed;
+  header->slotsOffset = slotsOffset;
+  header->size = size;
+
+  offset = slotsOffset + count * sizeof( sFrozenSlot );
+  for( i = 0; i < count; i++ )
+  {
+    sFrozenRecord *record = (sFrozenRecord *) ((*frozen)->image + offset);
+    unsigned char *key = (unsigned char *) (record + 1);
+
+    record->keyLength = (uint32_t) items[ i ].keyLength;
+    record->valueLength = (uint32_t) items[ i ].valueLength;
+    memcpy( key, items[ i ].key, items[ i ].keyLength );
+    memcpy( key + FROZEN_ALIGN( items[ i ].keyLength ), items[ i ].value,
+            items[ i ].valueLength );
+
+    slots[ itemSlots[ i ] ].hashValue = items[ i ].hashValue;
+    slots[ itemSlots[ i ] ].recordOffset = offset;
+
+    offset += sizeof( sFrozenRecord ) + FROZEN_ALIGN( items[ i ].keyLength ) +
+      FROZEN_ALIGN( items[ i ].valueLength );
+  }
+  assert( offset == size );
+
+  setPointers( *frozen );
+  goto ERR_RETURN;
+
+ OUT_OF_MEMORY:
+  error = ErrNew( ERR_MEMORY, MEMERR_OUT, NULL, "Out of memory when "
+                  "freezing a hash table of %d elements",
+                  HashGetElementCount( ht ) );
+
+ ERR_RETURN:
+  free( items );
+  free( itemSlots );
+  if( (error != NULL) && (*frozen != NULL) )
+  {
+    free( (*frozen)->image );
+    free( *frozen );
+    *frozen = NULL;
+  }
+
+  ErrPopFunc();
+  return error;
+}
+
+Error HashFrozenSave( HashFrozen frozen, const char *fileName )
+{
+  Error error = NULL;
+  FILE *file;
+
+  ErrPushFunc( "HashFrozenSave" );
+
+  file = fopen( fileName, "wb" );
+  if( file == NULL )
+  {
+    error = ErrNew( ERR_UNKNOWN, 0, ErrErrno(),
+                    "fopen( \"%s\", \"wb\" ) failed.", fileName );
+    goto ERR_RETURN;
+  }
+
+  if( fwrite( frozen->image, 1, frozen->size, file ) != frozen->size )
+    error = ErrNew( ERR_UNKNOWN, 0, ErrErrno(),
+                    "Failed to write \"%s\".", fileName );
+
+  if( (fclose( file ) != 0) && (error == NULL) )
+    error = ErrNew( ERR_UNKNOWN, 0, ErrErrno(),
+                    "Failed to write \"%s\".", fileName );
+
+ ERR_RETURN:
+  ErrPopFunc();
+  return error;
+}
+
+Error HashFrozenMap( const char *fileName, HashFrozen *frozen )
+{
+  Error error = NULL;
+  FILE *file;
+  long size;
+  void *image;
+  const sFrozenHeader *header;
+
+  ErrPushFunc( "HashFrozenMap" );
+
+  *frozen = NULL;
+
+  file = fopen( fileName, "rb" );
+  if( file == NULL )
+  {
+    error = ErrNew( ERR_UNKNOWN, 0, ErrErrno(),
+                    "fopen( \"%s\", \"rb\" ) failed.", fileName );
+    goto ERR_RETURN;
+  }
+
+  if( (fseek( file, 0, SEEK_END ) != 0) || ((size = ftell( file )) < 0) )
+  {
+    error = ErrNew( ERR_UNKNOWN, 0, ErrErrno(),
+                    "Failed to get the size of \"%s\".", fileName );
+    fclose( file );
+    goto ERR_RETURN;
+  }
+
+  if( (size_t) size < sizeof( sFrozenHeader ) )
+  {
+    error = ErrNew( ERR_APP, 0, NULL, "\"%s\" is not a frozen hash table.",
+                    fileName );
+    fclose( file );
+    goto ERR_RETURN;
+  }
+
+  image = mmap( NULL, (size_t) size, PROT_READ, MAP_SHARED, fileno( file ),
+                0 );
+  fclose( file );
+  if( image == (void *) MAP_FAILED )
+  {
+    error = ErrNew( ERR_UNKNOWN, 0, ErrErrno(),
+                    "Failed to map \"%s\".", fileName );
+    goto ERR_RETURN;
+  }
+
+  /* 
+     Only the parts read before the records are checked here. HashFrozenFind
+     checks each record it reads, so a corrupt file cannot make it read 
+     outside the mapping.
+  */
+  header = (const sFrozenHeader *) image;
+  if( (header->magic != FROZEN_MAGIC) ||
+      (header->version != FROZEN_VERSION) ||
+      (header->size != (uint64_t) size) ||
+      (header->slotsOffset !=
+       FROZEN_ALIGN( sizeof( sFrozenHeader ) +
+                     header->bucketCount * (uint64_t) sizeof( uint32_t ) )) ||
+      (header->slotsOffset +
+       header->elementCount * (uint64_t) sizeof( sFrozenSlot ) >
+       (uint64_t) size) )
+  {
+    error = ErrNew( ERR_APP, 0, NULL, "\"%s\" is not a frozen hash table "
+                    "of this version and byte order.", fileName );
+    munmap( image, (size_t) size );
+    goto ERR_RETURN;
+  }
+
+  *frozen = (HashFrozen) malloc( sizeof( struct sHashFrozen ) );
+  if( *frozen == NULL )
+  {
+    error = ErrNew( ERR_MEMORY, MEMERR_OUT, NULL, "Out of memory when "
+                    "mapping \"%s\"", fileName );
+    munmap( image, (size_t) size );
+    goto ERR_RETURN;
+  }
+
+  (*frozen)->image = (unsigned char *) image;
+  (*frozen)->size = (size_t) size;
+  (*frozen)->isMapped = TRUE;
+  setPointers( *frozen );
+
+ ERR_RETURN:
+  ErrPopFunc();
+  return error;
+}
+
+void HashFrozenDestroy( HashFrozen frozen )
+{
+  if( frozen->isMapped )
+    munmap( frozen->image, frozen->size );
+  else
+    free( frozen->image );
+
+  free( frozen );
+}
+
+int HashFrozenGetElementCount( HashFrozen frozen )
+{
+  return (int) frozen->header->elementCount;
+}
+
+const void *HashFrozenFind( HashFrozen frozen, const void *key,
+                            size_t keyLength, size_t *valueLength )
+{
+  const sFrozenHeader *header = frozen->header;
+  const sFrozenSlot *slot;
+  const sFrozenRecord *record;
+  const unsigned char *recordKey;
+  uint64_t hashValue;
+  uint32_t bucket;
+
+  if( header->elementCount == 0 )
+    return NULL;
+
+  hashValue = HashBytes64( key, keyLength, header->seed );
+  bucket = reduce( hashValue << 32, header->bucketCount );
+  slot = &(frozen->slots[ slotIndex( hashValue, frozen->pilots[ bucket ],
+                                     header->elementCount ) ]);
+
+  if( slot->hashValue != hashValue )
+    return NULL;
+
+  /* the record must lie within the image, in case the file is corrupt */
+  if( (slot->recordOffset > frozen->size - sizeof( sFrozenRecord )) ||
+      ((slot->recordOffset & 7) != 0) )
+    return NULL;
+
+  record = (const sFrozenRecord *) (frozen->image + slot->recordOffset);
+  recordKey = (const unsigned char *) (record + 1);
+
+  if( FROZEN_ALIGN( (uint64_t) record->keyLength ) + record->valueLength >
+      frozen->size - sizeof( sFrozenRecord ) - slot->recordOffset )
+    return NULL;
+
+  if( (record->keyLength != keyLength) ||
+      (memcmp( recordKey, key, keyLength ) != 0) )
+    return NULL;
+
+  if( valueLength != NULL )
+    *valueLength = record->valueLength;
+
+  return recordKey + FROZEN_ALIGN( keyLength );
+}
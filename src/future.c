@@ -0,0 +1,424 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   future.c -- futures with callbacks
+
+   The state word is FUTURE_DONE once the result is set, and has the
+   FUTURE_WAITERS bit set while threads may be sleeping on it. The result
+   is written before the word, so a thread that sees FUTURE_DONE sees the
+   result.
+
+   Callbacks are pushed on a lock-free stack. Completing the future swaps
+   the stack for CLOSED; a callback that finds the stack closed runs at
+   once instead. The completing thread reverses the stack, so that
+   callbacks run in the order they were added.
+
+   Futures and callback records are both taken from a cache of free
+   blocks kept per thread. A block goes back to the cache of the thread
+   that drops the last reference, so a thread that only completes futures
+   fills its cache and frees the rest.
+*/
+
+#include <voxi/util/config.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <voxi/util/win32_glue.h>
+#endif /* WIN32 */
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/err.h>
+#include <voxi/util/mem.h>
+#include <voxi/util/threading.h>
+#include <voxi/util/time.h>
+
+#include <voxi/util/future.h>
+
+CVSID("$Id$");
+
+/* --------- Definitions */
+
+#define FUTURE_PENDING 0
+#define FUTURE_WAITERS 1
+#define FUTURE_DONE    2
+
+/* The most free blocks a thread keeps */
+#define BLOCK_CACHE_SIZE 64
+
+typedef struct sContinuation
+{
+  FutureCallback callback;
+  void *userData;
+  struct sContinuation *next;
+} sContinuation, *Continuation;
+
+struct sFuture
+{
+  volatile int state;
+  volatile int refCount;
+  void *result;
+  Continuation volatile continuations;
+
+  /* for future_createTask */
+  ThreadFunc func;
+  void *args;
+
+  /* for future_whenAll: completions left, plus one while it is set up */
+  volatile int remaining;
+};
+
+typedef union uBlock
+{
+  struct sFuture future;
+  sContinuation continuation;
+  union uBlock *next;
+} uBlock, *Block;
+
+typedef struct
+{
+  Block first;
+  int count;
+} sBlockCache, *BlockCache;
+
+/* the marker for a continuation stack that takes no more pushes */
+static sContinuation closedContinuations;
+#define CLOSED (&closedContinuations)
+
+/* --------- Static data */
+
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t cacheKey;
+
+/* --------- Help functions */
+
+static void freeCache( void *data )
+{
+  BlockCache cache = data;
+  Block block, next;
+
+  for( block = cache->first; block != NULL; block = next )
+  {
+    next = block->next;
+    free( block );
+  }
+
+  free( cache );
+}
+
+static void createCacheKey( void )
+{
+  int err;
+
+  err = pthread_key_create( &cacheKey, freeCache );
+  assert( err == 0 );
+}
+
+static BlockCache getCache( void )
+{
+  BlockCache cache;
+
+  pthread_once( &cacheKeyOnce, createCacheKey );
+
+  cache = pthread_getspecific( cacheKey );
+  if( cache == NULL )
+  {
+    cache = malloc( sizeof( sBlockCache ) );
+    if( cache == NULL )
+      return NULL;
+
+    cache->first = NULL;
+    cache->count = 0;
+    pthread_setspecific( cacheKey, cache );
+  }
+
+  return cache;
+}
+
+static void *allocBlock( void )
+{
+  BlockCache cache = getCache();
+  Block block;
+
+  if( (cache != NULL) && (cache->first != NULL) )
+  {
+    block = cache->first;
+    cache->first = block->next;
+    cache->count--;
+    return block;
+  }
+
+  return malloc( sizeof( uBlock ) );
+}
+
+static void freeBlock( void *data )
+{
+  BlockCache cache = getCache();
+  Block block = data;
+
+  if( (cache == NULL) || (cache->count >= BLOCK_CACHE_SIZE) )
+  {
+    free( block );
+    return;
+  }
+
+  block->next = cache->first;
+  cache->first = block;
+  cache->count++;
+}
+
+/* Runs the callback at once if the future has already completed */
+static void addContinuation( Future future, Continuation continuation )
+{
+  Continuation first;
+
+  for( ;; )
+  {
+    first = atomic_loadPtr( (void * volatile *) &(future->continuations) );
+    if( first == CLOSED )
+    {
+      continuation->callback( future, future->result,
+                              continuation->userData );
+      freeBlock( continuation );
+      return;
+    }
+
+    continuation->next = first;
+    if( atomic_casPtr( (void * volatile *) &(future->continuations), first,
+                       continuation ) )
+      return;
+  }
+}
+
+static void whenAllStep( Future future, void *result, void *userData )
+{
+  Future all = userData;
+
+  (void) future;
+  (void) result;
+
+  if( atomic_addInt( &(all->remaining), -1 ) == 0 )
+    future_complete( all, NULL );
+}
+
+/* ----------------------- */
+
+Future future_create( void )
+{
+  Future future = allocBlock();
+
+  if( future == NULL )
+    return NULL;
+
+  future->state = FUTURE_PENDING;
+  future->refCount = 2;
+  future->result = NULL;
+  future->continuations = NULL;
+  future->func = NULL;
+  future->args = NULL;
+  future->remaining = 0;
+
+  return future;
+}
+
+Future future_createTask( ThreadFunc func, void *args )
+{
+  Future future;
+
+  assert( func != NULL );
+
+  future = future_create();
+  if( future != NULL )
+  {
+    future->func = func;
+    future->args = args;
+  }
+
+  return future;
+}
+
+void *future_runTask( void *data )
+{
+  Future future = data;
+
+  future_complete( future, future->func( future->args ) );
+
+  return NULL;
+}
+
+void future_complete( Future future, void *result )
+{
+  Continuation list, reversed = NULL, next;
+
+  future->result = result;
+  if( atomic_exchangeInt( &(future->state), FUTURE_DONE ) & FUTURE_WAITERS )
+    threading_word_wake( &(future->state), THREADING_WORD_WAKE_ALL );
+
+  list = atomic_exchangePtr( (void * volatile *) &(future->continuations),
+                             CLOSED );
+  assert( list != CLOSED );
+
+  for( ; list != NULL; list = next )
+  {
+    next = list->next;
+    list->next = reversed;
+    reversed = list;
+  }
+
+  for( ; reversed != NULL; reversed = next )
+  {
+    next = reversed->next;
+    reversed->callback( future, result, reversed->userData );
+    freeBlock( reversed );
+  }
+
+  future_release( future );
+}
+
+void future_retain( Future future )
+{
+  atomic_addInt( &(future->refCount), 1 );
+}
+
+void future_release( Future future )
+{
+  if( atomic_addInt( &(future->refCount), -1 ) == 0 )
+    freeBlock( future );
+}
+
+Boolean future_poll( Future future, void **result )
+{
+  if( (atomic_loadInt( &(future->state) ) & FUTURE_DONE) == 0 )
+    return FALSE;
+
+  if( result != NULL )
+    *result = future->result;
+
+  return TRUE;
+}
+
+void *future_wait( Future future )
+{
+  int state;
+
+  for( ;; )
+  {
+    state = atomic_loadInt( &(future->state) );
+    if( state & FUTURE_DONE )
+      break;
+
+    if( ((state & FUTURE_WAITERS) == 0) &&
+        !atomic_casInt( &(future->state), state, state | FUTURE_WAITERS ) )
+      continue;
+
+    threading_word_wait( &(future->state), state | FUTURE_WAITERS );
+  }
+
+  return future->result;
+}
+
+Boolean future_waitTimeout( Future future, unsigned long usec, void **result )
+{
+  uint64_t deadline, now;
+  int state;
+
+  deadline = nanosec() + (uint64_t) usec * 1000;
+
+  for( ;; )
+  {
+    state = atomic_loadInt( &(future->state) );
+    if( state & FUTURE_DONE )
+      break;
+
+    now = nanosec();
+    if( now >= deadline )
+      return FALSE;
+
+    if( ((state & FUTURE_WAITERS) == 0) &&
+        !atomic_casInt( &(future->state), state, state | FUTURE_WAITERS ) )
+      continue;
+
+    threading_word_timedwait( &(future->state), state | FUTURE_WAITERS,
+                              (unsigned long) ((deadline - now) / 1000) );
+  }
+
+  if( result != NULL )
+    *result = future->result;
+
+  return TRUE;
+}
+
+Error future_then( Future future, FutureCallback callback, void *userData )
+{
+  Continuation continuation;
+
+  assert( callback != NULL );
+
+  continuation = allocBlock();
+  if( continuation == NULL )
+    return ErrNew( ERR_MEMORY, MEMERR_OUT, NULL,
+                   "future_then: out of memory." );
+
+  continuation->callback = callback;
+  continuation->userData = userData;
+  addContinuation( future, continuation );
+
+  return NULL;
+}
+
+Future future_whenAll( Future *futures, int count )
+{
+  Continuation continuations = NULL, continuation;
+  Future all;
+  int i;
+
+  assert( count >= 0 );
+
+  all = future_create();
+  if( all == NULL )
+    return NULL;
+
+  /* Allocate everything first, so that nothing is attached on failure */
+  for( i = 0; i < count; i++ )
+  {
+    continuation = allocBlock();
+    if( continuation == NULL )
+    {
+      for( ; continuations != NULL; continuations = continuation )
+      {
+        continuation = continuations->next;
+        freeBlock( continuations );
+      }
+      freeBlock( all );
+      return NULL;
+    }
+
+    continuation->callback = whenAllStep;
+    continuation->userData = all;
+    continuation->next = continuations;
+    continuations = continuation;
+  }
+
+  all->remaining = count + 1;
+
+  for( i = 0; i < count; i++ )
+  {
+    continuation = continuations;
+    continuations = continuation->next;
+    addContinuation( futures[ i ], continuation );
+  }
+
+  /* Drop the setup count; completes at once if all futures were done */
+  whenAllStep( NULL, NULL, all );
+
+  return all;
+}
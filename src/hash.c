@@ -25,15 +25,24 @@
       
       WARNING: semaphores made conditional on _POSIX_SEMAPHORES 2002-03-15.
       Will the cursor stuff still work properly if we don't have semaphores?
+
+      The per-element cursor lists and their semaphores have been replaced
+      by a generation counter in the table, and the elements are allocated
+      from a per-table free list rather than with malloc for each HashAdd.
 */
 
 #include <voxi/util/config.h>
 
 #include <assert.h>
-#include <ctype.h> /* for tolower */
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h> /* for perror */
+#include <string.h>
+#include <time.h> /* for seeding */
+
+#if defined( _MSC_VER ) && (defined( _M_IX86 ) || defined( _M_X64 ))
+#include <xmmintrin.h> /* for _mm_prefetch */
+#endif
 
 #if HAVE_UNISTD_H
 #include <unistd.h> /* For POSIX-feature definitions on unix-like systems */
@@ -43,19 +52,9 @@
 #include <voxi/util/win32_glue.h>
 #endif /* WIN32 */
 
-#if HAVE_PTHREAD_H
-/* Needed for semaphores. POSIX-feature defs are here on some platforms. */
-#include <pthread.h>
-#endif
-
-#if HAVE_SEMAPHORE_H
-/* POSIX-feature defs are also here on some platforms. */
-#include <semaphore.h>  
-#endif
-
 #include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
 #include <voxi/util/err.h>
-#include <voxi/util/threading.h>
 
 #include <voxi/util/hash.h>
 
@@ -66,26 +65,94 @@ CVSID("$Id: hash.c 6744 2009-11-19 15:54:29Z mst $");
 typedef struct HiPtr {
   struct HiPtr *next;
   void *data;
-
-  /* a semaphore on the element. The element may not be removed from the 
-     hashtable without first setting this semaphore.
- 
-     Not Implemented Yet (tm)
+  /* as returned by calcIndx, compared before compData is called */
+  unsigned int hashValue;
+  /* 
+     Incremented each time the node is freed, so that a cursor can tell 
+     the element it was on from a new one that got the same node.
   */
-  /* sem_t semaphore; */
+  unsigned int reuse;
+} *HashInfoPtr;
 
-  /* This value is set to non-NULL if there is a cursor pointing to this 
-     element. This information is neccessary in case the element is deleted
-     while the cursor is traversing the hash table. 
- 
-     The cursors are in a linked list.
-     This list is protected by a monitor which all accesses must respect.
-  */
-#if defined (_POSIX_SEMAPHORES) && defined (_POSIX_THREADS) 
-  sem_t cursorListSemaphore;
+/* 
+   Elements are allocated this many at a time. Removed elements are put on
+   the table's free list and reused by later HashAdds. The blocks are only
+   freed by HashDestroyTable.
+*/
+#define HASH_NODE_BLOCK_SIZE 64
+
+typedef struct sHashNodeBlock
+{
+  struct sHashNodeBlock *next;
+  struct HiPtr nodes[ HASH_NODE_BLOCK_SIZE ];
+} sHashNodeBlock, *HashNodeBlock;
+
+/*
+  A slot in the open addressing array used by tables created with 
+  HashCreateTableDynamic. data is NULL for a never used slot and 
+  HASH_TOMBSTONE for a slot whose element has been removed. Tables created
+  with HashCreateTableCompact use it for their entries.
+*/
+typedef struct sHashSlot
+{
+  void *data;
+  unsigned int hashValue; /* as returned by calcIndx, valid if data is live */
+} sHashSlot, *HashSlot;
+
+#define HASH_TOMBSTONE ((void *) &hashTombstone)
+
+/* 
+   A dynamic table never gets fuller than this, regardless of the load factor
+   given at creation. 
+*/
+#define HASH_MAX_LOAD_FACTOR 0.9f
+#define HASH_DEFAULT_LOAD_FACTOR 0.75f
+#define HASH_MIN_DYNAMIC_SIZE 8
+
+/* number of old slots moved to the new array by each HashAdd/HashDelete */
+#define HASH_REHASH_STEP 16
+
+/* entryIndex values of compact tables that do not refer to an entry */
+#define HASH_INDEX_EMPTY (-1)
+#define HASH_INDEX_REMOVED (-2)
+
+/* the home slot of hashValue in a dynamic table slot array of 2^bits slots */
+#define HASH_SLOT_INDEX( ht, hashValue, bits ) \
+  ((unsigned int) (HashMix64( (hashValue), (ht)->seed ) >> (64 - (bits))))
+
+/* number of lookups HashFindMany has in flight at a time */
+#define HASH_FIND_BATCH 16
+/*
+   Smaller tables are likely to be in the cache already, and HashFindMany
+   just looks the keys up one by one.
+*/
+#define HASH_FIND_BATCH_MIN_ELEMENTS 16384
+
+/* hint to the CPU to start loading the cache line at address */
+#if defined( __GNUC__ )
+#  define HASH_PREFETCH( address ) __builtin_prefetch( (address) )
+#elif defined( _MSC_VER ) && (defined( _M_IX86 ) || defined( _M_X64 ))
+#  define HASH_PREFETCH( address ) \
+  _mm_prefetch( (const char *) (address), _MM_HINT_T0 )
+#else
+#  define HASH_PREFETCH( address ) ((void) 0)
+#endif
+
+/* increments one of the lookup counters of ht if they are compiled in */
+#ifdef HASH_STATS
+#  define HASH_COUNT( ht, counter ) ((ht)->counter++)
+#else
+#  define HASH_COUNT( ht, counter ) ((void) 0)
 #endif
-  HashTableCursor firstCursor;
-} *HashInfoPtr;
+
+/* 
+   Constants for the 64 bit hash functions (the same as in wyhash, 
+   a public domain hash function by Wang Yi).
+*/
+#define HASH_SECRET0 0xa0761d6478bd642fULL
+#define HASH_SECRET1 0xe7037ed1a0b428dbULL
+#define HASH_SECRET2 0x8ebc6af09c88c6e3ULL
+#define HASH_SECRET3 0x589965cc75374cc3ULL
 
 struct Hasht 
 {
@@ -99,6 +166,76 @@ struct Hasht
   DestroyFuncPtr destrData;  
   
   int debugLevel;
+
+  /* 
+     Random for each table. The values from calcIndx are mixed with it
+     before the bucket is selected from the high bits of the result.
+  */
+  uint64_t seed;
+
+  /* 
+     Incremented each time an element is removed. A cursor that sees a new 
+     generation checks that its element is still in the table before 
+     following its next pointer.
+  */
+  unsigned long generation;
+
+  HashInfoPtr freeNodes;
+  HashNodeBlock nodeBlocks;
+
+  /*
+    The fields below are only used by tables created with 
+    HashCreateTableDynamic. 
+
+    While the table is being resized, the elements are spread over two
+    arrays. oldSlots holds the elements that have not yet been moved to 
+    slots; the old slots from migrateIndex and up are still to be moved. 
+    Each HashAdd/HashDelete moves a few more of them, so no single call pays 
+    for the whole rehash.
+  */
+  Boolean isDynamic;
+  float maxLoadFactor;
+
+  HashSlot slots;
+  unsigned int capacity;  /* always a power of two */
+  unsigned int capacityBits;
+  unsigned int usedSlots; /* live elements and tombstones in slots */
+
+  HashSlot oldSlots;
+  unsigned int oldCapacity;
+  unsigned int oldCapacityBits;
+  unsigned int oldCount;  /* live elements in oldSlots */
+  unsigned int migrateIndex;
+
+  /*
+    The fields below are only used by tables created with 
+    HashCreateTableCompact.
+
+    The elements are kept in entries, in the order they were added. A 
+    removed element leaves an entry with NULL data behind, which is only 
+    squeezed out when the table is resized with no cursors open. 
+    entryIndex is an open addressing array of 2^indexBits positions in 
+    entries, found the same way as the slots of a dynamic table.
+  */
+  Boolean isCompact;
+  HashSlot entries;
+  unsigned int entryCount;    /* used entries, including removed ones */
+  unsigned int entryCapacity;
+  int *entryIndex;
+  unsigned int indexBits;
+
+  /* 
+     Open cursors of dynamic and compact tables. Moving elements is 
+     postponed while there are any.
+  */
+  HashTableCursor firstCursor;
+
+#ifdef HASH_STATS
+  /* see sHashStats in hash.h */
+  unsigned long lookups;
+  unsigned long probes;
+  unsigned long compares;
+#endif
   
   HashInfoPtr infoArray[0];
 };
@@ -107,38 +244,89 @@ struct sHashTableCursor
 {
   HashTable hashTable;
 
-  /* all cursors pointing to an HashInfoPtr are in a double-linked list for 
-     that element.
-  */
- 
+  /* the open cursors of a dynamic or compact table are in a double-linked
+     list */
   HashTableCursor nextCursor;
   HashTableCursor prevCursor;
 
+  /* 
+     For dynamic tables, hashIndex counts the slots in oldSlots first and 
+     then the slots in slots, and element is not used. For compact tables, 
+     hashIndex is the position in entries.
+  */
   int hashIndex;
   HashInfoPtr element;
+  /* element->next when the cursor was moved to element */
+  HashInfoPtr nextElement;
+  /* the reuse counts of element and nextElement at that time */
+  unsigned int elementReuse;
+  unsigned int nextElementReuse;
+
+  /* the generation of the table when element was last known to be valid */
+  unsigned long generation;
 
 } sHashTableCursor;
 
+/* --------- static data */
+
+/* the address of this is used to mark removed slots in dynamic tables */
+static char hashTombstone;
+
 /* --------- static function prototypes */
-static void addCursorToList( HashTableCursor cursor );
+static unsigned int bucketIndex( HashTable ht, int hashValue );
+static HashInfoPtr allocNode( HashTable ht );
+static void freeNode( HashTable ht, HashInfoPtr node );
 static void moveCursorToNextIndex( HashTableCursor cursor );
-static void removeCursorFromList( HashTableCursor cursor );
+static void setCursorElement( HashTableCursor cursor, HashInfoPtr element );
+
+static HashSlot dynamicFindSlot( HashTable ht, void *data, 
+                                 unsigned int hashValue, Boolean *inOld );
+static void dynamicInsertSlot( HashTable ht, HashSlot slots, unsigned int bits,
+                               void *data, unsigned int hashValue );
+static Boolean dynamicMakeRoom( HashTable ht );
+static void dynamicMigrate( HashTable ht, unsigned int slotCount );
+static int dynamicRemove( HashTable ht, void *data, unsigned int hashValue,
+                          Boolean destroy );
+static int removeElement( HashTable ht, void *data, unsigned int hashValue,
+                          Boolean destroy );
+static void dynamicMoveCursorToNextSlot( HashTableCursor cursor );
+
+static int compactFindPosition( HashTable ht, void *data, 
+                                unsigned int hashValue );
+static Boolean compactResize( HashTable ht );
+static int compactAdd( HashTable ht, void *data, unsigned int hashValue );
+static int compactRemove( HashTable ht, void *data, unsigned int hashValue,
+                          Boolean destroy );
+static void compactMoveCursorToNextEntry( HashTableCursor cursor );
+
+static void addChainLength( HashStats stats, int length, 
+                            unsigned int count );
 
 
 /* --------- Help functions */
 
 /* Returns the record containing the specified data, NULL if not found */
-static HashInfoPtr FindInfo(HashTable ht, void *data, unsigned int hashval)
+static HashInfoPtr FindInfo(HashTable ht, void *data, unsigned int hashValue,
+                            unsigned int index)
 { 
   HashInfoPtr tmp;
 
 /*  #warning "ErrPushFunc disabled for debugging" */
 /*    ErrPushFunc("FindInfo"); */
 
-  for( tmp=ht->infoArray[hashval]; 
-       (tmp!=NULL) && (ht->compData(data, tmp->data)); 
-       tmp=tmp->next)
-    ;
+  HASH_COUNT( ht, lookups );
+
+  for( tmp=ht->infoArray[index]; tmp!=NULL; tmp=tmp->next)
+  {
+    HASH_COUNT( ht, probes );
+
+    if( tmp->hashValue == hashValue )
+    {
+      HASH_COUNT( ht, compares );
+      if( ht->compData(data, tmp->data) == 0 )
+        break;
+    }
+  }
 
 /*    ErrPopFunc(); */
   return(tmp);
@@ -147,26 +335,55 @@ static HashInfoPtr FindInfo(HashTable ht, void *data, unsigned int hashval)
 static void DestroyInfo(HashTable ht, HashInfoPtr rec)
 /* Frees the memory occupied by rec */
 {
-  int error;
-
   ErrPushFunc("DestroyInfo");
 
-  /* moving the cursor to the next element is not yet implemented */
-  assert( rec->firstCursor == NULL );
-
-#if defined (_POSIX_SEMAPHORES) && defined (_POSIX_THREADS)
-  error = sem_destroy( &(rec->cursorListSemaphore) );
-  if( error != 0 )
-    perror( "hash.c DestroyInfo sem_destroy" );
-#endif
   if( ht->destrData != NULL )
     ht->destrData(rec->data);
   
-  free(rec);
+  freeNode(ht, rec);
 
   ErrPopFunc();
 }
 
+/* Returns an unused element from the free list, refilling it if needed */
+static HashInfoPtr allocNode( HashTable ht )
+{
+  HashInfoPtr node;
+
+  if( ht->freeNodes == NULL )
+  {
+    HashNodeBlock block;
+    int i;
+
+    block = (HashNodeBlock) malloc( sizeof( sHashNodeBlock ) );
+    if( block == NULL )
+      return NULL;
+
+    block->next = ht->nodeBlocks;
+    ht->nodeBlocks = block;
+
+    for( i = HASH_NODE_BLOCK_SIZE - 1; i >= 0; i-- )
+    {
+      block->nodes[ i ].reuse = 0;
+      block->nodes[ i ].next = ht->freeNodes;
+      ht->freeNodes = &(block->nodes[ i ]);
+    }
+  }
+
+  node = ht->freeNodes;
+  ht->freeNodes = node->next;
+
+  return node;
+}
+
+static void freeNode( HashTable ht, HashInfoPtr node )
+{
+  node->data = NULL;
+  node->reuse++;
+  node->next = ht->freeNodes;
+  ht->freeNodes = node;
+}
+
 /* ----------------------- */
 
 HashTable HashCreateTable(unsigned int sz, HashFuncPtr calc, 
@@ -189,6 +406,22 @@ HashTable HashCreateTable(unsigned int sz, HashFuncPtr calc,
     ht->destrData = destr;
     ht->elementCount = 0;
     ht->debugLevel = 0;
+    ht->seed = HashNewSeed();
+    ht->generation = 0;
+    ht->freeNodes = NULL;
+    ht->nodeBlocks = NULL;
+    ht->isDynamic = FALSE;
+    ht->slots = NULL;
+    ht->oldSlots = NULL;
+    ht->isCompact = FALSE;
+    ht->entries = NULL;
+    ht->entryIndex = NULL;
+    ht->firstCursor = NULL;
+#ifdef HASH_STATS
+    ht->lookups = 0;
+    ht->probes = 0;
+    ht->compares = 0;
+#endif
   }
   
   ErrPopFunc();
@@ -198,6 +431,139 @@ HashTable HashCreateTable(unsigned int sz, HashFuncPtr calc,
   return(ht);
 }
 
+HashTable HashCreateTableDynamic( unsigned int initialSize, 
+                                  float maxLoadFactor, HashFuncPtr calc, 
+                                  CompFuncPtr comp, DestroyFuncPtr destr )
+{
+  HashTable ht;
+  unsigned int bits;
+
+  ErrPushFunc("HashCreateTableDynamic");
+
+  if( (maxLoadFactor <= 0.0f) || (maxLoadFactor > HASH_MAX_LOAD_FACTOR) )
+    maxLoadFactor = (maxLoadFactor <= 0.0f) ? HASH_DEFAULT_LOAD_FACTOR : 
+      HASH_MAX_LOAD_FACTOR;
+  
+  /* make room for initialSize elements without resizing */
+  for( bits = 3; 
+       ((1u << bits) < HASH_MIN_DYNAMIC_SIZE) || 
+         ((float) initialSize > (float) (1u << bits) * maxLoadFactor);
+       bits++ )
+    ;
+
+  ht = (HashTable) malloc( sizeof( struct Hasht ) );
+  if( ht == NULL )
+    goto ERR_RETURN;
+  
+  ht->slots = (HashSlot) calloc( 1u << bits, sizeof( sHashSlot ) );
+  if( ht->slots == NULL )
+  {
+    free( ht );
+    ht = NULL;
+    goto ERR_RETURN;
+  }
+
+  ht->size = 0;
+  ht->calcIndx = calc;
+  ht->compData = comp;
+  ht->destrData = destr;
+  ht->elementCount = 0;
+  ht->debugLevel = 0;
+  ht->seed = HashNewSeed();
+  ht->generation = 0;
+  ht->freeNodes = NULL;
+  ht->nodeBlocks = NULL;
+
+  ht->isDynamic = TRUE;
+  ht->maxLoadFactor = maxLoadFactor;
+  ht->capacity = 1u << bits;
+  ht->capacityBits = bits;
+  ht->usedSlots = 0;
+  ht->oldSlots = NULL;
+  ht->oldCapacity = 0;
+  ht->oldCapacityBits = 0;
+  ht->oldCount = 0;
+  ht->migrateIndex = 0;
+  ht->isCompact = FALSE;
+  ht->entries = NULL;
+  ht->entryIndex = NULL;
+  ht->firstCursor = NULL;
+#ifdef HASH_STATS
+  ht->lookups = 0;
+  ht->probes = 0;
+  ht->compares = 0;
+#endif
+
+ ERR_RETURN:
+  ErrPopFunc();
+
+  return ht;
+}
+
+HashTable HashCreateTableCompact( unsigned int initialSize, HashFuncPtr calc,
+                                  CompFuncPtr comp, DestroyFuncPtr destr )
+{
+  HashTable ht;
+  unsigned int i, bits;
+
+  ErrPushFunc("HashCreateTableCompact");
+
+  if( initialSize < HASH_MIN_DYNAMIC_SIZE )
+    initialSize = HASH_MIN_DYNAMIC_SIZE;
+
+  /* keep the index at most two thirds full */
+  for( bits = 3; (1u << bits) * 2 < initialSize * 3; bits++ )
+    ;
+
+  ht = (HashTable) malloc( sizeof( struct Hasht ) );
+  if( ht == NULL )
+    goto ERR_RETURN;
+
+  ht->entries = (HashSlot) malloc( initialSize * sizeof( sHashSlot ) );
+  ht->entryIndex = (int *) malloc( (1u << bits) * sizeof( int ) );
+  if( (ht->entries == NULL) || (ht->entryIndex == NULL) )
+  {
+    free( ht->entries );
+    free( ht->entryIndex );
+    free( ht );
+    ht = NULL;
+    goto ERR_RETURN;
+  }
+
+  for( i = 0; i < (1u << bits); i++ )
+    ht->entryIndex[ i ] = HASH_INDEX_EMPTY;
+
+  ht->size = 0;
+  ht->calcIndx = calc;
+  ht->compData = comp;
+  ht->destrData = destr;
+  ht->elementCount = 0;
+  ht->debugLevel = 0;
+  ht->seed = HashNewSeed();
+  ht->generation = 0;
+  ht->freeNodes = NULL;
+  ht->nodeBlocks = NULL;
+  ht->isDynamic = FALSE;
+  ht->slots = NULL;
+  ht->oldSlots = NULL;
+
+  ht->isCompact = TRUE;
+  ht->entryCount = 0;
+  ht->entryCapacity = initialSize;
+  ht->indexBits = bits;
+  ht->firstCursor = NULL;
+#ifdef HASH_STATS
+  ht->lookups = 0;
+  ht->probes = 0;
+  ht->compares = 0;
+#endif
+
+ ERR_RETURN:
+  ErrPopFunc();
+
+  return ht;
+}
+
 /*
   Set the debugging level for the hash table. 0 = no debugging.
   Returns the previous debugging level 
@@ -219,6 +585,41 @@ void HashDestroyTable(HashTable ht)
   HashInfoPtr tmp, tmp2;
 
   ErrPushFunc("HashDestroyTable");
+
+  if( ht->isDynamic )
+  {
+    assert( ht->firstCursor == NULL );
+
+    if( ht->destrData != NULL )
+    {
+      for( i = 0; i < ht->capacity; i++ )
+        if( (ht->slots[i].data != NULL) && 
+            (ht->slots[i].data != HASH_TOMBSTONE) )
+          ht->destrData( ht->slots[i].data );
+
+      if( ht->oldSlots != NULL )
+        for( i = ht->migrateIndex; i < ht->oldCapacity; i++ )
+          if( (ht->oldSlots[i].data != NULL) &&
+              (ht->oldSlots[i].data != HASH_TOMBSTONE) )
+            ht->destrData( ht->oldSlots[i].data );
+    }
+    free( ht->slots );
+    free( ht->oldSlots );
+  }
+
+  if( ht->isCompact )
+  {
+    assert( ht->firstCursor == NULL );
+
+    if( ht->destrData != NULL )
+      for( i = 0; i < ht->entryCount; i++ )
+        if( ht->entries[i].data != NULL )
+          ht->destrData( ht->entries[i].data );
+
+    free( ht->entries );
+    free( ht->entryIndex );
+  }
+
   for(i=0; i < ht->size; i++)
     for(tmp=ht->infoArray[i]; tmp!=NULL; ) 
     {
@@ -229,6 +630,14 @@ void HashDestroyTable(HashTable ht)
       
       DestroyInfo(ht, tmp2);
     }
+
+  while( ht->nodeBlocks != NULL )
+  {
+    HashNodeBlock block = ht->nodeBlocks;
+
+    ht->nodeBlocks = block->next;
+    free( block );
+  }
   
   free(ht);
   ErrPopFunc();
@@ -239,148 +648,395 @@ int HashGetElementCount( HashTable ht )
   return ht->elementCount;
 }
 
+/* counts count buckets (or elements) with chains of the given length */
+static void addChainLength( HashStats stats, int length, unsigned int count )
+{
+  stats->chainLengths[ MIN( length, HASH_STATS_CHAIN_LENGTHS - 1 ) ] += count;
+
+  if( length > stats->maxChainLength )
+    stats->maxChainLength = length;
+}
+
+void HashGetStats( HashTable ht, HashStats stats )
+{
+  unsigned int i, mask;
+  unsigned long chainSum = 0, chainCount = 0;
+  HashInfoPtr tmp;
+  int length;
+
+  assert( ht != NULL );
+
+  memset( stats, 0, sizeof( sHashStats ) );
+
+  stats->elementCount = ht->elementCount;
+
+  if( ht->isDynamic )
+  {
+    stats->bucketCount = ht->capacity;
+
+    /* the chain of an element runs from its home slot to its slot */
+    mask = ht->capacity - 1;
+    for( i = 0; i < ht->capacity; i++ )
+      if( (ht->slots[ i ].data != NULL) && 
+          (ht->slots[ i ].data != HASH_TOMBSTONE) )
+      {
+        length = (int) ((i - HASH_SLOT_INDEX( ht, ht->slots[ i ].hashValue,
+                                              ht->capacityBits )) & mask) + 1;
+        addChainLength( stats, length, 1 );
+        chainSum += length;
+        chainCount++;
+      }
+
+    if( ht->oldSlots != NULL )
+    {
+      mask = ht->oldCapacity - 1;
+      for( i = ht->migrateIndex; i < ht->oldCapacity; i++ )
+        if( (ht->oldSlots[ i ].data != NULL) && 
+            (ht->oldSlots[ i ].data != HASH_TOMBSTONE) )
+        {
+          length = (int) ((i - HASH_SLOT_INDEX( ht, 
+                                                ht->oldSlots[ i ].hashValue,
+                                                ht->oldCapacityBits )) & 
+                          mask) + 1;
+          addChainLength( stats, length, 1 );
+          chainSum += length;
+          chainCount++;
+        }
+    }
+  }
+  else if( ht->isCompact )
+  {
+    stats->bucketCount = 1u << ht->indexBits;
+
+    mask = stats->bucketCount - 1;
+    for( i = 0; i < stats->bucketCount; i++ )
+      if( ht->entryIndex[ i ] >= 0 )
+      {
+        length = (int) ((i - HASH_SLOT_INDEX( ht, 
+                          ht->entries[ ht->entryIndex[ i ] ].hashValue,
+                          ht->indexBits )) & mask) + 1;
+        addChainLength( stats, length, 1 );
+        chainSum += length;
+        chainCount++;
+      }
+  }
+  else
+  {
+    stats->bucketCount = ht->size;
+
+    for( i = 0; i < ht->size; i++ )
+    {
+      for( length = 0, tmp = ht->infoArray[ i ]; tmp != NULL; 
+           tmp = tmp->next )
+        length++;
+
+      addChainLength( stats, length, 1 );
+      if( length > 0 )
+      {
+        chainSum += length;
+        chainCount++;
+      }
+    }
+  }
+
+  if( stats->bucketCount > 0 )
+    stats->loadFactor = (float) stats->elementCount / stats->bucketCount;
+  if( chainCount > 0 )
+    stats->meanChainLength = (float) chainSum / chainCount;
+
+#ifdef HASH_STATS
+  stats->lookups = ht->lookups;
+  stats->probes = ht->probes;
+  stats->compares = ht->compares;
+#endif
+}
+
 void *HashFind(HashTable ht, void *data)
 /* If a data record matching 'data' is found in ht, a pointer to it is 
    returned.  Otherwise NULL. */
+{
+  return HashFindWithHash( ht, data, ht->calcIndx( data ) );
+}
+
+void *HashFindWithHash( HashTable ht, void *data, int hashValue )
 {
   void *foundData;
   HashInfoPtr tmp;
 
   /* ErrPushFunc("HashFind"); */
   
-  assert( ht != NULL && ht->size != 0 );
+  assert( ht != NULL );
+
+  if( ht->isDynamic )
+  {
+    HashSlot slot;
+    Boolean inOld;
+
+    slot = dynamicFindSlot( ht, data, (unsigned int) hashValue, &inOld );
+
+    return (slot == NULL) ? NULL : slot->data;
+  }
+
+  if( ht->isCompact )
+  {
+    int position;
+
+    position = compactFindPosition( ht, data, (unsigned int) hashValue );
+
+    return (position < 0) ? NULL : 
+      ht->entries[ ht->entryIndex[ position ] ].data;
+  }
+  
+  assert( ht->size != 0 );
   
   foundData=NULL;
-  if((tmp = FindInfo(ht, data, ht->calcIndx(data) % ht->size)) != NULL) {
+  if((tmp = FindInfo(ht, data, (unsigned int) hashValue, 
+                     bucketIndex(ht, hashValue))) != NULL) {
     foundData=tmp->data;
   }
   /* ErrPopFunc(); */
   return(foundData);
 }
 
-int HashDestroy(HashTable ht, void *data)
-/* Removes the record containing 'data' from ht and DESTROYS data. 
-   If no such record exists, it returns 0. On success 1 is returned. */
+/*
+   Each pass over the batch loads what the previous pass prefetched and 
+   prefetches the next step: the bucket, the first element in it, and the 
+   data of that element if its hash matches. By the time the chains are 
+   searched, most of what they touch is in the cache.
+*/
+void HashFindMany( HashTable ht, void *keys[], int count, void *results[] )
 {
-  int retval=0;
-  HashInfoPtr tmp;
-  unsigned int hashval = ht->calcIndx(data)%ht->size; 
+  unsigned int hashValues[ HASH_FIND_BATCH ];
+  unsigned int indexes[ HASH_FIND_BATCH ];
+  int first, n, i;
 
-  ErrPushFunc("HashDestroy");
-  if(ht->infoArray[hashval]!=NULL) {
-    if(!(ht->compData(ht->infoArray[hashval]->data, data))) {
-      HashInfoPtr toTrash;             /*First record matched -- remove it! */
-      toTrash=ht->infoArray[hashval];
-      ht->infoArray[hashval]=toTrash->next;
-      DestroyInfo(ht, toTrash);
-      ht->elementCount--;
+  assert( ht != NULL );
+
+  if( ht->elementCount < HASH_FIND_BATCH_MIN_ELEMENTS )
+  {
+    for( i = 0; i < count; i++ )
+      results[ i ] = HashFind( ht, keys[ i ] );
+    return;
+  }
+
+  for( first = 0; first < count; first += HASH_FIND_BATCH )
+  {
+    n = MIN( HASH_FIND_BATCH, count - first );
 
-      assert( ht->elementCount >= 0 );
+    for( i = 0; i < n; i++ )
+    {
+      hashValues[ i ] = (unsigned int) ht->calcIndx( keys[ first + i ] );
 
-      retval=1;
+      if( ht->isDynamic )
+      {
+        indexes[ i ] = HASH_SLOT_INDEX( ht, hashValues[ i ], 
+                                        ht->capacityBits );
+        HASH_PREFETCH( &(ht->slots[ indexes[ i ] ]) );
+      }
+      else if( ht->isCompact )
+      {
+        indexes[ i ] = HASH_SLOT_INDEX( ht, hashValues[ i ], 
+                                        ht->indexBits );
+        HASH_PREFETCH( &(ht->entryIndex[ indexes[ i ] ]) );
+      }
+      else
+      {
+        indexes[ i ] = bucketIndex( ht, (int) hashValues[ i ] );
+        HASH_PREFETCH( &(ht->infoArray[ indexes[ i ] ]) );
+      }
     }
-    else {
-      for( tmp = ht->infoArray[hashval];      /* Continue search for match */
-           (tmp->next!=NULL) && (ht->compData(tmp->next->data, data));
-           tmp = tmp->next )
-        ;
 
-      if(tmp->next!=NULL) {      /* If found, remove the matching record. */
-        HashInfoPtr toTrash;
-        toTrash = tmp->next;
-        tmp->next = toTrash->next;
-        DestroyInfo(ht, toTrash);
-        ht->elementCount--;
-        assert( ht->elementCount >= 0 );
-        retval=1;
+    if( ht->isDynamic )
+    {
+      for( i = 0; i < n; i++ )
+      {
+        HashSlot slot = &(ht->slots[ indexes[ i ] ]);
+
+        if( (slot->hashValue == hashValues[ i ]) && 
+            (slot->data != HASH_TOMBSTONE) && (slot->data != NULL) )
+          HASH_PREFETCH( slot->data );
+      }
+
+      for( i = 0; i < n; i++ )
+      {
+        HashSlot slot;
+        Boolean inOld;
+
+        slot = dynamicFindSlot( ht, keys[ first + i ], hashValues[ i ], 
+                                &inOld );
+        results[ first + i ] = (slot == NULL) ? NULL : slot->data;
       }
     }
-  }
-  ErrPopFunc();
-  return(retval);
-}
+    else if( ht->isCompact )
+    {
+      int entry;
 
-int HashDelete(HashTable ht, void *data)
-/* Removes the record containing 'data' from ht. If no such record exists, 
-   hashDelete returns 0. On success it returns 1. DOES NOT DESTROY DATA */
-{
-  int retval=0;
-  HashInfoPtr tmp;
-  unsigned int hashval = ht->calcIndx(data)%ht->size; 
+      for( i = 0; i < n; i++ )
+        if( ht->entryIndex[ indexes[ i ] ] >= 0 )
+          HASH_PREFETCH( &(ht->entries[ ht->entryIndex[ indexes[ i ] ] ]) );
 
-  ErrPushFunc("HashDelete");
-  if(ht->infoArray[hashval]!=NULL) {
-    if(!(ht->compData(ht->infoArray[hashval]->data, data))) {
-      HashInfoPtr toTrash;             /*First record matched -- remove it! */
-      toTrash=ht->infoArray[hashval];
-      ht->infoArray[hashval]=toTrash->next;
-#if defined (_POSIX_SEMAPHORES) && defined (_POSIX_THREADS)
+      for( i = 0; i < n; i++ )
       {
-        int error = sem_destroy(&(toTrash->cursorListSemaphore));
-        if (error != 0)
-          perror("hash.c HashDelete sem_destroy");
+        entry = ht->entryIndex[ indexes[ i ] ];
+        if( (entry >= 0) && 
+            (ht->entries[ entry ].hashValue == hashValues[ i ]) )
+          HASH_PREFETCH( ht->entries[ entry ].data );
+      }
+
+      for( i = 0; i < n; i++ )
+      {
+        entry = compactFindPosition( ht, keys[ first + i ], hashValues[ i ] );
+        results[ first + i ] = (entry < 0) ? NULL : 
+          ht->entries[ ht->entryIndex[ entry ] ].data;
       }
-#endif
-      free(toTrash);
-      ht->elementCount--;
-      assert( ht->elementCount >= 0 );
-      retval=1;
     }
-    else {
-      for( tmp = ht->infoArray[hashval];      /* Continue search for match */
-           (tmp->next!=NULL) && (ht->compData(tmp->next->data, data));
-           tmp = tmp->next)
-        ;
+    else
+    {
+      HashInfoPtr tmp;
 
-      if(tmp->next!=NULL) {      /* If found, remove the matching record. */
-        HashInfoPtr toTrash;
-        toTrash = tmp->next;
-        tmp->next = toTrash->next;
-#if defined (_POSIX_SEMAPHORES) && defined (_POSIX_THREADS)
-        {
-          int error = sem_destroy(&(toTrash->cursorListSemaphore));
-          if (error != 0)
-            perror("hash.c HashDelete sem_destroy");
-        }
-#endif
-        free(toTrash);
-        ht->elementCount--;
-        assert( ht->elementCount >= 0 );
+      for( i = 0; i < n; i++ )
+        if( ht->infoArray[ indexes[ i ] ] != NULL )
+          HASH_PREFETCH( ht->infoArray[ indexes[ i ] ] );
+
+      for( i = 0; i < n; i++ )
+      {
+        tmp = ht->infoArray[ indexes[ i ] ];
+        if( (tmp != NULL) && (tmp->hashValue == hashValues[ i ]) )
+          HASH_PREFETCH( tmp->data );
+      }
 
-        retval=1;
+      for( i = 0; i < n; i++ )
+      {
+        tmp = FindInfo( ht, keys[ first + i ], hashValues[ i ], indexes[ i ] );
+        results[ first + i ] = (tmp == NULL) ? NULL : tmp->data;
       }
     }
   }
-  ErrPopFunc();
-  return(retval);
 }
 
-int HashAdd(HashTable ht, void *data)
-/* Adds data to the specified hashtable. If an equivalent record (according to
-   ht->compData() ) exists, no adding is done. Returns 1 on success, 0 on 
-   failure. */
+/* 
+   Removes the record containing 'data' from ht, and destroys data if 
+   destroy is set. Returns 1 if the record was found, 0 otherwise.
+*/
+static int removeElement( HashTable ht, void *data, unsigned int hashValue,
+                          Boolean destroy )
+{
+  HashInfoPtr *link, toTrash;
+
+  if( ht->isDynamic )
+    return dynamicRemove( ht, data, hashValue, destroy );
+  if( ht->isCompact )
+    return compactRemove( ht, data, hashValue, destroy );
+
+  HASH_COUNT( ht, lookups );
+
+  for( link = &(ht->infoArray[ bucketIndex( ht, (int) hashValue ) ]);
+       *link != NULL; link = &((*link)->next) )
+  {
+    HASH_COUNT( ht, probes );
+
+    if( (*link)->hashValue == hashValue )
+    {
+      HASH_COUNT( ht, compares );
+      if( !ht->compData( (*link)->data, data ) )
+        break;
+    }
+  }
+
+  if( *link == NULL )
+    return 0;
+
+  toTrash = *link;
+  *link = toTrash->next;
+  if( destroy )
+    DestroyInfo(ht, toTrash);
+  else
+    freeNode(ht, toTrash);
+  ht->generation++;
+  ht->elementCount--;
+  assert( ht->elementCount >= 0 );
+
+  return 1;
+}
+
+int HashDestroy(HashTable ht, void *data)
+/* Removes the record containing 'data' from ht and DESTROYS data. 
+   If no such record exists, it returns 0. On success 1 is returned. */
+{
+  int retval;
+
+  ErrPushFunc("HashDestroy");
+  retval = removeElement( ht, data, (unsigned int) ht->calcIndx( data ), 
+                          TRUE );
+  ErrPopFunc();
+  return(retval);
+}
+
+int HashDelete(HashTable ht, void *data)
+/* Removes the record containing 'data' from ht. If no such record exists, 
+   hashDelete returns 0. On success it returns 1. DOES NOT DESTROY DATA */
+{
+  return HashDeleteWithHash( ht, data, ht->calcIndx( data ) );
+}
+
+int HashDeleteWithHash( HashTable ht, void *data, int hashValue )
+{
+  int retval;
+
+  ErrPushFunc("HashDelete");
+  retval = removeElement( ht, data, (unsigned int) hashValue, FALSE );
+  ErrPopFunc();
+  return(retval);
+}
+
+int HashAdd(HashTable ht, void *data)
+/* Adds data to the specified hashtable. If an equivalent record (according to
+   ht->compData() ) exists, no adding is done. Returns 1 on success, 0 on 
+   failure. */
+{
+  return HashAddWithHash( ht, data, ht->calcIndx( data ) );
+}
+
+int HashAddWithHash( HashTable ht, void *data, int hashValue )
 {
   int retval = 1;
-  unsigned int hashval = ht->calcIndx(data)%ht->size;
+  unsigned int hashval = (unsigned int) hashValue, index;
   HashInfoPtr newInfo;
 
   ErrPushFunc("HashAdd");
-  if(FindInfo(ht, data, hashval))
+
+  if( ht->isDynamic )
+  {
+    Boolean inOld;
+
+    if( dynamicFindSlot( ht, data, hashval, &inOld ) != NULL )
+      retval = 0;
+    else if( !dynamicMakeRoom( ht ) )
+      retval = 0;
+    else
+    {
+      dynamicInsertSlot( ht, ht->slots, ht->capacityBits, data, hashval );
+      ht->usedSlots++;
+      ht->elementCount++;
+    }
+    goto ERR_RETURN;
+  }
+
+  if( ht->isCompact )
+  {
+    retval = compactAdd( ht, data, hashval );
+    goto ERR_RETURN;
+  }
+
+  index = bucketIndex(ht, hashValue);
+
+  if(FindInfo(ht, data, hashval, index))
     retval=0;
   else {
-    if( (newInfo = (HashInfoPtr)malloc(sizeof(struct HiPtr))) != NULL ) {
-      int error;
-
+    if( (newInfo = allocNode(ht)) != NULL ) {
       newInfo->data = data;
-      newInfo->next = ht->infoArray[hashval];
-      newInfo->firstCursor = NULL;
-#if defined (_POSIX_SEMAPHORES) && defined (_POSIX_THREADS)
-      error = sem_init( &(newInfo->cursorListSemaphore), 0, 1 );
-      if (error != 0) {
-        retval = 0;
-        goto ERR_RETURN;
-      }
-#endif
+      newInfo->hashValue = hashval;
+      newInfo->next = ht->infoArray[index];
       /* I believe this is an atomic action and therefore needs not be 
          protected by a semaphore to be thread-safe.
      
@@ -389,7 +1045,7 @@ int HashAdd(HashTable ht, void *data)
  
          /Erl 981015
       */
-      ht->infoArray[hashval] = newInfo;
+      ht->infoArray[index] = newInfo;
       ht->elementCount++;
     }
     else {
@@ -423,6 +1079,15 @@ HashTableCursor HashCursorCreate( HashTable ht )
     result->nextCursor = NULL;
     result->element = NULL;
     
+    if( ht->isDynamic || ht->isCompact )
+    {
+      /* dynamic and compact tables keep track of their cursors instead */
+      result->nextCursor = ht->firstCursor;
+      if( ht->firstCursor != NULL )
+        ht->firstCursor->prevCursor = result;
+      ht->firstCursor = result;
+    }
+
     HashCursorGoFirst( result );
   }
 
@@ -437,11 +1102,17 @@ void HashCursorDestroy( HashTableCursor cursor )
   if( cursor->hashTable->debugLevel > 0 )
     fprintf( stderr, "hash.c: HashCursorDestroy( %p )\n", cursor );
   
-  /* if the cursor points at an element, then remove it from the cursor
-     list of that element */
-
-  if( cursor->element != NULL )
-    removeCursorFromList( cursor );
+  if( cursor->hashTable->isDynamic || cursor->hashTable->isCompact )
+  {
+    HashTable ht = cursor->hashTable;
+
+    if( cursor->prevCursor != NULL )
+      cursor->prevCursor->nextCursor = cursor->nextCursor;
+    else
+      ht->firstCursor = cursor->nextCursor;
+    if( cursor->nextCursor != NULL )
+      cursor->nextCursor->prevCursor = cursor->prevCursor;
+  }
 
   free( cursor );
 }
@@ -453,17 +1124,23 @@ void HashCursorGoFirst( HashTableCursor cursor )
 {
   if( cursor->hashTable->debugLevel > 0 )
     fprintf( stderr, "hash.c: HashCursorGoFirst( %p ): entry\n", cursor );
-  
-  /* 
-     if the cursor is pointing at an element, then remove it from the cursor 
-     list of that element.
-  */
-  if( cursor->element != NULL )
+
+  if( cursor->hashTable->isDynamic )
   {
-    removeCursorFromList( cursor );
-    cursor->element = NULL;
+    cursor->hashIndex = -1;
+    dynamicMoveCursorToNextSlot( cursor );
+    return;
+  }
+
+  if( cursor->hashTable->isCompact )
+  {
+    cursor->hashIndex = -1;
+    compactMoveCursorToNextEntry( cursor );
+    return;
   }
   
+  cursor->element = NULL;
+  cursor->generation = cursor->hashTable->generation;
   cursor->hashIndex = -1;
    
   moveCursorToNextIndex( cursor );
@@ -475,137 +1152,353 @@ void HashCursorGoFirst( HashTableCursor cursor )
 /* Move the cursor to the next element in the hash table */
 void HashCursorGoNext( HashTableCursor cursor )
 {
-  if( cursor->element->next == NULL )
-  {
-    /* find the next hash index with an entry */
-    removeCursorFromList( cursor );
-    
-    cursor->element = NULL;
-    
-    moveCursorToNextIndex( cursor );
-  }
+  if( cursor->hashTable->isDynamic )
+    dynamicMoveCursorToNextSlot( cursor );
+  else if( cursor->hashTable->isCompact )
+    compactMoveCursorToNextEntry( cursor );
   else
   {
-    removeCursorFromList( cursor );
-    
-    cursor->element = cursor->element->next;
-    
-    addCursorToList( cursor );
+    HashTable ht = cursor->hashTable;
+
+    assert( cursor->element != NULL );
+
+    if( cursor->generation != ht->generation )
+    {
+      HashInfoPtr tmp;
+
+      /* 
+         Elements have been removed since we last looked. If ours is one of
+         them, continue with the element that followed it, if that is still
+         there, or else with the next index.
+      */
+      for( tmp = ht->infoArray[ cursor->hashIndex ]; 
+           (tmp != NULL) && ((tmp != cursor->element) || 
+                             (tmp->reuse != cursor->elementReuse)); 
+           tmp = tmp->next )
+        ;
+
+      if( tmp == NULL )
+      {
+        for( tmp = ht->infoArray[ cursor->hashIndex ]; 
+             (tmp != NULL) && ((tmp != cursor->nextElement) ||
+                               (tmp->reuse != cursor->nextElementReuse)); 
+             tmp = tmp->next )
+          ;
+
+        cursor->element = NULL;
+        cursor->generation = ht->generation;
+
+        if( tmp != NULL )
+          setCursorElement( cursor, tmp );
+        else
+          moveCursorToNextIndex( cursor );
+
+        return;
+      }
+      cursor->generation = ht->generation;
+    }
+
+    if( cursor->element->next == NULL )
+    {
+      /* find the next hash index with an entry */
+      cursor->element = NULL;
+
+      moveCursorToNextIndex( cursor );
+    }
+    else
+      setCursorElement( cursor, cursor->element->next );
   }
 }
 
 /* return TRUE if the cursor has passed the last element */
 Boolean HashCursorPastLastElement( HashTableCursor cursor )
 {
+  HashTable ht = cursor->hashTable;
+
+  if( ht->isDynamic )
+    return cursor->hashIndex >= 
+      (long) (((ht->oldSlots == NULL) ? 0 : ht->oldCapacity) + ht->capacity);
+
+  if( ht->isCompact )
+    return cursor->hashIndex >= (long) ht->entryCount;
+
   return (cursor->hashIndex >= (long) cursor->hashTable->size);
 }
 
 void *HashCursorGetElement( HashTableCursor cursor )
 {
+  HashTable ht = cursor->hashTable;
+
+  if( ht->isDynamic )
+  {
+    unsigned int index = (unsigned int) cursor->hashIndex;
+    void *data;
+
+    if( (ht->oldSlots != NULL) && (index < ht->oldCapacity) )
+      data = ht->oldSlots[ index ].data;
+    else
+    {
+      if( ht->oldSlots != NULL )
+        index -= ht->oldCapacity;
+      assert( index < ht->capacity );
+      data = ht->slots[ index ].data;
+    }
+
+    /* NULL if the element has been removed, as for compact tables */
+    return (data == HASH_TOMBSTONE) ? NULL : data;
+  }
+
+  if( ht->isCompact )
+  {
+    /* NULL if the element has been removed */
+    assert( cursor->hashIndex < (long) ht->entryCount );
+
+    return ht->entries[ cursor->hashIndex ].data;
+  }
+
   assert( cursor->element != NULL );
+
+  /* NULL if the element has been removed, even if its node was reused */
+  if( cursor->element->reuse != cursor->elementReuse )
+    return NULL;
   
   return cursor->element->data;
 }
 
+/* 
+   The string hashes used to shift each character 4 bits into an int, which 
+   dropped all but the last 8 characters of long strings. They now return 
+   the high bits of the 64 bit hashes below.
+*/
 int HashString( const char *string )
 {
-  int hashValue;
-
   /* 
      be a bit tolerant 
   */
   if( string == NULL )
     return 0;
   
-  /* do it any old way now, we can implement something theoretically 
-     superior later if we need it 
-  */
-  for( hashValue = 0; (*string != '\0'); string++ )
-    hashValue = (hashValue << 4) ^ (*string);
-  
-  return hashValue;
+  return (int) (HashString64( string, 0 ) >> 32);
 }
 
 int HashLowercaseString( const char *string )
 {
-  int hashValue;
-
   if( string == NULL )
     return 0;
   
-  /* do it any old way now, we can implement something theoretically 
-     superior later if we need it 
-  */
-  for( hashValue = 0; (*string != '\0'); string++ )
-    hashValue = (hashValue << 4) ^ (tolower(*string));
+  return (int) (HashLowercaseString64( string, 0 ) >> 32);
+}
+
+/*
+  64 bit hashing.
+
+  The functions below follow wyhash: the input is read eight bytes at a time,
+  and each pair of words is combined with a 64x64->128 bit multiplication
+  whose halves are xor:ed together.
+*/
+
+/* multiplies a and b, and returns the high and low halves of the product */
+static void hashMultiply( uint64_t *a, uint64_t *b )
+{
+#if defined( __GNUC__ ) && defined( __SIZEOF_INT128__ )
+  __uint128_t r = *a;
+
+  r *= *b;
+  *a = (uint64_t) r;
+  *b = (uint64_t) (r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+  uint64_t hi, lo;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl;
+
+  lo = t + (rm1 << 32);
+  c += lo < t;
+  hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  *a = lo;
+  *b = hi;
+#endif
+}
+
+static uint64_t hashMix( uint64_t a, uint64_t b )
+{
+  hashMultiply( &a, &b );
 
-  return hashValue;
+  return a ^ b;
 }
 
-static void removeCursorFromList( HashTableCursor cursor )
+/* 
+   Turns the ASCII capitals in the bytes of x into lower case, eight at a 
+   time (bytes >= 0x80 are left alone).
+*/
+static uint64_t hashLowercaseWord( uint64_t x )
 {
-  int err;
-  
-  if( cursor->hashTable->debugLevel > 1 )
-    fprintf( stderr, "hash.c: removeCursorFromList( %p ): entry\n", cursor );
+  const uint64_t ones = 0x0101010101010101ULL;
+  uint64_t heptets = x & (0x7f * ones);
+  uint64_t aboveZ = heptets + ((0x7f - 'Z') * ones);
+  uint64_t fromA = heptets + ((0x80 - 'A') * ones);
+  uint64_t isUpper = ~x & (fromA ^ aboveZ) & (0x80 * ones);
 
-  assert( cursor->element != NULL );
-#if defined (_POSIX_SEMAPHORES) && defined (_POSIX_THREADS)
-  err = threading_sem_wait( &(cursor->element->cursorListSemaphore) );
-#endif
-  if( cursor->hashTable->debugLevel > 2 )
-    fprintf( stderr, "hash.c: removeCursorFromList( %p ): prevCursor=%p, "
-             "nextCursor = %p\n", 
-             cursor, cursor->prevCursor, cursor->nextCursor );
+  return x | (isUpper >> 2);
+}
 
-  if( cursor->prevCursor != NULL )
+static uint64_t hashRead8( const unsigned char *p, Boolean lowercase )
+{
+  uint64_t v;
+
+  memcpy( &v, p, 8 );
+
+  return lowercase ? hashLowercaseWord( v ) : v;
+}
+
+static uint64_t hashRead4( const unsigned char *p, Boolean lowercase )
+{
+  uint32_t v;
+
+  memcpy( &v, p, 4 );
+
+  return lowercase ? (uint32_t) hashLowercaseWord( v ) : v;
+}
+
+/* reads 1-3 bytes */
+static uint64_t hashRead3( const unsigned char *p, size_t length, 
+                           Boolean lowercase )
+{
+  uint64_t v = (((uint64_t) p[0]) << 16) | 
+    (((uint64_t) p[ length >> 1 ]) << 8) | p[ length - 1 ];
+
+  return lowercase ? hashLowercaseWord( v ) : v;
+}
+
+static uint64_t hashBytes( const unsigned char *p, size_t length, 
+                           uint64_t seed, Boolean lowercase )
+{
+  uint64_t a, b;
+
+  seed ^= hashMix( seed ^ HASH_SECRET0, HASH_SECRET1 );
+
+  if( length <= 16 )
   {
-    cursor->prevCursor->nextCursor = cursor->nextCursor;
-    cursor->prevCursor = NULL;
+    if( length >= 4 )
+    {
+      size_t offset = (length >> 3) << 2;
+
+      a = (hashRead4( p, lowercase ) << 32) | 
+        hashRead4( p + offset, lowercase );
+      b = (hashRead4( p + length - 4, lowercase ) << 32) | 
+        hashRead4( p + length - 4 - offset, lowercase );
+    }
+    else if( length > 0 )
+    {
+      a = hashRead3( p, length, lowercase );
+      b = 0;
+    }
+    else
+      a = b = 0;
   }
   else
-    cursor->element->firstCursor = cursor->nextCursor;
-
-  if( cursor->nextCursor != NULL )
   {
-    cursor->nextCursor->prevCursor = cursor->prevCursor;
-    cursor->nextCursor = NULL;
+    size_t i = length;
+
+    if( i > 48 )
+    {
+      uint64_t seed1 = seed, seed2 = seed;
+
+      do
+      {
+        seed = hashMix( hashRead8( p, lowercase ) ^ HASH_SECRET1, 
+                        hashRead8( p + 8, lowercase ) ^ seed );
+        seed1 = hashMix( hashRead8( p + 16, lowercase ) ^ HASH_SECRET2,
+                         hashRead8( p + 24, lowercase ) ^ seed1 );
+        seed2 = hashMix( hashRead8( p + 32, lowercase ) ^ HASH_SECRET3,
+                         hashRead8( p + 40, lowercase ) ^ seed2 );
+        p += 48;
+        i -= 48;
+      } while( i > 48 );
+
+      seed ^= seed1 ^ seed2;
+    }
+
+    while( i > 16 )
+    {
+      seed = hashMix( hashRead8( p, lowercase ) ^ HASH_SECRET1, 
+                      hashRead8( p + 8, lowercase ) ^ seed );
+      p += 16;
+      i -= 16;
+    }
+
+    a = hashRead8( p + i - 16, lowercase );
+    b = hashRead8( p + i - 8, lowercase );
   }
-#if defined (_POSIX_SEMAPHORES) && defined (_POSIX_THREADS)
-  sem_post( &(cursor->element->cursorListSemaphore) );
-#endif
-  
-  if( cursor->hashTable->debugLevel > 1 )
-    fprintf( stderr, "hash.c: removeCursorFromList( %p ): entry\n", cursor );
+
+  a ^= HASH_SECRET1;
+  b ^= seed;
+  hashMultiply( &a, &b );
+
+  return hashMix( a ^ HASH_SECRET0 ^ length, b ^ HASH_SECRET1 );
 }
 
-static void addCursorToList( HashTableCursor cursor )
+uint64_t HashString64( const char *string, uint64_t seed )
 {
-  int err;
-  
-  assert( cursor->element != NULL );
+  if( string == NULL )
+    return 0;
 
-  if( cursor->hashTable->debugLevel > 1 )
-    fprintf( stderr, "hash.c: addCursorToList( %p ): entry\n", cursor );
-#if defined (_POSIX_SEMAPHORES) && defined (_POSIX_THREADS)
-  err = threading_sem_wait( &(cursor->element->cursorListSemaphore) );
-#endif
-  /* add the cursor to the list of cursors that point at this element */
-  cursor->nextCursor = cursor->element->firstCursor;
-  cursor->prevCursor = NULL;
-  cursor->element->firstCursor = cursor;
-  if( cursor->nextCursor != NULL )
-    cursor->nextCursor->prevCursor = cursor;
-  
-  if( cursor->hashTable->debugLevel > 2 )
-    fprintf( stderr, "hash.c: addCursorToList( %p ): nextCursor=%p, "
-             "prevCursor=%p\n", cursor, cursor->nextCursor, 
-             cursor->prevCursor );
-#if defined (_POSIX_SEMAPHORES) && defined (_POSIX_THREADS)
-  sem_post( &(cursor->element->cursorListSemaphore) );
-#endif
-  if( cursor->hashTable->debugLevel > 1 )
-    fprintf( stderr, "hash.c: addCursorToList( %p ): exit\n", cursor );
+  return hashBytes( (const unsigned char *) string, strlen( string ), seed, 
+                    FALSE );
+}
+
+uint64_t HashLowercaseString64( const char *string, uint64_t seed )
+{
+  if( string == NULL )
+    return 0;
+
+  return hashBytes( (const unsigned char *) string, strlen( string ), seed, 
+                    TRUE );
+}
+
+uint64_t HashBytes64( const void *data, size_t length, uint64_t seed )
+{
+  return hashBytes( (const unsigned char *) data, length, seed, FALSE );
+}
+
+uint64_t HashMix64( uint64_t value, uint64_t seed )
+{
+  return hashMix( value ^ seed ^ HASH_SECRET0, HASH_SECRET1 );
+}
+
+uint64_t HashGetSeed( HashTable ht )
+{
+  return ht->seed;
+}
+
+/* 
+   Picks a seed for a new table. This only needs to differ between tables 
+   and runs, it does not have to be unpredictable.
+*/
+uint64_t HashNewSeed( void )
+{
+  /* Tables may be created on several threads at once */
+  static volatile int counter = 0;
+  uint64_t value, count;
+
+  value = ((uint64_t) time( NULL ) << 20) ^ (uint64_t) clock() ^ 
+    (uint64_t) (size_t) &value;
+  count = (uint64_t) (unsigned int) atomic_addInt( &counter, 1 );
+
+  return hashMix( value ^ HASH_SECRET0,
+                  (count * HASH_SECRET2) ^ HASH_SECRET3 );
+}
+
+/* 
+   Selects the bucket of a chained table from the high bits of the mix. 
+   Multiplying the top 32 bits by the size and keeping the top half of that
+   maps them evenly on 0..size-1 without a division.
+*/
+static unsigned int bucketIndex( HashTable ht, int hashValue )
+{
+  uint64_t mixed = HashMix64( (unsigned int) hashValue, ht->seed ) >> 32;
+
+  return (unsigned int) ((mixed * ht->size) >> 32);
 }
 
 void *HashGetArbitraryElement( HashTable hashTable )
@@ -614,6 +1507,35 @@ void *HashGetArbitraryElement( HashTable hashTable )
 
   assert( hashTable->elementCount > 0 );
 
+  if( hashTable->isDynamic )
+  {
+    for( hashIndex = 0; hashIndex < hashTable->capacity; hashIndex++ )
+      if( (hashTable->slots[ hashIndex ].data != NULL) &&
+          (hashTable->slots[ hashIndex ].data != HASH_TOMBSTONE) )
+        return hashTable->slots[ hashIndex ].data;
+
+    assert( hashTable->oldSlots != NULL );
+
+    for( hashIndex = hashTable->migrateIndex; 
+         hashIndex < hashTable->oldCapacity; hashIndex++ )
+      if( (hashTable->oldSlots[ hashIndex ].data != NULL) &&
+          (hashTable->oldSlots[ hashIndex ].data != HASH_TOMBSTONE) )
+        return hashTable->oldSlots[ hashIndex ].data;
+
+    assert( FALSE );
+    return NULL;
+  }
+
+  if( hashTable->isCompact )
+  {
+    for( hashIndex = 0; hashIndex < hashTable->entryCount; hashIndex++ )
+      if( hashTable->entries[ hashIndex ].data != NULL )
+        return hashTable->entries[ hashIndex ].data;
+
+    assert( FALSE );
+    return NULL;
+  }
+
   for( hashIndex = 0; (hashIndex < hashTable->size) && 
        (hashTable->infoArray[ hashIndex ] == NULL); 
        hashIndex++ )
@@ -641,13 +1563,439 @@ static void moveCursorToNextIndex( HashTableCursor cursor )
     ;
 
   if( cursor->hashIndex < ((long) cursor->hashTable->size) )
+    setCursorElement( cursor, 
+                      cursor->hashTable->infoArray[ cursor->hashIndex ] );
+  else
+    cursor->element = NULL;
+}
+
+/* Moves the cursor to element, which must be in the table */
+static void setCursorElement( HashTableCursor cursor, HashInfoPtr element )
+{
+  assert( element != NULL );
+
+  cursor->element = element;
+  cursor->elementReuse = element->reuse;
+  cursor->nextElement = element->next;
+  if( element->next != NULL )
+    cursor->nextElementReuse = element->next->reuse;
+}
+
+/*
+  Dynamic (open addressing) table internals.
+  
+  The slot arrays use linear probing. The hash value from calcIndx is 
+  mixed with the table's seed and the top bits are used as the start 
+  index, so that poor hash functions (such as returning a plain number) do
+  not cluster (see HASH_SLOT_INDEX).
+*/
+
+static HashSlot dynamicFindInArray( HashTable ht, HashSlot slots, 
+                                    unsigned int bits, void *data,
+                                    unsigned int hashValue )
+{
+  unsigned int mask = (1u << bits) - 1;
+  unsigned int index;
+
+  for( index = HASH_SLOT_INDEX( ht, hashValue, bits ); 
+       slots[ index ].data != NULL; 
+       index = (index + 1) & mask )
   {
-    cursor->element = cursor->hashTable->infoArray[ cursor->hashIndex ];
+    HASH_COUNT( ht, probes );
+
+    if( (slots[ index ].data != HASH_TOMBSTONE) &&
+        (slots[ index ].hashValue == hashValue) )
+    {
+      HASH_COUNT( ht, compares );
+      if( ht->compData( data, slots[ index ].data ) == 0 )
+        return &(slots[ index ]);
+    }
+  }
+
+  return NULL;
+}
+
+/* 
+   Returns the slot holding an element equal to data, or NULL. inOld is set to
+   TRUE if the slot is in the array that is being moved away from.
+*/
+static HashSlot dynamicFindSlot( HashTable ht, void *data, 
+                                 unsigned int hashValue, Boolean *inOld )
+{
+  HashSlot slot;
+
+  HASH_COUNT( ht, lookups );
+
+  slot = dynamicFindInArray( ht, ht->slots, ht->capacityBits, data, 
+                             hashValue );
+  *inOld = FALSE;
+
+  if( (slot == NULL) && (ht->oldSlots != NULL) )
+  {
+    slot = dynamicFindInArray( ht, ht->oldSlots, ht->oldCapacityBits, data,
+                               hashValue );
+    *inOld = TRUE;
+  }
+
+  return slot;
+}
+
+/* 
+   Puts data in the first free slot. The caller has checked that data is not
+   already in the table and that there is room for it. 
+*/
+static void dynamicInsertSlot( HashTable ht, HashSlot slots, unsigned int bits,
+                               void *data, unsigned int hashValue )
+{
+  unsigned int mask = (1u << bits) - 1;
+  unsigned int index;
+
+  for( index = HASH_SLOT_INDEX( ht, hashValue, bits ); 
+       slots[ index ].data != NULL; 
+       index = (index + 1) & mask )
+    ;
   
-    assert( cursor->element != NULL );
+  slots[ index ].data = data;
+  slots[ index ].hashValue = hashValue;
+}
 
-    addCursorToList( cursor );
+/* 
+   Moves up to slotCount slots from oldSlots to slots, and frees oldSlots
+   when all of it has been moved.
+*/
+static void dynamicMigrate( HashTable ht, unsigned int slotCount )
+{
+  HashTableCursor cursor;
+
+  assert( ht->oldSlots != NULL );
+
+  for( ; (slotCount > 0) && (ht->migrateIndex < ht->oldCapacity); 
+       slotCount--, ht->migrateIndex++ )
+  {
+    HashSlot slot = &(ht->oldSlots[ ht->migrateIndex ]);
+
+    if( (slot->data != NULL) && (slot->data != HASH_TOMBSTONE) )
+    {
+      dynamicInsertSlot( ht, ht->slots, ht->capacityBits, slot->data, 
+                         slot->hashValue );
+      ht->usedSlots++;
+      ht->oldCount--;
+      /* keep the probe sequences in the old array intact */
+      slot->data = HASH_TOMBSTONE;
+    }
   }
-  else
-    cursor->element = NULL;
+  
+  if( ht->migrateIndex < ht->oldCapacity )
+    return;
+
+  if( ht->debugLevel > 2 )
+    fprintf( stderr, "hash.c: dynamicMigrate( %p ): done, capacity %u\n", 
+             ht, ht->capacity );
+
+  /* 
+     Cursors count the old slots first, so they must be renumbered. A cursor
+     that was still in the old array has to start over in the new one and 
+     may therefore see some elements again. This only happens when the table 
+     has to grow past its limits while a cursor is open. 
+  */
+  for( cursor = ht->firstCursor; cursor != NULL; 
+       cursor = cursor->nextCursor )
+  {
+    if( cursor->hashIndex >= (long) ht->oldCapacity )
+      cursor->hashIndex -= ht->oldCapacity;
+    else
+      cursor->hashIndex = -1;
+  }
+
+  free( ht->oldSlots );
+  ht->oldSlots = NULL;
+  ht->oldCapacity = 0;
+  ht->oldCapacityBits = 0;
+  ht->oldCount = 0;
+  ht->migrateIndex = 0;
+
+  for( cursor = ht->firstCursor; cursor != NULL; 
+       cursor = cursor->nextCursor )
+    if( cursor->hashIndex == -1 )
+      dynamicMoveCursorToNextSlot( cursor );
+}
+
+/*
+  Makes sure that one more element can be put in slots, starting a resize
+  if the load factor would be exceeded. Returns FALSE if out of memory.
+*/
+static Boolean dynamicMakeRoom( HashTable ht )
+{
+  unsigned int pending, bits;
+  HashSlot newSlots;
+
+  if( (ht->oldSlots != NULL) && (ht->firstCursor == NULL) )
+    dynamicMigrate( ht, HASH_REHASH_STEP );
+
+  /* elements still in the old array will end up in slots too */
+  pending = ht->usedSlots + ht->oldCount;
+
+  if( (float) (pending + 1) <= (float) ht->capacity * ht->maxLoadFactor )
+    return TRUE;
+
+  if( ht->oldSlots != NULL )
+  {
+    /* moving is postponed while cursors are open, as long as we can */
+    if( (ht->firstCursor != NULL) && 
+        ((float) (pending + 1) <= 
+         (float) ht->capacity * HASH_MAX_LOAD_FACTOR) )
+      return TRUE;
+
+    dynamicMigrate( ht, ht->oldCapacity );
+  }
+
+  /* grow, unless most of the used slots are tombstones */
+  bits = ht->capacityBits;
+  if( (float) ((ht->elementCount + 1) * 2) > 
+      (float) ht->capacity * ht->maxLoadFactor )
+    bits++;
+
+  newSlots = (HashSlot) calloc( 1u << bits, sizeof( sHashSlot ) );
+  if( newSlots == NULL )
+    return (ht->usedSlots + 1 < ht->capacity);
+
+  if( ht->debugLevel > 1 )
+    fprintf( stderr, "hash.c: resizing %p from %u to %u slots, "
+             "%d elements\n", ht, ht->capacity, 1u << bits, 
+             ht->elementCount );
+
+  ht->oldSlots = ht->slots;
+  ht->oldCapacity = ht->capacity;
+  ht->oldCapacityBits = ht->capacityBits;
+  ht->oldCount = (unsigned int) ht->elementCount;
+  ht->migrateIndex = 0;
+
+  ht->slots = newSlots;
+  ht->capacity = 1u << bits;
+  ht->capacityBits = bits;
+  ht->usedSlots = 0;
+
+  if( ht->firstCursor == NULL )
+    dynamicMigrate( ht, HASH_REHASH_STEP );
+
+  return TRUE;
+}
+
+static int dynamicRemove( HashTable ht, void *data, unsigned int hashValue,
+                          Boolean destroy )
+{
+  HashSlot slot;
+  Boolean inOld;
+  void *found;
+
+  if( (ht->oldSlots != NULL) && (ht->firstCursor == NULL) )
+    dynamicMigrate( ht, HASH_REHASH_STEP );
+
+  slot = dynamicFindSlot( ht, data, hashValue, &inOld );
+  if( slot == NULL )
+    return 0;
+
+  found = slot->data;
+  slot->data = HASH_TOMBSTONE;
+  if( inOld )
+    ht->oldCount--;
+  ht->elementCount--;
+  assert( ht->elementCount >= 0 );
+
+  if( destroy && (ht->destrData != NULL) )
+    ht->destrData( found );
+
+  return 1;
+}
+
+static void dynamicMoveCursorToNextSlot( HashTableCursor cursor )
+{
+  HashTable ht = cursor->hashTable;
+  unsigned int oldCapacity = (ht->oldSlots == NULL) ? 0 : ht->oldCapacity;
+  unsigned int index;
+
+  for( index = (unsigned int) (cursor->hashIndex + 1); 
+       index < oldCapacity + ht->capacity; index++ )
+  {
+    void *data = (index < oldCapacity) ? ht->oldSlots[ index ].data :
+      ht->slots[ index - oldCapacity ].data;
+
+    if( (data != NULL) && (data != HASH_TOMBSTONE) )
+      break;
+  }
+
+  cursor->hashIndex = (int) index;
+}
+
+/*
+  Compact (insertion ordered) table internals.
+
+  entryIndex is probed linearly from the same start index as the slots of
+  a dynamic table. A removed element's position is marked 
+  HASH_INDEX_REMOVED rather than emptied, so that the probing for the 
+  elements after it still works; the marks are cleared when the index is 
+  rebuilt by compactResize.
+*/
+
+/* Returns the position in entryIndex of the element equal to data, or -1 */
+static int compactFindPosition( HashTable ht, void *data, 
+                                unsigned int hashValue )
+{
+  unsigned int mask = (1u << ht->indexBits) - 1;
+  unsigned int position;
+  int entry;
+
+  HASH_COUNT( ht, lookups );
+
+  for( position = HASH_SLOT_INDEX( ht, hashValue, ht->indexBits );
+       (entry = ht->entryIndex[ position ]) != HASH_INDEX_EMPTY;
+       position = (position + 1) & mask )
+  {
+    HASH_COUNT( ht, probes );
+
+    if( (entry >= 0) && (ht->entries[ entry ].hashValue == hashValue) )
+    {
+      HASH_COUNT( ht, compares );
+      if( ht->compData( data, ht->entries[ entry ].data ) == 0 )
+        return (int) position;
+    }
+  }
+
+  return -1;
+}
+
+/* 
+   Makes room for at least one more entry and rebuilds the index. The 
+   removed entries are squeezed out unless cursors are open, since the 
+   cursors hold positions in entries. 
+*/
+static Boolean compactResize( HashTable ht )
+{
+  unsigned int keep, capacity, bits, i, j, mask, position;
+  int *newIndex;
+  HashSlot newEntries;
+
+  keep = (ht->firstCursor == NULL) ? (unsigned int) ht->elementCount : 
+    ht->entryCount;
+  capacity = keep * 2;
+  /* the entries are never shrunk, the index must have room for them all */
+  if( capacity < ht->entryCapacity )
+    capacity = ht->entryCapacity;
+
+  for( bits = 3; (1u << bits) * 2 < capacity * 3; bits++ )
+    ;
+
+  newIndex = (int *) malloc( (1u << bits) * sizeof( int ) );
+  if( newIndex == NULL )
+    return FALSE;
+
+  if( capacity > ht->entryCapacity )
+  {
+    newEntries = (HashSlot) realloc( ht->entries, 
+                                     capacity * sizeof( sHashSlot ) );
+    if( newEntries == NULL )
+    {
+      free( newIndex );
+      return FALSE;
+    }
+    ht->entries = newEntries;
+  }
+  ht->entryCapacity = capacity;
+
+  if( ht->debugLevel > 1 )
+    fprintf( stderr, "hash.c: resizing %p from %u to %u entries, "
+             "%d elements\n", ht, ht->entryCount, capacity, 
+             ht->elementCount );
+
+  if( ht->firstCursor == NULL )
+  {
+    for( i = 0, j = 0; i < ht->entryCount; i++ )
+      if( ht->entries[ i ].data != NULL )
+        ht->entries[ j++ ] = ht->entries[ i ];
+    ht->entryCount = j;
+  }
+
+  for( i = 0; i < (1u << bits); i++ )
+    newIndex[ i ] = HASH_INDEX_EMPTY;
+
+  mask = (1u << bits) - 1;
+  for( i = 0; i < ht->entryCount; i++ )
+    if( ht->entries[ i ].data != NULL )
+    {
+      for( position = HASH_SLOT_INDEX( ht, ht->entries[ i ].hashValue, bits );
+           newIndex[ position ] != HASH_INDEX_EMPTY;
+           position = (position + 1) & mask )
+        ;
+      newIndex[ position ] = (int) i;
+    }
+
+  free( ht->entryIndex );
+  ht->entryIndex = newIndex;
+  ht->indexBits = bits;
+
+  return TRUE;
+}
+
+static int compactAdd( HashTable ht, void *data, unsigned int hashValue )
+{
+  unsigned int mask, position;
+
+  if( compactFindPosition( ht, data, hashValue ) >= 0 )
+    return 0;
+
+  if( (ht->entryCount == ht->entryCapacity) && !compactResize( ht ) )
+    return 0;
+
+  /* the element is known not to be there, so a removed mark will do */
+  mask = (1u << ht->indexBits) - 1;
+  for( position = HASH_SLOT_INDEX( ht, hashValue, ht->indexBits );
+       ht->entryIndex[ position ] >= 0;
+       position = (position + 1) & mask )
+    ;
+
+  ht->entries[ ht->entryCount ].data = data;
+  ht->entries[ ht->entryCount ].hashValue = hashValue;
+  ht->entryIndex[ position ] = (int) ht->entryCount;
+  ht->entryCount++;
+  ht->elementCount++;
+
+  return 1;
+}
+
+static int compactRemove( HashTable ht, void *data, unsigned int hashValue,
+                          Boolean destroy )
+{
+  int position, entry;
+  void *found;
+
+  position = compactFindPosition( ht, data, hashValue );
+  if( position < 0 )
+    return 0;
+
+  entry = ht->entryIndex[ position ];
+  found = ht->entries[ entry ].data;
+
+  ht->entryIndex[ position ] = HASH_INDEX_REMOVED;
+  ht->entries[ entry ].data = NULL;
+  ht->generation++;
+  ht->elementCount--;
+  assert( ht->elementCount >= 0 );
+
+  if( destroy && (ht->destrData != NULL) )
+    ht->destrData( found );
+
+  return 1;
+}
+
+static void compactMoveCursorToNextEntry( HashTableCursor cursor )
+{
+  HashTable ht = cursor->hashTable;
+  unsigned int index;
+
+  for( index = (unsigned int) (cursor->hashIndex + 1); 
+       (index < ht->entryCount) && (ht->entries[ index ].data == NULL);
+       index++ )
+    ;
+
+  cursor->hashIndex = (int) index;
 }
@@ -94,7 +94,8 @@ MemoryManager memManager_create( size_t elementSize, const char *name,
   result->capacity = capacity;
   result->firstFree = 0;
 #ifdef _POSIX_THREADS
-  error = threading_mutex_init( &(result->mutex) );
+  error = threading_mutex_initMode( &(result->mutex),
+                                    THREADING_MUTEX_ADAPTIVE );
   if (error != NULL) {
     ErrDispose(error, TRUE);
     goto ERR_RETURN2;
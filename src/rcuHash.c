@@ -0,0 +1,409 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   rcuHash.c -- read-mostly hash table with lock-free lookups
+
+   The table is a directory of buckets, and each bucket is an immutable
+   array of elements with their hash values. A writer that changes a
+   bucket builds a new array, publishes it in the directory with a single
+   pointer store, and retires the old array to the epoch domain. Growing
+   the table builds a new directory with new buckets the same way.
+
+   A reader therefore always sees a complete bucket, either from before or
+   from after any change, and the memory it looks at is not freed until it
+   has left its read section.
+*/
+
+#include <voxi/util/config.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <voxi/util/win32_glue.h>
+#endif /* WIN32 */
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/epoch.h>
+#include <voxi/util/err.h>
+#include <voxi/util/threading.h>
+
+#include <voxi/util/rcuHash.h>
+
+CVSID("$Id$");
+
+/* --------- Definitions */
+
+/* Grow when there are more elements than buckets */
+#define RCU_HASH_MAX_LOAD 1
+
+typedef struct
+{
+  unsigned int hashValue;
+  void *data;
+} sRcuEntry;
+
+typedef struct
+{
+  unsigned int count;
+  sRcuEntry entries[ 1 ];
+} sRcuBucket, *RcuBucket;
+
+typedef struct
+{
+  unsigned int bits;
+  RcuBucket volatile buckets[ 1 ];
+} sRcuDirectory, *RcuDirectory;
+
+struct sRcuHashTable
+{
+  RcuDirectory volatile directory;
+  uint64_t seed;
+  HashFuncPtr calcIndx;
+  CompFuncPtr compData;
+  DestroyFuncPtr destrData;
+  EpochDomain domain;
+
+  /* serializes writers */
+  sVoxiMutex lock;
+  volatile int elementCount;
+};
+
+#define BUCKET_INDEX( ht, dir, hashValue ) \
+  ((unsigned int) (HashMix64( (hashValue), (ht)->seed ) >> (64 - (dir)->bits)))
+
+/* --------- Static function declarations */
+
+static RcuBucket newBucket( unsigned int count );
+static RcuDirectory newDirectory( unsigned int bits );
+static void freeDirectory( void *directory );
+static int findInBucket( RcuHashTable ht, RcuBucket bucket, void *data,
+                         unsigned int hashValue );
+static Boolean grow( RcuHashTable ht );
+static int removeElement( RcuHashTable ht, void *data, Boolean destroy );
+
+/* --------- Help functions */
+
+static RcuBucket newBucket( unsigned int count )
+{
+  RcuBucket bucket;
+
+  bucket = (RcuBucket) malloc( offsetof( sRcuBucket, entries ) +
+                               count * sizeof( sRcuEntry ) );
+  if( bucket != NULL )
+    bucket->count = count;
+
+  return bucket;
+}
+
+static RcuDirectory newDirectory( unsigned int bits )
+{
+  RcuDirectory directory;
+  size_t size = (size_t) 1 << bits;
+
+  directory = (RcuDirectory) malloc( offsetof( sRcuDirectory, buckets ) +
+                                     size * sizeof( RcuBucket ) );
+  if( directory == NULL )
+    return NULL;
+
+  directory->bits = bits;
+  memset( (void *) directory->buckets, 0, size * sizeof( RcuBucket ) );
+
+  return directory;
+}
+
+/* Frees a directory and all its buckets */
+static void freeDirectory( void *directory )
+{
+  RcuDirectory dir = (RcuDirectory) directory;
+  size_t i;
+
+  for( i = 0; i < ((size_t) 1 << dir->bits); i++ )
+    free( dir->buckets[ i ] );
+
+  free( dir );
+}
+
+/* Returns the index of the element in the bucket, or -1 */
+static int findInBucket( RcuHashTable ht, RcuBucket bucket, void *data,
+                         unsigned int hashValue )
+{
+  unsigned int i;
+
+  if( bucket == NULL )
+    return -1;
+
+  for( i = 0; i < bucket->count; i++ )
+    if( (bucket->entries[ i ].hashValue == hashValue) &&
+        (ht->compData( data, bucket->entries[ i ].data ) == 0) )
+      return (int) i;
+
+  return -1;
+}
+
+/*
+   Replaces the directory with one twice the size. Must be called with the
+   table lock held. Returns FALSE if out of memory.
+*/
+static Boolean grow( RcuHashTable ht )
+{
+  RcuDirectory oldDir = ht->directory, newDir;
+  size_t oldSize = (size_t) 1 << oldDir->bits, newSize = oldSize * 2;
+  unsigned int *counts;
+  size_t i;
+  unsigned int j;
+
+  newDir = newDirectory( oldDir->bits + 1 );
+  counts = (unsigned int *) calloc( newSize, sizeof( unsigned int ) );
+  if( (newDir == NULL) || (counts == NULL) )
+    goto ERR_RETURN;
+
+  for( i = 0; i < oldSize; i++ )
+    if( oldDir->buckets[ i ] != NULL )
+      for( j = 0; j < oldDir->buckets[ i ]->count; j++ )
+        counts[ BUCKET_INDEX( ht, newDir,
+                              oldDir->buckets[ i ]->entries[ j ].hashValue ) ]++;
+
+  for( i = 0; i < newSize; i++ )
+    if( counts[ i ] > 0 )
+    {
+      newDir->buckets[ i ] = newBucket( counts[ i ] );
+      if( newDir->buckets[ i ] == NULL )
+        goto ERR_RETURN;
+      newDir->buckets[ i ]->count = 0;
+    }
+
+  for( i = 0; i < oldSize; i++ )
+    if( oldDir->buckets[ i ] != NULL )
+      for( j = 0; j < oldDir->buckets[ i ]->count; j++ )
+      {
+        sRcuEntry *entry = &(oldDir->buckets[ i ]->entries[ j ]);
+        RcuBucket bucket = newDir->buckets[ BUCKET_INDEX( ht, newDir,
+                                                          entry->hashValue ) ];
+
+        bucket->entries[ bucket->count++ ] = *entry;
+      }
+
+  free( counts );
+
+  atomic_storePtr( (void * volatile *) &(ht->directory), newDir );
+  epoch_retire( ht->domain, oldDir, freeDirectory );
+
+  return TRUE;
+
+ ERR_RETURN:
+  free( counts );
+  if( newDir != NULL )
+    freeDirectory( newDir );
+  return FALSE;
+}
+
+/* ----------------------- */
+
+RcuHashTable RcuHashCreateTable( unsigned int size, HashFuncPtr calc,
+                                 CompFuncPtr comp, DestroyFuncPtr destr )
+{
+  RcuHashTable ht;
+  unsigned int bits;
+  Error error;
+
+  ErrPushFunc( "RcuHashCreateTable" );
+
+  ht = (RcuHashTable) malloc( sizeof( struct sRcuHashTable ) );
+  if( ht == NULL )
+    goto ERR_RETURN;
+
+  for( bits = 1; (bits < 31) && ((1U << bits) * RCU_HASH_MAX_LOAD < size);
+       bits++ )
+    ;
+
+  ht->directory = newDirectory( bits );
+  if( ht->directory == NULL )
+  {
+    free( ht );
+    ht = NULL;
+    goto ERR_RETURN;
+  }
+
+  error = threading_mutex_init( &(ht->lock) );
+  if( error != NULL )
+  {
+    ErrDispose( error, TRUE );
+    free( (void *) ht->directory );
+    free( ht );
+    ht = NULL;
+    goto ERR_RETURN;
+  }
+
+  ht->seed = HashNewSeed();
+  ht->calcIndx = calc;
+  ht->compData = comp;
+  ht->destrData = destr;
+  ht->domain = epoch_getDefaultDomain();
+  ht->elementCount = 0;
+
+ ERR_RETURN:
+  ErrPopFunc();
+  return ht;
+}
+
+void RcuHashDestroyTable( RcuHashTable ht )
+{
+  RcuDirectory dir = ht->directory;
+  size_t i;
+  unsigned int j;
+
+  if( ht->destrData != NULL )
+    for( i = 0; i < ((size_t) 1 << dir->bits); i++ )
+      if( dir->buckets[ i ] != NULL )
+        for( j = 0; j < dir->buckets[ i ]->count; j++ )
+          ht->destrData( dir->buckets[ i ]->entries[ j ].data );
+
+  freeDirectory( dir );
+  threading_mutex_destroy( &(ht->lock) );
+  free( ht );
+}
+
+int RcuHashGetElementCount( RcuHashTable ht )
+{
+  return atomic_loadInt( &(ht->elementCount) );
+}
+
+void *RcuHashFind( RcuHashTable ht, void *data )
+{
+  unsigned int hashValue = (unsigned int) ht->calcIndx( data );
+  RcuDirectory dir;
+  RcuBucket bucket;
+  void *result = NULL;
+  int i;
+
+  epoch_enter( ht->domain );
+
+  dir = atomic_loadPtr( (void * volatile *) &(ht->directory) );
+  bucket = atomic_loadPtr( (void * volatile *)
+                           &(dir->buckets[ BUCKET_INDEX( ht, dir,
+                                                         hashValue ) ]) );
+
+  i = findInBucket( ht, bucket, data, hashValue );
+  if( i >= 0 )
+    result = bucket->entries[ i ].data;
+
+  epoch_exit( ht->domain );
+
+  return result;
+}
+
+int RcuHashAdd( RcuHashTable ht, void *data )
+{
+  unsigned int hashValue = (unsigned int) ht->calcIndx( data );
+  unsigned int index, oldCount;
+  RcuBucket oldBucket, bucket;
+  int retval = 0;
+
+  threading_mutex_lock( &(ht->lock) );
+
+  index = BUCKET_INDEX( ht, ht->directory, hashValue );
+  if( findInBucket( ht, ht->directory->buckets[ index ], data,
+                    hashValue ) >= 0 )
+    goto ERR_RETURN;
+
+  /* If the table cannot grow, it is still correct, only slower */
+  if( ((unsigned int) ht->elementCount >=
+       ((1U << ht->directory->bits) * RCU_HASH_MAX_LOAD)) &&
+      grow( ht ) )
+    index = BUCKET_INDEX( ht, ht->directory, hashValue );
+
+  oldBucket = ht->directory->buckets[ index ];
+  oldCount = (oldBucket == NULL) ? 0 : oldBucket->count;
+
+  bucket = newBucket( oldCount + 1 );
+  if( bucket == NULL )
+    goto ERR_RETURN;
+
+  if( oldCount > 0 )
+    memcpy( bucket->entries, oldBucket->entries,
+            oldCount * sizeof( sRcuEntry ) );
+  bucket->entries[ oldCount ].hashValue = hashValue;
+  bucket->entries[ oldCount ].data = data;
+
+  atomic_storePtr( (void * volatile *) &(ht->directory->buckets[ index ]),
+                   bucket );
+  if( oldBucket != NULL )
+    epoch_retire( ht->domain, oldBucket, free );
+
+  atomic_storeInt( &(ht->elementCount), ht->elementCount + 1 );
+  retval = 1;
+
+ ERR_RETURN:
+  threading_mutex_unlock( &(ht->lock) );
+  return retval;
+}
+
+static int removeElement( RcuHashTable ht, void *data, Boolean destroy )
+{
+  unsigned int hashValue = (unsigned int) ht->calcIndx( data );
+  unsigned int index;
+  RcuBucket oldBucket, bucket = NULL;
+  void *removed;
+  int i;
+
+  threading_mutex_lock( &(ht->lock) );
+
+  index = BUCKET_INDEX( ht, ht->directory, hashValue );
+  oldBucket = ht->directory->buckets[ index ];
+
+  i = findInBucket( ht, oldBucket, data, hashValue );
+  if( i < 0 )
+  {
+    threading_mutex_unlock( &(ht->lock) );
+    return 0;
+  }
+
+  removed = oldBucket->entries[ i ].data;
+
+  if( oldBucket->count > 1 )
+  {
+    bucket = newBucket( oldBucket->count - 1 );
+    if( bucket == NULL )
+    {
+      threading_mutex_unlock( &(ht->lock) );
+      return 0;
+    }
+
+    memcpy( bucket->entries, oldBucket->entries, i * sizeof( sRcuEntry ) );
+    memcpy( bucket->entries + i, oldBucket->entries + i + 1,
+            (oldBucket->count - i - 1) * sizeof( sRcuEntry ) );
+  }
+
+  atomic_storePtr( (void * volatile *) &(ht->directory->buckets[ index ]),
+                   bucket );
+  epoch_retire( ht->domain, oldBucket, free );
+
+  if( destroy && (ht->destrData != NULL) )
+    epoch_retire( ht->domain, removed, ht->destrData );
+
+  atomic_storeInt( &(ht->elementCount), ht->elementCount - 1 );
+
+  threading_mutex_unlock( &(ht->lock) );
+
+  return 1;
+}
+
+int RcuHashDelete( RcuHashTable ht, void *data )
+{
+  return removeElement( ht, data, FALSE );
+}
+
+int RcuHashDestroy( RcuHashTable ht, void *data )
+{
+  return removeElement( ht, data, TRUE );
+}
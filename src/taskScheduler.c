@@ -0,0 +1,704 @@
+/*
+  Copyright (C) 1999-2002 Voxi AB. All rights reserved.
+
+  This software is the proprietary information of Voxi AB, Stockholm, Sweden.
+  Use of this software is subject to license terms.
+
+*/
+
+/*
+   taskScheduler.c -- work-stealing task scheduler
+
+   Every worker owns a Chase-Lev deque: the owner pushes and pops at the
+   bottom without locking, thieves take from the top with a single
+   compare-and-swap. Only when the deque holds a single task do the owner
+   and the thieves race for it, and the owner then also uses the
+   compare-and-swap. The deque grows when it is full; the arrays it has
+   outgrown are kept until the scheduler is destroyed, since a thief may
+   still be reading them.
+
+   Idle workers sleep on an eventcount. A worker that finds no task counts
+   itself as a sleeper, reads the wakeup counter, and looks for tasks once
+   more before it sleeps on the counter. A spawner that sees sleepers
+   increments the counter and wakes one of them. Either the spawner sees
+   the sleeper, or the sleeper sees the task; and a wakeup that comes
+   between the read of the counter and the sleep makes the sleep return at
+   once.
+
+   Task records are kept on a free list per worker. A record goes on the
+   list of the worker that ran it, which need not be the one that
+   allocated it.
+*/
+
+#include <voxi/util/config.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <voxi/util/win32_glue.h>
+#endif /* WIN32 */
+
+#include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/err.h>
+#include <voxi/util/mem.h>
+#include <voxi/util/threading.h>
+
+#include <voxi/util/taskScheduler.h>
+
+CVSID("$Id$");
+
+/* --------- Definitions */
+
+/* Slots in a new deque, a power of two */
+#define DEQUE_INITIAL_SIZE 256
+
+/* Finished task records a worker keeps for reuse. Records spawned by
+   other threads, or stolen, end up with the worker that ran them, so the
+   rest are freed */
+#define FREE_TASKS_MAX 256
+
+/* Steal attempts per worker before a thief gives up for a round */
+#define STEAL_ATTEMPTS 2
+
+/* Rounds an idle worker looks for tasks, yielding in between, before it
+   sleeps */
+#define IDLE_ROUNDS 64
+
+typedef struct sSchedulerTask
+{
+  ThreadFunc func;
+  void *args;
+  TaskGroup group;
+  struct sSchedulerTask *next;
+} sSchedulerTask, *SchedulerTask;
+
+typedef struct sDequeArray
+{
+  int mask;
+  /* the array this one replaced */
+  struct sDequeArray *previous;
+  void * volatile slots[ 1 ];
+} sDequeArray, *DequeArray;
+
+typedef struct sWorker
+{
+  /* top is written by thieves, bottom by the owner */
+  char topPadding[ 64 ];
+  volatile int top;
+  char bottomPadding[ 64 ];
+  volatile int bottom;
+  DequeArray volatile array;
+
+  TaskScheduler scheduler;
+  int index;
+  unsigned int random;
+  SchedulerTask freeTasks;
+  int freeTaskCount;
+  pthread_t thread;
+  char endPadding[ 64 ];
+} sWorker, *Worker;
+
+struct sTaskScheduler
+{
+  int workerCount;
+  Worker workers;
+  volatile int isShuttingDown;
+
+  /* tasks spawned by threads that are not workers, oldest first */
+  sVoxiMutex injectLock;
+  SchedulerTask injectFirst, injectLast;
+  volatile int injectCount;
+
+  /* the eventcount idle workers sleep on */
+  volatile int sleepers;
+  volatile int wakeups;
+};
+
+/* --------- Static data */
+
+static pthread_once_t workerKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t workerKey;
+
+/* --------- Static functions */
+
+static void createWorkerKey( void )
+{
+  int err;
+
+  err = pthread_key_create( &workerKey, NULL );
+  assert( err == 0 );
+}
+
+static Worker getCurrentWorker( TaskScheduler scheduler )
+{
+  Worker worker = pthread_getspecific( workerKey );
+
+  if( (worker != NULL) && (worker->scheduler == scheduler) )
+    return worker;
+  else
+    return NULL;
+}
+
+static DequeArray dequeArrayCreate( int size )
+{
+  DequeArray array;
+
+  array = malloc( sizeof( sDequeArray ) + (size - 1) * sizeof( void * ) );
+  if( array == NULL )
+    return NULL;
+
+  array->mask = size - 1;
+  array->previous = NULL;
+
+  return array;
+}
+
+/* Moves the tasks to an array twice the size. Called by the owner only. */
+static DequeArray dequeGrow( Worker worker, DequeArray array, int top,
+                             int bottom )
+{
+  DequeArray newArray;
+  int i;
+
+  newArray = dequeArrayCreate( 2 * (array->mask + 1) );
+  if( newArray == NULL )
+    return NULL;
+
+  for( i = top; i != bottom; i = (int) ((unsigned int) i + 1) )
+    newArray->slots[ i & newArray->mask ] = array->slots[ i & array->mask ];
+
+  newArray->previous = array;
+  atomic_storePtr( (void * volatile *) &(worker->array), newArray );
+
+  return newArray;
+}
+
+static Boolean dequePush( Worker worker, SchedulerTask task )
+{
+  DequeArray array = worker->array;
+  int bottom = worker->bottom;
+  int top = atomic_loadInt( &(worker->top) );
+
+  if( (int) ((unsigned int) bottom - (unsigned int) top) > array->mask )
+  {
+    array = dequeGrow( worker, array, top, bottom );
+    if( array == NULL )
+      return FALSE;
+  }
+
+  atomic_storePtr( &(array->slots[ bottom & array->mask ]), task );
+  /* publishes the slot to thieves */
+  atomic_storeInt( &(worker->bottom), (int) ((unsigned int) bottom + 1) );
+
+  return TRUE;
+}
+
+static SchedulerTask dequePop( Worker worker )
+{
+  DequeArray array = worker->array;
+  SchedulerTask task;
+  int bottom, top, size;
+
+  bottom = (int) ((unsigned int) worker->bottom - 1);
+  atomic_storeInt( &(worker->bottom), bottom );
+  /* thieves must see the new bottom before we look at top */
+  atomic_fence();
+  top = atomic_loadInt( &(worker->top) );
+
+  size = (int) ((unsigned int) bottom - (unsigned int) top);
+  if( size < 0 )
+  {
+    atomic_storeInt( &(worker->bottom), (int) ((unsigned int) bottom + 1) );
+    return NULL;
+  }
+
+  task = atomic_loadPtr( &(array->slots[ bottom & array->mask ]) );
+  if( size > 0 )
+    return task;
+
+  /* The last task; thieves may be after it too */
+  if( !atomic_casInt( &(worker->top), top, (int) ((unsigned int) top + 1) ) )
+    task = NULL;
+  atomic_storeInt( &(worker->bottom), (int) ((unsigned int) bottom + 1) );
+
+  return task;
+}
+
+static SchedulerTask dequeSteal( Worker victim )
+{
+  DequeArray array;
+  SchedulerTask task;
+  int top, bottom;
+
+  top = atomic_loadInt( &(victim->top) );
+  atomic_fence();
+  bottom = atomic_loadInt( &(victim->bottom) );
+
+  if( (int) ((unsigned int) bottom - (unsigned int) top) <= 0 )
+    return NULL;
+
+  array = atomic_loadPtr( (void * volatile *) &(victim->array) );
+  task = atomic_loadPtr( &(array->slots[ top & array->mask ]) );
+  if( !atomic_casInt( &(victim->top), top, (int) ((unsigned int) top + 1) ) )
+    return NULL;
+
+  return task;
+}
+
+static SchedulerTask takeInjected( TaskScheduler scheduler )
+{
+  SchedulerTask task;
+
+  if( atomic_loadInt( &(scheduler->injectCount) ) == 0 )
+    return NULL;
+
+  threading_mutex_lock( &(scheduler->injectLock) );
+  task = scheduler->injectFirst;
+  if( task != NULL )
+  {
+    scheduler->injectFirst = task->next;
+    if( scheduler->injectFirst == NULL )
+      scheduler->injectLast = NULL;
+    atomic_addInt( &(scheduler->injectCount), -1 );
+  }
+  threading_mutex_unlock( &(scheduler->injectLock) );
+
+  return task;
+}
+
+static SchedulerTask steal( Worker worker )
+{
+  TaskScheduler scheduler = worker->scheduler;
+  SchedulerTask task;
+  unsigned int random;
+  int i, victim;
+
+  if( scheduler->workerCount == 1 )
+    return NULL;
+
+  for( i = 0; i < STEAL_ATTEMPTS * scheduler->workerCount; i++ )
+  {
+    /* xorshift */
+    random = worker->random;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    worker->random = random;
+
+    victim = (int) (random % (unsigned int) scheduler->workerCount);
+    if( victim == worker->index )
+      continue;
+
+    task = dequeSteal( &(scheduler->workers[ victim ]) );
+    if( task != NULL )
+      return task;
+  }
+
+  return NULL;
+}
+
+static SchedulerTask findTask( Worker worker )
+{
+  SchedulerTask task;
+
+  task = dequePop( worker );
+  if( task == NULL )
+    task = takeInjected( worker->scheduler );
+  if( task == NULL )
+    task = steal( worker );
+
+  return task;
+}
+
+static void finishTask( TaskGroup group )
+{
+  /* The waiter may be gone as soon as the count drops, but waking an
+     address that is no longer in use is harmless */
+  if( atomic_addInt( &(group->pending), -2 ) == 1 )
+    threading_word_wake( &(group->pending), THREADING_WORD_WAKE_ALL );
+}
+
+static void runTask( Worker worker, SchedulerTask task )
+{
+  TaskGroup group = task->group;
+
+  task->func( task->args );
+
+  if( worker->freeTaskCount < FREE_TASKS_MAX )
+  {
+    task->next = worker->freeTasks;
+    worker->freeTasks = task;
+    worker->freeTaskCount++;
+  }
+  else
+    free( task );
+
+  if( group != NULL )
+    finishTask( group );
+}
+
+static void wakeSleeper( TaskScheduler scheduler )
+{
+  /* The task must be visible before we look for sleepers */
+  atomic_fence();
+  if( atomic_loadInt( &(scheduler->sleepers) ) > 0 )
+  {
+    atomic_addInt( &(scheduler->wakeups), 1 );
+    threading_word_wake( &(scheduler->wakeups), 1 );
+  }
+}
+
+static void *workerLoop( void *arg )
+{
+  Worker worker = arg;
+  TaskScheduler scheduler = worker->scheduler;
+  SchedulerTask task;
+  int rounds, key;
+
+  pthread_setspecific( workerKey, worker );
+
+  for( ;; )
+  {
+    task = findTask( worker );
+    for( rounds = 0; (task == NULL) && (rounds < IDLE_ROUNDS) &&
+           !atomic_loadInt( &(scheduler->isShuttingDown) ); rounds++ )
+    {
+      threading_yield();
+      task = findTask( worker );
+    }
+
+    if( task == NULL )
+    {
+      if( atomic_loadInt( &(scheduler->isShuttingDown) ) )
+      {
+        /* A task may have been queued just before the flag was set */
+        task = findTask( worker );
+        if( task == NULL )
+          break;
+      }
+      else
+      {
+        atomic_addInt( &(scheduler->sleepers), 1 );
+        key = atomic_loadInt( &(scheduler->wakeups) );
+        task = findTask( worker );
+        if( (task == NULL) && !atomic_loadInt( &(scheduler->isShuttingDown) ) )
+          threading_word_wait( &(scheduler->wakeups), key );
+        atomic_addInt( &(scheduler->sleepers), -1 );
+      }
+    }
+
+    if( task != NULL )
+      runTask( worker, task );
+  }
+
+  return NULL;
+}
+
+/* --------- Exported functions */
+
+void taskGroup_init( TaskGroup group )
+{
+  group->pending = 0;
+}
+
+Error taskScheduler_create( int workerCount, ThreadSpec spec,
+                            TaskScheduler *res )
+{
+  Error error = NULL;
+  TaskScheduler scheduler;
+  sThreadSpec workerSpec;
+  Worker worker;
+  int i, err, started = 0;
+
+  assert( workerCount >= 0 );
+
+  pthread_once( &workerKeyOnce, createWorkerKey );
+
+  if( workerCount == 0 )
+    workerCount = threading_getCpuCount();
+
+  if( spec != NULL )
+    workerSpec = *spec;
+  else
+    threading_spec_init( &workerSpec );
+  /* The scheduler joins its workers itself */
+  workerSpec.detached = FALSE;
+
+  scheduler = malloc( sizeof( struct sTaskScheduler ) );
+  if( scheduler == NULL )
+    return ErrNew( ERR_MEMORY, MEMERR_OUT, NULL,
+                   "taskScheduler_create: out of memory." );
+
+  scheduler->workerCount = workerCount;
+  scheduler->isShuttingDown = FALSE;
+  scheduler->injectFirst = NULL;
+  scheduler->injectLast = NULL;
+  scheduler->injectCount = 0;
+  scheduler->sleepers = 0;
+  scheduler->wakeups = 0;
+
+  scheduler->workers = calloc( workerCount, sizeof( sWorker ) );
+  if( scheduler->workers == NULL )
+  {
+    error = ErrNew( ERR_MEMORY, MEMERR_OUT, NULL,
+                    "taskScheduler_create: out of memory." );
+    goto ERR1;
+  }
+
+  for( i = 0; i < workerCount; i++ )
+  {
+    worker = &(scheduler->workers[ i ]);
+    worker->scheduler = scheduler;
+    worker->index = i;
+    worker->random = 2654435769U * (unsigned int) (i + 1);
+    worker->array = dequeArrayCreate( DEQUE_INITIAL_SIZE );
+    if( worker->array == NULL )
+    {
+      error = ErrNew( ERR_MEMORY, MEMERR_OUT, NULL,
+                      "taskScheduler_create: out of memory." );
+      goto ERR2;
+    }
+  }
+
+  error = threading_mutex_init( &(scheduler->injectLock) );
+  if( error != NULL )
+    goto ERR2;
+
+  for( started = 0; started < workerCount; started++ )
+  {
+    worker = &(scheduler->workers[ started ]);
+    err = threading_pthread_createSpec( &(worker->thread), &workerSpec,
+                                        workerLoop, worker );
+    if( err != 0 )
+    {
+      error = ErrNew( ERR_THREADING, 0, NULL,
+                      "taskScheduler_create: Couldn't create worker "
+                      "thread." );
+      goto ERR3;
+    }
+  }
+
+  *res = scheduler;
+
+  return NULL;
+
+ ERR3:
+  atomic_storeInt( &(scheduler->isShuttingDown), TRUE );
+  atomic_addInt( &(scheduler->wakeups), 1 );
+  threading_word_wake( &(scheduler->wakeups), THREADING_WORD_WAKE_ALL );
+  for( i = 0; i < started; i++ )
+    pthread_join( scheduler->workers[ i ].thread, NULL );
+  threading_mutex_destroy( &(scheduler->injectLock) );
+ ERR2:
+  for( i = 0; i < workerCount; i++ )
+    free( scheduler->workers[ i ].array );
+  free( scheduler->workers );
+ ERR1:
+  free( scheduler );
+
+  return error;
+}
+
+void taskScheduler_destroy( TaskScheduler scheduler )
+{
+  SchedulerTask task, nextTask;
+  DequeArray array, previous;
+  Worker worker;
+  int i, err;
+
+  assert( getCurrentWorker( scheduler ) == NULL );
+
+  /* Set under the lock, so that a spawn either fails or is seen by the
+     workers before they exit */
+  threading_mutex_lock( &(scheduler->injectLock) );
+  atomic_storeInt( &(scheduler->isShuttingDown), TRUE );
+  threading_mutex_unlock( &(scheduler->injectLock) );
+
+  atomic_addInt( &(scheduler->wakeups), 1 );
+  threading_word_wake( &(scheduler->wakeups), THREADING_WORD_WAKE_ALL );
+
+  for( i = 0; i < scheduler->workerCount; i++ )
+  {
+    err = pthread_join( scheduler->workers[ i ].thread, NULL );
+    assert( err == 0 );
+  }
+
+  for( i = 0; i < scheduler->workerCount; i++ )
+  {
+    worker = &(scheduler->workers[ i ]);
+
+    for( task = worker->freeTasks; task != NULL; task = nextTask )
+    {
+      nextTask = task->next;
+      free( task );
+    }
+
+    for( array = worker->array; array != NULL; array = previous )
+    {
+      previous = array->previous;
+      free( array );
+    }
+  }
+
+  assert( scheduler->injectFirst == NULL );
+
+  threading_mutex_destroy( &(scheduler->injectLock) );
+  free( scheduler->workers );
+  free( scheduler );
+}
+
+Error taskScheduler_spawn( TaskScheduler scheduler, TaskGroup group,
+                           ThreadFunc func, void *args )
+{
+  Error error = NULL;
+  SchedulerTask task;
+  Worker worker;
+
+  assert( func != NULL );
+
+  worker = getCurrentWorker( scheduler );
+
+  if( (worker != NULL) && (worker->freeTasks != NULL) )
+  {
+    task = worker->freeTasks;
+    worker->freeTasks = task->next;
+    worker->freeTaskCount--;
+  }
+  else
+  {
+    task = malloc( sizeof( sSchedulerTask ) );
+    if( task == NULL )
+      return ErrNew( ERR_MEMORY, MEMERR_OUT, NULL,
+                     "taskScheduler_spawn: out of memory." );
+  }
+
+  task->func = func;
+  task->args = args;
+  task->group = group;
+  task->next = NULL;
+
+  if( group != NULL )
+    atomic_addInt( &(group->pending), 2 );
+
+  if( worker != NULL )
+  {
+    if( !dequePush( worker, task ) )
+    {
+      error = ErrNew( ERR_MEMORY, MEMERR_OUT, NULL,
+                      "taskScheduler_spawn: out of memory." );
+      goto ERR1;
+    }
+  }
+  else
+  {
+    threading_mutex_lock( &(scheduler->injectLock) );
+    if( scheduler->isShuttingDown )
+    {
+      threading_mutex_unlock( &(scheduler->injectLock) );
+      error = ErrNew( ERR_THREADING, 0, NULL,
+                      "Cannot spawn task, since the scheduler is shutting "
+                      "down." );
+      goto ERR1;
+    }
+    if( scheduler->injectLast != NULL )
+      scheduler->injectLast->next = task;
+    else
+      scheduler->injectFirst = task;
+    scheduler->injectLast = task;
+    atomic_addInt( &(scheduler->injectCount), 1 );
+    threading_mutex_unlock( &(scheduler->injectLock) );
+  }
+
+  wakeSleeper( scheduler );
+
+  return NULL;
+
+ ERR1:
+  if( group != NULL )
+    atomic_addInt( &(group->pending), -2 );
+  free( task );
+
+  return error;
+}
+
+Error taskScheduler_spawnFuture( TaskScheduler scheduler,
+                                 ThreadFunc func, void *args, Future *res )
+{
+  Error error;
+  Future future;
+
+  future = future_createTask( func, args );
+  if( future == NULL )
+    return ErrNew( ERR_MEMORY, MEMERR_OUT, NULL,
+                   "taskScheduler_spawnFuture: out of memory." );
+
+  error = taskScheduler_spawn( scheduler, NULL, future_runTask, future );
+  if( error != NULL )
+  {
+    /* Neither side will use it */
+    future_release( future );
+    future_release( future );
+    return error;
+  }
+
+  *res = future;
+
+  return NULL;
+}
+
+void taskScheduler_wait( TaskScheduler scheduler, TaskGroup group )
+{
+  SchedulerTask task;
+  Worker worker;
+  int pending;
+
+  worker = getCurrentWorker( scheduler );
+
+  if( worker != NULL )
+  {
+    /* Run tasks until the group is done, ours first */
+    while( atomic_loadInt( &(group->pending) ) >= 2 )
+    {
+      task = findTask( worker );
+      if( task != NULL )
+        runTask( worker, task );
+      else
+        threading_yield();
+    }
+  }
+  else
+  {
+    for( ;; )
+    {
+      pending = atomic_loadInt( &(group->pending) );
+      if( pending < 2 )
+        break;
+
+      /* Tell finishTask that someone sleeps on the count */
+      if( ((pending & 1) == 0) &&
+          !atomic_casInt( &(group->pending), pending, pending | 1 ) )
+        continue;
+
+      threading_word_wait( &(group->pending), pending | 1 );
+    }
+  }
+}
+
+int taskScheduler_getWorkerCount( TaskScheduler scheduler )
+{
+  return scheduler->workerCount;
+}
+
+int taskScheduler_getCurrentWorker( TaskScheduler scheduler )
+{
+  Worker worker;
+
+  pthread_once( &workerKeyOnce, createWorkerKey );
+
+  worker = getCurrentWorker( scheduler );
+
+  return (worker != NULL) ? worker->index : -1;
+}
@@ -10,6 +10,11 @@
  * Utility functions for threading 
  */
 
+#ifndef _GNU_SOURCE
+/* for pthread_setname_np and pthread_setaffinity_np */
+#define _GNU_SOURCE
+#endif
+
 #include "config.h"
 
 #include <assert.h>
@@ -17,6 +22,8 @@
 #include <errno.h>
 #include <semaphore.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef HAVE_TIME_H
 #include <time.h>
@@ -34,7 +41,19 @@
 #include <sys/time.h>
 #endif
 
+#ifndef WIN32
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#define THREADING_FUTEX
+#endif
+
 #include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/time.h>
 
 #include <voxi/util/threading.h>
 
@@ -44,6 +63,34 @@ CVSID("$Id$");
   macros
 */
 
+/* contention profile records per thread, a power of two */
+#define PROFILE_RECORDS 256
+/* hold times of at least 2^i ns, but less than 2^(i + 1), go in bucket i */
+#define PROFILE_HOLD_BUCKETS 24
+
+/*
+  types
+*/
+
+typedef struct
+{
+  void * volatile mutex;
+  const char *where;
+  unsigned long acquisitions;
+  unsigned long contended;
+  uint64_t waitTotal, waitMax;
+  uint64_t holdMax;
+  unsigned long holds[ PROFILE_HOLD_BUCKETS ];
+} sProfileRecord, *ProfileRecord;
+
+typedef struct sProfileBuffer
+{
+  sProfileRecord records[ PROFILE_RECORDS ];
+  /* lockings not recorded because the buffer was full */
+  unsigned long dropped;
+  struct sProfileBuffer *next;
+} sProfileBuffer, *ProfileBuffer;
+
 /*
  * Exported data
  */
@@ -61,6 +108,449 @@ pthread_attr_t detachedThreadAttr, realtimeDetachedThreadAttr,
  */
 static int inits = 0;
 
+static pthread_once_t threadIdOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t threadIdKey;
+static volatile int lastThreadId = 0;
+
+static volatile int lockProfiling = 0;
+static pthread_once_t profileOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t profileKey;
+static ProfileBuffer volatile profileBuffers = NULL;
+static const char *profileFileName = NULL;
+
+#ifndef NDEBUG
+/* 
+   The read locks each thread holds, kept by debug builds to catch nested 
+   read locks, see threading_rwlock_rdlock.
+*/
+typedef struct sReadHold
+{
+  VoxiRWLock rwlock;
+  struct sReadHold *next;
+} sReadHold, *ReadHold;
+
+static pthread_once_t readHoldOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t readHoldKey;
+#endif
+
+/*
+ * static functions
+ */
+static void profileReport( void );
+
+/*
+  Ids of threads that have locked a VoxiMutex. A thread gets its id the
+  first time it locks one; 0 is never used.
+*/
+static void createThreadIdKey( void )
+{
+  int err;
+  
+  err = pthread_key_create( &threadIdKey, NULL );
+  assert( err == 0 );
+}
+
+static int getThreadId( void )
+{
+  int id;
+  
+  pthread_once( &threadIdOnce, createThreadIdKey );
+  
+  id = (int) (long) pthread_getspecific( threadIdKey );
+  if( id == 0 )
+  {
+    id = atomic_addInt( &lastThreadId, 1 );
+    pthread_setspecific( threadIdKey, (void *) (long) id );
+  }
+  
+  return id;
+}
+
+/* Sleeps until woken if the lock word still has the given value */
+static void waitOnState( VoxiMutex mutex, int value )
+{
+#ifdef THREADING_FUTEX
+  syscall( SYS_futex, &(mutex->state), FUTEX_WAIT_PRIVATE, value, 
+           NULL, NULL, 0 );
+#else
+  pthread_mutex_lock( &(mutex->parkMutex) );
+  if( atomic_loadInt( &(mutex->state) ) == value )
+    pthread_cond_wait( &(mutex->parkCondition), &(mutex->parkMutex) );
+  pthread_mutex_unlock( &(mutex->parkMutex) );
+#endif
+}
+
+/* Wakes one of the threads sleeping in waitOnState */
+static void wakeState( VoxiMutex mutex )
+{
+#ifdef THREADING_FUTEX
+  syscall( SYS_futex, &(mutex->state), FUTEX_WAKE_PRIVATE, 1, 
+           NULL, NULL, 0 );
+#else
+  pthread_mutex_lock( &(mutex->parkMutex) );
+  pthread_cond_signal( &(mutex->parkCondition) );
+  pthread_mutex_unlock( &(mutex->parkMutex) );
+#endif
+}
+
+/*
+  Takes the lock word. A free lock is taken with a single compare-and-swap.
+  Otherwise an adaptive mutex polls the word for a while, and if that fails
+  the word is set to 2, so that the thread releasing it knows that it has 
+  to wake someone, and the thread sleeps until it is released.
+*/
+static Boolean acquireLock( VoxiMutex mutex )
+{
+  int state, spins;
+  Boolean contended = FALSE, spun = FALSE;
+  unsigned long parks = 0;
+  
+  if( !atomic_casInt( &(mutex->state), 0, 1 ) )
+  {
+    contended = TRUE;
+    
+    /* On a single processor the holder cannot run while we poll */
+    if( (mutex->spinBudget > 0) && (threading_getCpuCount() > 1) )
+    {
+      for( spins = 0; spins < mutex->spinBudget; spins++ )
+      {
+        atomic_pause();
+        
+        state = atomic_loadInt( &(mutex->state) );
+        /* Others are already sleeping on it, so it is held for long */
+        if( state == 2 )
+          break;
+        if( (state == 0) && atomic_casInt( &(mutex->state), 0, 1 ) )
+        {
+          spun = TRUE;
+          break;
+        }
+      }
+    }
+    
+    if( !spun )
+    {
+      state = atomic_exchangeInt( &(mutex->state), 2 );
+      while( state != 0 )
+      {
+        parks++;
+        waitOnState( mutex, 2 );
+        state = atomic_exchangeInt( &(mutex->state), 2 );
+      }
+    }
+  }
+  
+  mutex->acquisitions++;
+  if( contended )
+  {
+    mutex->contendedAcquisitions++;
+    if( spun )
+      mutex->spinAcquisitions++;
+    mutex->parks += parks;
+  }
+  
+  /* 
+     A thread in threading_cond_wait may have released the lock without 
+     waiting on its condition yet. It holds condMutex until it does, so 
+     wait for that before returning and perhaps signalling the condition.
+     condWindow is only set and cleared with the lock held, so only the 
+     first acquisition after a release in condWait does this.
+  */
+  if( mutex->condWindow )
+  {
+    pthread_mutex_lock( &(mutex->condMutex) );
+    pthread_mutex_unlock( &(mutex->condMutex) );
+    mutex->condWindow = FALSE;
+  }
+  
+  return contended;
+}
+
+static void releaseLock( VoxiMutex mutex )
+{
+  if( atomic_addInt( &(mutex->state), -1 ) != 0 )
+  {
+    atomic_storeInt( &(mutex->state), 0 );
+    wakeState( mutex );
+  }
+}
+
+/*
+  Contention profiling, see threading_profile_setEnabled. Each thread has a
+  buffer of records, found by hashing the mutex and where. Only the owning
+  thread writes to a buffer; a record's mutex field is set last, so that 
+  threading_profile_dump can read the buffers of running threads.
+*/
+static void profileInit( void )
+{
+  int err;
+  const char *fileName;
+  
+  err = pthread_key_create( &profileKey, NULL );
+  assert( err == 0 );
+  
+  fileName = getenv( "VOXI_LOCK_PROFILE" );
+  if( fileName != NULL )
+  {
+    profileFileName = fileName;
+    atexit( profileReport );
+    atomic_storeInt( &lockProfiling, 1 );
+  }
+}
+
+/* Called at exit when profiling was turned on by VOXI_LOCK_PROFILE */
+static void profileReport( void )
+{
+  FILE *file = stderr;
+  
+  if( (profileFileName[ 0 ] != '\0') && (strcmp( profileFileName, "-" ) != 0) )
+  {
+    file = fopen( profileFileName, "w" );
+    if( file == NULL )
+    {
+      perror( "threading: VOXI_LOCK_PROFILE" );
+      return;
+    }
+  }
+  
+  threading_profile_dump( file );
+  
+  if( file != stderr )
+    fclose( file );
+}
+
+/* Returns the calling thread's buffer, creating it on first use */
+static ProfileBuffer getProfileBuffer( void )
+{
+  ProfileBuffer buffer;
+  
+  buffer = (ProfileBuffer) pthread_getspecific( profileKey );
+  if( buffer != NULL )
+    return buffer;
+  
+  buffer = (ProfileBuffer) calloc( 1, sizeof( sProfileBuffer ) );
+  if( buffer == NULL )
+    return NULL;
+  
+  /* The buffers are kept after their threads exit, for the report */
+  do
+    buffer->next = atomic_loadPtr( (void * volatile *) &profileBuffers );
+  while( !atomic_casPtr( (void * volatile *) &profileBuffers, 
+                         buffer->next, buffer ) );
+  
+  pthread_setspecific( profileKey, buffer );
+  
+  return buffer;
+}
+
+/* Returns the record for mutex and where, NULL if the buffer is full */
+static ProfileRecord findProfileRecord( ProfileBuffer buffer, 
+                                        VoxiMutex mutex, const char *where )
+{
+  ProfileRecord record;
+  unsigned int i, probes;
+  
+  i = (unsigned int) ((size_t) mutex >> 3) * 31 + 
+    (unsigned int) ((size_t) where >> 3);
+  
+  for( probes = 0; probes < PROFILE_RECORDS; probes++ )
+  {
+    record = &(buffer->records[ (i + probes) & (PROFILE_RECORDS - 1) ]);
+    
+    if( record->mutex == NULL )
+    {
+      record->where = where;
+      atomic_storePtr( &(record->mutex), mutex );
+      return record;
+    }
+    if( (record->mutex == mutex) && (record->where == where) )
+      return record;
+  }
+  
+  buffer->dropped++;
+  return NULL;
+}
+
+/* acquireLock, recording the wait and starting to time the hold */
+static Boolean acquireProfiled( VoxiMutex mutex, const char *where )
+{
+  ProfileBuffer buffer;
+  ProfileRecord record = NULL;
+  uint64_t start, now, wait;
+  Boolean contended;
+  
+  start = nanosec();
+  contended = acquireLock( mutex );
+  now = contended ? nanosec() : start;
+  
+  buffer = getProfileBuffer();
+  if( buffer != NULL )
+    record = findProfileRecord( buffer, mutex, where );
+  
+  if( record != NULL )
+  {
+    record->acquisitions++;
+    if( contended )
+    {
+      wait = now - start;
+      
+      record->contended++;
+      record->waitTotal += wait;
+      if( wait > record->waitMax )
+        record->waitMax = wait;
+    }
+    
+    mutex->profileRecord = record;
+    mutex->profileHoldStart = now;
+  }
+  
+  return contended;
+}
+
+/* Records the end of a hold started by acquireProfiled */
+static void releaseProfiled( VoxiMutex mutex )
+{
+  ProfileRecord record = (ProfileRecord) mutex->profileRecord;
+  uint64_t held = nanosec() - mutex->profileHoldStart;
+  int bucket = 0;
+  
+  mutex->profileRecord = NULL;
+  
+  while( (bucket < PROFILE_HOLD_BUCKETS - 1) && ((held >> (bucket + 1)) != 0) )
+    bucket++;
+  
+  record->holds[ bucket ]++;
+  if( held > record->holdMax )
+    record->holdMax = held;
+}
+
+/* Orders records by mutex and where, so that equal ones end up together */
+static int compareProfileKeys( const void *a, const void *b )
+{
+  const sProfileRecord *r1 = (const sProfileRecord *) a;
+  const sProfileRecord *r2 = (const sProfileRecord *) b;
+  
+  if( r1->mutex != r2->mutex )
+    return ((size_t) r1->mutex < (size_t) r2->mutex) ? -1 : 1;
+  if( r1->where != r2->where )
+    return ((size_t) r1->where < (size_t) r2->where) ? -1 : 1;
+  return 0;
+}
+
+/* Orders records by decreasing total wait, then decreasing lockings */
+static int compareProfileWaits( const void *a, const void *b )
+{
+  const sProfileRecord *r1 = (const sProfileRecord *) a;
+  const sProfileRecord *r2 = (const sProfileRecord *) b;
+  
+  if( r1->waitTotal != r2->waitTotal )
+    return (r1->waitTotal > r2->waitTotal) ? -1 : 1;
+  if( r1->acquisitions != r2->acquisitions )
+    return (r1->acquisitions > r2->acquisitions) ? -1 : 1;
+  return 0;
+}
+
+/* The upper bound of the hold times of the given fraction of the holds */
+static uint64_t holdPercentile( ProfileRecord record, double fraction )
+{
+  unsigned long total = 0, sum = 0;
+  int i;
+  
+  for( i = 0; i < PROFILE_HOLD_BUCKETS; i++ )
+    total += record->holds[ i ];
+  
+  for( i = 0; i < PROFILE_HOLD_BUCKETS - 1; i++ )
+  {
+    sum += record->holds[ i ];
+    if( sum >= total * fraction )
+      break;
+  }
+  
+  if( i == PROFILE_HOLD_BUCKETS - 1 )
+    return record->holdMax;
+  
+  return (uint64_t) 1 << (i + 1);
+}
+
+/*
+  Releases the VoxiMutex completely, waits on the condition and locks the 
+  mutex again. Returns the value returned by pthread_cond_(timed)wait.
+*/
+static int condWait( pthread_cond_t *condition, VoxiMutex mutex, 
+                     struct timespec *wakeuptime )
+{
+  int self = getThreadId();
+  int oldCount;
+  int err;
+  const char *oldLastLockFrom = NULL;
+  const char *profileWhere = NULL;
+  
+  assert( atomic_loadInt( &(mutex->owner) ) == self );
+  assert( mutex->count > 0 );
+  
+  /* 
+     condMutex is held from before the lock is released until the 
+     condition wait has started, see acquireLock 
+  */
+  pthread_mutex_lock( &(mutex->condMutex) );
+  mutex->condWindow = TRUE;
+  
+  /* release the VoxiMutex, saving the old state */
+  oldCount = mutex->count;
+  mutex->count = 0;
+  
+#ifndef NDEBUG
+  /* I dont set it to 0 since i want to know that I was the one that set 
+     these values (when i'm debugging) */
+  mutex->pid = 12;
+  
+  oldLastLockFrom = mutex->lastLockFrom;
+  mutex->lastLockFrom = NULL;
+  
+  if( mutex->debug )
+    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: oldCount=%d\n",
+             condition, mutex, getpid(), oldCount );
+#endif
+  
+  if( mutex->profileRecord != NULL )
+  {
+    profileWhere = ((ProfileRecord) mutex->profileRecord)->where;
+    releaseProfiled( mutex );
+  }
+  
+  atomic_storeInt( &(mutex->owner), 0 );
+  releaseLock( mutex );
+  
+  if( wakeuptime == NULL )
+    err = pthread_cond_wait( condition, &(mutex->condMutex) );
+  else
+    err = pthread_cond_timedwait( condition, &(mutex->condMutex), 
+                                  wakeuptime );
+  
+  pthread_mutex_unlock( &(mutex->condMutex) );
+  
+  if( lockProfiling )
+    acquireProfiled( mutex, profileWhere );
+  else
+    acquireLock( mutex );
+  
+  assert( mutex->count == 0 );
+  mutex->count = oldCount;
+  atomic_storeInt( &(mutex->owner), self );
+  
+#ifndef NDEBUG
+  mutex->lastLockFrom = oldLastLockFrom;
+  mutex->thread = pthread_self();
+  mutex->pid = getpid();
+  
+  if( mutex->debug )
+    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: leaving "
+             "(count=%d)\n", condition, mutex, getpid(), mutex->count );
+#endif
+  
+  return err;
+}
+
 /*
   The threading modules can be init'ed by several modules simultaneously 
   without any problems - it keeps track of how many inits and shutdowns have
@@ -231,24 +721,38 @@ Error threading_shutdown()
 }
 
 Error threading_mutex_init( VoxiMutex mutex )
+{
+  return threading_mutex_initMode( mutex, THREADING_MUTEX_BLOCKING );
+}
+
+Error threading_mutex_initMode( VoxiMutex mutex, VoxiMutexMode mode )
 {
   Error error = NULL;
   int err;
   
-  err = sem_init( &(mutex->semaphore), 0, 1 );
+  pthread_once( &profileOnce, profileInit );
+  
+  err = pthread_mutex_init( &(mutex->condMutex), NULL );
   if (err != 0) {
     error = ErrNew(ERR_THREADING, 0, NULL,
-                   "sem_init failed." );
+                   "pthread_mutex_init failed." );
     goto ERR_RETURN;
   }
-  
-  err = pthread_mutex_init( &(mutex->mutex), NULL );
+
+  err = pthread_mutex_init( &(mutex->parkMutex), NULL );
   if (err != 0) {
     error = ErrNew(ERR_THREADING, 0, NULL,
                    "pthread_mutex_init failed." );
     goto ERR_RETURN;
   }
 
+  err = pthread_cond_init( &(mutex->parkCondition), NULL );
+  if (err != 0) {
+    error = ErrNew(ERR_THREADING, 0, NULL,
+                   "pthread_cond_init failed." );
+    goto ERR_RETURN;
+  }
+
 #ifndef NDEBUG
   /* I dont set it to 0 since i want to know that I was the one that set 
      these values (when i'm debugging) */
@@ -257,125 +761,88 @@ Error threading_mutex_init( VoxiMutex mutex )
   mutex->pid = 0;
 #endif
 
-  mutex->lastLockFrom = NULL;
+  mutex->state = 0;
+  mutex->owner = 0;
   mutex->count = 0;
+  mutex->condWindow = FALSE;
+  mutex->spinBudget = (mode == THREADING_MUTEX_ADAPTIVE) ? 
+    THREADING_MUTEX_SPIN_BUDGET : 0;
+  mutex->acquisitions = 0;
+  mutex->contendedAcquisitions = 0;
+  mutex->spinAcquisitions = 0;
+  mutex->parks = 0;
+  mutex->profileRecord = NULL;
+  mutex->profileHoldStart = 0;
+  mutex->lastLockFrom = NULL;
   mutex->debug = FALSE;
 
  ERR_RETURN:
   return error;
 }
 
+void threading_mutex_setSpinBudget( VoxiMutex mutex, int spinBudget )
+{
+  assert( spinBudget >= 0 );
+  
+  mutex->spinBudget = spinBudget;
+}
+
+void threading_mutex_getStats( VoxiMutex mutex, VoxiMutexStats stats )
+{
+  stats->acquisitions = mutex->acquisitions;
+  stats->contendedAcquisitions = mutex->contendedAcquisitions;
+  stats->spinAcquisitions = mutex->spinAcquisitions;
+  stats->parks = mutex->parks;
+}
+
 void threading_mutex_lock( VoxiMutex mutex )
 {
   threading_mutex_lock_debug( mutex, NULL );
 }
 
-/* FIXME: Change the API of this function to return Error info, since there
-   are several points in it where runtime errors may occur (now marked as
-   commented-out assertions on return values from various functions.
-   NB: This should of course not affect assertions that document the
-   intended algorithmic flow of the implementation itself. -mst */
 const char *threading_mutex_lock_debug( VoxiMutex mutex, const char *where )
 {
-  int err, tempInt;
-  const char *oldWhere;
-
-  DEBUG( "threading_mutex_lock: sem_wait" );
-  
-  if( mutex->debug )
-    fprintf( stderr, "threading_mutex_lock_debug( %p, %s ), pid %d: "
-             "waiting.\n",
-             mutex, (where == NULL) ? "NULL" : where, getpid() );
-  
-  err = threading_sem_wait( &(mutex->semaphore) );
-  /* assert( err == 0 ); */
-
-  err = sem_getvalue( &(mutex->semaphore), &tempInt );
-  /* assert( err == 0 ); */
-  assert( tempInt == 0 );
+  int self = getThreadId();
+  const char *oldWhere = NULL;
 
-  if( mutex->debug )
-    fprintf( stderr, "threading_mutex_lock_debug( %p, %s ), pid %d: "
-             "got semaphore, count=%d.\n",
-             mutex, (where == NULL) ? "NULL" : where, getpid(), mutex->count );
+  if( atomic_loadInt( &(mutex->owner) ) == self )
   {
-    pthread_t mythread = pthread_self();
-    
-    if( (mutex->count > 0) && pthread_equal( mutex->thread, mythread) )
-    {
-      if( mutex->debug )
-        fprintf( stderr, "threading_mutex_lock_debug( %p, %s ), pid %d: got "
-                 "recursive lock.\n", mutex, (where == NULL) ? "NULL" : where,
-                 getpid() );
-  
-      mutex->count++;
-    }
-    else
-    {
-      DEBUG( "threading_mutex_lock: wait sem_post" );
+    assert( mutex->count > 0 );
+    mutex->count++;
+  }
+  else
+  {
+#ifndef NDEBUG
+    if( mutex->debug )
+      fprintf( stderr, "threading_mutex_lock_debug( %p, %s ), pid %d: "
+               "waiting.\n",
+               mutex, (where == NULL) ? "NULL" : where, getpid() );
+#endif
 
-      err = sem_post( &(mutex->semaphore) );
-      /* assert( err == 0 ); */
-      
-#ifndef PTHREADS_WIN32      
-      if( mutex->debug )
-        fprintf( stderr, "threading_mutex_lock_debug( %p, %s ), pid %d: "
-                 "before second wait, status=?\n", mutex, /* status was %ld */
-                 (where == NULL) ? "NULL" : where, getpid()
-                 /* mutex->mutex.__m_lock.__status */);
-#endif /* PTHREADS_WIN32 */
-      
-      err = pthread_mutex_lock( &(mutex->mutex) );
-      /* assert( err == 0 ); */
-      /* assert( mutex->mutex.__m_lock.__status > 0 ); */
-      
-#ifndef PTHREADS_WIN32      
-      if( mutex->debug )
-        fprintf( stderr, "threading_mutex_lock_debug( %p, %s ), pid %d, "
-                 "thread %ld: after second wait, locked mutex_t %p, "
-                 "status = ?, " /* status was %ld */
-                 "waiting for semaphore.\n", 
-                 mutex, (where == NULL) ? "NULL" : where,
-                 getpid(), (long int) pthread_self(), &(mutex->mutex)
-                 /* mutex->mutex.__m_lock.__status */);
-#endif /* PTHREADS_WIN32 */
+    if( lockProfiling )
+      acquireProfiled( mutex, where );
+    else
+      acquireLock( mutex );
 
-      DEBUG( "threading_mutex_lock: wait sem_wait" );
+    assert( mutex->count == 0 );
+    mutex->count = 1;
+    atomic_storeInt( &(mutex->owner), self );
 
-      err = threading_sem_wait( &(mutex->semaphore) );
-      /* assert( err == 0 ); */
+#ifndef NDEBUG
+    mutex->thread = pthread_self();
+    mutex->pid = getpid();
+#endif
+  }
 
-      err = sem_getvalue( &(mutex->semaphore), &tempInt );
-      /* assert( err == 0 ); */
-      assert( tempInt == 0 );
+#ifndef NDEBUG
+  oldWhere = mutex->lastLockFrom;
+  mutex->lastLockFrom = where;
 
-      if( mutex->debug )
-        fprintf( stderr, "threading_mutex_lock_debug( %p, %s ), pid %d: "
-                 "second gotit.\n", mutex, (where == NULL) ? "NULL" : where,
-                 getpid() );
-
-      if( mutex->count != 0 )
-        fprintf( stderr, "ERROR: threading_mutex_lock_debug( %p, %s ), "
-                 "pid %d: mutex count was %d!\n", mutex, 
-                 (where == NULL) ? "NULL" : where,
-                 getpid(), mutex->count );
-
-      assert( mutex->count == 0 );
-      mutex->count = 1;
-      mutex->thread = pthread_self();
-      mutex->pid = getpid();
-    }  
-    oldWhere = mutex->lastLockFrom;
-    mutex->lastLockFrom = where;
-  }
-  DEBUG( "threading_mutex_lock: sem_post" );
-  
-  err = sem_post( &(mutex->semaphore) );
-  /* assert( err == 0 ); */
-  
-  DEBUG("threading_mutex_lock_debug( %p, %s ) = %s\n", mutex,
-        (where == NULL) ? "NULL" : where,
-        (oldWhere == NULL) ? "NULL" : oldWhere);
+  if( mutex->debug )
+    fprintf( stderr, "threading_mutex_lock_debug( %p, %s ), pid %d: "
+             "got lock, count=%d.\n",
+             mutex, (where == NULL) ? "NULL" : where, getpid(), mutex->count );
+#endif
 
   return oldWhere;
 }
@@ -385,187 +852,344 @@ void threading_mutex_unlock( VoxiMutex mutex )
   threading_mutex_unlock_debug( mutex, NULL );
 }
 
-/* FIXME: Change the API of this function to return Error info, since there
-   are several points in it where runtime errors may occur (now marked as
-   commented-out assertions on runtime return values from various functions).
-   NB: This should of course not affect assertions that document the
-   intended algorithmic flow of the implementation itself. -mst */
 void threading_mutex_unlock_debug( VoxiMutex mutex, const char *oldWhere )
 {
-  int err;
-  int tempInt = 0;
-  
-  DEBUG( "threading_mutex_unlock: sem_wait" );
-  
-  err = sem_getvalue( &(mutex->semaphore), &tempInt );
-  /* assert( err == 0 ); */
-  
-  if( mutex->debug )
-    fprintf( stderr, "threading_mutex_unlock_debug( %p, %s ), pid %d: "
-             "waiting for access, sem %p value=%d.\n", mutex, 
-             (oldWhere == NULL) ? "NULL" : oldWhere, getpid(), 
-             &(mutex->semaphore), tempInt );
-  
-  /* wait for the semaphore to have a non-zero value, then decrease it */
-  err = threading_sem_wait( &(mutex->semaphore) );
-  /* assert( err == 0 ); */
-  
-  err = sem_getvalue( &(mutex->semaphore), &tempInt );
-  /* assert( err == 0 ); */
-  assert( tempInt == 0 );
-  
-  assert( pthread_equal( mutex->thread, pthread_self() ) );
+  assert( atomic_loadInt( &(mutex->owner) ) == getThreadId() );
   assert( mutex->count > 0 );
   
-  mutex->lastLockFrom = oldWhere;
   mutex->count--;
   
+#ifndef NDEBUG
+  mutex->lastLockFrom = oldWhere;
+  
   if( mutex->debug )
     fprintf( stderr, "threading_mutex_unlock_debug( %p, %s ), pid %d: "
              "new count=%d\n", mutex, (oldWhere == NULL) ? "NULL" : oldWhere,
              getpid(), mutex->count );
+#endif
   
   if( mutex->count == 0 )
   {
+#ifndef NDEBUG
     /* I dont set it to 0 since i want to know that */
     /* I was the one that set these values (when i'm debugging) */
     mutex->pid = 11;     
-
-    err = pthread_mutex_unlock( &(mutex->mutex) );
-    /* assert( err == 0 ); */
     
-    if( mutex->debug )
-      fprintf( stderr, "threading_mutex_unlock_debug( %p, %s ), pid %d: "
-               "pthread_mutex_unlock( %p )\n", mutex, 
-               (oldWhere == NULL) ? "NULL" : oldWhere,
-               getpid(), &(mutex->mutex) );
-
     assert( oldWhere == NULL );
-  }
-  
-  DEBUG( "threading_mutex_unlock: sem_post" );
-  
-  err = sem_post( &(mutex->semaphore) );
-  /* assert( err == 0 ); */
+#endif
 
-#ifndef NDEBUG
-  if( mutex->debug || debug )
-#else
-  if( mutex->debug )
-#endif /* NDEBUG */
-    fprintf( stderr, "threading_mutex_unlock_debug( %p, %s ), pid %d: "
-             "leaving.\n", mutex, (oldWhere == NULL) ? "NULL" : oldWhere,
-             getpid() );
+    if( mutex->profileRecord != NULL )
+      releaseProfiled( mutex );
+
+    atomic_storeInt( &(mutex->owner), 0 );
+    releaseLock( mutex );
+  }
 }
 
 Error threading_cond_wait( pthread_cond_t *condition, VoxiMutex mutex )
 {
   Error error = NULL;
-  int oldCount, tempInt;
   int err;
-  const char *oldLastLockFrom;
   
-  err = threading_sem_wait( &(mutex->semaphore) );
+  err = condWait( condition, mutex, NULL );
   if (err != 0) {
     error = ErrNew(ERR_THREADING, 0, NULL,
-                   "sem_wait failed." );
+                   "pthread_cond_wait failed." );
     goto ERR_RETURN;
   }
+
+ ERR_RETURN:
+  return error;
+}
+
+void threading_mutex_destroy( VoxiMutex mutex )
+{
+  int err;
   
-  err = sem_getvalue( &(mutex->semaphore), &tempInt );
-  if (err != 0) {
-    error = ErrNew(ERR_THREADING, 0, NULL,
-                   "sem_getvalue failed." );
-    goto ERR_RETURN;
-  }
-  assert( tempInt == 0 );
+  assert( mutex->count == 0 );
 
-  /* Is the below really a requirement?
-     Is it not allowed to pass on a locked mutex to a new
-     thread to "finish the job"? -mst */
-  /* assert( mutex->thread == pthread_self() ); */
+  if( mutex->debug )
+    fprintf( stderr, "threading_mutex_destroy( %p ), pid %d.\n",
+             mutex, getpid() );
   
-  assert( mutex->count > 0 );
+  err = pthread_mutex_destroy( &(mutex->condMutex) );
+  if( err != 0 )
+    perror( "threading_mutex_destroy - pthread_mutex_destroy" );
   
-  /* release the VoxiMutex, saving the old state */
+  err = pthread_mutex_destroy( &(mutex->parkMutex) );
+  if( err != 0 )
+    perror( "threading_mutex_destroy - pthread_mutex_destroy" );
+  
+  err = pthread_cond_destroy( &(mutex->parkCondition) );
+  if( err != 0 )
+    perror( "threading_mutex_destroy - pthread_cond_destroy" );
+}
 
-  /* I dont set it to 0 since i want to know that I was the one that set 
-     these values (when i'm debugging) */
-  mutex->pid = 12;
+Boolean threading_cond_timedwait( pthread_cond_t *condition, VoxiMutex mutex, 
+                                  unsigned long usec )
+{
+  struct timespec wakeuptime;
+  struct timeval now;
+ /* Fix timespec struct */
+  gettimeofday(&now, NULL);
+  wakeuptime.tv_sec = now.tv_sec + (usec / 1000000);
+  wakeuptime.tv_nsec = (now.tv_usec + (usec % 1000000)) * 1000;
+  if( wakeuptime.tv_nsec >= 1000000000 )
+  {
+    wakeuptime.tv_sec++;
+    wakeuptime.tv_nsec -= 1000000000;
+  }
+
+  return threading_cond_absolute_timedwait(condition, mutex, &wakeuptime);
+}
+
+Boolean threading_cond_absolute_timedwait( pthread_cond_t *condition, 
+                                           VoxiMutex mutex, 
+                                           struct timespec *wakeuptime ) 
+{
+  return condWait( condition, mutex, wakeuptime ) == ETIMEDOUT;
+}
+
+void threading_mutex_setDebug( VoxiMutex mutex, Boolean debug )
+{
+  if( debug || (mutex->debug) )
+    fprintf( stderr, "threading_mutex_setDebug( %p, %s ), pid %d, "
+             "thread %ld.\n", mutex, debug ? "TRUE" : "FALSE", getpid(), 
+             pthread_self() );
+
+  mutex->debug = debug;
+}
+
+void threading_profile_setEnabled( Boolean enabled )
+{
+  pthread_once( &profileOnce, profileInit );
   
-  oldLastLockFrom = mutex->lastLockFrom;
-  mutex->lastLockFrom = NULL;
+  atomic_storeInt( &lockProfiling, enabled ? 1 : 0 );
+}
+
+void threading_profile_dump( FILE *file )
+{
+  ProfileBuffer buffer;
+  ProfileRecord records, record;
+  unsigned long dropped = 0;
+  int capacity = 0, count = 0, merged, i;
   
-  oldCount = mutex->count;
-  mutex->count = 0;
+  pthread_once( &profileOnce, profileInit );
   
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: oldCount=%d\n",
-             condition, mutex, getpid(), oldCount );
+  for( buffer = atomic_loadPtr( (void * volatile *) &profileBuffers );
+       buffer != NULL; buffer = buffer->next )
+    for( i = 0; i < PROFILE_RECORDS; i++ )
+      if( atomic_loadPtr( &(buffer->records[ i ].mutex) ) != NULL )
+        capacity++;
   
-  /* Hmm, is it dangerous to sem-post here, before the wait */
-  err = sem_post( &(mutex->semaphore) );
-  if (err != 0) {
-    error = ErrNew(ERR_THREADING, 0, NULL,
-                   "sem_post failed." );
-    goto ERR_RETURN;
+  records = (ProfileRecord) malloc( (capacity + 1) * 
+                                    sizeof( sProfileRecord ) );
+  if( records == NULL )
+  {
+    fprintf( file, "Lock contention profile: out of memory.\n" );
+    return;
   }
   
-  err = pthread_cond_wait( condition, &(mutex->mutex) );
-  if (err != 0) {
-    error = ErrNew(ERR_THREADING, 0, NULL,
-                   "pthread_cond_wait failed." );
-    goto ERR_RETURN;
+  /* Copy the records, threads may add more meanwhile */
+  for( buffer = atomic_loadPtr( (void * volatile *) &profileBuffers );
+       buffer != NULL; buffer = buffer->next )
+  {
+    dropped += buffer->dropped;
+    for( i = 0; (i < PROFILE_RECORDS) && (count < capacity); i++ )
+      if( atomic_loadPtr( &(buffer->records[ i ].mutex) ) != NULL )
+        records[ count++ ] = buffer->records[ i ];
   }
+  
+  /* Merge the records of different threads for the same mutex and where */
+  qsort( records, count, sizeof( sProfileRecord ), compareProfileKeys );
+  
+  for( merged = 0, i = 0; i < count; i++ )
+  {
+    if( (merged > 0) && 
+        (compareProfileKeys( &(records[ merged - 1 ]), 
+                             &(records[ i ]) ) == 0) )
+    {
+      int j;
+      
+      record = &(records[ merged - 1 ]);
+      record->acquisitions += records[ i ].acquisitions;
+      record->contended += records[ i ].contended;
+      record->waitTotal += records[ i ].waitTotal;
+      if( records[ i ].waitMax > record->waitMax )
+        record->waitMax = records[ i ].waitMax;
+      if( records[ i ].holdMax > record->holdMax )
+        record->holdMax = records[ i ].holdMax;
+      for( j = 0; j < PROFILE_HOLD_BUCKETS; j++ )
+        record->holds[ j ] += records[ i ].holds[ j ];
+    }
+    else
+      records[ merged++ ] = records[ i ];
+  }
+  
+  qsort( records, merged, sizeof( sProfileRecord ), compareProfileWaits );
+  
+  fprintf( file, "Lock contention profile: %d locks/wheres, %lu lockings "
+           "not recorded.\n", merged, dropped );
+  fprintf( file, "%-18s %-28s %10s %10s %12s %10s %10s %10s %10s\n",
+           "mutex", "where", "locks", "contended", "wait us", "max us",
+           "hold p50", "hold p99", "max hold" );
+  fprintf( file, "%-18s %-28s %10s %10s %12s %10s %10s %10s %10s\n",
+           "", "", "", "", "(total)", "(wait)", "< ns", "< ns", "us" );
+  
+  for( i = 0; i < merged; i++ )
+  {
+    record = &(records[ i ]);
+    fprintf( file, "%-18p %-28s %10lu %10lu %12.1f %10.1f %10.0f %10.0f "
+             "%10.1f\n",
+             record->mutex, 
+             (record->where == NULL) ? "NULL" : record->where,
+             record->acquisitions, record->contended,
+             record->waitTotal / 1000.0, record->waitMax / 1000.0,
+             (double) holdPercentile( record, 0.5 ),
+             (double) holdPercentile( record, 0.99 ),
+             record->holdMax / 1000.0 );
+  }
+  
+  free( records );
+}
 
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: after "
-             "pthread_cond_wait\n",
-             condition, mutex, getpid() );
+#ifndef NDEBUG
+static void freeReadHolds( void *holds )
+{
+  ReadHold hold = (ReadHold) holds;
+  ReadHold next;
+  
+  for( ; hold != NULL; hold = next )
+  {
+    next = hold->next;
+    free( hold );
+  }
+}
+
+static void createReadHoldKey( void )
+{
+  int err;
+  
+  err = pthread_key_create( &readHoldKey, freeReadHolds );
+  assert( err == 0 );
+}
+
+/* Returns TRUE if the calling thread holds rwlock for reading */
+static Boolean holdsReadLock( VoxiRWLock rwlock )
+{
+  ReadHold hold;
   
-#if 0
-  /* release the mutex, and get the semaphore, because that's the order it 
-     must be done in to prevent deadlock. */
+  pthread_once( &readHoldOnce, createReadHoldKey );
   
-  err = pthread_mutex_unlock( &(mutex->mutex) );
+  for( hold = (ReadHold) pthread_getspecific( readHoldKey ); hold != NULL;
+       hold = hold->next )
+    if( hold->rwlock == rwlock )
+      return TRUE;
   
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: reaquiring\n",
-             condition, mutex, getpid() );
+  return FALSE;
+}
+
+static void addReadHold( VoxiRWLock rwlock )
+{
+  ReadHold hold;
+  
+  /* only for the check, so a failure just leaves this hold unchecked */
+  hold = (ReadHold) malloc( sizeof( sReadHold ) );
+  if( hold == NULL )
+    return;
+  
+  hold->rwlock = rwlock;
+  hold->next = (ReadHold) pthread_getspecific( readHoldKey );
+  pthread_setspecific( readHoldKey, hold );
+}
+
+static void removeReadHold( VoxiRWLock rwlock )
+{
+  ReadHold holds = (ReadHold) pthread_getspecific( readHoldKey );
+  ReadHold *link;
+  ReadHold hold;
+  
+  for( link = &holds; *link != NULL; link = &((*link)->next) )
+    if( (*link)->rwlock == rwlock )
+    {
+      hold = *link;
+      *link = hold->next;
+      free( hold );
+      break;
+    }
+  
+  pthread_setspecific( readHoldKey, holds );
+}
 #endif
-  err = threading_sem_wait( &(mutex->semaphore) );
+
+/* The reader counter used by the calling thread */
+static volatile int *readerCount( VoxiRWLock rwlock, int self )
+{
+  return &(rwlock->slots[ self % THREADING_RWLOCK_SLOTS ].readers);
+}
+
+static int countReaders( VoxiRWLock rwlock )
+{
+  int i, readers = 0;
+  
+  for( i = 0; i < THREADING_RWLOCK_SLOTS; i++ )
+    readers += atomic_loadInt( &(rwlock->slots[ i ].readers) );
+  
+  return readers;
+}
+
+/*
+  Removes a reader. A writer that is waiting for the readers to leave is
+  woken; it checks the counters with waitMutex held, so the signal cannot
+  get lost.
+*/
+static void leaveRead( VoxiRWLock rwlock, volatile int *count )
+{
+  atomic_addInt( count, -1 );
+  
+  if( atomic_loadInt( &(rwlock->writers) ) > 0 )
+  {
+    pthread_mutex_lock( &(rwlock->waitMutex) );
+    pthread_cond_signal( &(rwlock->writerCondition) );
+    pthread_mutex_unlock( &(rwlock->waitMutex) );
+  }
+}
+
+Error threading_rwlock_init( VoxiRWLock rwlock )
+{
+  Error error = NULL;
+  int i, err;
+  
+  for( i = 0; i < THREADING_RWLOCK_SLOTS; i++ )
+    rwlock->slots[ i ].readers = 0;
+  
+  rwlock->writers = 0;
+  rwlock->writerOwner = 0;
+  rwlock->lastLockFrom = NULL;
+  rwlock->debug = FALSE;
+  
+  error = threading_mutex_init( &(rwlock->writerMutex) );
+  if( error != NULL )
+    goto ERR_RETURN;
+  
+  err = pthread_mutex_init( &(rwlock->waitMutex), NULL );
   if (err != 0) {
     error = ErrNew(ERR_THREADING, 0, NULL,
-                   "sem_wait failed." );
+                   "pthread_mutex_init failed." );
     goto ERR_RETURN;
   }
-  
-  err = sem_getvalue( &(mutex->semaphore), &tempInt );
+
+  err = pthread_cond_init( &(rwlock->readerCondition), NULL );
   if (err != 0) {
     error = ErrNew(ERR_THREADING, 0, NULL,
-                   "sem_getvalue failed." );
+                   "pthread_cond_init failed." );
     goto ERR_RETURN;
   }
-  assert( tempInt == 0 );
 
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: got semaphore\n",
-             condition, mutex, getpid() );
-
-  assert( mutex->count == 0 );
-  mutex->count = oldCount;
-  mutex->lastLockFrom = oldLastLockFrom;
-  mutex->thread = pthread_self();
-  mutex->pid = getpid();
-
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: leaving "
-             "(count=%d)\n", condition, mutex, getpid(), mutex->count );
-  
-  err = sem_post( &(mutex->semaphore) );
+  err = pthread_cond_init( &(rwlock->writerCondition), NULL );
   if (err != 0) {
     error = ErrNew(ERR_THREADING, 0, NULL,
-                   "sem_post failed." );
+                   "pthread_cond_init failed." );
     goto ERR_RETURN;
   }
 
@@ -573,139 +1197,166 @@ Error threading_cond_wait( pthread_cond_t *condition, VoxiMutex mutex )
   return error;
 }
 
-void threading_mutex_destroy( VoxiMutex mutex )
+void threading_rwlock_destroy( VoxiRWLock rwlock )
 {
   int err;
   
-  assert( mutex->count == 0 );
-
-  if( mutex->debug )
-    fprintf( stderr, "threading_mutex_destroy( %p ), pid %d.\n",
-             mutex, getpid() );
+  assert( rwlock->writers == 0 );
+  assert( countReaders( rwlock ) == 0 );
+  
+  threading_mutex_destroy( &(rwlock->writerMutex) );
   
-  err = sem_destroy( &(mutex->semaphore) );
+  err = pthread_mutex_destroy( &(rwlock->waitMutex) );
   if( err != 0 )
-    perror( "threading_mutex_destroy - sem_destroy" );
+    perror( "threading_rwlock_destroy - pthread_mutex_destroy" );
   
-  err = pthread_mutex_destroy( &(mutex->mutex) );
+  err = pthread_cond_destroy( &(rwlock->readerCondition) );
   if( err != 0 )
-    perror( "threading_mutex_destroy - pthread_mutex_destroy" );
+    perror( "threading_rwlock_destroy - pthread_cond_destroy" );
+  
+  err = pthread_cond_destroy( &(rwlock->writerCondition) );
+  if( err != 0 )
+    perror( "threading_rwlock_destroy - pthread_cond_destroy" );
 }
 
-Boolean threading_cond_timedwait( pthread_cond_t *condition, VoxiMutex mutex, 
-                                  unsigned long usec )
+void threading_rwlock_rdlock( VoxiRWLock rwlock )
 {
-  struct timespec wakeuptime;
-  struct timeval now;
- /* Fix timespec struct */
-  gettimeofday(&now, NULL);
-  wakeuptime.tv_sec = now.tv_sec + (usec / 1000000);
-  wakeuptime.tv_nsec = (now.tv_usec + (usec % 1000000)) * 1000;
-
-  return threading_cond_absolute_timedwait(condition, mutex, &wakeuptime);
+  threading_rwlock_rdlock_debug( rwlock, NULL );
 }
 
-/* FIXME: Change the API of this function to return Error info, since there
-   are several points in it where runtime errors may occur (now marked as
-   commented-out assertions on runtime return values from various functions).
-   NB: This should of course not affect assertions that document the
-   intended algorithmic flow of the implementation itself. -mst */
-Boolean threading_cond_absolute_timedwait( pthread_cond_t *condition, 
-                                           VoxiMutex mutex, 
-                                           struct timespec *wakeuptime ) 
+void threading_rwlock_rdlock_debug( VoxiRWLock rwlock, const char *where )
 {
-  int oldCount, tempInt;
-  int err;
-  const char *oldLastLockFrom;
-
-  Boolean timedout;
+  int self = getThreadId();
+  volatile int *count = readerCount( rwlock, self );
   
-  err = threading_sem_wait( &(mutex->semaphore) );
-  assert( err == 0 );
+  assert( atomic_loadInt( &(rwlock->writerOwner) ) != self );
   
-  err = sem_getvalue( &(mutex->semaphore), &tempInt );
-  /* assert( err == 0 ); */
-  assert( tempInt == 0 );
-
-  assert( pthread_equal( mutex->thread, pthread_self() ) );
-  assert( mutex->count > 0 );
+#ifndef NDEBUG
+  /* a nested read lock deadlocks once a writer waits, see threading.h */
+  assert( !holdsReadLock( rwlock ) );
+  addReadHold( rwlock );
   
-  /* release the VoxiMutex, saving the old state */
+  if( rwlock->debug )
+    fprintf( stderr, "threading_rwlock_rdlock_debug( %p, %s ), pid %d: "
+             "waiting.\n",
+             rwlock, (where == NULL) ? "NULL" : where, getpid() );
+#endif
+  
+  for( ;; )
+  {
+    /* 
+       Count ourselves first, then look for writers; a writer does it the 
+       other way around, so at least one of us sees the other.
+    */
+    atomic_addInt( count, 1 );
+    if( atomic_loadInt( &(rwlock->writers) ) == 0 )
+      break;
+    
+    /* Back off and wait for the writers to finish */
+    leaveRead( rwlock, count );
+    
+    pthread_mutex_lock( &(rwlock->waitMutex) );
+    while( atomic_loadInt( &(rwlock->writers) ) > 0 )
+      pthread_cond_wait( &(rwlock->readerCondition), &(rwlock->waitMutex) );
+    pthread_mutex_unlock( &(rwlock->waitMutex) );
+  }
+  
+#ifndef NDEBUG
+  if( rwlock->debug )
+    fprintf( stderr, "threading_rwlock_rdlock_debug( %p, %s ), pid %d: "
+             "got lock.\n",
+             rwlock, (where == NULL) ? "NULL" : where, getpid() );
+#endif
+}
+
+void threading_rwlock_wrlock( VoxiRWLock rwlock )
+{
+  threading_rwlock_wrlock_debug( rwlock, NULL );
+}
 
-  /* I dont set it to 0 since i want to know that I was the one that 
-     set these values (when i'm debugging) */
-  mutex->pid = 13;
+void threading_rwlock_wrlock_debug( VoxiRWLock rwlock, const char *where )
+{
+  int self = getThreadId();
   
-  oldLastLockFrom = mutex->lastLockFrom;
-  mutex->lastLockFrom = NULL;
+  assert( atomic_loadInt( &(rwlock->writerOwner) ) != self );
   
-  oldCount = mutex->count;
-  mutex->count = 0;
+#ifndef NDEBUG
+  /* the writer would wait for its own read lock */
+  assert( !holdsReadLock( rwlock ) );
   
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: oldCount=%d\n",
-             condition, mutex, getpid(), oldCount );
+  if( rwlock->debug )
+    fprintf( stderr, "threading_rwlock_wrlock_debug( %p, %s ), pid %d: "
+             "waiting.\n",
+             rwlock, (where == NULL) ? "NULL" : where, getpid() );
+#endif
   
-  /* Hmm, is it dangerous to sem-post here, before the wait */
-  err = sem_post( &(mutex->semaphore) );
-  /* assert( err == 0 ); */
-
-  /* Do the wait */
-  err = pthread_cond_timedwait( condition, &(mutex->mutex), wakeuptime );
-  /* assert( err == 0 ); */
-  timedout = (err == ETIMEDOUT);
-
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: after "
-             "pthread_cond_wait\n",
-             condition, mutex, getpid() );
+  /* From here on, new readers wait */
+  atomic_addInt( &(rwlock->writers), 1 );
   
-#if 0
-  /* release the mutex, and get the semaphore, because that's the order it 
-     must be done in to prevent deadlock. */
+  threading_mutex_lock( &(rwlock->writerMutex) );
   
-  err = pthread_mutex_unlock( &(mutex->mutex) );
+  pthread_mutex_lock( &(rwlock->waitMutex) );
+  while( countReaders( rwlock ) > 0 )
+    pthread_cond_wait( &(rwlock->writerCondition), &(rwlock->waitMutex) );
+  pthread_mutex_unlock( &(rwlock->waitMutex) );
   
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: reaquiring\n",
-             condition, mutex, getpid() );
+  atomic_storeInt( &(rwlock->writerOwner), self );
+  
+#ifndef NDEBUG
+  rwlock->lastLockFrom = where;
+  
+  if( rwlock->debug )
+    fprintf( stderr, "threading_rwlock_wrlock_debug( %p, %s ), pid %d: "
+             "got lock.\n",
+             rwlock, (where == NULL) ? "NULL" : where, getpid() );
 #endif
-  err = threading_sem_wait( &(mutex->semaphore) );
-  /* assert( err == 0 ); */
-
-    
-  err = sem_getvalue( &(mutex->semaphore), &tempInt );
-  /* assert( err == 0 ); */
-  assert( tempInt == 0 );
-
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: got semaphore\n",
-             condition, mutex, getpid() );
+}
 
-  assert( mutex->count == 0 );
-  mutex->count = oldCount;
-  mutex->lastLockFrom = oldLastLockFrom;
-  mutex->thread = pthread_self();
-  mutex->pid = getpid();
+void threading_rwlock_unlock( VoxiRWLock rwlock )
+{
+  threading_rwlock_unlock_debug( rwlock, NULL );
+}
 
-  if( mutex->debug )
-    fprintf( stderr, "threading_cond_wait( %p, %p ), pid %d: leaving "
-             "(count=%d)\n", condition, mutex, getpid(), mutex->count );
+void threading_rwlock_unlock_debug( VoxiRWLock rwlock, const char *where )
+{
+  int self = getThreadId();
   
-  err = sem_post( &(mutex->semaphore) );
-  /* assert( err == 0 ); */
-
-  return timedout;
+#ifndef NDEBUG
+  if( rwlock->debug )
+    fprintf( stderr, "threading_rwlock_unlock_debug( %p, %s ), pid %d.\n",
+             rwlock, (where == NULL) ? "NULL" : where, getpid() );
+#endif
+  
+  if( atomic_loadInt( &(rwlock->writerOwner) ) == self )
+  {
+#ifndef NDEBUG
+    rwlock->lastLockFrom = NULL;
+#endif
+    atomic_storeInt( &(rwlock->writerOwner), 0 );
+    threading_mutex_unlock( &(rwlock->writerMutex) );
+    
+    if( atomic_addInt( &(rwlock->writers), -1 ) == 0 )
+    {
+      pthread_mutex_lock( &(rwlock->waitMutex) );
+      pthread_cond_broadcast( &(rwlock->readerCondition) );
+      pthread_mutex_unlock( &(rwlock->waitMutex) );
+    }
+  }
+  else
+  {
+    assert( atomic_loadInt( readerCount( rwlock, self ) ) > 0 );
+    
+#ifndef NDEBUG
+    assert( holdsReadLock( rwlock ) );
+    removeReadHold( rwlock );
+#endif
+    leaveRead( rwlock, readerCount( rwlock, self ) );
+  }
 }
 
-void threading_mutex_setDebug( VoxiMutex mutex, Boolean debug )
+void threading_rwlock_setDebug( VoxiRWLock rwlock, Boolean debug )
 {
-  if( debug || (mutex->debug) )
-    fprintf( stderr, "threading_mutex_setDebug( %p, %s ), pid %d, "
-             "thread %ld.\n", mutex, debug ? "TRUE" : "FALSE", getpid(), 
-             pthread_self() );
-
-  mutex->debug = debug;
+  rwlock->debug = debug;
 }
 
 #ifdef PROFILING
@@ -807,6 +1458,159 @@ int threading_pthread_create(pthread_t * thread, pthread_attr_t * attr,
   return i_return;
 }
 
+/* What a thread created by threading_pthread_createSpec sets up itself */
+typedef struct
+{
+  ThreadFunc start_routine;
+  void *arg;
+  char name[ THREADING_SPEC_NAME_LENGTH + 1 ];
+  Boolean hasCpus;
+  unsigned long cpus[ THREADING_SPEC_MAX_CPUS / THREADING_SPEC_CPU_BITS ];
+} sSpecStart, *SpecStart;
+
+static void *specStart( void *data )
+{
+  sSpecStart start = *((SpecStart) data);
+  
+  free( data );
+  
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  if( start.name[ 0 ] != '\0' )
+    pthread_setname_np( pthread_self(), start.name );
+#endif
+  
+  if( start.hasCpus )
+  {
+#if defined( HAVE_PTHREAD_SETAFFINITY_NP )
+    cpu_set_t cpuSet;
+    int cpu;
+    
+    CPU_ZERO( &cpuSet );
+    for( cpu = 0; cpu < THREADING_SPEC_MAX_CPUS; cpu++ )
+      if( start.cpus[ cpu / THREADING_SPEC_CPU_BITS ] & 
+          (1UL << (cpu % THREADING_SPEC_CPU_BITS)) )
+        CPU_SET( cpu, &cpuSet );
+    
+    if( pthread_setaffinity_np( pthread_self(), sizeof( cpuSet ), 
+                                &cpuSet ) != 0 )
+      perror( "threading_pthread_createSpec - pthread_setaffinity_np" );
+#elif defined( WIN32 )
+    DWORD_PTR mask = 0;
+    int cpu;
+    
+    for( cpu = 0; cpu < 8 * sizeof( DWORD_PTR ); cpu++ )
+      if( start.cpus[ cpu / THREADING_SPEC_CPU_BITS ] & 
+          (1UL << (cpu % THREADING_SPEC_CPU_BITS)) )
+        mask |= (DWORD_PTR) 1 << cpu;
+    
+    if( SetThreadAffinityMask( GetCurrentThread(), mask ) == 0 )
+      fprintf( stderr, "threading_pthread_createSpec: "
+               "SetThreadAffinityMask failed.\n" );
+#endif
+  }
+  
+  return start.start_routine( start.arg );
+}
+
+void threading_spec_init( ThreadSpec spec )
+{
+  memset( spec, 0, sizeof( sThreadSpec ) );
+  
+  spec->name = NULL;
+  spec->policy = THREADING_SPEC_INHERIT_POLICY;
+  spec->priority = 0;
+  spec->stackSize = 0;
+  spec->guardSize = 0;
+  spec->detached = FALSE;
+}
+
+void threading_spec_addCpu( ThreadSpec spec, int cpu )
+{
+  assert( (cpu >= 0) && (cpu < THREADING_SPEC_MAX_CPUS) );
+  
+  spec->cpus[ cpu / THREADING_SPEC_CPU_BITS ] |= 
+    1UL << (cpu % THREADING_SPEC_CPU_BITS);
+}
+
+int threading_pthread_createSpec( pthread_t *thread, ThreadSpec spec,
+                                  ThreadFunc start_routine, void *arg )
+{
+  pthread_attr_t attr;
+  SpecStart start;
+  int err, i;
+  
+  start = (SpecStart) malloc( sizeof( sSpecStart ) );
+  if( start == NULL )
+    return ENOMEM;
+  
+  start->start_routine = start_routine;
+  start->arg = arg;
+  start->name[ 0 ] = '\0';
+  if( spec->name != NULL )
+  {
+    strncpy( start->name, spec->name, THREADING_SPEC_NAME_LENGTH );
+    start->name[ THREADING_SPEC_NAME_LENGTH ] = '\0';
+  }
+  start->hasCpus = FALSE;
+  for( i = 0; i < THREADING_SPEC_MAX_CPUS / THREADING_SPEC_CPU_BITS; i++ )
+  {
+    start->cpus[ i ] = spec->cpus[ i ];
+    if( spec->cpus[ i ] != 0 )
+      start->hasCpus = TRUE;
+  }
+  
+  err = pthread_attr_init( &attr );
+  if( err != 0 )
+  {
+    free( start );
+    return err;
+  }
+  
+  err = pthread_attr_setdetachstate( &attr, spec->detached ? 
+                                     PTHREAD_CREATE_DETACHED : 
+                                     PTHREAD_CREATE_JOINABLE );
+  
+  if( (err == 0) && (spec->stackSize > 0) )
+    err = pthread_attr_setstacksize( &attr, spec->stackSize );
+  
+#ifndef PTHREADS_WIN32
+  if( (err == 0) && (spec->guardSize > 0) )
+    err = pthread_attr_setguardsize( &attr, spec->guardSize );
+  
+  if( (err == 0) && (spec->policy != THREADING_SPEC_INHERIT_POLICY) )
+  {
+    struct sched_param sched_param;
+    
+    sched_param.sched_priority = spec->priority;
+    
+    err = pthread_attr_setinheritsched( &attr, PTHREAD_EXPLICIT_SCHED );
+    if( err == 0 )
+      err = pthread_attr_setschedpolicy( &attr, spec->policy );
+    if( err == 0 )
+      err = pthread_attr_setschedparam( &attr, &sched_param );
+  }
+#else  /* PTHREADS_WIN32 */
+  /* Win32 threads only have a priority, see threading_init */
+  if( (err == 0) && (spec->policy != THREADING_SPEC_INHERIT_POLICY) )
+  {
+    struct sched_param sched_param;
+    
+    sched_param.sched_priority = spec->priority;
+    err = pthread_attr_setschedparam( &attr, &sched_param );
+  }
+#endif /* PTHREADS_WIN32 */
+  
+  if( err == 0 )
+    err = threading_pthread_create( thread, &attr, specStart, start );
+  
+  if( err != 0 )
+    free( start );
+  
+  pthread_attr_destroy( &attr );
+  
+  return err;
+}
+
 /* sem_wait can return non-zero, and set errno to EINTR if the process
    receives a signal. This function repeats the sem_wait until it returns
    successfully
@@ -822,3 +1626,133 @@ int threading_sem_wait( sem_t *semaphore )
   
   return err;
 }
+
+int threading_getCpuCount( void )
+{
+  static int cpuCount = 0;
+
+#ifdef WIN32
+  if( cpuCount == 0 )
+  {
+    SYSTEM_INFO info;
+
+    GetSystemInfo( &info );
+    cpuCount = (int) info.dwNumberOfProcessors;
+  }
+#elif defined( _SC_NPROCESSORS_ONLN )
+  if( cpuCount == 0 )
+    cpuCount = (int) sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+
+  if( cpuCount < 1 )
+    cpuCount = 1;
+
+  return cpuCount;
+}
+
+void threading_yield( void )
+{
+#ifdef WIN32
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
+/*
+  Where a word cannot be slept on directly, threads sleep on one of a fixed
+  set of condition variables, picked by the address of the word. A waker
+  takes the same mutex, so a wake cannot slip in between a waiter's check 
+  of the word and its sleep. Words that share a bucket get each other's 
+  wakeups, which waiters have to tolerate anyway.
+*/
+#ifndef THREADING_FUTEX
+#define WORD_BUCKETS 64
+
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t condition;
+} sWordBucket;
+
+static pthread_once_t wordBucketsOnce = PTHREAD_ONCE_INIT;
+static sWordBucket wordBuckets[ WORD_BUCKETS ];
+
+static void initWordBuckets( void )
+{
+  int i;
+  
+  for( i = 0; i < WORD_BUCKETS; i++ )
+  {
+    pthread_mutex_init( &(wordBuckets[ i ].mutex), NULL );
+    pthread_cond_init( &(wordBuckets[ i ].condition), NULL );
+  }
+}
+
+static sWordBucket *getWordBucket( volatile int *word )
+{
+  pthread_once( &wordBucketsOnce, initWordBuckets );
+  
+  return &(wordBuckets[ (((unsigned long) word) >> 2) % WORD_BUCKETS ]);
+}
+#endif
+
+void threading_word_wait( volatile int *word, int value )
+{
+#ifdef THREADING_FUTEX
+  syscall( SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0 );
+#else
+  sWordBucket *bucket = getWordBucket( word );
+  
+  pthread_mutex_lock( &(bucket->mutex) );
+  if( atomic_loadInt( word ) == value )
+    pthread_cond_wait( &(bucket->condition), &(bucket->mutex) );
+  pthread_mutex_unlock( &(bucket->mutex) );
+#endif
+}
+
+Boolean threading_word_timedwait( volatile int *word, int value, 
+                                  unsigned long usec )
+{
+#ifdef THREADING_FUTEX
+  struct timespec timeout;
+  
+  timeout.tv_sec = usec / 1000000;
+  timeout.tv_nsec = (usec % 1000000) * 1000;
+  
+  return (syscall( SYS_futex, word, FUTEX_WAIT_PRIVATE, value, &timeout, 
+                   NULL, 0 ) != 0) && (errno == ETIMEDOUT);
+#else
+  sWordBucket *bucket = getWordBucket( word );
+  struct timespec wakeuptime;
+  struct timeval now;
+  int err = 0;
+  
+  gettimeofday( &now, NULL );
+  wakeuptime.tv_sec = now.tv_sec + (usec / 1000000) + 
+    (now.tv_usec + (usec % 1000000)) / 1000000;
+  wakeuptime.tv_nsec = ((now.tv_usec + (usec % 1000000)) % 1000000) * 1000;
+  
+  pthread_mutex_lock( &(bucket->mutex) );
+  if( atomic_loadInt( word ) == value )
+    err = pthread_cond_timedwait( &(bucket->condition), &(bucket->mutex), 
+                                  &wakeuptime );
+  pthread_mutex_unlock( &(bucket->mutex) );
+  
+  return err == ETIMEDOUT;
+#endif
+}
+
+void threading_word_wake( volatile int *word, int count )
+{
+#ifdef THREADING_FUTEX
+  syscall( SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0 );
+#else
+  sWordBucket *bucket = getWordBucket( word );
+  
+  /* the bucket may be shared, so everyone has to look */
+  pthread_mutex_lock( &(bucket->mutex) );
+  pthread_cond_broadcast( &(bucket->condition) );
+  pthread_mutex_unlock( &(bucket->mutex) );
+#endif
+}
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef HAVE_TIME_H
 #include <time.h>
@@ -37,7 +38,10 @@
 #define DEBUG_MESSAGES 0
 
 #include <voxi/alwaysInclude.h>
+#include <voxi/util/atomic.h>
+#include <voxi/util/mem.h>
 #include <voxi/util/threadpool.h>
+#include <voxi/util/time.h>
 
 CVSID("$Id$");
 
@@ -49,6 +53,10 @@ CVSID("$Id$");
  */
 static void * threadPoolThread_mainLoop(ThreadPoolThread self);
 
+/* Creates a pool, with its threads described by spec if it is not NULL */
+static Error threadPool_createInternal(int initialSize, pthread_attr_t attr,
+                                       ThreadSpec spec, ThreadPool *res);
+
 /* Check if thread attr is detached */
 static Boolean threadPool_checkDetached(pthread_attr_t attr);
 
@@ -62,8 +70,80 @@ static Error threadPoolThread_destroy(ThreadPoolThread thread);
  * NOTE: YOU ARE RESPONSIBLE FOR LOCKING YOURSELF */
 static void threadPool_makeAvailable(ThreadPoolThread thread);
 
+/* Lets a thread that has been idle for idleTimeout leave the available
+ * list, returns FALSE if it is still needed */
+static Boolean threadPoolThread_retire(ThreadPoolThread thread);
+
+/* An executor's worker thread */
+typedef struct sThreadPoolWorker *ThreadPoolWorker;
+
+/* The loop of an executor's worker threads, see threadPool_submit */
+static void * threadPool_workerLoop(ThreadPoolWorker self);
+
+/* Lets a worker that has been idle for idleTimeout exit, returns FALSE if
+ * it is still needed */
+static Boolean threadPool_retireWorker(ThreadPoolWorker self);
+
+/* Starts one more worker, unless the executor already has maxWorkers */
+static Error threadPool_addWorker(ThreadPool pool);
+
+/* See threadPool_parallelRun */
+typedef struct sParallelJob *ParallelJob;
+
+/* Works on chunks of a parallel job until there are none left */
+static void threadPool_parallelWork(ParallelJob job);
+
+/* The task run by the workers that help with a parallel job */
+static void * threadPool_parallelHelper(void *data);
+
+/* Lets go of a parallel job, freeing it if no one else holds it */
+static void threadPool_parallelRelease(ParallelJob job);
+
+/* Runs a parallelFor (reduce == NULL) or parallelReduce */
+static Error threadPool_parallelRun(ThreadPool pool, int begin, int end,
+                                    int grain, ThreadPoolRangeFunc func,
+                                    ThreadPoolReduceFunc reduce,
+                                    ThreadPoolCombineFunc combine,
+                                    void *context, void **res);
+
+/* Wakes an idle worker after a task has been queued, or starts a new one
+ * if all are busy */
+static void threadPool_wakeWorker(ThreadPool pool);
+
+/* Puts a task in the queue, returns FALSE if it is full */
+static Boolean threadPool_enqueue(ThreadPool pool, ThreadFunc func, void *args);
+
+/* Takes a task from the queue, returns FALSE if it is empty. *queuedAt is
+ * the nanosec() time at which it was put there. */
+static Boolean threadPool_dequeue(ThreadPool pool, ThreadFunc *func,
+                                  void **args, uint64_t *queuedAt);
+
+/* Returns TRUE if there seems to be a task in the queue */
+static Boolean threadPool_hasTasks(ThreadPool pool);
+
 /* Internal data */
 
+/* What threads have done, summed up by threadPool_getStats. Only the
+ * owning thread changes them; sequence is odd while it does */
+typedef struct sThreadPoolCounters {
+  volatile int sequence;
+  unsigned long tasksRun;
+  uint64_t runTimeTotal;
+  uint64_t waitTimeTotal;
+  unsigned long runTimes[THREADPOOL_STATS_BUCKETS];
+  unsigned long waitTimes[THREADPOOL_STATS_BUCKETS];
+} sThreadPoolCounters, *ThreadPoolCounters;
+
+/* Counts a task that was queued and started at the given nanosec() times,
+ * and has just finished */
+static void threadPool_countTask(ThreadPoolCounters counters,
+                                 uint64_t queuedAt, uint64_t startedAt);
+
+/* Adds the counters in from to those in to. from may be changed by its
+ * thread meanwhile */
+static void threadPool_addCounters(ThreadPoolCounters to,
+                                   ThreadPoolCounters from);
+
 /* Possibilities for the joined state of the non-detached ThreadPoolThreds */
 typedef enum {JOIN_STATE_RUNNING_UNJOINED,
               JOIN_STATE_RUNNING_JOINED,
@@ -71,6 +151,47 @@ typedef enum {JOIN_STATE_RUNNING_UNJOINED,
               JOIN_STATE_FINISHED_JOINED,
               JOIN_STATE_COMPLETE} JoinState;
 
+/*
+ * A slot in the task queue of an executor. The sequence number says whose
+ * turn it is: a producer may fill the slot for queue position pos when it
+ * is pos, and a consumer may empty it when it is pos + 1.
+ */
+typedef struct sThreadPoolTask {
+  volatile int sequence;
+  ThreadFunc func;
+  void *args;
+  uint64_t queuedAt;
+} sThreadPoolTask, *ThreadPoolTask;
+
+typedef struct sThreadPoolWorker {
+  pthread_t thread;
+  ThreadPool pool;
+  sThreadPoolCounters counters;
+} sThreadPoolWorker;
+
+/*
+ * A range being worked on by threadPool_parallelFor or
+ * threadPool_parallelReduce. It is freed by the last of the calling thread
+ * and the helper tasks to let go of it, since a helper may only get to
+ * run after the caller has returned.
+ */
+typedef struct sParallelJob {
+  int begin, end, grain, chunkCount;
+  volatile int nextChunk;
+  /* the caller sleeps on this until it reaches chunkCount */
+  volatile int chunksDone;
+  volatile int refCount;
+
+  ThreadPoolRangeFunc func;
+  ThreadPoolReduceFunc reduce;
+  ThreadPoolCombineFunc combine;
+  void *context;
+
+  sVoxiMutex resultLock;
+  Boolean hasResult;
+  void *result;
+} sParallelJob;
+
 typedef struct sThreadPool {
 
   /* The pthread attributes for this thread as a bitmap */
@@ -88,6 +209,49 @@ typedef struct sThreadPool {
   Boolean isShuttingDown;
 
   Boolean isDetached;
+
+  /* Threads started and ended, and the counters of the threads that have
+   * ended, all under threadListMutex */
+  unsigned long threadsCreated;
+  unsigned long threadsDestroyed;
+  sThreadPoolCounters retired;
+
+  /* Threads idle for idleTimeout usec exit, down to minThreads threads
+   * (minWorkers for executors); 0 means never */
+  unsigned long idleTimeout;
+  int threadCount, minThreads;
+
+  /* Set by threadPool_createSpec, spec.name then points to name */
+  Boolean hasSpec;
+  sThreadSpec spec;
+  char name[THREADING_SPEC_NAME_LENGTH + 1];
+
+  /* The rest is only used by executors, see threadPool_createExecutor */
+  Boolean isExecutor;
+  ThreadPoolRejectPolicy rejectPolicy;
+
+  /* A bounded queue of tasks, taskMask + 1 slots */
+  ThreadPoolTask tasks;
+  int taskMask;
+  /* The next positions to empty and fill, on cache lines of their own */
+  char headPadding[64];
+  volatile int taskHead;
+  char tailPadding[64];
+  volatile int taskTail;
+  char countPadding[64];
+
+  /* Workers are added and removed under threadListMutex */
+  int minWorkers, maxWorkers;
+  volatile int workerCount;
+  ThreadPoolWorker *workers;
+
+  /* Idle workers wait for taskCondition, blocked submitters for
+   * spaceCondition */
+  sVoxiMutex taskMutex;
+  pthread_cond_t taskCondition;
+  pthread_cond_t spaceCondition;
+  volatile int idleWorkers;
+  volatile int blockedSubmitters;
   
 } sThreadPool;
 
@@ -118,10 +282,49 @@ typedef struct sThreadPoolThread {
 
   /* For detached ThreadPoolThreads only */
   JoinState state;  
+
+  /* TRUE while in the available list, under threadListMutex */
+  Boolean isAvailable;
+
+  /* Set by threadPool_runThread, for the wait time */
+  uint64_t queuedAt;
+  sThreadPoolCounters counters;
 } sThreadPoolThread;
 
 
 Error threadPool_create(int initialSize, pthread_attr_t attr, ThreadPool *res) {
+  return threadPool_createInternal(initialSize, attr, NULL, res);
+}
+
+Error threadPool_createSpec(int initialSize, ThreadSpec spec, ThreadPool *res) {
+  Error error = NULL;
+  pthread_attr_t attr;
+  int err;
+
+  err = pthread_attr_init(&attr);
+  if (err != 0) {
+    error = ErrNew(ERR_THREADING, 0, NULL,
+                   "pthread_attr_init failed." );
+    goto ERR1;
+  }
+
+  err = pthread_attr_setdetachstate(&attr, spec->detached ?
+                                    PTHREAD_CREATE_DETACHED :
+                                    PTHREAD_CREATE_JOINABLE);
+  if (err != 0) {
+    error = ErrNew(ERR_THREADING, 0, NULL,
+                   "pthread_attr_setdetachstate failed." );
+    goto ERR1;
+  }
+
+  error = threadPool_createInternal(initialSize, attr, spec, res);
+
+ ERR1:
+  return error;
+}
+
+static Error threadPool_createInternal(int initialSize, pthread_attr_t attr,
+                                       ThreadSpec spec, ThreadPool *res) {
   Error error = NULL;
   int i;
   ThreadPool pool;
@@ -133,6 +336,30 @@ Error threadPool_create(int initialSize, pthread_attr_t attr, ThreadPool *res) {
   pool = (ThreadPool) malloc(sizeof(sThreadPool));
   assert(pool != NULL);
 
+  pool->isExecutor = FALSE;
+  pool->tasks      = NULL;
+  pool->workers    = NULL;
+
+  pool->threadsCreated   = 0;
+  pool->threadsDestroyed = 0;
+  memset(&(pool->retired), 0, sizeof(sThreadPoolCounters));
+  pool->idleTimeout = 0;
+  pool->threadCount = 0;
+  pool->minThreads  = 0;
+
+  pool->hasSpec = (spec != NULL);
+  if (spec != NULL) {
+    pool->spec = *spec;
+    pool->name[0] = '\0';
+    if (spec->name != NULL) {
+      strncpy(pool->name, spec->name, THREADING_SPEC_NAME_LENGTH);
+      pool->name[THREADING_SPEC_NAME_LENGTH] = '\0';
+      pool->spec.name = pool->name;
+    }
+    /* The pool joins its threads itself, see threadPool_destroy */
+    pool->spec.detached = FALSE;
+  }
+
   /* The attribute should not be joinable since we join the
    * actal threads manually */
   pool->isDetached = threadPool_checkDetached(attr);
@@ -174,47 +401,78 @@ Error threadPool_create(int initialSize, pthread_attr_t attr, ThreadPool *res) {
 Error threadPool_destroy(ThreadPool threadPool) {
   Error error = NULL;
   ThreadPoolThread theThread = NULL;
+  ThreadPoolThread available, inUse;
   int err = 0;
 
   DEBUG("ThreadPool_destroy enter\n");
   assert(threadPool != NULL);
 
+  /* Once isShuttingDown is set no thread is added to or leaves the lists
+   * or the workers on its own, so they can be walked without the lock,
+   * which the threads take on their way out */
   threading_mutex_lock(&(threadPool->threadListMutex));
-  
   threadPool->isShuttingDown = TRUE;
+  available = threadPool->firstAvailableThread;
+  inUse     = threadPool->firstThreadInUse;
+  threadPool->firstAvailableThread = NULL;
+  threadPool->firstThreadInUse     = NULL;
+  threading_mutex_unlock(&(threadPool->threadListMutex));
   
   /* Destroy all available threads */
-  while ((theThread = threadPool->firstAvailableThread) != NULL) {
+  while ((theThread = available) != NULL) {
     Error tempErr;
-    ThreadPoolThread next;
 
     DEBUG("ThreadPool_destroy waking available thread\n");
+    threading_mutex_lock(&(theThread->startConditionMutex));
     err = pthread_cond_signal(&(theThread->startCondition));
     assert(err == 0);
+    threading_mutex_unlock(&(theThread->startConditionMutex));
 
-    next    = theThread->next;
-    tempErr = threadPoolThread_destroy(theThread); /* Also frees it */
-    threadPool->firstAvailableThread = next;
+    available = theThread->next;
+    tempErr   = threadPoolThread_destroy(theThread); /* Also frees it */
     
     if (tempErr != NULL)
       error = tempErr;
   }
   
    /* Destroy all threads in use */
-  while ((theThread = threadPool->firstThreadInUse) != NULL) {
+  while ((theThread = inUse) != NULL) {
     Error tempErr;
-    ThreadPoolThread next;
 
     DEBUG("ThreadPool_destroy destroying in use thread\n");
-    next    = theThread->next;
+    inUse   = theThread->next;
     tempErr = threadPoolThread_destroy(theThread);
-    threadPool->firstThreadInUse = next;
     
     if (tempErr != NULL)
       error = tempErr;
   }
-  
-  threading_mutex_unlock(&(threadPool->threadListMutex));
+
+  if (threadPool->isExecutor) {
+    int i;
+
+    /* The workers run the tasks left in the queue, then exit */
+    threading_mutex_lock(&(threadPool->taskMutex));
+    pthread_cond_broadcast(&(threadPool->taskCondition));
+    pthread_cond_broadcast(&(threadPool->spaceCondition));
+    threading_mutex_unlock(&(threadPool->taskMutex));
+
+    for (i = 0; i < threadPool->workerCount; i++) {
+      err = pthread_join(threadPool->workers[i]->thread, NULL);
+      assert(err == 0);
+      free(threadPool->workers[i]);
+    }
+
+    /* Submitters woken above may still be on their way out of
+     * threadPool_submit, reading the pool */
+    while (atomic_loadInt(&(threadPool->blockedSubmitters)) > 0)
+      threading_yield();
+
+    pthread_cond_destroy(&(threadPool->taskCondition));
+    pthread_cond_destroy(&(threadPool->spaceCondition));
+    threading_mutex_destroy(&(threadPool->taskMutex));
+    free(threadPool->workers);
+    free(threadPool->tasks);
+  }
   
   /* Now clean up the thread pool's attributes */
   err = pthread_attr_destroy(&(threadPool->attribute));
@@ -262,6 +520,7 @@ Error threadPool_runThread(ThreadPool threadPool, ThreadFunc func, void *args,
     threadPool->firstAvailableThread = theThread->next;
     if (threadPool->firstAvailableThread != NULL)
       threadPool->firstAvailableThread->prev = NULL;
+    theThread->isAvailable = FALSE;
   }
 
   if (error != NULL) {
@@ -283,6 +542,7 @@ Error threadPool_runThread(ThreadPool threadPool, ThreadFunc func, void *args,
   threading_mutex_lock(&(theThread->startConditionMutex));
   theThread->threadFunc = func;
   theThread->threadFuncArgs = args;
+  theThread->queuedAt = nanosec();
   DEBUG("threadPool_runThread before signal startCondition\n");
   pthread_cond_signal(&(theThread->startCondition));
   threading_mutex_unlock(&(theThread->startConditionMutex));
@@ -337,6 +597,274 @@ Error threadPoolThread_join(ThreadPoolThread thread, void **threadFuncResult) {
   return error;
 }
 
+Error threadPool_createExecutor(int minWorkers, int maxWorkers,
+                                int queueCapacity,
+                                ThreadPoolRejectPolicy rejectPolicy,
+                                ThreadSpec spec, ThreadPool *res) {
+  Error error = NULL;
+  ThreadPool pool = NULL;
+  pthread_attr_t attr;
+  int i, err, slots;
+
+  assert((minWorkers >= 1) && (maxWorkers >= minWorkers));
+  assert(queueCapacity >= 1);
+
+  if (spec != NULL)
+    error = threadPool_createSpec(0, spec, &pool);
+  else {
+    err = pthread_attr_init(&attr);
+    if (err != 0) {
+      error = ErrNew(ERR_THREADING, 0, NULL,
+                     "pthread_attr_init failed." );
+      goto ERR1;
+    }
+    error = threadPool_create(0, attr, &pool);
+  }
+  if (error != NULL)
+    goto ERR1;
+
+  /* The queue needs a power of two slots */
+  for (slots = 1; slots < queueCapacity; slots *= 2)
+    ;
+
+  pool->rejectPolicy = rejectPolicy;
+  pool->taskMask     = slots - 1;
+  pool->taskHead     = 0;
+  pool->taskTail     = 0;
+  pool->minWorkers   = minWorkers;
+  pool->maxWorkers   = maxWorkers;
+  pool->workerCount  = 0;
+  pool->idleWorkers  = 0;
+  pool->blockedSubmitters = 0;
+
+  pool->tasks   = (ThreadPoolTask) malloc(slots * sizeof(sThreadPoolTask));
+  pool->workers = (ThreadPoolWorker *) malloc(maxWorkers *
+                                             sizeof(ThreadPoolWorker));
+  if ((pool->tasks == NULL) || (pool->workers == NULL)) {
+    error = ErrNew(ERR_MEMORY, MEMERR_OUT, NULL,
+                   "threadPool_createExecutor: out of memory.");
+    goto ERR2;
+  }
+
+  for (i = 0; i < slots; i++)
+    pool->tasks[i].sequence = i;
+
+  error = threading_mutex_init(&(pool->taskMutex));
+  if (error != NULL)
+    goto ERR2;
+  pthread_cond_init(&(pool->taskCondition), NULL);
+  pthread_cond_init(&(pool->spaceCondition), NULL);
+
+  pool->isExecutor = TRUE;
+
+  for (i = 0; (i < minWorkers) && (error == NULL); i++)
+    error = threadPool_addWorker(pool);
+
+  if (error != NULL) {
+    threadPool_destroy(pool);
+    goto ERR1;
+  }
+
+  *res = pool;
+  goto ERR1;
+
+ ERR2:
+  free(pool->tasks);
+  pool->tasks = NULL;
+  free(pool->workers);
+  pool->workers = NULL;
+  threadPool_destroy(pool);
+ ERR1:
+  return error;
+}
+
+Error threadPool_submit(ThreadPool pool, ThreadFunc func, void *args) {
+  Error error = NULL;
+  Boolean blocked = FALSE, shuttingDown;
+
+  assert(func != NULL);
+  assert(pool->isExecutor);
+
+  if (pool->isShuttingDown) {
+    error = ErrNew(ERR_THREADING, 0, NULL,
+                   "Cannot submit task, since pool is shutting down.");
+    goto ERR1;
+  }
+
+  while (!threadPool_enqueue(pool, func, args)) {
+    switch (pool->rejectPolicy) {
+    case THREADPOOL_REJECT_FAIL:
+      error = ErrNew(ERR_THREADING, 0, NULL,
+                     "Cannot submit task, since the queue is full.");
+      goto ERR1;
+
+    case THREADPOOL_REJECT_CALLER_RUNS:
+      func(args);
+      goto ERR1;
+
+    case THREADPOOL_REJECT_BLOCK:
+      /* Workers that take a task wake us if they see us counted, and
+       * threadPool_destroy does not free the pool while we are */
+      threading_mutex_lock(&(pool->taskMutex));
+      if (!blocked) {
+        atomic_addInt(&(pool->blockedSubmitters), 1);
+        blocked = TRUE;
+      }
+      atomic_fence();
+      shuttingDown = pool->isShuttingDown;
+      if (!shuttingDown && threadPool_enqueue(pool, func, args)) {
+        threading_mutex_unlock(&(pool->taskMutex));
+        goto WAKE;
+      }
+      if (!shuttingDown) {
+        threading_cond_wait(&(pool->spaceCondition), &(pool->taskMutex));
+        shuttingDown = pool->isShuttingDown;
+      }
+      threading_mutex_unlock(&(pool->taskMutex));
+
+      if (shuttingDown) {
+        error = ErrNew(ERR_THREADING, 0, NULL,
+                       "Cannot submit task, since pool is shutting down.");
+        goto ERR1;
+      }
+      break;
+    }
+  }
+
+ WAKE:
+  threadPool_wakeWorker(pool);
+
+ ERR1:
+  /* The last touch of the pool, see threadPool_destroy */
+  if (blocked)
+    atomic_addInt(&(pool->blockedSubmitters), -1);
+
+  return error;
+}
+
+Error threadPool_submitFuture(ThreadPool pool, ThreadFunc func, void *args,
+                              Future *res) {
+  Error error = NULL;
+  Future future;
+
+  future = future_createTask(func, args);
+  if (future == NULL) {
+    error = ErrNew(ERR_MEMORY, MEMERR_OUT, NULL,
+                   "threadPool_submitFuture: out of memory.");
+    goto ERR1;
+  }
+
+  error = threadPool_submit(pool, future_runTask, future);
+  if (error != NULL) {
+    /* Neither side will use it */
+    future_release(future);
+    future_release(future);
+    goto ERR1;
+  }
+
+  *res = future;
+
+ ERR1:
+  return error;
+}
+
+Error threadPool_parallelFor(ThreadPool pool, int begin, int end, int grain,
+                             ThreadPoolRangeFunc func, void *context) {
+  assert(func != NULL);
+
+  return threadPool_parallelRun(pool, begin, end, grain, func, NULL, NULL,
+                                context, NULL);
+}
+
+Error threadPool_parallelReduce(ThreadPool pool, int begin, int end,
+                                int grain, ThreadPoolReduceFunc reduce,
+                                ThreadPoolCombineFunc combine, void *context,
+                                void **res) {
+  assert((reduce != NULL) && (combine != NULL) && (res != NULL));
+
+  return threadPool_parallelRun(pool, begin, end, grain, NULL, reduce,
+                                combine, context, res);
+}
+
+void threadPool_getStats(ThreadPool pool, ThreadPoolStats stats) {
+  sThreadPoolCounters sum;
+  ThreadPoolThread thread;
+  int i;
+
+  memset(stats, 0, sizeof(sThreadPoolStats));
+
+  threading_mutex_lock(&(pool->threadListMutex));
+
+  sum = pool->retired;
+  stats->threadsCreated   = pool->threadsCreated;
+  stats->threadsDestroyed = pool->threadsDestroyed;
+
+  for (thread = pool->firstThreadInUse; thread != NULL; thread = thread->next) {
+    threadPool_addCounters(&sum, &(thread->counters));
+    stats->busyThreads++;
+  }
+  for (thread = pool->firstAvailableThread; thread != NULL;
+       thread = thread->next) {
+    threadPool_addCounters(&sum, &(thread->counters));
+    stats->idleThreads++;
+  }
+
+  if (pool->isExecutor) {
+    for (i = 0; i < pool->workerCount; i++)
+      threadPool_addCounters(&sum, &(pool->workers[i]->counters));
+
+    stats->idleThreads = atomic_loadInt(&(pool->idleWorkers));
+    stats->busyThreads = pool->workerCount - stats->idleThreads;
+    if (stats->busyThreads < 0)
+      stats->busyThreads = 0;
+
+    stats->queuedTasks =
+      (int) ((unsigned int) atomic_loadInt(&(pool->taskTail)) -
+             (unsigned int) atomic_loadInt(&(pool->taskHead)));
+    if (stats->queuedTasks < 0)
+      stats->queuedTasks = 0;
+  }
+
+  threading_mutex_unlock(&(pool->threadListMutex));
+
+  stats->tasksRun      = sum.tasksRun;
+  stats->runTimeTotal  = sum.runTimeTotal;
+  stats->waitTimeTotal = sum.waitTimeTotal;
+  memcpy(stats->runTimes, sum.runTimes, sizeof(sum.runTimes));
+  memcpy(stats->waitTimes, sum.waitTimes, sizeof(sum.waitTimes));
+}
+
+void threadPool_setIdleTimeout(ThreadPool pool, unsigned long usec,
+                               int minThreads) {
+  ThreadPoolThread thread;
+
+  assert(minThreads >= (pool->isExecutor ? 1 : 0));
+
+  threading_mutex_lock(&(pool->threadListMutex));
+
+  pool->idleTimeout = usec;
+  if (pool->isExecutor)
+    pool->minWorkers = minThreads;
+  else
+    pool->minThreads = minThreads;
+
+  /* Idle threads wait again, with the new timeout */
+  for (thread = pool->firstAvailableThread; thread != NULL;
+       thread = thread->next) {
+    threading_mutex_lock(&(thread->startConditionMutex));
+    pthread_cond_signal(&(thread->startCondition));
+    threading_mutex_unlock(&(thread->startConditionMutex));
+  }
+
+  threading_mutex_unlock(&(pool->threadListMutex));
+
+  if (pool->isExecutor) {
+    threading_mutex_lock(&(pool->taskMutex));
+    pthread_cond_broadcast(&(pool->taskCondition));
+    threading_mutex_unlock(&(pool->taskMutex));
+  }
+}
+
 /*
  * Loops until the pool is shut down.
  * The start condition could be signaled, either by the thread
@@ -344,16 +872,28 @@ Error threadPoolThread_join(ThreadPoolThread thread, void **threadFuncResult) {
  */
 static void * threadPoolThread_mainLoop(ThreadPoolThread self) {
   int err = 0;
+  uint64_t startedAt;
   DEBUG("threadPool mainLoop, enter\n");
   
   do {
     /* Wait until either shutting down or thread in use */
     threading_mutex_lock(&(self->startConditionMutex));
     
-    if (self->threadFunc == NULL) {
+    while ((self->threadFunc == NULL) && !(self->myPool->isShuttingDown)) {
       DEBUG("threadPool mainLoop, before startCondition wait\n");
-      threading_cond_wait(&(self->startCondition),
-                          &(self->startConditionMutex));
+      if (self->myPool->idleTimeout == 0)
+        threading_cond_wait(&(self->startCondition),
+                            &(self->startConditionMutex));
+      else if (threading_cond_timedwait(&(self->startCondition),
+                                        &(self->startConditionMutex),
+                                        self->myPool->idleTimeout)) {
+        /* threadPool_runThread may be taking us meanwhile, but then
+         * we are no longer available */
+        threading_mutex_unlock(&(self->startConditionMutex));
+        if (threadPoolThread_retire(self))
+          return NULL;
+        threading_mutex_lock(&(self->startConditionMutex));
+      }
     }
 
     DEBUG("threadPool mainLoop, thread woke up\n");
@@ -368,7 +908,9 @@ static void * threadPoolThread_mainLoop(ThreadPoolThread self) {
     
     /* Call the thread function */
     DEBUG("threadPool mainLoop calling thread function.\n");
+    startedAt = nanosec();
     self->threadFuncResult = self->threadFunc(self->threadFuncArgs);
+    threadPool_countTask(&(self->counters), self->queuedAt, startedAt);
 
     /* If not detached we should join the thread */
     if (!(self->myPool->isDetached)) {
@@ -452,6 +994,10 @@ static Error threadPoolThread_create(ThreadPool pool, ThreadPoolThread *res) {
   resource->threadFuncArgs   = NULL;
   resource->threadFuncResult = NULL;
 
+  resource->isAvailable = FALSE;
+  resource->queuedAt    = 0;
+  memset(&(resource->counters), 0, sizeof(sThreadPoolCounters));
+
   error = threading_mutex_init(&(resource->startConditionMutex));
   if (error != NULL) {
     goto ERR1;
@@ -463,9 +1009,14 @@ static Error threadPoolThread_create(ThreadPool pool, ThreadPoolThread *res) {
   err1 = pthread_cond_init(&(resource->startCondition), NULL); 
   err2 = pthread_cond_init(&(resource->joinStateCondition), NULL);
   
-  err3 = threading_pthread_create(&(resource->thread), &(pool->attribute),
-                                  (ThreadFunc) threadPoolThread_mainLoop,
-                                  resource);
+  if (pool->hasSpec)
+    err3 = threading_pthread_createSpec(&(resource->thread), &(pool->spec),
+                                        (ThreadFunc) threadPoolThread_mainLoop,
+                                        resource);
+  else
+    err3 = threading_pthread_create(&(resource->thread), &(pool->attribute),
+                                    (ThreadFunc) threadPoolThread_mainLoop,
+                                    resource);
   
   if ((err1 | err2 | err3) != 0) {
     error = ErrNew(ERR_THREADING, 0, NULL,
@@ -474,6 +1025,9 @@ static Error threadPoolThread_create(ThreadPool pool, ThreadPoolThread *res) {
     goto ERR1;
   }
 
+  pool->threadsCreated++;
+  pool->threadCount++;
+
   *res = resource;
   
  ERR1:
@@ -490,6 +1044,43 @@ static void threadPool_makeAvailable(ThreadPoolThread resource) {
   resource->next = tempElement;
   pool->firstAvailableThread = resource;
   resource->prev = NULL;
+  resource->isAvailable = TRUE;
+}
+
+static Boolean threadPoolThread_retire(ThreadPoolThread thread) {
+  ThreadPool pool = thread->myPool;
+  Boolean retire;
+
+  threading_mutex_lock(&(pool->threadListMutex));
+
+  retire = (!pool->isShuttingDown && thread->isAvailable &&
+            (pool->threadCount > pool->minThreads));
+  if (retire) {
+    if (pool->firstAvailableThread == thread)
+      pool->firstAvailableThread = thread->next;
+    if (thread->prev != NULL)
+      thread->prev->next = thread->next;
+    if (thread->next != NULL)
+      thread->next->prev = thread->prev;
+
+    threadPool_addCounters(&(pool->retired), &(thread->counters));
+    pool->threadCount--;
+    pool->threadsDestroyed++;
+  }
+
+  threading_mutex_unlock(&(pool->threadListMutex));
+
+  if (retire) {
+    /* No one else can reach us any more */
+    pthread_detach(pthread_self());
+    pthread_cond_destroy(&(thread->startCondition));
+    threading_mutex_destroy(&(thread->startConditionMutex));
+    pthread_cond_destroy(&(thread->joinStateCondition));
+    threading_mutex_destroy(&(thread->joinStateMutex));
+    free(thread);
+  }
+
+  return retire;
 }
 
 static Error threadPoolThread_destroy(ThreadPoolThread thread) {
@@ -526,3 +1117,413 @@ static Error threadPoolThread_destroy(ThreadPoolThread thread) {
   
   return error;
 }
+
+static void * threadPool_workerLoop(ThreadPoolWorker self) {
+  ThreadPool pool = self->pool;
+  ThreadFunc func;
+  void *args;
+  uint64_t queuedAt, startedAt;
+  Boolean shuttingDown, timedOut;
+
+  for (;;) {
+    if (threadPool_dequeue(pool, &func, &args, &queuedAt)) {
+      /* There is room in the queue now */
+      atomic_fence();
+      if (atomic_loadInt(&(pool->blockedSubmitters)) > 0) {
+        threading_mutex_lock(&(pool->taskMutex));
+        pthread_cond_signal(&(pool->spaceCondition));
+        threading_mutex_unlock(&(pool->taskMutex));
+      }
+
+      startedAt = nanosec();
+      func(args);
+      threadPool_countTask(&(self->counters), queuedAt, startedAt);
+      continue;
+    }
+
+    /* Count ourselves as idle, then look at the queue once more, so that
+     * a submitter either sees us idle or we see its task */
+    threading_mutex_lock(&(pool->taskMutex));
+    atomic_addInt(&(pool->idleWorkers), 1);
+    atomic_fence();
+    timedOut = FALSE;
+    if (!threadPool_hasTasks(pool) && !pool->isShuttingDown) {
+      if (pool->idleTimeout == 0)
+        threading_cond_wait(&(pool->taskCondition), &(pool->taskMutex));
+      else
+        timedOut = threading_cond_timedwait(&(pool->taskCondition),
+                                            &(pool->taskMutex),
+                                            pool->idleTimeout);
+    }
+    atomic_addInt(&(pool->idleWorkers), -1);
+    shuttingDown = pool->isShuttingDown;
+    threading_mutex_unlock(&(pool->taskMutex));
+
+    if (shuttingDown && !threadPool_hasTasks(pool))
+      break;
+
+    /* A task queued meanwhile is left to the minWorkers that stay */
+    if (timedOut && threadPool_retireWorker(self))
+      break;
+  }
+
+  return NULL;
+}
+
+static Error threadPool_addWorker(ThreadPool pool) {
+  Error error = NULL;
+  ThreadPoolWorker worker;
+  int err;
+
+  threading_mutex_lock(&(pool->threadListMutex));
+
+  if ((pool->workerCount >= pool->maxWorkers) || pool->isShuttingDown)
+    goto ERR1;
+
+  worker = (ThreadPoolWorker) malloc(sizeof(sThreadPoolWorker));
+  if (worker == NULL) {
+    error = ErrNew(ERR_MEMORY, MEMERR_OUT, NULL,
+                   "threadPool_addWorker: out of memory.");
+    goto ERR1;
+  }
+  worker->pool = pool;
+  memset(&(worker->counters), 0, sizeof(sThreadPoolCounters));
+
+  if (pool->hasSpec)
+    err = threading_pthread_createSpec(&(worker->thread), &(pool->spec),
+                                       (ThreadFunc) threadPool_workerLoop,
+                                       worker);
+  else
+    err = threading_pthread_create(&(worker->thread), &(pool->attribute),
+                                   (ThreadFunc) threadPool_workerLoop,
+                                   worker);
+  if (err != 0) {
+    free(worker);
+    error = ErrNew(ERR_THREADING, 0, NULL,
+                   "threadPool_addWorker: Couldn't create worker thread.");
+    goto ERR1;
+  }
+
+  pool->workers[pool->workerCount] = worker;
+  atomic_storeInt(&(pool->workerCount), pool->workerCount + 1);
+  pool->threadsCreated++;
+
+ ERR1:
+  threading_mutex_unlock(&(pool->threadListMutex));
+  return error;
+}
+
+static Boolean threadPool_retireWorker(ThreadPoolWorker self) {
+  ThreadPool pool = self->pool;
+  Boolean retire;
+  int i, last;
+
+  threading_mutex_lock(&(pool->threadListMutex));
+
+  retire = (!pool->isShuttingDown && (pool->workerCount > pool->minWorkers) &&
+            !threadPool_hasTasks(pool));
+  if (retire) {
+    last = pool->workerCount - 1;
+    for (i = 0; pool->workers[i] != self; i++)
+      ;
+    pool->workers[i] = pool->workers[last];
+    atomic_storeInt(&(pool->workerCount), last);
+
+    threadPool_addCounters(&(pool->retired), &(self->counters));
+    pool->threadsDestroyed++;
+  }
+
+  threading_mutex_unlock(&(pool->threadListMutex));
+
+  if (retire) {
+    pthread_detach(pthread_self());
+    free(self);
+  }
+
+  return retire;
+}
+
+static void threadPool_wakeWorker(ThreadPool pool) {
+  Error error;
+
+  /* Workers count themselves as idle before they look at the queue a
+   * last time */
+  atomic_fence();
+  if (atomic_loadInt(&(pool->idleWorkers)) > 0) {
+    threading_mutex_lock(&(pool->taskMutex));
+    pthread_cond_signal(&(pool->taskCondition));
+    threading_mutex_unlock(&(pool->taskMutex));
+  }
+  else if (atomic_loadInt(&(pool->workerCount)) < pool->maxWorkers) {
+    /* The task is queued already; if no worker can be added, one of the
+     * minWorkers workers will get to it */
+    error = threadPool_addWorker(pool);
+    if (error != NULL)
+      ErrDispose(error, TRUE);
+  }
+}
+
+static Boolean threadPool_enqueue(ThreadPool pool, ThreadFunc func, void *args) {
+  ThreadPoolTask task;
+  int pos, diff;
+
+  pos = atomic_loadInt(&(pool->taskTail));
+  for (;;) {
+    task = &(pool->tasks[pos & pool->taskMask]);
+    diff = (int) ((unsigned int) atomic_loadInt(&(task->sequence)) -
+                  (unsigned int) pos);
+    if (diff == 0) {
+      if (atomic_casInt(&(pool->taskTail), pos,
+                        (int) ((unsigned int) pos + 1)))
+        break;
+      pos = atomic_loadInt(&(pool->taskTail));
+    }
+    else if (diff < 0)
+      return FALSE; /* full: the slot still holds a task from a lap ago */
+    else
+      pos = atomic_loadInt(&(pool->taskTail));
+  }
+
+  task->func = func;
+  task->args = args;
+  task->queuedAt = nanosec();
+  atomic_storeInt(&(task->sequence), (int) ((unsigned int) pos + 1));
+
+  return TRUE;
+}
+
+static Boolean threadPool_dequeue(ThreadPool pool, ThreadFunc *func,
+                                  void **args, uint64_t *queuedAt) {
+  ThreadPoolTask task;
+  int pos, diff;
+
+  pos = atomic_loadInt(&(pool->taskHead));
+  for (;;) {
+    task = &(pool->tasks[pos & pool->taskMask]);
+    diff = (int) ((unsigned int) atomic_loadInt(&(task->sequence)) -
+                  ((unsigned int) pos + 1));
+    if (diff == 0) {
+      if (atomic_casInt(&(pool->taskHead), pos,
+                        (int) ((unsigned int) pos + 1)))
+        break;
+      pos = atomic_loadInt(&(pool->taskHead));
+    }
+    else if (diff < 0)
+      return FALSE; /* empty: the slot has not been filled yet */
+    else
+      pos = atomic_loadInt(&(pool->taskHead));
+  }
+
+  *func = task->func;
+  *args = task->args;
+  *queuedAt = task->queuedAt;
+  atomic_storeInt(&(task->sequence),
+                  (int) ((unsigned int) pos + pool->taskMask + 1));
+
+  return TRUE;
+}
+
+static Boolean threadPool_hasTasks(ThreadPool pool) {
+  int pos = atomic_loadInt(&(pool->taskHead));
+  ThreadPoolTask task = &(pool->tasks[pos & pool->taskMask]);
+
+  return atomic_loadInt(&(task->sequence)) == (int) ((unsigned int) pos + 1);
+}
+
+static Error threadPool_parallelRun(ThreadPool pool, int begin, int end,
+                                    int grain, ThreadPoolRangeFunc func,
+                                    ThreadPoolReduceFunc reduce,
+                                    ThreadPoolCombineFunc combine,
+                                    void *context, void **res) {
+  Error error = NULL;
+  ParallelJob job;
+  int count, helpers, done, i;
+
+  assert(pool->isExecutor);
+  assert(grain >= 0);
+
+  if (res != NULL)
+    *res = NULL;
+
+  count = end - begin;
+  if (count <= 0)
+    goto ERR1;
+
+  if (grain == 0) {
+    grain = count / (4 * (pool->maxWorkers + 1));
+    if (grain < 1)
+      grain = 1;
+  }
+
+  /* A single chunk is not worth handing out */
+  if (count <= grain) {
+    if (reduce != NULL)
+      *res = reduce(begin, end, context);
+    else
+      func(begin, end, context);
+    goto ERR1;
+  }
+
+  job = (ParallelJob) malloc(sizeof(sParallelJob));
+  if (job == NULL) {
+    error = ErrNew(ERR_MEMORY, MEMERR_OUT, NULL,
+                   "threadPool_parallelRun: out of memory.");
+    goto ERR1;
+  }
+
+  error = threading_mutex_init(&(job->resultLock));
+  if (error != NULL) {
+    free(job);
+    goto ERR1;
+  }
+
+  job->begin      = begin;
+  job->end        = end;
+  job->grain      = grain;
+  job->chunkCount = (count - 1) / grain + 1;
+  job->nextChunk  = 0;
+  job->chunksDone = 0;
+  job->func       = func;
+  job->reduce     = reduce;
+  job->combine    = combine;
+  job->context    = context;
+  job->hasResult  = FALSE;
+  job->result     = NULL;
+
+  helpers = job->chunkCount - 1;
+  if (helpers > pool->maxWorkers)
+    helpers = pool->maxWorkers;
+  job->refCount = helpers + 1;
+
+  /* Helpers that do not fit in the queue are not needed; the caller
+   * does their share */
+  for (i = 0; i < helpers; i++) {
+    if (pool->isShuttingDown ||
+        !threadPool_enqueue(pool, threadPool_parallelHelper, job))
+      break;
+    threadPool_wakeWorker(pool);
+  }
+  if (i < helpers)
+    atomic_addInt(&(job->refCount), i - helpers);
+
+  threadPool_parallelWork(job);
+
+  while ((done = atomic_loadInt(&(job->chunksDone))) < job->chunkCount)
+    threading_word_wait(&(job->chunksDone), done);
+
+  if (res != NULL)
+    *res = job->result;
+
+  threadPool_parallelRelease(job);
+
+ ERR1:
+  return error;
+}
+
+static void threadPool_parallelWork(ParallelJob job) {
+  int chunk, begin, end, done = 0;
+  Boolean hasPartial = FALSE;
+  void *partial = NULL, *value;
+
+  while ((chunk = atomic_addInt(&(job->nextChunk), 1) - 1) <
+         job->chunkCount) {
+    begin = job->begin + chunk * job->grain;
+    end   = (job->end - begin > job->grain) ? begin + job->grain : job->end;
+
+    if (job->reduce != NULL) {
+      value = job->reduce(begin, end, job->context);
+      partial = hasPartial ? job->combine(partial, value, job->context) :
+        value;
+      hasPartial = TRUE;
+    }
+    else
+      job->func(begin, end, job->context);
+
+    done++;
+  }
+
+  if (hasPartial) {
+    threading_mutex_lock(&(job->resultLock));
+    job->result = job->hasResult ?
+      job->combine(job->result, partial, job->context) : partial;
+    job->hasResult = TRUE;
+    threading_mutex_unlock(&(job->resultLock));
+  }
+
+  /* Counted only now, so that the caller sees our partial result */
+  if ((done > 0) &&
+      (atomic_addInt(&(job->chunksDone), done) == job->chunkCount))
+    threading_word_wake(&(job->chunksDone), THREADING_WORD_WAKE_ALL);
+}
+
+static void * threadPool_parallelHelper(void *data) {
+  ParallelJob job = (ParallelJob) data;
+
+  threadPool_parallelWork(job);
+  threadPool_parallelRelease(job);
+
+  return NULL;
+}
+
+static void threadPool_parallelRelease(ParallelJob job) {
+  if (atomic_addInt(&(job->refCount), -1) == 0) {
+    threading_mutex_destroy(&(job->resultLock));
+    free(job);
+  }
+}
+
+static void threadPool_countTask(ThreadPoolCounters counters,
+                                 uint64_t queuedAt, uint64_t startedAt) {
+  uint64_t ranFor, waitedFor;
+  int bucket;
+
+  ranFor    = nanosec() - startedAt;
+  waitedFor = startedAt - queuedAt;
+
+  atomic_storeInt(&(counters->sequence), counters->sequence + 1);
+  atomic_fence();
+
+  counters->tasksRun++;
+  counters->runTimeTotal  += ranFor;
+  counters->waitTimeTotal += waitedFor;
+
+  for (bucket = 0; (bucket < THREADPOOL_STATS_BUCKETS - 1) &&
+         ((ranFor >> (bucket + 1)) != 0); bucket++)
+    ;
+  counters->runTimes[bucket]++;
+
+  for (bucket = 0; (bucket < THREADPOOL_STATS_BUCKETS - 1) &&
+         ((waitedFor >> (bucket + 1)) != 0); bucket++)
+    ;
+  counters->waitTimes[bucket]++;
+
+  atomic_storeInt(&(counters->sequence), counters->sequence + 1);
+}
+
+static void threadPool_addCounters(ThreadPoolCounters to,
+                                   ThreadPoolCounters from) {
+  sThreadPoolCounters copy;
+  int sequence, i;
+
+  /* Copy again if the thread was counting a task, so that no field,
+   * not even a 64-bit one on a 32-bit machine, is half updated */
+  for (;;) {
+    sequence = atomic_loadInt(&(from->sequence));
+    if ((sequence & 1) == 0) {
+      memcpy(&copy, (void *) from, sizeof(copy));
+      atomic_fence();
+      if (atomic_loadInt(&(from->sequence)) == sequence)
+        break;
+    }
+    atomic_pause();
+  }
+
+  to->tasksRun      += copy.tasksRun;
+  to->runTimeTotal  += copy.runTimeTotal;
+  to->waitTimeTotal += copy.waitTimeTotal;
+
+  for (i = 0; i < THREADPOOL_STATS_BUCKETS; i++) {
+    to->runTimes[i]  += copy.runTimes[i];
+    to->waitTimes[i] += copy.waitTimes[i];
+  }
+}
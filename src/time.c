@@ -61,3 +61,26 @@ unsigned long microsec()
   
   return (tempTime.tv_sec * 1000000 + tempTime.tv_usec ) & 0xffffffff;
 }
+
+uint64_t nanosec( void )
+{
+#ifdef WIN32
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  
+  if( frequency.QuadPart == 0 )
+    QueryPerformanceFrequency( &frequency );
+  
+  QueryPerformanceCounter( &counter );
+  
+  return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000000 +
+    (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000000 / 
+    frequency.QuadPart;
+#else
+  struct timespec now;
+  
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
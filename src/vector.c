@@ -125,12 +125,14 @@ Vector vectorCreate( const char *name, size_t elementSize,
   }
   result->elementCount = 0;
 #ifdef _POSIX_THREADS
-  error = threading_mutex_init( &(result->lock) );
+  error = threading_mutex_initMode( &(result->lock),
+                                    THREADING_MUTEX_ADAPTIVE );
   if (error != NULL) {
     ErrDispose(error, TRUE);
     goto ERR_RETURN;
   }
-  error = threading_mutex_init( &(result->refCountLock) );
+  error = threading_mutex_initMode( &(result->refCountLock),
+                                    THREADING_MUTEX_ADAPTIVE );
   if (error != NULL) {
     ErrDispose(error, TRUE);
     goto ERR_RETURN;
@@ -429,3 +431,42 @@ static void increaseCapacity( Vector vector )
   vectorUnlock( vector );
 #endif
 }
+
+#ifdef _POSIX_THREADS
+typedef struct
+{
+  Vector vector;
+  ForEachFunc forEachFunc;
+  void *args;
+} sForEachParallel;
+
+static void forEachParallelRange( int begin, int end, void *context )
+{
+  sForEachParallel *forEach = context;
+  Vector vector = forEach->vector;
+  int i;
+
+  for( i = begin; i < end; i++ )
+    forEach->forEachFunc( forEach->args, 
+                          vector->data + i * vector->elementSize );
+}
+
+Error vectorForEachParallel( Vector vector, ThreadPool pool,
+                             ForEachFunc forEachFunc, void *args )
+{
+  sForEachParallel forEach;
+  const char *prevLocker;
+  Error error;
+
+  forEach.vector = vector;
+  forEach.forEachFunc = forEachFunc;
+  forEach.args = args;
+
+  prevLocker = vectorLockDebug( vector, "vectorForEachParallel" );
+  error = threadPool_parallelFor( pool, 0, vector->elementCount, 0,
+                                  forEachParallelRange, &forEach );
+  vectorUnlockDebug( vector, prevLocker );
+
+  return error;
+}
+#endif
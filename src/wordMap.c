@@ -43,6 +43,8 @@ CVSID("$Id$");
 
 #define FILE_FORMAT_VERSION 2
 #define DEFAULT_HASHTABLE_SIZE 1024
+/* number of names wordMap_findManyByName passes to HashFindMany at a time */
+#define FIND_BATCH_SIZE 64
 
 LOG_MODULE_DECL( "WordMap", LOGLEVEL_NONE );
 
@@ -90,16 +92,14 @@ Error wordMap_create2( const char *name, WordMapType type, WordMap *phoneMap,
   (*phoneMap)->type = type;
 
   if( type & WORDMAPMASK_BYNAME )
-    (*phoneMap)->byName = HashCreateTable( hashTableSize, 
-                                           (HashFuncPtr) hashEntryName, 
-                                           (CompFuncPtr) compareEntryNames,
-                                           NULL );
+    (*phoneMap)->byName = 
+      HashCreateTableCompact( hashTableSize, (HashFuncPtr) hashEntryName, 
+                              (CompFuncPtr) compareEntryNames, NULL );
 
   if( type & WORDMAPMASK_BYNUMBER )
-    (*phoneMap)->byNumber = HashCreateTable( hashTableSize, 
-                                             (HashFuncPtr) hashEntryNumber,
-                                             (CompFuncPtr) compareEntryNumbers,
-                                             NULL );
+    (*phoneMap)->byNumber = 
+      HashCreateTableCompact( hashTableSize, (HashFuncPtr) hashEntryNumber,
+                              (CompFuncPtr) compareEntryNumbers, NULL );
 
   DEBUG("leave\n");
 
@@ -164,6 +164,33 @@ int wordMap_findByName( WordMap map, const char *name )
     return entry->number;
 }
 
+void wordMap_findManyByName( WordMap map, const char *names[], int count,
+                             int numbers[] )
+{
+  sEntry templates[ FIND_BATCH_SIZE ];
+  void *keys[ FIND_BATCH_SIZE ], *results[ FIND_BATCH_SIZE ];
+  int first, n, i;
+
+  assert( map->type & WORDMAPMASK_BYNAME );
+
+  for( first = 0; first < count; first += FIND_BATCH_SIZE )
+  {
+    n = MIN( FIND_BATCH_SIZE, count - first );
+
+    for( i = 0; i < n; i++ )
+    {
+      templates[ i ].name = names[ first + i ];
+      keys[ i ] = &(templates[ i ]);
+    }
+
+    HashFindMany( map->byName, keys, n, results );
+
+    for( i = 0; i < n; i++ )
+      numbers[ first + i ] = (results[ i ] == NULL) ? -1 : 
+        (int) ((Entry) results[ i ])->number;
+  }
+}
+
 const char *wordMap_findByNumber( WordMap map, int number )
 {
   sEntry template;
@@ -434,16 +461,17 @@ Error wordMap_deleteByName( WordMap map, const char *name )
 {
   sEntry template;
   Entry entry;
-  int tempInt;
+  int tempInt, hashValue;
   
   assert( map->type & WORDMAPMASK_BYNAME );
   
   template.name = name;
+  hashValue = hashEntryName( &template );
   
-  entry = HashFind( map->byName, &template );
+  entry = HashFindWithHash( map->byName, &template, hashValue );
   assert( entry != NULL );
   
-  tempInt = HashDelete( map->byName, entry );
+  tempInt = HashDeleteWithHash( map->byName, entry, hashValue );
   assert( tempInt == 1 );
   
   if( map->type & WORDMAPMASK_BYNUMBER )